@@ -0,0 +1,19 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Chunked bump allocator. Memory is only released all at once, either by
+ * arena_reset (chunks are kept for reuse) or by arena_free.
+ */
+
+typedef struct Arena Arena;
+
+Arena *arena_create(size_t chunk_size);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef BLOB_INDEX_H
+#define BLOB_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+/*
+ * Directory of the blobs of a PBF file with the range of ids each data blob
+ * holds and a blocked Bloom filter over those ids (ranges alone overlap a lot
+ * in unsorted or merged files). Building it needs one pass that inflates every
+ * blob but decodes only ids, so it is cached next to the file in a
+ * "<path>.idx" sidecar.
+ */
+
+typedef enum {
+    OSM_BLOB_HEADER = 0,
+    OSM_BLOB_DATA = 1,
+    OSM_BLOB_OTHER = 2
+} OSM_BlobType;
+
+/* Entity slots of the per-blob id ranges */
+#define OSM_BLOB_NODES 0
+#define OSM_BLOB_WAYS 1
+#define OSM_BLOB_RELATIONS 2
+#define OSM_BLOB_ENTITY_TYPES 3
+
+typedef struct OSM_BlobInfo {
+    uint64_t offset; // file offset of the blob's 4 byte header length
+    uint64_t size;   // bytes from offset to the next blob
+    uint32_t type;   // OSM_BlobType
+    uint32_t bloom_blocks; // 64 byte blocks of the blob's filter, 0 when it holds no ids
+    uint64_t bloom_offset; // offset of the filter in the index's bloom data
+    OSM_Id min_id[OSM_BLOB_ENTITY_TYPES]; // min > max when the blob holds none of that type
+    OSM_Id max_id[OSM_BLOB_ENTITY_TYPES];
+} OSM_BlobInfo;
+
+typedef struct OSM_BlobIndex {
+    uint64_t count;
+    OSM_BlobInfo *blobs;
+    uint8_t *bloom;        // filters of every blob, back to back
+    uint64_t bloom_size;
+    uint64_t source_size;  // size, mtime and content check of the indexed file, used to detect stale sidecars
+    int64_t source_mtime;
+    int64_t source_mtime_nsec;
+    uint32_t source_check; // CRC-32 of the first and last 64 KiB of the file
+
+    // construction state
+    uint64_t capacity;
+    uint64_t bloom_capacity;
+    uint64_t *pending;     // hashes of the ids of the blob being appended
+    uint64_t pending_count;
+    uint64_t pending_capacity;
+
+    // set when blobs and bloom point into a mapped sidecar
+    void *mapping;
+    size_t mapping_size;
+} OSM_BlobIndex;
+
+/* Incremental construction: append a blob, add its ids, then finish it to build its filter */
+OSM_BlobIndex *OSM_BlobIndex_create(void);
+OSM_BlobInfo *OSM_BlobIndex_append(OSM_BlobIndex *idx, uint64_t offset, uint64_t size, uint32_t type);
+int OSM_BlobIndex_add_id(OSM_BlobIndex *idx, int entity, OSM_Id id);
+int OSM_BlobIndex_finish_blob(OSM_BlobIndex *idx);
+
+OSM_BlobIndex *OSM_BlobIndex_build(FILE *in);
+OSM_BlobIndex *OSM_BlobIndex_build_directory(FILE *in); // offsets, sizes and types only: reads the blob headers, inflates nothing
+OSM_BlobIndex *OSM_BlobIndex_load(const char *index_path);
+int OSM_BlobIndex_save(OSM_BlobIndex *idx, const char *index_path);
+void OSM_BlobIndex_free(OSM_BlobIndex *idx);
+
+/* Load the sidecar of a PBF file, or build the index from the file when missing or stale (nothing is saved) */
+OSM_BlobIndex *OSM_BlobIndex_open(const char *pbf_path);
+
+/* Sidecar of a PBF file: whether an up to date one exists, and saving one built elsewhere */
+int OSM_BlobIndex_sidecar_is_current(const char *pbf_path);
+int OSM_BlobIndex_save_sidecar(OSM_BlobIndex *idx, const char *pbf_path);
+
+/* Whether blob may hold id: its range covers the id and its filter does not rule it out */
+int OSM_BlobIndex_may_contain(OSM_BlobIndex *idx, uint64_t blob, int entity, OSM_Id id);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "osm.h"
+#include "output.h"
 
 /*
  * Command Line Output Message And Exit Code
@@ -11,25 +12,98 @@
     do                                                                                                           \
     {                                                                                                            \
         fprintf(stderr, "USAGE: %s %s\n", program_name,                                                          \
-                "[-h] [-f filename] [-s] [-b] [-n id] [-w id] [-w id key ...]\n"                                 \
+                "[-h] [-f filename] [-s] [-S] [-b] [-q minlon minlat maxlon maxlat] [-k lat lon] [-n id] [-w id]\n"      \
+                "       [-w id key ...] [-r graphfile [highway,...]] [-t filter] [-o snapshot]\n"                \
+                "       [-Q queries] [--serve socket] [--format text|json|csv|geojson]\n"                        \
+                "       [--index] [--shard i/N] [--merge partial ...]\n"                                         \
                 "   -h              Help: displays this help menu.\n"                                            \
-                "   -f filename     File: read map data from the specified file\n"                               \
+                "   -f filename     File: read map data from the specified file (repeat to merge files).\n"      \
                 "   -s              Summary: displays map summary information.\n"                                \
+                "   -S              Entity summary: displays node, way and relation counts and tags.\n"          \
                 "   -b              Bounding box: displays map bounding box.\n"                                  \
+                "   -q minlon minlat maxlon maxlat\n"                                                             \
+                "                   Box query: displays the nodes inside the box (degrees).\n"                  \
+                "   -k lat lon      Nearest node: displays the node closest to the point (degrees).\n"         \
                 "   -n id           Node: displays information about the specified node.\n"                      \
                 "   -w id           Way refs: displays node references for the specified way.\n"                 \
-                "   -w id key ...   Way values: displays values associated with the specified way and keys.\n"); \
+                "   -w id key ...   Way values: displays values associated with the specified way and keys.\n"  \
+                "   -Q queries      Batch: answers a file of -n and -w lookups in one sorted pass.\n"            \
+                "   -r graphfile [highway,...]\n"                                                                 \
+                "                   Routing graph: writes the CSR road graph of the given highway types.\n"     \
+                "   -t filter       Tag filter: displays the ways matching key=value,... clauses.\n"             \
+                "   -o snapshot     Snapshot: saves the map and its indexes for fast reopening with -f.\n"       \
+                "   --serve socket  Daemon: answers query lines sent to the Unix socket until stopped.\n"        \
+                "   --format name   Output: text (default), or json, geojson or csv records.\n"                  \
+                "   --index         Index: saves the blob index next to the file (filename.idx) for lookups.\n"  \
+                "   --shard i/N     Shard: writes partial -s, -S, -b and -t results of blob range i of N.\n"     \
+                "   --merge partial ...\n"                                                                       \
+                "                   Merge: displays the results of the partials of every shard combined.\n");    \
         exit(retcode);                                                                                           \
     } while (0)
 
 /* set flag if -h is passed in CLI */
 extern int help_requested;
 
-/* store path if a file is specified to be read */
+/* store path if a file is specified to be read (the first when -f is given several times) */
 extern char *osm_input_file;
+extern int num_input_files;
+
+/* socket path if the map is to be served (--serve) instead of queried once */
+extern char *serve_socket_path;
+
+/* set if the blob index of the input file is to be saved in its sidecar (--index), nothing is written otherwise */
+extern int write_index;
+
+/* format of the query results (--format), text unless given */
+extern Output_Format output_format;
+
+/* shard i of N of the input to write partial results for (--shard i/N), shard_count 0 unless given */
+extern int shard_index;
+extern int shard_count;
+
+/* partial results of the shards to merge (--merge), NULL unless given */
+extern char **merge_paths;
+extern int num_merge_paths;
 
 /*
     process CLI args and queries
 */
 
 int process_args(int argc, char **argv, OSM_Map *mp);
+
+/* validate the query options of argv, 0 if they are well formed */
+int validate_args(int argc, char **argv);
+
+/* run the queries of argv (after argv[0]) on the map, writing their results to out */
+int run_query_list(char **argv, OSM_Map *mp, Output *out);      // independent queries on worker threads, printed in argv order
+int run_queries_in_order(char **argv, OSM_Map *mp, Output *out); // one after another on the calling thread
+
+/* cheapest way to read the input for the queries given */
+typedef enum
+{
+    PLAN_HEADER, // -b alone: the header block, the rest of the file is never read
+    PLAN_COUNT,  // -s, -S (and -b): entities are counted, not decoded
+    PLAN_LOOKUP, // -n, -w (and -b): the file is opened lazily, only blobs holding the ids are decoded
+    PLAN_STREAM, // -n, -w alone: answered while the input streams by, reading stops once all are found
+    PLAN_FULL    // everything else, or counts mixed with lookups: one full load
+} Query_Plan;
+
+Query_Plan plan_queries(char **argv);
+
+/* answer the -n and -w queries of argv in one pass over in, each printed as soon as its block is decoded */
+int run_stream_queries(char **argv, FILE *in);
+
+/* results printed the same way for a map and for merged shards (see shard.h) */
+void print_results_header(Output *out, const char *input_name);
+void print_summary_result(Output *out, uint64_t num_nodes, uint64_t num_ways);
+int print_entity_summary_result(Output *out, const OSM_Summary *summary); // -1 without a summary
+void print_bbox_result(Output *out, int found, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat);
+void print_filter_header(Output *out, const char *filter);
+int print_filter_match(Output *out, const char *filter, int64_t id, OSM_Map *mp, OSM_Way *wp); // wp NULL: no geometry
+void print_filter_footer(Output *out, int64_t found);
+
+/* read options for a plan read from a stream (PLAN_LOOKUP needs a seekable file), NULL for a full load */
+const OSM_ReadOptions *plan_read_options(Query_Plan plan, char **argv);
+
+/* read options for each input when several -f are merged into one map */
+const OSM_ReadOptions *merged_read_options(char **argv);
@@ -0,0 +1,39 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdint.h>
+
+#include "osm.h"
+
+/*
+ * Routing graph in compressed sparse row form. Ways whose highway tag is in
+ * the requested set are split at every node they share with another selected
+ * way (and at their ends), each piece becoming one edge per allowed direction
+ * weighted by its great circle length. Vertices are renumbered 0..n-1 in node
+ * order; oneway=yes/true/1/-1, roundabouts and motorways are honoured.
+ */
+
+typedef struct OSM_Graph {
+    uint64_t num_vertices;
+    uint64_t num_edges;
+    uint64_t *offsets;  // num_vertices + 1, edges leaving v are offsets[v] .. offsets[v + 1]
+    uint32_t *targets;  // num_edges
+    float *weights;     // num_edges, meters
+    OSM_Id *node_ids;   // num_vertices, OSM node of every vertex
+    OSM_Coord *coords;  // num_vertices
+} OSM_Graph;
+
+/* Build the graph of the ways whose highway value is in highways (NULL terminated, NULL for any highway) */
+OSM_Graph *OSM_Graph_build(OSM_Map *mp, const char **highways);
+
+/*
+ * Write the graph as a flat little endian file: a 32 byte header ("OSMGRPH",
+ * version, reserved, num_vertices, num_edges) followed by offsets (uint64),
+ * targets (uint32), weights (float32), node ids (int64) and coordinates
+ * (int64 lat, lon pairs in nanodegrees).
+ */
+int OSM_Graph_save(const OSM_Graph *graph, const char *path);
+
+void OSM_Graph_free(OSM_Graph *graph);
+
+#endif
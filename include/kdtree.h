@@ -0,0 +1,37 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <stdint.h>
+
+/*
+ * Implicit 2-d tree over points in nanodegrees. The points array is reordered
+ * in place so that the median of every range [lo, hi) sits at (lo + hi) / 2,
+ * split on latitude at even depths and longitude at odd depths; there are no
+ * child pointers. Distances are equirectangular: longitude differences are
+ * scaled by the cosine of the query latitude.
+ */
+
+typedef struct OSM_KDPoint {
+    int64_t lat;
+    int64_t lon;
+    uint64_t item;
+} OSM_KDPoint;
+
+typedef struct OSM_KDTree {
+    uint64_t count;
+    OSM_KDPoint *points;
+} OSM_KDTree;
+
+/* Build a tree over count points, taking ownership of the malloc'd points array */
+OSM_KDTree *kdtree_build(OSM_KDPoint *points, uint64_t count);
+
+/*
+ * Find the k points nearest to (lat, lon), writing their items nearest first.
+ * Returns the number found (less than k only when the tree is smaller). Safe
+ * to call from several threads at once.
+ */
+int kdtree_nearest(const OSM_KDTree *tree, int64_t lat, int64_t lon, int k, uint64_t *items);
+
+void kdtree_free(OSM_KDTree *tree);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef LAZY_MAP_H
+#define LAZY_MAP_H
+
+#include "blob_index.h"
+#include "osm.h"
+
+/* Blob directory and decoded blob cache behind a map opened with OSM_open_Map_lazy */
+
+typedef struct OSM_LazySource OSM_LazySource;
+
+OSM_LazySource *lazy_source_open(OSM_Map *mp, const char *path, int cache_blocks);
+OSM_Node *lazy_find_Node(OSM_LazySource *src, OSM_Id id);
+OSM_Way *lazy_find_Way(OSM_LazySource *src, OSM_Id id);
+int lazy_lookup_failed(OSM_LazySource *src); // the last find returned NULL because a blob could not be read
+OSM_BlobIndex *lazy_source_index(OSM_LazySource *src); // blob index the lookups use
+int lazy_node_extent(OSM_LazySource *src, OSM_Lon *min_lonp, OSM_Lat *min_latp, OSM_Lon *max_lonp, OSM_Lat *max_latp); // -1 without nodes
+void lazy_source_free(OSM_LazySource *src);
+
+#endif
@@ -16,14 +16,336 @@ typedef int64_t OSM_Lon;            // Longitude (in nanodegrees)
 
 OSM_Map *OSM_read_Map(FILE *in);
 
+/* Selective loading: which entities, tags and metadata get decoded */
+
+#define OSM_READ_NODES 0x1
+#define OSM_READ_WAYS 0x2
+
+typedef struct OSM_ReadOptions
+{
+    int entities;          // OR of OSM_READ_* flags, 0 reads only the header (and the nodes if it has no bbox)
+    int decode_tags;       // keep way tags
+    const char **tag_keys; // NULL terminated list of way keys to keep, NULL keeps every key
+    int decode_metadata;   // decode versions (see OSM_Map_get_Node_version)
+
+    // called with all tags of a way before anything is allocated for it, return 0 to skip the way
+    int (*way_filter)(OSM_Id id, int num_tags, char **keys, char **values, void *arg);
+    void *filter_arg;
+
+    int index_tags; // build the inverted tag index (see OSM_Map_build_tag_index) once loaded
+    int count_only; // count the selected entities for OSM_Map_get_num_* without storing them
+    int summarize;  // fill the summary (implied by count_only)
+} OSM_ReadOptions;
+
+OSM_Map *OSM_read_Map_ex(FILE *in, const OSM_ReadOptions *options); // NULL options reads everything
+
+/*
+ * Entities and tags of every type in the file, counted by a load with
+ * count_only or summarize set. The blocks are only walked: nodes are counted
+ * from packed DenseNodes ids, tags from packed keys, without decoding values.
+ */
+
+typedef struct OSM_Summary
+{
+    uint64_t nodes;
+    uint64_t ways;
+    uint64_t relations;
+    uint64_t node_tags;
+    uint64_t way_tags;
+    uint64_t relation_tags;
+    uint64_t summed_files; // > 1 when node tags and relations add up the counts of that many merged files
+} OSM_Summary;
+
+const OSM_Summary *OSM_Map_get_summary(OSM_Map *mp); // NULL unless the load summarized
+
+/*
+ * Several files (neighbouring extracts) as one map. OSM_read_Maps reads each
+ * file on its own worker thread, then OSM_Map_merge walks the inputs' nodes
+ * and ways in id order (a k-way merge) into a new map. An id found in several
+ * inputs is kept once: the copy with the highest version when versions were
+ * decoded, else the first input's. Tag strings are interned into the new
+ * map's pool. The summary counts the merged nodes, ways and way tags; node
+ * tags and relations are not kept, so theirs add up the inputs' and count an
+ * entity once per input holding it (summed_files). The inputs must be plain
+ * loads that kept their entities (not lazy, counted or snapshots); they are
+ * left untouched. OSM_read_Maps instead frees the maps it read as the merge
+ * goes: an input's string pool once its strings are interned, and its nodes,
+ * ways, refs and tags once the merge has taken the last of them. NULL on error.
+ */
+
+OSM_Map *OSM_read_Maps(FILE **ins, int count, const OSM_ReadOptions *options);
+OSM_Map *OSM_Map_merge(OSM_Map **maps, int count);
+
+/*
+ * Streaming: OSM_read_stream decodes the stream block by block and hands each
+ * entity to the handler as soon as it is decoded, without building a map (the
+ * OSM_Map loader is one such handler). Memory is bounded by a single block:
+ * an entity, its strings and its refs are only valid during the callback.
+ * Entities without a callback are skipped. Tags are indices into strings, the
+ * string table of the block: key i is strings[keys[i]].
+ */
+
+typedef struct OSM_NodeEvent
+{
+    OSM_Id id;
+    OSM_Lat lat;
+    OSM_Lon lon;
+    int32_t version;       // -1 unless decode_metadata is set
+    int num_tags;          // 0 unless node_tags is set
+    const uint32_t *keys;
+    const uint32_t *values;
+    char **strings;
+    uint32_t num_strings;
+} OSM_NodeEvent;
+
+typedef struct OSM_WayEvent
+{
+    OSM_Id id;
+    int32_t version;
+    int num_tags;
+    const uint32_t *keys;
+    const uint32_t *values;
+    char **strings;
+    uint32_t num_strings;
+    int num_refs;
+    const uint8_t *refs; // packed zig-zag delta varints, see OSM_WayEvent_copy_refs
+    uint32_t refs_size;  // bytes
+} OSM_WayEvent;
+
+#define OSM_MEMBER_NODE 0
+#define OSM_MEMBER_WAY 1
+#define OSM_MEMBER_RELATION 2
+
+typedef struct OSM_RelationEvent
+{
+    OSM_Id id;
+    int32_t version;
+    int num_tags;
+    const uint32_t *keys;
+    const uint32_t *values;
+    char **strings;
+    uint32_t num_strings;
+    int num_members;
+    const OSM_Id *member_ids;
+    const uint32_t *member_types; // OSM_MEMBER_*
+    const uint32_t *member_roles; // indices into strings
+} OSM_RelationEvent;
+
+typedef struct OSM_Header
+{
+    OSM_BBox *bbox; // NULL if the header has none
+    int sorted;     // Sort.Type_then_ID: nodes, then ways, then relations, each in ascending id order
+} OSM_Header;
+
+/* Callbacks return 0 to go on, 1 to stop reading, -1 to fail the read */
+typedef struct OSM_Handler
+{
+    int (*on_header)(const OSM_Header *header, void *arg);
+    int (*on_node)(const OSM_NodeEvent *node, void *arg);
+    int (*on_way)(const OSM_WayEvent *way, void *arg);
+    int (*on_relation)(const OSM_RelationEvent *relation, void *arg);
+    int (*on_block_end)(void *arg); // after the entities of each data block
+    int node_tags;                  // decode node tags (ways and relations always carry theirs)
+    int decode_metadata;            // decode versions
+    void *arg;
+} OSM_Handler;
+
+int OSM_read_stream(FILE *in, const OSM_Handler *handler); // 0 at the end of the stream, 1 if stopped, -1 on error
+int OSM_WayEvent_copy_refs(const OSM_WayEvent *way, OSM_Id *refs, int max); // like OSM_Way_copy_refs
+
+/*
+ * Lazy map over a PBF file: opening reads the header and the blob directory
+ * (cached in a "<path>.idx" sidecar), and OSM_Map_find_Node/Way decode only
+ * the blobs whose id range and Bloom filter admit the id, keeping up to
+ * cache_blocks decoded blobs in an LRU cache. Entities it returns stay valid
+ * until the next lookup.
+ */
+
+OSM_Map *OSM_open_Map_lazy(const char *path, int cache_blocks);
+int OSM_Map_is_lazy(OSM_Map *mp); // opened by OSM_open_Map_lazy
+
+/* Write the sidecar of pbf_path (its blob index) unless an up to date one exists, -1 for a snapshot or on error */
+int OSM_Map_save_index(OSM_Map *mp, const char *pbf_path);
+
+/*
+ * Snapshots: a decoded map saved as flat, offset based sections (nodes, way
+ * records, tags and refs, the string pool and whichever indexes were built)
+ * that opens with one mmap and a header check. Nothing is parsed, the pages
+ * of a section are faulted in by the first query touching them; only the way
+ * structs and the pool's string pointers are rebuilt. Section bounds are
+ * validated, their contents are trusted like the sidecar's. Lazy maps and
+ * count-only loads cannot be saved.
+ */
+
+int OSM_Map_save_snapshot(OSM_Map *mp, const char *path);
+OSM_Map *OSM_Map_open_snapshot(const char *path); // NULL unless path is a valid snapshot
+
+/*
+ * Spatial queries, bounds in nanodegrees and inclusive. The first query bulk
+ * loads an R-tree over the nodes, later ones cost O(log n + matches). Not
+ * available on lazy maps. Returns the number of nodes visited, -1 on error.
+ */
+
+typedef int (*OSM_NodeVisitor)(OSM_Node *np, void *arg); // return non zero to stop the query
+
+int OSM_Map_query_bbox(OSM_Map *mp, OSM_Lon min_lon, OSM_Lat min_lat, OSM_Lon max_lon, OSM_Lat max_lat,
+                       OSM_NodeVisitor callback, void *arg);
+
+/*
+ * Nearest nodes by equirectangular distance, using a k-d tree over the nodes
+ * built by the first query. results receives up to k nodes, nearest first,
+ * padded with NULL; the count found is returned, -1 on error. The batched
+ * variant answers count queries (k results each, row after row) across
+ * worker threads and returns 0 on success.
+ */
+
+int OSM_Map_nearest_node(OSM_Map *mp, OSM_Lat lat, OSM_Lon lon, int k, OSM_Node **results);
+int OSM_Map_nearest_nodes(OSM_Map *mp, int count, const OSM_Lat *lats, const OSM_Lon *lons, int k, OSM_Node **results);
+
+/*
+ * Geometry of every way at once: refs are joined with the nodes in bulk (a
+ * sort-merge join across worker threads) into one flat coordinate buffer.
+ * Way i covers coords[offsets[i]] up to coords[offsets[i + 1]], one entry per
+ * ref in ref order; refs missing from the map get OSM_COORD_MISSING.
+ */
+
+#define OSM_COORD_MISSING INT64_MIN
+
+typedef struct OSM_Coord
+{
+    OSM_Lat lat;
+    OSM_Lon lon;
+} OSM_Coord;
+
+typedef struct OSM_Geometries
+{
+    uint64_t num_ways;
+    uint64_t *offsets;    // num_ways + 1 entries
+    OSM_Coord *coords;    // offsets[num_ways] entries
+    uint64_t num_missing; // refs that did not resolve
+} OSM_Geometries;
+
+OSM_Geometries *OSM_Map_resolve_way_geometries(OSM_Map *mp); // NULL on error
+void OSM_Geometries_free(OSM_Geometries *gp);
+
+/*
+ * Reverse index from nodes to the ways using them, built in parallel on first
+ * use as CSR arrays. A way is listed once per node, in way order.
+ * OSM_Map_get_ways_for_node returns how many ways use the node and writes up
+ * to max of them. OSM_Map_find_intersections visits every node shared by at
+ * least two ways in one linear pass and returns how many it visited.
+ */
+
+int OSM_Map_build_node_ways(OSM_Map *mp); // done on first use by the functions below
+int OSM_Map_get_ways_for_node(OSM_Map *mp, OSM_Id node_id, OSM_Way **ways, int max);
+int OSM_Map_find_intersections(OSM_Map *mp, OSM_NodeVisitor callback, void *arg);
+
+/*
+ * Way bounding boxes, resolved from the way refs in one parallel pass and kept
+ * as packed int32 boxes rounded outwards to 100 nanodegrees. Refs missing from
+ * the map are ignored; a way without any resolvable ref has no box.
+ */
+
+typedef int (*OSM_WayVisitor)(OSM_Way *wp, void *arg); // return non zero to stop the query
+
+int OSM_Map_compute_Way_bboxes(OSM_Map *mp); // done on first use by the functions below
+int OSM_Map_get_Way_bbox(OSM_Map *mp, int index, OSM_Lon *min_lonp, OSM_Lat *min_latp, OSM_Lon *max_lonp, OSM_Lat *max_latp);
+int OSM_Map_query_ways_bbox(OSM_Map *mp, OSM_Lon min_lon, OSM_Lat min_lat, OSM_Lon max_lon, OSM_Lat max_lat,
+                            OSM_WayVisitor callback, void *arg); // ways whose box intersects, -1 on error
+
+/*
+ * Tag filters such as "highway=primary|secondary,surface=asphalt,!access".
+ * Clauses are separated by commas and must all hold: key (or key=*) needs the
+ * key, key=a|b one of the values, key!=a|b and !key rule them out. A filter is
+ * compiled against the interned strings of one loaded map and is only valid
+ * for that map until it is reset or reloaded. OSM_Map_filter_ways scans every
+ * way across worker threads, then visits the matches in map order and returns
+ * how many it visited.
+ */
+
+#define OSM_TAG_FILTER_MAX_CLAUSES 64
+
+typedef struct OSM_TagFilter OSM_TagFilter;
+
+OSM_TagFilter *OSM_TagFilter_compile(OSM_Map *mp, const char *expr); // NULL if malformed
+void OSM_TagFilter_free(OSM_TagFilter *filter);
+int OSM_Map_filter_ways(OSM_Map *mp, const OSM_TagFilter *filter, OSM_WayVisitor callback, void *arg);
+
+/*
+ * Inverted tag index: every key and every (key, value) pair maps to the
+ * ascending positions of the ways carrying it, stored as delta varint posting
+ * lists. Once built, OSM_Map_filter_ways answers filters with a required
+ * clause by intersecting postings (shortest first, galloping) instead of
+ * scanning. Built by a load with index_tags set, or on demand.
+ */
+
+int OSM_Map_build_tag_index(OSM_Map *mp);
+
+/*
+ * Build indexes the queries above otherwise build on first use. Once the
+ * indexes a set of queries needs exist, those queries only read the map, so
+ * any number of threads may run them at once. Not available on lazy maps.
+ */
+
+#define OSM_INDEX_NODE_TREE 0x1      // node R-tree: OSM_Map_query_bbox
+#define OSM_INDEX_NODE_KDTREE 0x2    // k-d tree: OSM_Map_nearest_node(s)
+#define OSM_INDEX_NODE_LOCATIONS 0x4 // id order of unsorted nodes: batch lookups, way geometries, graphs
+#define OSM_INDEX_TAGS 0x8           // inverted tag index: OSM_Map_filter_ways
+#define OSM_INDEX_ALL 0xF
+
+int OSM_Map_build_query_indexes(OSM_Map *mp, int indexes); // OR of OSM_INDEX_* flags
+
+/* OSM_Map lifetime: a map owns every entity, string and buffer reachable from it */
+
+OSM_Map *OSM_Map_create(void);
+int OSM_Map_load(OSM_Map *mp, FILE *in);   // load into an empty (new or reset) map
+int OSM_Map_load_ex(OSM_Map *mp, FILE *in, const OSM_ReadOptions *options);
+int OSM_Map_load_blob(OSM_Map *mp, FILE *in, uint64_t offset, const OSM_ReadOptions *options); // one blob at a file offset
+void OSM_Map_reset(OSM_Map *mp);           // drop all entities, keep memory for the next load
+void OSM_Map_free(OSM_Map *mp);
+
 
 /* OSM_Map accessors */
 
-OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp);
+OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp); // the header's, else the extent of the loaded nodes
 int OSM_Map_get_num_nodes(OSM_Map *mp);
 int OSM_Map_get_num_ways(OSM_Map *mp);
 OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index);
 OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index);
+OSM_Node *OSM_Map_find_Node(OSM_Map *mp, OSM_Id id); // by id, NULL if absent
+OSM_Way *OSM_Map_find_Way(OSM_Map *mp, OSM_Id id);   // by id, NULL if absent
+int64_t OSM_Map_find_Node_index(OSM_Map *mp, OSM_Id id); // index for OSM_Map_get_Node, -1 if absent
+int OSM_Map_lookup_failed(OSM_Map *mp); // 1 if the last find on a lazy map could not read a blob: its NULL is an error
+int32_t OSM_Map_get_Node_version(OSM_Map *mp, int index); // -1 unless loaded with decode_metadata
+int32_t OSM_Map_get_Way_version(OSM_Map *mp, int index);  // -1 unless loaded with decode_metadata
+
+/*
+ * Batch lookups: the ids are sorted once and answered in one merge pass over
+ * the id sorted entities (galloping, so sparse batches skip ahead), instead
+ * of a search per id. The callback gets the index in ids of each id found, in
+ * ascending id order; entities of lazy maps are valid during the call only.
+ * Returns how many were found, -1 on error (a blob of a lazy map that cannot be read).
+ */
+
+typedef int (*OSM_NodeBatchVisitor)(uint64_t index, OSM_Node *np, void *arg); // return non zero to stop
+typedef int (*OSM_WayBatchVisitor)(uint64_t index, OSM_Map *mp, OSM_Way *wp, void *arg); // mp holds wp, non zero stops
+
+int64_t OSM_Map_find_Nodes(OSM_Map *mp, const OSM_Id *ids, uint64_t count, OSM_NodeBatchVisitor callback, void *arg);
+int64_t OSM_Map_find_Ways(OSM_Map *mp, const OSM_Id *ids, uint64_t count, OSM_WayBatchVisitor callback, void *arg);
+
+/*
+ * Streaming lookups, without a map: the ids are registered before the stream
+ * is read, and each entity found is visited as soon as its block is decoded.
+ * Reading stops once every id is found, or once a sorted stream has gone past
+ * the ids still missing. Entities are valid during the call only. Returns how
+ * many were found, -1 on error.
+ */
+
+int64_t OSM_find_stream(FILE *in, const OSM_Id *node_ids, uint64_t num_node_ids, OSM_NodeBatchVisitor node_callback,
+                        const OSM_Id *way_ids, uint64_t num_way_ids, OSM_WayBatchVisitor way_callback, void *arg);
+
+/* Replace the bbox with the exact extent of the nodes (a parallel min/max pass), -1 without nodes */
+int OSM_Map_compute_BBox(OSM_Map *mp);
 
 /* OSM_BBox accessors */
 
@@ -47,7 +369,8 @@ OSM_Id OSM_Way_get_id(OSM_Way *wp);
 int OSM_Way_get_num_refs(OSM_Way *wp);
 int OSM_Way_get_num_keys(OSM_Way *wp);
 OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index);
-char *OSM_Way_get_key(OSM_Way *wp, int index);
-char *OSM_Way_get_value(OSM_Way *wp, int index);
+int OSM_Way_copy_refs(OSM_Way *wp, OSM_Id *refs, int max); // bulk decode up to max refs, returns count
+char *OSM_Way_get_key(OSM_Way *wp, int index);     // string is owned by the map
+char *OSM_Way_get_value(OSM_Way *wp, int index);   // string is owned by the map
 
 #endif
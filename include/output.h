@@ -0,0 +1,102 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Buffered query output. Bytes are formatted straight into a large buffer
+ * (integers and fixed point degrees without going through printf or doubles)
+ * that is handed to the sink in OUTPUT_BUFFER_SIZE blocks, or kept growing in
+ * memory when there is no sink.
+ *
+ * Structured formats are written as records: one query result per record,
+ * opened with output_begin_record and closed with output_end_record.
+ *
+ *   json     one object per line: {"query":"node","id":1,"lat":..,"lon":..,"found":true}
+ *   geojson  one Feature per line, the fields as properties and the point,
+ *            box or line of the record as geometry (null when it has none)
+ *   csv      rows of query,id,lat,lon,key,value: one per field of the record
+ *            (one per element of a list), or a single row without key and value
+ *
+ * Text is the human readable layout of the CLI, written with the plain helpers.
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum
+{
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV,
+    OUTPUT_GEOJSON
+} Output_Format;
+
+typedef struct Output
+{
+    Output_Format format;
+    FILE *sink;    // NULL to keep everything in buffer
+    char *buffer;
+    size_t size;   // bytes in buffer
+    size_t capacity;
+    int failed;    // out of memory or the sink refused a write
+
+    // record being written
+    const char *query;
+    int64_t id;
+    int has_id;
+    int64_t point[2]; // lat, lon
+    int has_point;
+    int64_t box[4];   // min lon, min lat, max lon, max lat
+    int has_box;
+    int has_fields;   // a field was written at the current nesting level (json)
+    int has_rows;     // csv
+    int has_geometry; // geojson properties are closed and the geometry written
+} Output;
+
+/* Format named name (text, json, csv or geojson). Returns -1 if there is none */
+int output_parse_format(const char *name, Output_Format *format);
+
+/* Output to sink, or to memory if sink is NULL. NULL when out of memory */
+Output *output_open(FILE *sink, Output_Format format);
+
+/* Hand the buffered bytes to the sink. Returns -1 if anything written so far was lost */
+int output_flush(Output *out);
+
+/* Flush and free (the sink stays open). Returns -1 if anything written was lost */
+int output_close(Output *out);
+
+/* Start of a document: the csv header row, nothing in other formats */
+void output_header(Output *out);
+
+void output_bytes(Output *out, const char *bytes, size_t len);
+void output_str(Output *out, const char *str);
+void output_char(Output *out, char c);
+void output_int(Output *out, int64_t value);
+void output_uint(Output *out, uint64_t value);
+void output_printf(Output *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Nanodegrees as degrees, truncated toward zero to decimals digits (at most 9).
+ * The fraction is zero padded to width digits, and trailing zeros beyond width
+ * are dropped.
+ */
+void output_degrees(Output *out, int64_t nano, int decimals, int width);
+
+/* Records of the structured formats. Id, point and box come before the fields */
+void output_begin_record(Output *out, const char *query);
+void output_record_id(Output *out, int64_t id);
+void output_record_point(Output *out, int64_t lat, int64_t lon);                            // lat and lon fields
+void output_record_box(Output *out, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat); // min/max fields
+void output_field_int(Output *out, const char *name, int64_t value);
+void output_field_uint(Output *out, const char *name, uint64_t value);
+void output_field_double(Output *out, const char *name, double value, int decimals);
+void output_field_bool(Output *out, const char *name, int value);
+void output_field_string(Output *out, const char *name, const char *value); // NULL is written as null
+void output_field_ids(Output *out, const char *name, const int64_t *ids, int count);
+void output_begin_object(Output *out, const char *name); // nested fields (in csv: rows keyed by their own names)
+void output_end_object(Output *out);
+void output_record_line(Output *out, const int64_t *lats, const int64_t *lons, int count); // geojson only, last before the end
+void output_end_record(Output *out);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+
+/* Upper bound on worker threads, whatever the number of online CPUs */
+#define PARALLEL_MAX_WORKERS 64
+
+/* Body of a parallel loop: handles items [begin, end) as worker number worker, returns -1 on error */
+typedef int (*Parallel_Body)(uint64_t begin, uint64_t end, int worker, void *arg);
+
+/* Number of workers parallel_for uses (online CPUs, capped at PARALLEL_MAX_WORKERS) */
+int parallel_num_workers(void);
+
+/*
+ * Split [0, count) into one contiguous range per worker, with at least
+ * min_chunk items each, and run body on every range. The calling thread
+ * runs the first range. Returns -1 if any body or thread creation failed.
+ */
+int parallel_for(uint64_t count, uint64_t min_chunk, Parallel_Body body, void *arg);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "arena.h"
+
 /* Protobuf wire values */
 
 typedef enum {
@@ -24,6 +26,9 @@ typedef enum {
 
 #define ANY_FIELD (-1)
 
+/* upper bound on the size of an inflated blob (the PBF spec caps blobs at 32MB) */
+#define PB_MAX_INFLATED_SIZE (64 * 1024 * 1024)
+
 /* represents a field in a message */
 
 typedef struct PB_Field {
@@ -44,6 +49,9 @@ typedef struct PB_Field {
 typedef PB_Field *PB_Message;
 
 
+/* Allocate fields and buffers of messages read by this thread from arena (NULL for malloc). */
+void PB_set_arena(Arena *arena);
+
 /* For reading messages from an input stream. */
 int PB_read_message(FILE *in, size_t len, PB_Message *msgp);
 int PB_read_field(FILE *in, PB_Field *fieldp);
@@ -52,7 +60,10 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep);
 
 /* For reading embedded messages from memory buffers. */
 int PB_read_embedded_message(char *buf, size_t len, PB_Message *msgp);
-int PB_inflate_embedded_message(char *buf, size_t len, PB_Message *msgp);
+int PB_inflate_embedded_message(char *buf, size_t len, size_t raw_size, PB_Message *msgp); // raw_size 0 if unknown
+
+/* For scanning messages held in memory without allocating (LEN values point into buf). */
+int PB_scan_field(char *buf, size_t len, size_t *posp, PB_Field *fieldp);
 
 /* For traversing and manipulating PB_Message objects. */
 PB_Field *PB_next_field(PB_Field *prev, int fnum, PB_WireType type, PB_Direction dir);
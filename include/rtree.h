@@ -0,0 +1,47 @@
+#ifndef RTREE_H
+#define RTREE_H
+
+#include <stdint.h>
+
+/*
+ * Static R-tree bulk loaded with Sort-Tile-Recursive packing. Items are boxes
+ * in int32 units of 100 nanodegrees (the default PBF granularity), so a node
+ * is a box of at most one unit per side. Every level is a flat array of boxes
+ * and the children of box i are boxes i * RTREE_FANOUT ... of the level below,
+ * so the tree needs no pointers and is built in O(n log n).
+ */
+
+#define RTREE_FANOUT 16
+#define RTREE_MAX_LEVELS 16
+
+typedef struct OSM_RTreeBox {
+    int32_t min_lon;
+    int32_t min_lat;
+    int32_t max_lon;
+    int32_t max_lat;
+} OSM_RTreeBox;
+
+typedef struct OSM_RTree {
+    uint32_t count;
+    uint32_t *items;     // item numbers in leaf order
+    OSM_RTreeBox *boxes; // every level back to back, items first and the root last
+    int num_levels;
+    uint64_t level_start[RTREE_MAX_LEVELS];
+    uint64_t level_count[RTREE_MAX_LEVELS];
+} OSM_RTree;
+
+/* Called for every item whose box intersects the query, return non zero to stop */
+typedef int (*OSM_RTreeVisitor)(uint32_t item, void *arg);
+
+/* Bulk load a tree over count item boxes, item i being boxes[i] */
+OSM_RTree *rtree_build(const OSM_RTreeBox *boxes, uint32_t count);
+
+/* Visit the items intersecting query, returns 1 if the visitor stopped the search, else 0 */
+int rtree_query(const OSM_RTree *tree, const OSM_RTreeBox *query, OSM_RTreeVisitor visit, void *arg);
+
+void rtree_free(OSM_RTree *tree);
+
+/* Tightest int32 unit box containing a nanodegree box */
+void rtree_box_from_nano(OSM_RTreeBox *box, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat);
+
+#endif
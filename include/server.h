@@ -0,0 +1,25 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "osm.h"
+
+/*
+ * Query daemon over a Unix domain socket. The map is loaded once, its query
+ * indexes are built up front, and every client then sends request lines with
+ * the query options of the CLI (-s, -S, -b, -n, -w, -q, -k, -t), several per
+ * line if it likes. Each line gets one response, in order:
+ *
+ *   OK <length>\n followed by exactly length bytes of output in the --format
+ *                 the server was started with (CLI text by default)
+ *   ERROR <reason>\n
+ *
+ * One thread multiplexes the connections with epoll and a pool of workers
+ * runs the queries against the shared read-only map; a client has at most one
+ * request with the workers, so pipelined requests are answered in order. A
+ * client that half closes its side still gets the answers to what it sent.
+ */
+
+/* Serve until SIGINT or SIGTERM, replacing any stale socket at path. Returns -1 if serving could not start */
+int serve_queries(OSM_Map *mp, const char *socket_path);
+
+#endif
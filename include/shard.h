@@ -0,0 +1,38 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+
+#include "output.h"
+
+/*
+ * One file split across processes or machines. The blob directory is cut into
+ * N contiguous ranges of about the same number of bytes, and shard i decodes
+ * only the data blobs of range i (plus the header). Its -s, -S, -b and -t
+ * results are written as a partial:
+ *
+ *   "OSMPART\0", then varints: format version, shard, shard count, input size,
+ *   input name (length and bytes), FNV-1a digest of the blob directory (offset,
+ *   size and type of every blob), record count and the kind letter of each
+ *   record, then one record per query in command line order:
+ *
+ *   's' nodes ways
+ *   'S' nodes node_tags ways way_tags relations relation_tags
+ *   'b' found, then zig-zag min_lon min_lat max_lon max_lat when found
+ *   't' filter (length and bytes), matches, zig-zag deltas of the way ids
+ *
+ * Counts add up, boxes are joined and matches are concatenated in shard
+ * (file) order, so merging the partials of every shard prints what a single
+ * run over the whole file would. Partials are varints throughout, so shards
+ * may run on machines of any byte order; the digest tells copies of the file
+ * apart from a different file of the same name and size. Nothing is printed
+ * unless every record merges.
+ */
+
+/* Write the partial results of the queries of argv for shard shard of num_shards of the file at path to out */
+int run_shard_queries(char **argv, const char *path, int shard, int num_shards, FILE *out);
+
+/* Print the results of merged partials, one per shard in any order, -1 if one is missing, repeated, foreign or a geojson -t */
+int merge_shard_results(char **paths, int num_paths, FILE *out, Output_Format format);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+ * Map wide intern pool: every distinct tag string is stored once, in the
+ * owning map's arena, and named by a dense uint32 id. Ids are handed out in
+ * first-seen order, so equal strings compare as equal ids anywhere in the map.
+ * Lookups use an open addressing table of ids probed linearly.
+ */
+
+#define STRING_POOL_NONE UINT32_MAX
+
+typedef struct OSM_StringPool {
+    uint32_t count;
+    uint32_t capacity; // of strings
+    char **strings;    // by id, NUL terminated, owned by the arena passed to intern
+    uint64_t *hashes;  // by id
+    uint32_t *slots;   // ids, STRING_POOL_NONE when empty
+    uint32_t num_slots; // power of two, 0 once borrowed tables are dropped
+    int borrowed;       // hashes and slots belong to the caller of string_pool_attach
+} OSM_StringPool;
+
+OSM_StringPool *string_pool_create(void);
+
+/* Id of str, adding a copy allocated from arena if it is new. STRING_POOL_NONE on failure */
+uint32_t string_pool_intern(OSM_StringPool *pool, Arena *arena, const char *str, size_t len);
+
+/* Id of an already interned string, STRING_POOL_NONE if it was never interned */
+uint32_t string_pool_find(const OSM_StringPool *pool, const char *str, size_t len);
+
+/*
+ * Serve the strings and tables of a saved pool (string id i at bytes + offsets[i])
+ * without copying them. The pool never writes to or frees the borrowed tables and
+ * drops them on reset. Returns -1 when out of memory.
+ */
+int string_pool_attach(OSM_StringPool *pool, uint32_t count, const char *bytes, const uint64_t *offsets,
+                       const uint64_t *hashes, const uint32_t *slots, uint32_t num_slots);
+
+/* Forget every string, keeping the tables for reuse (the strings die with their arena) */
+void string_pool_reset(OSM_StringPool *pool);
+
+void string_pool_free(OSM_StringPool *pool);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Maximum number of bytes used by a single base 128 varint */
+#define VARINT_MAX_BYTES 10
+
+/* Encode a single varint into out (at least VARINT_MAX_BYTES long), returns the byte count */
+size_t varint_encode(uint64_t value, uint8_t *out);
+
+/* Decode a single varint from buf, returns the byte count or 0 if truncated */
+size_t varint_decode(const uint8_t *buf, size_t len, uint64_t *valuep);
+
+/* Count the varints in a packed buffer (number of bytes without the continuation bit) */
+size_t varint_count(const uint8_t *buf, size_t len);
+
+/* Count the varints equal to zero in a packed buffer (single 0x00 bytes) */
+size_t varint_count_zeros(const uint8_t *buf, size_t len);
+
+/*
+ * Decode up to max zig-zag encoded deltas from a packed buffer, writing the running
+ * totals to out. Returns the number of values written.
+ */
+size_t varint_decode_deltas(const uint8_t *buf, size_t len, int64_t *out, size_t max);
+
+#endif
@@ -4,5 +4,6 @@
 #include <stdio.h>
 
 int zlib_inflate(FILE *source, FILE *dest);
+int zlib_inflate_buffer(const char *source, size_t len, char *dest, size_t capacity, size_t *sizep);
 
 #endif
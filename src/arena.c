@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+typedef struct Arena_Chunk
+{
+    struct Arena_Chunk *next;
+    size_t size; // usable bytes in data
+    size_t used;
+    unsigned char data[];
+} Arena_Chunk;
+
+struct Arena
+{
+    Arena_Chunk *head;
+    Arena_Chunk *current; // chunk allocations are served from
+    Arena_Chunk *tail;
+    size_t chunk_size;
+};
+
+Arena *arena_create(size_t chunk_size)
+{
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (!arena)
+    {
+        return NULL;
+    }
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+/* Try to carve size bytes out of a chunk, returns NULL if it does not fit */
+static void *chunk_take(Arena_Chunk *chunk, size_t size)
+{
+    uintptr_t base = (uintptr_t)chunk->data;
+    uintptr_t start = (base + chunk->used + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+    size_t offset = start - base;
+
+    if (offset + size > chunk->size)
+    {
+        return NULL;
+    }
+    chunk->used = offset + size;
+    return (void *)start;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    // chunks after current are either fresh or emptied by a reset
+    for (Arena_Chunk *chunk = arena->current; chunk != NULL; chunk = chunk->next)
+    {
+        void *ptr = chunk_take(chunk, size);
+        if (ptr)
+        {
+            arena->current = chunk;
+            return ptr;
+        }
+    }
+
+    size_t chunk_size = arena->chunk_size;
+    if (size + ARENA_ALIGN > chunk_size)
+    {
+        chunk_size = size + ARENA_ALIGN;
+    }
+
+    Arena_Chunk *chunk = malloc(sizeof(Arena_Chunk) + chunk_size);
+    if (!chunk)
+    {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+
+    if (!arena->head)
+    {
+        arena->head = chunk;
+    }
+    else
+    {
+        arena->tail->next = chunk;
+    }
+    arena->tail = chunk;
+    arena->current = chunk;
+
+    return chunk_take(chunk, size);
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy)
+    {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_reset(Arena *arena)
+{
+    for (Arena_Chunk *chunk = arena->head; chunk != NULL; chunk = chunk->next)
+    {
+        chunk->used = 0;
+    }
+    arena->current = arena->head;
+}
+
+void arena_free(Arena *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    Arena_Chunk *chunk = arena->head;
+    while (chunk)
+    {
+        Arena_Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
@@ -0,0 +1,693 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "blob_index.h"
+#include "protocol_buffer.h"
+#include "varint.h"
+#include "zlib_inflate.h"
+
+#define BLOB_INDEX_MAGIC "OSMBIDX"
+#define BLOB_INDEX_VERSION 3
+
+/* Bytes at each end of the indexed file covered by the content check of a sidecar */
+#define SOURCE_CHECK_BYTES 65536
+
+/* Blocked Bloom filter: each id sets BLOOM_PROBES bits inside one 512 bit block */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BITS_PER_ID 10
+#define BLOOM_PROBES 6
+
+/* Layout of the sidecar file: this header, count OSM_BlobInfo entries, then bloom_size bytes of filters */
+typedef struct BlobIndex_FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t source_size;
+    int64_t source_mtime;
+    int64_t source_mtime_nsec;
+    uint32_t source_check;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t bloom_size;
+} BlobIndex_FileHeader;
+
+/* Growable buffer reused across blobs */
+typedef struct BlobIndex_Buffer
+{
+    char *buf;
+    size_t capacity;
+} BlobIndex_Buffer;
+
+static int reserve(BlobIndex_Buffer *b, size_t size)
+{
+    if (size <= b->capacity)
+    {
+        return 0;
+    }
+    char *grown = realloc(b->buf, size);
+    if (!grown)
+    {
+        return -1;
+    }
+    b->buf = grown;
+    b->capacity = size;
+    return 0;
+}
+
+/* Mix an (entity, id) pair into a well distributed 64 bit hash (splitmix64 finalizer) */
+static uint64_t bloom_hash(int entity, OSM_Id id)
+{
+    uint64_t h = (uint64_t)id + 0x9E3779B97F4A7C15ULL * (uint64_t)(entity + 1);
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/* Block of a filter with num_blocks blocks that a hash maps to */
+static uint64_t bloom_block(uint64_t hash, uint32_t num_blocks)
+{
+    return ((hash >> 32) * num_blocks) >> 32;
+}
+
+/* Bit within a block for a probe, 9 bits of the hash per probe */
+static uint32_t bloom_bit(uint64_t hash, int probe)
+{
+    return (hash >> (9 * probe)) & (BLOOM_BLOCK_BYTES * 8 - 1);
+}
+
+OSM_BlobIndex *OSM_BlobIndex_create(void)
+{
+    return calloc(1, sizeof(OSM_BlobIndex));
+}
+
+OSM_BlobInfo *OSM_BlobIndex_append(OSM_BlobIndex *idx, uint64_t offset, uint64_t size, uint32_t type)
+{
+    if (idx->count == idx->capacity)
+    {
+        uint64_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+        OSM_BlobInfo *grown = realloc(idx->blobs, capacity * sizeof(OSM_BlobInfo));
+        if (!grown)
+        {
+            return NULL;
+        }
+        idx->blobs = grown;
+        idx->capacity = capacity;
+    }
+
+    OSM_BlobInfo *info = &idx->blobs[idx->count++];
+    memset(info, 0, sizeof(OSM_BlobInfo));
+    info->offset = offset;
+    info->size = size;
+    info->type = type;
+    for (int entity = 0; entity < OSM_BLOB_ENTITY_TYPES; entity++)
+    {
+        info->min_id[entity] = INT64_MAX;
+        info->max_id[entity] = INT64_MIN;
+    }
+    idx->pending_count = 0;
+    return info;
+}
+
+int OSM_BlobIndex_add_id(OSM_BlobIndex *idx, int entity, OSM_Id id)
+{
+    OSM_BlobInfo *info = &idx->blobs[idx->count - 1];
+    if (id < info->min_id[entity])
+    {
+        info->min_id[entity] = id;
+    }
+    if (id > info->max_id[entity])
+    {
+        info->max_id[entity] = id;
+    }
+
+    // hashes wait until the blob is finished and its filter can be sized
+    if (idx->pending_count == idx->pending_capacity)
+    {
+        uint64_t capacity = idx->pending_capacity ? idx->pending_capacity * 2 : 8192;
+        uint64_t *grown = realloc(idx->pending, capacity * sizeof(uint64_t));
+        if (!grown)
+        {
+            return -1;
+        }
+        idx->pending = grown;
+        idx->pending_capacity = capacity;
+    }
+    idx->pending[idx->pending_count++] = bloom_hash(entity, id);
+    return 0;
+}
+
+int OSM_BlobIndex_finish_blob(OSM_BlobIndex *idx)
+{
+    OSM_BlobInfo *info = &idx->blobs[idx->count - 1];
+    if (idx->pending_count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t bits = idx->pending_count * BLOOM_BITS_PER_ID;
+    uint32_t num_blocks = (bits + BLOOM_BLOCK_BYTES * 8 - 1) / (BLOOM_BLOCK_BYTES * 8);
+    uint64_t filter_size = (uint64_t)num_blocks * BLOOM_BLOCK_BYTES;
+
+    if (idx->bloom_size + filter_size > idx->bloom_capacity)
+    {
+        uint64_t capacity = idx->bloom_capacity ? idx->bloom_capacity : 65536;
+        while (capacity < idx->bloom_size + filter_size)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(idx->bloom, capacity);
+        if (!grown)
+        {
+            return -1;
+        }
+        idx->bloom = grown;
+        idx->bloom_capacity = capacity;
+    }
+
+    uint8_t *filter = idx->bloom + idx->bloom_size;
+    memset(filter, 0, filter_size);
+    for (uint64_t i = 0; i < idx->pending_count; i++)
+    {
+        uint64_t hash = idx->pending[i];
+        uint8_t *block = filter + bloom_block(hash, num_blocks) * BLOOM_BLOCK_BYTES;
+        for (int probe = 0; probe < BLOOM_PROBES; probe++)
+        {
+            uint32_t bit = bloom_bit(hash, probe);
+            block[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+
+    info->bloom_offset = idx->bloom_size;
+    info->bloom_blocks = num_blocks;
+    idx->bloom_size += filter_size;
+    idx->pending_count = 0;
+    return 0;
+}
+
+/* Id (field 1) of a Node, Way or Relation message */
+static int scan_entity_id(PB_Field *entity, OSM_Id *idp)
+{
+    size_t pos = 0;
+    PB_Field field;
+    while (PB_scan_field(entity->value.bytes.buf, entity->value.bytes.size, &pos, &field) == 1)
+    {
+        if (field.number == 1 && field.type == VARINT_TYPE)
+        {
+            *idp = (OSM_Id)field.value.i64;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Ids of a DenseNodes message: packed, zig-zag delta coded in field 1 */
+static int scan_dense_ids(PB_Field *dense, OSM_BlobIndex *idx)
+{
+    size_t pos = 0;
+    PB_Field field;
+    while (PB_scan_field(dense->value.bytes.buf, dense->value.bytes.size, &pos, &field) == 1)
+    {
+        if (field.number != 1 || field.type != LEN_TYPE)
+        {
+            continue;
+        }
+
+        const uint8_t *ids = (const uint8_t *)field.value.bytes.buf;
+        size_t size = field.value.bytes.size;
+        size_t offset = 0;
+        OSM_Id total = 0;
+        while (offset < size)
+        {
+            uint64_t delta;
+            size_t used = varint_decode(ids + offset, size - offset, &delta);
+            if (used == 0)
+            {
+                return -1;
+            }
+            total += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+            if (OSM_BlobIndex_add_id(idx, OSM_BLOB_NODES, total) == -1)
+            {
+                return -1;
+            }
+            offset += used;
+        }
+    }
+    return 0;
+}
+
+/* Add the ids of an inflated PrimitiveBlock to the last blob of the index */
+static int scan_primitive_block(char *buf, size_t len, OSM_BlobIndex *idx)
+{
+    size_t pos = 0;
+    PB_Field group;
+    int result;
+
+    while ((result = PB_scan_field(buf, len, &pos, &group)) == 1)
+    {
+        if (group.number != 2 || group.type != LEN_TYPE)
+        {
+            continue;
+        }
+
+        size_t group_pos = 0;
+        PB_Field entity;
+        while (PB_scan_field(group.value.bytes.buf, group.value.bytes.size, &group_pos, &entity) == 1)
+        {
+            OSM_Id id;
+            if (entity.type != LEN_TYPE)
+            {
+                continue;
+            }
+
+            // same id decoding as handle_NODE, handle_WAY and handle_DENSE
+            int result = 0;
+            if (entity.number == 1 && scan_entity_id(&entity, &id) == 0)
+            {
+                result = OSM_BlobIndex_add_id(idx, OSM_BLOB_NODES, id);
+            }
+            else if (entity.number == 2)
+            {
+                result = scan_dense_ids(&entity, idx);
+            }
+            else if (entity.number == 3 && scan_entity_id(&entity, &id) == 0)
+            {
+                result = OSM_BlobIndex_add_id(idx, OSM_BLOB_WAYS, id);
+            }
+            else if (entity.number == 4 && scan_entity_id(&entity, &id) == 0)
+            {
+                result = OSM_BlobIndex_add_id(idx, OSM_BLOB_RELATIONS, id);
+            }
+            if (result == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return result;
+}
+
+/* Inflate a Blob message (raw field 1 or zlib field 3) into out, returns the data size or -1 */
+static int64_t inflate_blob(char *blob, size_t len, BlobIndex_Buffer *out, char **datap)
+{
+    size_t pos = 0;
+    PB_Field field;
+    uint64_t raw_size = 0;
+    PB_Field *zlib_data = NULL;
+    PB_Field zlib_field;
+
+    while (PB_scan_field(blob, len, &pos, &field) == 1)
+    {
+        if (field.number == 1 && field.type == LEN_TYPE)
+        {
+            *datap = field.value.bytes.buf;
+            return field.value.bytes.size;
+        }
+        if (field.number == 2 && field.type == VARINT_TYPE)
+        {
+            raw_size = field.value.i64;
+        }
+        if (field.number == 3 && field.type == LEN_TYPE)
+        {
+            zlib_field = field;
+            zlib_data = &zlib_field;
+        }
+    }
+
+    if (!zlib_data || raw_size > PB_MAX_INFLATED_SIZE || reserve(out, raw_size + 1) == -1)
+    {
+        return -1;
+    }
+
+    size_t inflated_size = 0;
+    if (zlib_inflate_buffer(zlib_data->value.bytes.buf, zlib_data->value.bytes.size, out->buf, out->capacity, &inflated_size) != Z_OK)
+    {
+        return -1;
+    }
+    *datap = out->buf;
+    return inflated_size;
+}
+
+/* Walk the blobs of in, inflating data blobs to add their ids when scan_ids is set */
+static OSM_BlobIndex *build_index(FILE *in, int scan_ids)
+{
+    OSM_BlobIndex *idx = OSM_BlobIndex_create();
+    BlobIndex_Buffer raw = {NULL, 0};
+    BlobIndex_Buffer inflated = {NULL, 0};
+
+    if (!idx || fseeko(in, 0, SEEK_SET) != 0)
+    {
+        free(idx);
+        return NULL;
+    }
+
+    while (1)
+    {
+        uint64_t offset = ftello(in);
+        unsigned char length_bytes[4];
+        size_t bytes_read = fread(length_bytes, 1, sizeof(length_bytes), in);
+        if (bytes_read == 0 && feof(in))
+        {
+            break;
+        }
+        if (bytes_read != sizeof(length_bytes))
+        {
+            goto error;
+        }
+
+        // network byte order
+        uint32_t header_length = ((uint32_t)length_bytes[0] << 24) | ((uint32_t)length_bytes[1] << 16) |
+                                 ((uint32_t)length_bytes[2] << 8) | length_bytes[3];
+        if (reserve(&raw, header_length) == -1 || fread(raw.buf, 1, header_length, in) != header_length)
+        {
+            goto error;
+        }
+
+        // BlobHeader: type (field 1) and datasize (field 3)
+        uint32_t type = OSM_BLOB_OTHER;
+        uint64_t datasize = 0;
+
+        size_t pos = 0;
+        PB_Field field;
+        while (PB_scan_field(raw.buf, header_length, &pos, &field) == 1)
+        {
+            if (field.number == 1 && field.type == LEN_TYPE)
+            {
+                if (field.value.bytes.size == 9 && memcmp(field.value.bytes.buf, "OSMHeader", 9) == 0)
+                {
+                    type = OSM_BLOB_HEADER;
+                }
+                else if (field.value.bytes.size == 7 && memcmp(field.value.bytes.buf, "OSMData", 7) == 0)
+                {
+                    type = OSM_BLOB_DATA;
+                }
+            }
+            else if (field.number == 3 && field.type == VARINT_TYPE)
+            {
+                datasize = field.value.i64;
+            }
+        }
+
+        if (!OSM_BlobIndex_append(idx, offset, 4 + header_length + datasize, type))
+        {
+            goto error;
+        }
+
+        if (type == OSM_BLOB_DATA && scan_ids)
+        {
+            char *data = NULL;
+            if (reserve(&raw, datasize) == -1 || fread(raw.buf, 1, datasize, in) != datasize)
+            {
+                goto error;
+            }
+            int64_t data_size = inflate_blob(raw.buf, datasize, &inflated, &data);
+            if (data_size == -1 || scan_primitive_block(data, data_size, idx) == -1 || OSM_BlobIndex_finish_blob(idx) == -1)
+            {
+                goto error;
+            }
+        }
+        else if (fseeko(in, datasize, SEEK_CUR) != 0)
+        {
+            goto error;
+        }
+    }
+
+    free(raw.buf);
+    free(inflated.buf);
+    return idx;
+
+error:
+    free(raw.buf);
+    free(inflated.buf);
+    OSM_BlobIndex_free(idx);
+    return NULL;
+}
+
+OSM_BlobIndex *OSM_BlobIndex_build(FILE *in)
+{
+    return build_index(in, 1);
+}
+
+OSM_BlobIndex *OSM_BlobIndex_build_directory(FILE *in)
+{
+    return build_index(in, 0);
+}
+
+OSM_BlobIndex *OSM_BlobIndex_load(const char *index_path)
+{
+    FILE *f = fopen(index_path, "r");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    BlobIndex_FileHeader header;
+    OSM_BlobIndex *idx = NULL;
+
+    if (fstat(fileno(f), &st) != 0 || fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, BLOB_INDEX_MAGIC, sizeof(BLOB_INDEX_MAGIC)) != 0 ||
+        header.version != BLOB_INDEX_VERSION || header.entry_size != sizeof(OSM_BlobInfo) ||
+        (uint64_t)st.st_size != sizeof(header) + header.count * sizeof(OSM_BlobInfo) + header.bloom_size)
+    {
+        goto done;
+    }
+
+    // map the sidecar so filters of blobs that are never queried are never paged in
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (mapping == MAP_FAILED)
+    {
+        goto done;
+    }
+
+    idx = OSM_BlobIndex_create();
+    if (!idx)
+    {
+        munmap(mapping, st.st_size);
+        goto done;
+    }
+    idx->mapping = mapping;
+    idx->mapping_size = st.st_size;
+    idx->count = header.count;
+    idx->source_size = header.source_size;
+    idx->source_mtime = header.source_mtime;
+    idx->source_mtime_nsec = header.source_mtime_nsec;
+    idx->source_check = header.source_check;
+    idx->blobs = (OSM_BlobInfo *)((char *)mapping + sizeof(header));
+    idx->bloom = (uint8_t *)(idx->blobs + header.count);
+    idx->bloom_size = header.bloom_size;
+
+done:
+    fclose(f);
+    return idx;
+}
+
+int OSM_BlobIndex_save(OSM_BlobIndex *idx, const char *index_path)
+{
+    FILE *f = fopen(index_path, "w");
+    if (!f)
+    {
+        return -1;
+    }
+
+    BlobIndex_FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BLOB_INDEX_MAGIC, sizeof(BLOB_INDEX_MAGIC));
+    header.version = BLOB_INDEX_VERSION;
+    header.entry_size = sizeof(OSM_BlobInfo);
+    header.source_size = idx->source_size;
+    header.source_mtime = idx->source_mtime;
+    header.source_mtime_nsec = idx->source_mtime_nsec;
+    header.source_check = idx->source_check;
+    header.count = idx->count;
+    header.bloom_size = idx->bloom_size;
+
+    int result = 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(idx->blobs, sizeof(OSM_BlobInfo), idx->count, f) != idx->count ||
+        fwrite(idx->bloom, 1, idx->bloom_size, f) != idx->bloom_size)
+    {
+        result = -1;
+    }
+    if (fclose(f) != 0)
+    {
+        result = -1;
+    }
+    if (result == -1)
+    {
+        remove(index_path);
+    }
+    return result;
+}
+
+void OSM_BlobIndex_free(OSM_BlobIndex *idx)
+{
+    if (!idx)
+    {
+        return;
+    }
+    if (idx->mapping)
+    {
+        munmap(idx->mapping, idx->mapping_size);
+    }
+    else
+    {
+        free(idx->blobs);
+        free(idx->bloom);
+    }
+    free(idx->pending);
+    free(idx);
+}
+
+/* Path of the sidecar of a PBF file, malloc'd */
+static char *sidecar_path(const char *pbf_path)
+{
+    char *index_path = malloc(strlen(pbf_path) + sizeof(".idx"));
+    if (index_path)
+    {
+        sprintf(index_path, "%s.idx", pbf_path);
+    }
+    return index_path;
+}
+
+/* CRC-32 of the first and last SOURCE_CHECK_BYTES of a file of size bytes, -1 on error */
+static int source_check(const char *pbf_path, uint64_t size, uint32_t *checkp)
+{
+    FILE *in = fopen(pbf_path, "r");
+    if (!in)
+    {
+        return -1;
+    }
+
+    char *buf = malloc(SOURCE_CHECK_BYTES);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t tail = size > SOURCE_CHECK_BYTES ? size - SOURCE_CHECK_BYTES : 0;
+    uint64_t starts[2] = {0, tail > SOURCE_CHECK_BYTES ? tail : SOURCE_CHECK_BYTES};
+    int result = buf ? 0 : -1;
+
+    for (int i = 0; i < 2 && result == 0 && starts[i] < size; i++)
+    {
+        size_t len = size - starts[i] < SOURCE_CHECK_BYTES ? size - starts[i] : SOURCE_CHECK_BYTES;
+        if (fseeko(in, starts[i], SEEK_SET) != 0 || fread(buf, 1, len, in) != len)
+        {
+            result = -1;
+            break;
+        }
+        crc = crc32(crc, (const Bytef *)buf, len);
+    }
+    free(buf);
+    fclose(in);
+    *checkp = crc;
+    return result;
+}
+
+/* Load the sidecar of a PBF file if it was built from the file as it is now */
+static OSM_BlobIndex *load_current_sidecar(const char *pbf_path, struct stat *st)
+{
+    if (stat(pbf_path, st) != 0)
+    {
+        return NULL;
+    }
+
+    char *index_path = sidecar_path(pbf_path);
+    if (!index_path)
+    {
+        return NULL;
+    }
+    OSM_BlobIndex *idx = OSM_BlobIndex_load(index_path);
+    free(index_path);
+
+    // size and mtime first, the content check only reads the file once they match
+    uint32_t check;
+    if (idx && (idx->source_size != (uint64_t)st->st_size || idx->source_mtime != (int64_t)st->st_mtim.tv_sec ||
+                idx->source_mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+                source_check(pbf_path, st->st_size, &check) != 0 || idx->source_check != check))
+    {
+        OSM_BlobIndex_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+int OSM_BlobIndex_sidecar_is_current(const char *pbf_path)
+{
+    struct stat st;
+    OSM_BlobIndex *idx = load_current_sidecar(pbf_path, &st);
+    OSM_BlobIndex_free(idx);
+    return idx != NULL;
+}
+
+int OSM_BlobIndex_save_sidecar(OSM_BlobIndex *idx, const char *pbf_path)
+{
+    struct stat st;
+    if (stat(pbf_path, &st) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t check;
+    if (source_check(pbf_path, st.st_size, &check) != 0)
+    {
+        return -1;
+    }
+
+    char *index_path = sidecar_path(pbf_path);
+    if (!index_path)
+    {
+        return -1;
+    }
+    idx->source_size = st.st_size;
+    idx->source_mtime = st.st_mtim.tv_sec;
+    idx->source_mtime_nsec = st.st_mtim.tv_nsec;
+    idx->source_check = check;
+    int result = OSM_BlobIndex_save(idx, index_path);
+    free(index_path);
+    return result;
+}
+
+OSM_BlobIndex *OSM_BlobIndex_open(const char *pbf_path)
+{
+    struct stat st;
+    OSM_BlobIndex *idx = load_current_sidecar(pbf_path, &st);
+    if (idx)
+    {
+        return idx;
+    }
+
+    FILE *in = fopen(pbf_path, "r");
+    if (!in)
+    {
+        return NULL;
+    }
+    idx = OSM_BlobIndex_build(in);
+    fclose(in);
+    return idx;
+}
+
+int OSM_BlobIndex_may_contain(OSM_BlobIndex *idx, uint64_t blob, int entity, OSM_Id id)
+{
+    OSM_BlobInfo *info = &idx->blobs[blob];
+    if (info->type != OSM_BLOB_DATA || id < info->min_id[entity] || id > info->max_id[entity])
+    {
+        return 0;
+    }
+    if (info->bloom_blocks == 0)
+    {
+        return 1;
+    }
+
+    uint64_t hash = bloom_hash(entity, id);
+    const uint8_t *block = idx->bloom + info->bloom_offset + bloom_block(hash, info->bloom_blocks) * BLOOM_BLOCK_BYTES;
+    for (int probe = 0; probe < BLOOM_PROBES; probe++)
+    {
+        uint32_t bit = bloom_bit(hash, probe);
+        if ((block[bit >> 3] & (1 << (bit & 7))) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -1,225 +1,1950 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "config.h"
+#include "graph.h"
 #include "osm.h"
+#include "output.h"
+#include "parallel.h"
 
 // flags
 int help_requested = 0;
 
 // input file if specified
 char *osm_input_file = NULL;
+int num_input_files = 0;
+
+// socket to serve the map on if specified
+char *serve_socket_path = NULL;
+
+// keep the blob index of the input in its sidecar if specified
+int write_index = 0;
+
+// format of the query results
+Output_Format output_format = OUTPUT_TEXT;
+
+// shard of the input to process if specified (shard_count 0 otherwise)
+int shard_index = 0;
+int shard_count = 0;
+
+// partial results to merge if specified
+char **merge_paths = NULL;
+int num_merge_paths = 0;
+
+/* nodes matched by a -q query, grown as the query visits them */
+typedef struct BBox_Matches
+{
+  OSM_Node **nodes;
+  int count;
+  int capacity;
+} BBox_Matches;
+
+/* helper to collect the nodes of a bbox query */
+int collect_node(OSM_Node *np, void *arg)
+{
+  BBox_Matches *matches = arg;
+  if (matches->count == matches->capacity)
+  {
+    int capacity = matches->capacity ? matches->capacity * 2 : 64;
+    OSM_Node **grown = realloc(matches->nodes, sizeof(OSM_Node *) * capacity);
+    if (!grown)
+    {
+      return 1;
+    }
+    matches->nodes = grown;
+    matches->capacity = capacity;
+  }
+  matches->nodes[matches->count++] = np;
+  return 0;
+}
+
+/* helper to print matches in id order (the index visits them in spatial order) */
+int compare_node_ids(const void *a, const void *b)
+{
+  OSM_Id x = OSM_Node_get_id(*(OSM_Node **)a);
+  OSM_Id y = OSM_Node_get_id(*(OSM_Node **)b);
+  return x < y ? -1 : x > y;
+}
+
+/* helper to count how many times an option is given */
+int count_option(char **argv, const char *option)
+{
+  int count = 0;
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    count += strcmp(*p, option) == 0;
+  }
+  return count;
+}
+
+/* helper to convert a coordinate in degrees to nanodegrees */
+int64_t degrees_to_nano(double degrees)
+{
+  double nano = degrees * 1000000000;
+  return (int64_t)(nano < 0 ? nano - 0.5 : nano + 0.5);
+}
+
+/* helper to check that an arg is a coordinate in degrees */
+int is_coordinate(char *arg)
+{
+  char *endptr;
+  if (arg == NULL)
+  {
+    return 0;
+  }
+  strtod(arg, &endptr);
+  return endptr != arg && *endptr == '\0';
+}
+
+/* helper for the equirectangular distance in meters between two points in nanodegrees */
+double distance_meters(int64_t lat1, int64_t lon1, int64_t lat2, int64_t lon2)
+{
+  double to_radians = M_PI / 180.0 / 1000000000;
+  double x = (lon2 - lon1) * to_radians * cos(lat1 * to_radians);
+  double y = (lat2 - lat1) * to_radians;
+  return sqrt(x * x + y * y) * 6371008.8;
+}
+
+/* coordinates of the nodes of a way, by position in its ref sequence */
+typedef struct Way_Line
+{
+  int64_t *lats;
+  int64_t *lons;
+  char *found;
+} Way_Line;
+
+/* helper to collect the nodes of a way line */
+int collect_line_node(uint64_t index, OSM_Node *np, void *arg)
+{
+  Way_Line *line = arg;
+  line->lats[index] = OSM_Node_get_lat(np);
+  line->lons[index] = OSM_Node_get_lon(np);
+  line->found[index] = 1;
+  return 0;
+}
+
+/* helper to write the geometry of a way record (geojson only): the line through its nodes found in the map */
+int print_way_line(Output *out, OSM_Map *mp, OSM_Way *wp)
+{
+  if (out->format != OUTPUT_GEOJSON)
+  {
+    return 0;
+  }
+
+  // the refs are copied first, finding the nodes of a lazy map may evict the blob of the way
+  int ref_count = OSM_Way_get_num_refs(wp);
+  size_t capacity = ref_count > 0 ? ref_count : 1;
+  OSM_Id *refs = malloc(sizeof(OSM_Id) * capacity);
+  Way_Line line = {malloc(sizeof(int64_t) * capacity), malloc(sizeof(int64_t) * capacity), calloc(capacity, 1)};
+  int result = -1;
+  if (refs && line.lats && line.lons && line.found)
+  {
+    int decoded = OSM_Way_copy_refs(wp, refs, ref_count);
+    if (OSM_Map_find_Nodes(mp, refs, decoded, collect_line_node, &line) != -1)
+    {
+      // nodes cut off by an extract are left out of the line
+      int count = 0;
+      for (int i = 0; i < decoded; i++)
+      {
+        if (line.found[i])
+        {
+          line.lats[count] = line.lats[i];
+          line.lons[count++] = line.lons[i];
+        }
+      }
+      output_record_line(out, line.lats, line.lons, count);
+      result = 0;
+    }
+  }
+  free(refs);
+  free(line.lats);
+  free(line.lons);
+  free(line.found);
+  return result;
+}
+
+/* ways matched by a -t filter, written as the filter visits them */
+typedef struct Filter_Matches
+{
+  Output *out;
+  OSM_Map *map;
+  const char *filter;
+  int failed;
+} Filter_Matches;
+
+/* helper to print a way matched by a -t filter, with its line when the way is at hand (wp NULL without) */
+int print_filter_match(Output *out, const char *filter, int64_t id, OSM_Map *mp, OSM_Way *wp)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "  Way ID: ");
+    output_int(out, id);
+    output_char(out, '\n');
+    return 0;
+  }
+
+  output_begin_record(out, "tag_filter");
+  output_record_id(out, id);
+  output_field_string(out, "filter", filter);
+  if (wp && print_way_line(out, mp, wp) == -1)
+  {
+    return -1;
+  }
+  output_end_record(out);
+  return 0;
+}
+
+/* helper to print the ways matched by a -t filter */
+int print_way_id(OSM_Way *wp, void *arg)
+{
+  Filter_Matches *matches = arg;
+  if (print_filter_match(matches->out, matches->filter, OSM_Way_get_id(wp), matches->map, wp) == -1)
+  {
+    matches->failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* helpers to print what comes before and after the matches of a -t filter */
+void print_filter_header(Output *out, const char *filter)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "=== Tag Filter ===\nFilter: ");
+    output_str(out, filter);
+    output_char(out, '\n');
+  }
+}
+
+void print_filter_footer(Output *out, int64_t found)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "Ways Found: ");
+    output_int(out, found);
+    output_char(out, '\n');
+  }
+}
+
+/* helper to print a text coordinate: truncated to 5 decimals, shown with 9 */
+void print_degrees(Output *out, int64_t nano)
+{
+  output_degrees(out, nano, 5, 9);
+}
+
+/* helper to tell a lookup that found nothing from one that could not read the file (reported), 1 for the latter */
+int lookup_read_error(OSM_Map *mp, const char *entity, int64_t id)
+{
+  if (!OSM_Map_lookup_failed(mp))
+  {
+    return 0;
+  }
+  fprintf(stderr, "Error reading the blocks that may hold %s %ld\n", entity, id);
+  return 1;
+}
+
+/* helper to print the result of a node lookup (np NULL if not found) */
+void print_node_result(Output *out, int64_t id, OSM_Node *np)
+{
+  if (out->format != OUTPUT_TEXT)
+  {
+    output_begin_record(out, "node");
+    output_record_id(out, id);
+    if (np)
+    {
+      output_record_point(out, OSM_Node_get_lat(np), OSM_Node_get_lon(np));
+    }
+    output_field_bool(out, "found", np != NULL);
+    output_end_record(out);
+    return;
+  }
+
+  output_str(out, "=== Node Information ===\nSearching for Node ID: ");
+  output_int(out, id);
+  output_char(out, '\n');
+
+  if (np)
+  {
+    output_str(out, "Node Found:\n  ID: ");
+    output_int(out, id);
+    output_str(out, "\n  Latitude:  ");
+    print_degrees(out, OSM_Node_get_lat(np));
+    output_str(out, "\n  Longitude: ");
+    print_degrees(out, OSM_Node_get_lon(np));
+    output_char(out, '\n');
+  }
+  else
+  {
+    output_str(out, "Node not found in the map.\n");
+  }
+}
+
+/* helper to print the node references of a way lookup (wp NULL if not found) */
+int print_way_refs_result(Output *out, OSM_Map *mp, int64_t id, OSM_Way *wp)
+{
+  if (out->format != OUTPUT_TEXT)
+  {
+    output_begin_record(out, "way");
+    output_record_id(out, id);
+    output_field_bool(out, "found", wp != NULL);
+  }
+  else
+  {
+    output_str(out, "=== Way Node References ===\nSearching for Way ID: ");
+    output_int(out, id);
+    output_char(out, '\n');
+  }
+
+  if (!wp)
+  {
+    if (out->format == OUTPUT_TEXT)
+    {
+      output_str(out, "Way not found in the map.\n");
+    }
+    else
+    {
+      output_end_record(out);
+    }
+    return 0;
+  }
+
+  // decode the whole ref sequence at once instead of per index
+  int ref_count = OSM_Way_get_num_refs(wp);
+  OSM_Id *refs = malloc(sizeof(OSM_Id) * (ref_count > 0 ? ref_count : 1));
+  if (!refs)
+  {
+    return -1;
+  }
+  int decoded = OSM_Way_copy_refs(wp, refs, ref_count);
+
+  int result = 0;
+  if (out->format != OUTPUT_TEXT)
+  {
+    output_field_ids(out, "refs", refs, decoded);
+    result = print_way_line(out, mp, wp);
+    output_end_record(out);
+  }
+  else
+  {
+    output_str(out, "Way Found:\n  ID: ");
+    output_int(out, id);
+    output_str(out, "\n  Number of Node References: ");
+    output_int(out, ref_count);
+    output_str(out, "\n  Node Reference Sequence: ");
+    for (int i = 0; i < decoded - 1; i++)
+    {
+      output_int(out, refs[i]);
+      output_char(out, ' ');
+    }
+    output_int(out, decoded > 0 ? refs[decoded - 1] : -1);
+    output_char(out, '\n');
+  }
+  free(refs);
+  return result;
+}
+
+/* helper to print the values of the given keys of a way lookup (wp NULL if not found) */
+int print_way_values_result(Output *out, OSM_Map *mp, int64_t id, OSM_Way *wp, char **keys, int num_keys)
+{
+  if (out->format != OUTPUT_TEXT)
+  {
+    output_begin_record(out, "way");
+    output_record_id(out, id);
+    output_field_bool(out, "found", wp != NULL);
+    if (!wp)
+    {
+      output_end_record(out);
+      return 0;
+    }
+    // a missing key is null and a key without value empty
+    output_begin_object(out, "tags");
+  }
+  else if (!wp)
+  {
+    output_str(out, "Way ID ");
+    output_int(out, id);
+    output_str(out, " not found in the map.\n");
+    return 0;
+  }
+  else
+  {
+    output_str(out, "=== Way Key-Value Pairs ===\nWay ID: ");
+    output_int(out, id);
+    output_str(out, "\nRequested Key-Value Pairs:\n");
+  }
+
+  int way_keys = OSM_Way_get_num_keys(wp);
+  for (int k = 0; k < num_keys; k++)
+  {
+    int key_index = -1;
+    for (int i = 0; i < way_keys; i++)
+    {
+      if (strcmp(OSM_Way_get_key(wp, i), keys[k]) == 0)
+      {
+        key_index = i;
+        break;
+      }
+    }
+    char *value = key_index == -1 ? NULL : OSM_Way_get_value(wp, key_index);
+
+    if (out->format != OUTPUT_TEXT)
+    {
+      output_field_string(out, keys[k], key_index == -1 ? NULL : value ? value : "");
+      continue;
+    }
+    output_str(out, "  ");
+    output_str(out, keys[k]);
+    output_str(out, key_index == -1 ? ": <key not found>" : value ? ": " : ": <no value>");
+    if (value)
+    {
+      output_str(out, value);
+    }
+    output_char(out, '\n');
+  }
+  if (out->format == OUTPUT_TEXT)
+  {
+    return 0;
+  }
+  output_end_object(out);
+  int result = print_way_line(out, mp, wp);
+  output_end_record(out);
+  return result;
+}
+
+/* queries answered per -Q batch of a loaded map, bounding the memory held for ids and rendered results */
+#define BATCH_QUERIES 65536
+
+/* a lookup of a -Q file: "-n id", "-w id" or "-w id key ...", one per line */
+typedef struct Batch_Query
+{
+  int64_t id;
+  int is_way;
+  char **keys; // -w values query when not NULL, pointing into line
+  int num_keys;
+  char *line;
+  int64_t result_offset; // rendered result in the batch buffer, -1 if not found
+  size_t result_size;
+} Batch_Query;
+
+/* queries of a batch, with the query of each id handed to a batch lookup */
+typedef struct Query_Batch
+{
+  Batch_Query *queries;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t *lookups;
+  OSM_Map *map;
+  Output *results; // in memory
+  int64_t found;   // lookups answered, counted when streamed
+  int failed;
+} Query_Batch;
+
+/* helper to parse a -Q line into a query: 1 if it holds one, 0 if blank or a # comment, -1 if invalid */
+int parse_batch_query(const char *text, Batch_Query *query)
+{
+  memset(query, 0, sizeof(Batch_Query));
+  query->result_offset = -1;
+  query->line = strdup(text);
+  if (!query->line)
+  {
+    return -1;
+  }
+
+  char *save = NULL;
+  char *option = strtok_r(query->line, " \t\r\n", &save);
+  if (!option || *option == '#')
+  {
+    free(query->line);
+    query->line = NULL;
+    return 0;
+  }
+
+  char *id = strtok_r(NULL, " \t\r\n", &save);
+  char *endptr;
+  if (id == NULL || strchr(id, '-') != NULL)
+  {
+    return -1;
+  }
+  query->id = strtoll(id, &endptr, 10);
+  if (endptr == id || *endptr != '\0')
+  {
+    return -1;
+  }
+
+  query->is_way = strcmp(option, "-w") == 0;
+  if (!query->is_way && strcmp(option, "-n") != 0)
+  {
+    return -1;
+  }
+
+  // the rest of a -w line are keys
+  for (char *key = strtok_r(NULL, " \t\r\n", &save); key != NULL; key = strtok_r(NULL, " \t\r\n", &save))
+  {
+    if (!query->is_way || *key == '-')
+    {
+      return -1;
+    }
+    char **grown = realloc(query->keys, sizeof(char *) * (query->num_keys + 1));
+    if (!grown)
+    {
+      return -1;
+    }
+    query->keys = grown;
+    query->keys[query->num_keys++] = key;
+  }
+  if (!query->keys)
+  {
+    free(query->line);
+    query->line = NULL;
+  }
+  return 1;
+}
+
+/* helper to render the node found for a query of a batch into the batch buffer */
+void render_batch_node_query(Query_Batch *batch, Batch_Query *query, OSM_Node *np)
+{
+  query->result_offset = batch->results->size;
+  print_node_result(batch->results, query->id, np);
+  query->result_size = batch->results->size - query->result_offset;
+}
+
+/* helper to render the way found for a query of a batch into the batch buffer, mp holding the way */
+int render_batch_way_query(Query_Batch *batch, Batch_Query *query, OSM_Map *mp, OSM_Way *wp)
+{
+  query->result_offset = batch->results->size;
+  int rendered = query->keys ? print_way_values_result(batch->results, mp, query->id, wp, query->keys, query->num_keys)
+                             : print_way_refs_result(batch->results, mp, query->id, wp);
+  if (rendered == -1)
+  {
+    batch->failed = 1;
+    return -1;
+  }
+  query->result_size = batch->results->size - query->result_offset;
+  return 0;
+}
+
+/* helper to render a node found by a batch lookup into the batch buffer */
+int render_batch_node(uint64_t index, OSM_Node *np, void *arg)
+{
+  Query_Batch *batch = arg;
+  render_batch_node_query(batch, &batch->queries[batch->lookups[index]], np);
+  return 0;
+}
+
+/* helper to render a way found by a batch lookup into the batch buffer */
+int render_batch_way(uint64_t index, OSM_Map *mp, OSM_Way *wp, void *arg)
+{
+  Query_Batch *batch = arg;
+  return render_batch_way_query(batch, &batch->queries[batch->lookups[index]], mp, wp) == -1;
+}
+
+/* helper to print the results of an answered batch in input order, then its line of totals */
+void print_batch_results(Query_Batch *batch, int number, int64_t found, double ms, Output *out)
+{
+  for (uint64_t i = 0; i < batch->count; i++)
+  {
+    Batch_Query *query = &batch->queries[i];
+    if (query->result_offset != -1)
+    {
+      output_bytes(out, batch->results->buffer + query->result_offset, query->result_size);
+    }
+    else if (!query->is_way)
+    {
+      print_node_result(out, query->id, NULL);
+    }
+    else if (query->keys)
+    {
+      print_way_values_result(out, NULL, query->id, NULL, query->keys, query->num_keys);
+    }
+    else
+    {
+      print_way_refs_result(out, NULL, query->id, NULL);
+    }
+    if (out->format == OUTPUT_TEXT)
+    {
+      output_char(out, '\n');
+    }
+  }
+
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_printf(out, "Batch %d: %lu queries, %ld found in %.3f ms (%.0f queries/s)\n\n", number, batch->count,
+                  found, ms, ms > 0 ? batch->count / (ms / 1000) : 0);
+  }
+  else
+  {
+    output_begin_record(out, "batch");
+    output_field_int(out, "number", number);
+    output_field_uint(out, "queries", batch->count);
+    output_field_int(out, "found", found);
+    output_field_double(out, "ms", ms, 3);
+    output_end_record(out);
+  }
+}
+
+/* helper to answer a batch with one sorted lookup pass per entity type, printing the results in input order */
+int run_batch(Query_Batch *batch, int number, OSM_Map *mp, Output *out)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  OSM_Id *node_ids = malloc(sizeof(OSM_Id) * (batch->count ? batch->count : 1));
+  OSM_Id *way_ids = malloc(sizeof(OSM_Id) * (batch->count ? batch->count : 1));
+  uint64_t *node_lookups = malloc(sizeof(uint64_t) * (batch->count ? batch->count : 1));
+  uint64_t *way_lookups = malloc(sizeof(uint64_t) * (batch->count ? batch->count : 1));
+  batch->map = mp;
+  batch->results = output_open(NULL, out->format);
+
+  int result = -1;
+  int64_t found_nodes = -1;
+  int64_t found_ways = -1;
+  if (node_ids && way_ids && node_lookups && way_lookups && batch->results)
+  {
+    uint64_t num_nodes = 0;
+    uint64_t num_ways = 0;
+    for (uint64_t i = 0; i < batch->count; i++)
+    {
+      if (batch->queries[i].is_way)
+      {
+        way_ids[num_ways] = batch->queries[i].id;
+        way_lookups[num_ways++] = i;
+      }
+      else
+      {
+        node_ids[num_nodes] = batch->queries[i].id;
+        node_lookups[num_nodes++] = i;
+      }
+    }
+
+    batch->lookups = node_lookups;
+    found_nodes = OSM_Map_find_Nodes(mp, node_ids, num_nodes, render_batch_node, batch);
+    batch->lookups = way_lookups;
+    found_ways = found_nodes == -1 ? -1 : OSM_Map_find_Ways(mp, way_ids, num_ways, render_batch_way, batch);
+  }
+  if (batch->results && !batch->results->failed && found_ways != -1 && !batch->failed)
+  {
+    result = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // lookups visit in id order, the results are printed in input order
+  if (result == 0)
+  {
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+    print_batch_results(batch, number, found_nodes + found_ways, ms, out);
+  }
+
+  if (batch->results)
+  {
+    output_close(batch->results);
+  }
+  free(node_ids);
+  free(way_ids);
+  free(node_lookups);
+  free(way_lookups);
+  return result;
+}
+
+/* helper to release the queries of a batch for the next one */
+void clear_batch(Query_Batch *batch)
+{
+  for (uint64_t i = 0; i < batch->count; i++)
+  {
+    free(batch->queries[i].keys);
+    free(batch->queries[i].line);
+  }
+  batch->count = 0;
+  batch->found = 0;
+  batch->failed = 0;
+}
+
+/* helper to print what comes before the batches of a -Q file */
+void print_batch_file_header(Output *out, const char *path)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "=== Batch Queries ===\nReading queries from: ");
+    output_str(out, path);
+    output_str(out, "\n\n");
+  }
+}
+
+/* helper to read the next lookups of a -Q file into the batch, up to limit of them, -1 on an invalid line */
+int read_batch_queries(FILE *in, const char *path, uint64_t *line_numberp, Query_Batch *batch, uint64_t limit)
+{
+  int result = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  while (result == 0 && batch->count < limit && getline(&line, &line_capacity, in) != -1)
+  {
+    (*line_numberp)++;
+    if (batch->count == batch->capacity)
+    {
+      uint64_t capacity = batch->capacity ? batch->capacity * 2 : 1024;
+      Batch_Query *grown = realloc(batch->queries, sizeof(Batch_Query) * capacity);
+      if (!grown)
+      {
+        result = -1;
+        break;
+      }
+      batch->queries = grown;
+      batch->capacity = capacity;
+    }
+
+    int parsed = parse_batch_query(line, &batch->queries[batch->count]);
+    if (parsed == -1)
+    {
+      fprintf(stderr, "Invalid query on line %lu of %s\n", *line_numberp, path);
+      free(batch->queries[batch->count].keys);
+      free(batch->queries[batch->count].line);
+      result = -1;
+    }
+    batch->count += parsed == 1;
+  }
+  free(line);
+  return result;
+}
+
+/* helper to answer the lookups of a -Q file, BATCH_QUERIES at a time */
+int run_batch_file(const char *path, OSM_Map *mp, Output *out)
+{
+  // a lazy map retains no blobs, one sorted batch decodes each blob it needs exactly once
+  uint64_t batch_limit = OSM_Map_is_lazy(mp) ? UINT64_MAX : BATCH_QUERIES;
+
+  FILE *in = fopen(path, "r");
+  Query_Batch batch = {0};
+  if (!in)
+  {
+    return -1;
+  }
+  print_batch_file_header(out, path);
+
+  int result = 0;
+  int number = 0;
+  uint64_t line_number = 0;
+  while (result == 0 && (result = read_batch_queries(in, path, &line_number, &batch, batch_limit)) == 0 && batch.count > 0)
+  {
+    result = run_batch(&batch, ++number, mp, out);
+    clear_batch(&batch);
+  }
+
+  clear_batch(&batch);
+  free(batch.queries);
+  fclose(in);
+  return result;
+}
+
+/* helper to print the result of -s */
+void print_summary_result(Output *out, uint64_t num_nodes, uint64_t num_ways)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "=== Map Summary ===\nTotal Nodes: ");
+    output_int(out, num_nodes);
+    output_str(out, "\nTotal Ways: ");
+    output_int(out, num_ways);
+    output_char(out, '\n');
+  }
+  else
+  {
+    output_begin_record(out, "summary");
+    output_field_int(out, "nodes", num_nodes);
+    output_field_int(out, "ways", num_ways);
+    output_end_record(out);
+  }
+}
+
+/* helper to print the result of -S, -1 without a summary */
+int print_entity_summary_result(Output *out, const OSM_Summary *summary)
+{
+  int text = out->format == OUTPUT_TEXT;
+  if (text)
+  {
+    output_str(out, "=== Entity Summary ===\n");
+  }
+  if (!summary)
+  {
+    return -1;
+  }
+  // merged files keep no node tags or relations, theirs are the sums of each file's counts
+  if (text && summary->summed_files > 1)
+  {
+    output_printf(out, "Nodes: %lu (%lu tags, summed over %lu files)\n", summary->nodes, summary->node_tags,
+                  summary->summed_files);
+    output_printf(out, "Ways: %lu (%lu tags)\n", summary->ways, summary->way_tags);
+    output_printf(out, "Relations: %lu (%lu tags), summed over %lu files\n", summary->relations, summary->relation_tags,
+                  summary->summed_files);
+  }
+  else if (text)
+  {
+    output_printf(out, "Nodes: %lu (%lu tags)\n", summary->nodes, summary->node_tags);
+    output_printf(out, "Ways: %lu (%lu tags)\n", summary->ways, summary->way_tags);
+    output_printf(out, "Relations: %lu (%lu tags)\n", summary->relations, summary->relation_tags);
+  }
+  else
+  {
+    output_begin_record(out, "entity_summary");
+    output_field_uint(out, "nodes", summary->nodes);
+    output_field_uint(out, "node_tags", summary->node_tags);
+    output_field_uint(out, "ways", summary->ways);
+    output_field_uint(out, "way_tags", summary->way_tags);
+    output_field_uint(out, "relations", summary->relations);
+    output_field_uint(out, "relation_tags", summary->relation_tags);
+    if (summary->summed_files > 1)
+    {
+      output_field_uint(out, "summed_files", summary->summed_files);
+    }
+    output_end_record(out);
+  }
+  return 0;
+}
+
+/* helper to print the result of -b, only its title when the map has no box (found 0) */
+void print_bbox_result(Output *out, int found, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat)
+{
+  int text = out->format == OUTPUT_TEXT;
+  if (text)
+  {
+    output_str(out, "=== Map Bounding Box ===\n");
+  }
+  if (found && text)
+  {
+    output_str(out, "Bounding Box Coordinates:\n  Minimum Longitude: ");
+    print_degrees(out, min_lon);
+    output_str(out, "\n  Maximum Longitude: ");
+    print_degrees(out, max_lon);
+    output_str(out, "\n  Minimum Latitude:  ");
+    print_degrees(out, min_lat);
+    output_str(out, "\n  Maximum Latitude:  ");
+    print_degrees(out, max_lat);
+    output_char(out, '\n');
+  }
+  else if (found)
+  {
+    output_begin_record(out, "bbox");
+    output_record_box(out, min_lon, min_lat, max_lon, max_lat);
+    output_end_record(out);
+  }
+}
+
+/* helper to run the queries of an argv style list (from argv + 1) on the map one after another, printing to out */
+int run_queries_in_order(char **argv, OSM_Map *mp, Output *out)
+{
+  int text = out->format == OUTPUT_TEXT;
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (strcmp(*p, "-s") == 0)
+    {
+      print_summary_result(out, OSM_Map_get_num_nodes(mp), OSM_Map_get_num_ways(mp));
+    }
+    else if (strcmp(*p, "-S") == 0)
+    {
+      if (print_entity_summary_result(out, OSM_Map_get_summary(mp)) == -1)
+      {
+        return -1;
+      }
+    }
+    else if (strcmp(*p, "-b") == 0)
+    {
+      OSM_BBox *bbox = OSM_Map_get_BBox(mp);
+
+      // a lazily opened file without a header bbox has to decode its node blobs
+      if (!bbox && OSM_Map_compute_BBox(mp) == 0)
+      {
+        bbox = OSM_Map_get_BBox(mp);
+      }
+      if (bbox)
+      {
+        print_bbox_result(out, 1, OSM_BBox_get_min_lon(bbox), OSM_BBox_get_min_lat(bbox), OSM_BBox_get_max_lon(bbox),
+                          OSM_BBox_get_max_lat(bbox));
+      }
+      else
+      {
+        print_bbox_result(out, 0, 0, 0, 0, 0);
+      }
+    }
+    else if (strcmp(*p, "-q") == 0)
+    {
+      double min_lon = strtod(*(p + 1), NULL);
+      double min_lat = strtod(*(p + 2), NULL);
+      double max_lon = strtod(*(p + 3), NULL);
+      double max_lat = strtod(*(p + 4), NULL);
+      p += 4;
+
+      if (text)
+      {
+        output_str(out, "=== Nodes In Bounding Box ===\n");
+        output_printf(out, "Searching Longitude: %.9f to %.9f\n", min_lon, max_lon);
+        output_printf(out, "Searching Latitude:  %.9f to %.9f\n", min_lat, max_lat);
+      }
+
+      BBox_Matches matches = {NULL, 0, 0};
+      int visited = OSM_Map_query_bbox(mp, degrees_to_nano(min_lon), degrees_to_nano(min_lat),
+                                       degrees_to_nano(max_lon), degrees_to_nano(max_lat), collect_node, &matches);
+      if (visited == -1 || visited != matches.count)
+      {
+        free(matches.nodes);
+        return -1;
+      }
+
+      if (matches.count > 0)
+      {
+        qsort(matches.nodes, matches.count, sizeof(OSM_Node *), compare_node_ids);
+      }
+
+      for (int i = 0; i < matches.count; i++)
+      {
+        OSM_Node *np = matches.nodes[i];
+        if (text)
+        {
+          output_str(out, "  ID: ");
+          output_int(out, OSM_Node_get_id(np));
+          output_str(out, "  Latitude: ");
+          print_degrees(out, OSM_Node_get_lat(np));
+          output_str(out, "  Longitude: ");
+          print_degrees(out, OSM_Node_get_lon(np));
+          output_char(out, '\n');
+        }
+        else
+        {
+          output_begin_record(out, "bbox_query");
+          output_record_id(out, OSM_Node_get_id(np));
+          output_record_point(out, OSM_Node_get_lat(np), OSM_Node_get_lon(np));
+          output_end_record(out);
+        }
+      }
+      if (text)
+      {
+        output_str(out, "Nodes Found: ");
+        output_int(out, matches.count);
+        output_char(out, '\n');
+      }
+      free(matches.nodes);
+    }
+    else if (strcmp(*p, "-r") == 0)
+    {
+      p++;
+      char *path = *p;
+
+      // optional comma separated highway values
+      char *list = NULL;
+      const char **highways = NULL;
+      if (*(p + 1) != NULL && strchr(*(p + 1), '-') == NULL)
+      {
+        p++;
+        list = strdup(*p);
+        highways = calloc(strlen(*p) / 2 + 2, sizeof(char *));
+        if (!list || !highways)
+        {
+          free(list);
+          free(highways);
+          return -1;
+        }
+        int count = 0;
+        char *save = NULL;
+        for (char *value = strtok_r(list, ",", &save); value != NULL; value = strtok_r(NULL, ",", &save))
+        {
+          highways[count++] = value;
+        }
+      }
+
+      if (text)
+      {
+        output_str(out, "=== Routing Graph ===\n");
+      }
+      OSM_Graph *graph = OSM_Graph_build(mp, highways);
+      int saved = graph ? OSM_Graph_save(graph, path) : -1;
+      free(list);
+      free(highways);
+      if (saved == -1)
+      {
+        OSM_Graph_free(graph);
+        return -1;
+      }
+      if (text)
+      {
+        output_printf(out, "Vertices: %lu\nEdges: %lu\n", graph->num_vertices, graph->num_edges);
+        output_str(out, "Graph Written To: ");
+        output_str(out, path);
+        output_char(out, '\n');
+      }
+      else
+      {
+        output_begin_record(out, "graph");
+        output_field_string(out, "path", path);
+        output_field_uint(out, "vertices", graph->num_vertices);
+        output_field_uint(out, "edges", graph->num_edges);
+        output_end_record(out);
+      }
+      OSM_Graph_free(graph);
+    }
+    else if (strcmp(*p, "-o") == 0)
+    {
+      p++;
+      if (text)
+      {
+        output_str(out, "=== Snapshot ===\n");
+      }
+      if (OSM_Map_save_snapshot(mp, *p) == -1)
+      {
+        return -1;
+      }
+      if (text)
+      {
+        output_str(out, "Snapshot Written To: ");
+        output_str(out, *p);
+        output_char(out, '\n');
+      }
+      else
+      {
+        output_begin_record(out, "snapshot");
+        output_field_string(out, "path", *p);
+        output_end_record(out);
+      }
+    }
+    else if (strcmp(*p, "-t") == 0)
+    {
+      p++;
+      print_filter_header(out, *p);
+
+      // several filters pay for the inverted index once instead of a scan each
+      if (count_option(argv, "-t") > 1 && OSM_Map_build_tag_index(mp) == -1)
+      {
+        return -1;
+      }
+
+      OSM_TagFilter *filter = OSM_TagFilter_compile(mp, *p);
+      if (!filter)
+      {
+        return -1;
+      }
+      Filter_Matches matches = {out, mp, *p, 0};
+      int found = OSM_Map_filter_ways(mp, filter, print_way_id, &matches);
+      OSM_TagFilter_free(filter);
+      if (found == -1 || matches.failed)
+      {
+        return -1;
+      }
+      print_filter_footer(out, found);
+    }
+    else if (strcmp(*p, "-k") == 0)
+    {
+      double lat = strtod(*(p + 1), NULL);
+      double lon = strtod(*(p + 2), NULL);
+      p += 2;
+
+      if (text)
+      {
+        output_printf(out, "=== Nearest Node ===\nSearching Near: %.9f, %.9f\n", lat, lon);
+      }
+
+      OSM_Node *nearest = NULL;
+      int found = OSM_Map_nearest_node(mp, degrees_to_nano(lat), degrees_to_nano(lon), 1, &nearest);
+      if (found == -1)
+      {
+        return -1;
+      }
+      double distance = found == 1 ? distance_meters(degrees_to_nano(lat), degrees_to_nano(lon),
+                                                      OSM_Node_get_lat(nearest), OSM_Node_get_lon(nearest))
+                                   : 0;
+      if (found == 1 && text)
+      {
+        output_str(out, "Node Found:\n  ID: ");
+        output_int(out, OSM_Node_get_id(nearest));
+        output_str(out, "\n  Latitude:  ");
+        print_degrees(out, OSM_Node_get_lat(nearest));
+        output_str(out, "\n  Longitude: ");
+        print_degrees(out, OSM_Node_get_lon(nearest));
+        output_printf(out, "\n  Distance: %.1f m\n", distance);
+      }
+      else if (found == 1)
+      {
+        output_begin_record(out, "nearest");
+        output_record_id(out, OSM_Node_get_id(nearest));
+        output_record_point(out, OSM_Node_get_lat(nearest), OSM_Node_get_lon(nearest));
+        output_field_double(out, "distance_m", distance, 1);
+        output_end_record(out);
+      }
+      else if (text)
+      {
+        output_str(out, "No nodes in the map.\n");
+      }
+    }
+    else if (strcmp(*p, "-Q") == 0)
+    {
+      p++;
+      if (run_batch_file(*p, mp, out) == -1)
+      {
+        return -1;
+      }
+    }
+    else if (strcmp(*p, "-n") == 0)
+    {
+      p++;
+      char *id = *p;
+
+      char *endptr;
+      int64_t id_as_int = strtol(id, &endptr, 10);
+
+      OSM_Node *node = OSM_Map_find_Node(mp, id_as_int);
+      if (!node && lookup_read_error(mp, "node", id_as_int))
+      {
+        return -1;
+      }
+      print_node_result(out, id_as_int, node);
+    }
+    else if (strcmp(*p, "-w") == 0)
+    {
+      // if the value after -w [arg] is NULL or contains a -, then its just one arg
+      if (*(p + 2) == NULL || strchr(*(p + 2), '-') != NULL)
+      {
+        p++;
+
+        char *id = *p;
+
+        char *endptr;
+        int64_t id_as_int = strtol(id, &endptr, 10);
+
+        OSM_Way *way = OSM_Map_find_Way(mp, id_as_int);
+        if ((!way && lookup_read_error(mp, "way", id_as_int)) || print_way_refs_result(out, mp, id_as_int, way) == -1)
+        {
+          return -1;
+        }
+      }
+      else
+      {
+        //-------------Get the Way Object----------------
+        p++;
+        char *id = *p;
+
+        char *endptr;
+        int64_t id_as_int = strtol(id, &endptr, 10);
+
+        // the keys are only consumed when the way is found
+        int num_keys = 0;
+        while (*(p + 1 + num_keys) != NULL && strchr(*(p + 1 + num_keys), '-') == NULL)
+        {
+          num_keys++;
+        }
+        OSM_Way *curr_way = OSM_Map_find_Way(mp, id_as_int);
+        if ((!curr_way && lookup_read_error(mp, "way", id_as_int)) ||
+            print_way_values_result(out, mp, id_as_int, curr_way, p + 1, num_keys) == -1)
+        {
+          return -1;
+        }
+        if (curr_way)
+        {
+          p += num_keys;
+        }
+      }
+    }
+    else if (strcmp(*p, "--format") == 0)
+    {
+      // chosen before the queries run, prints nothing
+      p++;
+      continue;
+    }
+    else if (strcmp(*p, "--index") == 0)
+    {
+      // written around the queries, prints nothing
+      continue;
+    }
+    if (text)
+    {
+      output_char(out, '\n');
+    }
+  }
+  return 0;
+}
+
+/* options that start a query of an argv list, the tokens after one up to the next belong to it */
+const char *query_options[] = {"-f", "--format", "-s", "-S", "-b", "-q", "-k", "-n", "-w", "-r", "-t", "-o", "-Q", NULL};
+
+/* helper to check if an arg starts a query (coordinates like -1.5 do not) */
+int is_query_option(const char *arg)
+{
+  for (const char **option = query_options; *option != NULL; option++)
+  {
+    if (strcmp(arg, *option) == 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* a query of an argv list run on its own, its output kept for printing in argv order */
+typedef struct Query_Task
+{
+  char **argv; // argv style: a placeholder, the option and its arguments, NULL
+  Output *output; // in memory
+  int result;
+} Query_Task;
+
+/* tasks handed to the workers */
+typedef struct Query_Run
+{
+  OSM_Map *map;
+  Output_Format format;
+  Query_Task *tasks;
+} Query_Run;
+
+/* helper to run the tasks [begin, end) of a parallel loop, each into its own buffer */
+int run_query_tasks(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+  Query_Run *run = arg;
+  for (uint64_t i = begin; i < end; i++)
+  {
+    Query_Task *task = &run->tasks[i];
+    task->output = output_open(NULL, run->format);
+    task->result = task->output ? run_queries_in_order(task->argv, run->map, task->output) : -1;
+    if (task->output && task->output->failed)
+    {
+      task->result = -1;
+    }
+
+    // like the sequential loop, nothing after a failed query runs (its output is never printed)
+    if (task->result == -1)
+    {
+      for (i++; i < end; i++)
+      {
+        run->tasks[i].result = -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* helper to build up front the indexes the tasks would otherwise build on first use, racing each other */
+int prepare_query_tasks(Query_Task *tasks, uint64_t count, char **argv, OSM_Map *mp, Output_Format format)
+{
+  int indexes = 0;
+  int needs_bbox = 0;
+  for (uint64_t i = 0; i < count; i++)
+  {
+    char *option = tasks[i].argv[1];
+    if (strcmp(option, "-q") == 0)
+    {
+      indexes |= OSM_INDEX_NODE_TREE;
+    }
+    else if (strcmp(option, "-k") == 0)
+    {
+      indexes |= OSM_INDEX_NODE_KDTREE;
+    }
+    else if (strcmp(option, "-r") == 0 || strcmp(option, "-Q") == 0)
+    {
+      indexes |= OSM_INDEX_NODE_LOCATIONS;
+    }
+    else if (strcmp(option, "-t") == 0 && count_option(argv, "-t") > 1)
+    {
+      indexes |= OSM_INDEX_TAGS;
+    }
+
+    // way geometries look up the nodes of the ways
+    if (format == OUTPUT_GEOJSON && (strcmp(option, "-w") == 0 || strcmp(option, "-t") == 0))
+    {
+      indexes |= OSM_INDEX_NODE_LOCATIONS;
+    }
+    needs_bbox |= strcmp(option, "-b") == 0;
+  }
+
+  if (needs_bbox && !OSM_Map_get_BBox(mp))
+  {
+    OSM_Map_compute_BBox(mp);
+  }
+  return indexes ? OSM_Map_build_query_indexes(mp, indexes) : 0;
+}
+
+/* helper to run the queries of an argv style list (from argv + 1) on the map, printing to out in argv order */
+int run_query_list(char **argv, OSM_Map *mp, Output *out)
+{
+  int argc = 0;
+  int num_tasks = 0;
+  int num_queries = 0;
+  while (argv[argc] != NULL)
+  {
+    if (argc > 0 && is_query_option(argv[argc]))
+    {
+      num_tasks++;
+      num_queries += strcmp(argv[argc], "-f") != 0 && strcmp(argv[argc], "--format") != 0;
+    }
+    argc++;
+  }
+
+  // a lazy map decodes into a shared block cache, its queries run one at a time
+  if (OSM_Map_is_lazy(mp) || num_queries < 2 || !is_query_option(argv[1]))
+  {
+    return run_queries_in_order(argv, mp, out);
+  }
+
+  Query_Task *tasks = calloc(num_tasks, sizeof(Query_Task));
+  char **task_args = malloc(sizeof(char *) * (argc + 2 * num_tasks));
+  if (!tasks || !task_args)
+  {
+    free(tasks);
+    free(task_args);
+    return -1;
+  }
+
+  // each task: the placeholder argv[0], its option and arguments, NULL
+  int t = -1;
+  char **next = task_args;
+  for (int i = 1; i < argc; i++)
+  {
+    if (is_query_option(argv[i]))
+    {
+      if (t >= 0)
+      {
+        *next++ = NULL;
+      }
+      tasks[++t].argv = next;
+      *next++ = argv[0];
+    }
+    *next++ = argv[i];
+  }
+  *next = NULL;
+
+  int result = 0;
+  for (int begin = 0; begin < num_tasks && result == 0;)
+  {
+    // a snapshot saves the indexes of the queries before it, so it runs alone between them
+    int end = begin + 1;
+    if (strcmp(tasks[begin].argv[1], "-o") != 0)
+    {
+      while (end < num_tasks && strcmp(tasks[end].argv[1], "-o") != 0)
+      {
+        end++;
+      }
+    }
+
+    Query_Run run = {mp, out->format, tasks + begin};
+    if (end - begin > 1 && prepare_query_tasks(tasks + begin, end - begin, argv, mp, out->format) == 0)
+    {
+      parallel_for(end - begin, 1, run_query_tasks, &run);
+    }
+    else
+    {
+      run_query_tasks(0, end - begin, 0, &run);
+    }
+
+    for (int i = begin; i < end && result == 0; i++)
+    {
+      if (tasks[i].output)
+      {
+        output_bytes(out, tasks[i].output->buffer, tasks[i].output->size);
+      }
+      result = tasks[i].result;
+    }
+    begin = end;
+  }
+
+  for (int i = 0; i < num_tasks; i++)
+  {
+    if (tasks[i].output)
+    {
+      output_close(tasks[i].output);
+    }
+  }
+  free(tasks);
+  free(task_args);
+  return result;
+}
+
+/* helper to start the results of the command line queries */
+void print_results_header(Output *out, const char *input_name)
+{
+  if (out->format == OUTPUT_TEXT)
+  {
+    output_str(out, "\n=== OSM Map Query Results ===\nProcessing file: ");
+    output_str(out, input_name ? input_name : "(null)");
+  }
+  output_header(out);
+}
+
+/* helper to name the input of the results: the file, or the files of several -f joined by commas (free it) */
+char *input_files_label(char **argv)
+{
+  size_t size = 1;
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (strcmp(*p, "-f") == 0 && *(p + 1) != NULL)
+    {
+      size += strlen(*++p) + 2;
+    }
+  }
+
+  char *label = malloc(size);
+  if (!label)
+  {
+    return NULL;
+  }
+  label[0] = '\0';
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (strcmp(*p, "-f") == 0 && *(p + 1) != NULL)
+    {
+      if (label[0] != '\0')
+      {
+        strcat(label, ", ");
+      }
+      strcat(label, *++p);
+    }
+  }
+  return label;
+}
+
+/* helper to copy argv without the -f options after the first, which name more inputs rather than queries (free it) */
+char **first_input_argv(char **argv)
+{
+  int argc = 0;
+  while (argv[argc] != NULL)
+  {
+    argc++;
+  }
+
+  char **copy = malloc(sizeof(char *) * (argc + 1));
+  if (!copy)
+  {
+    return NULL;
+  }
+  int inputs = 0;
+  char **next = copy;
+  for (char **p = argv; *p != NULL; p++)
+  {
+    if (p > argv && strcmp(*p, "-f") == 0 && inputs++ > 0 && *(p + 1) != NULL)
+    {
+      p++;
+      continue;
+    }
+    *next++ = *p;
+  }
+  *next = NULL;
+  return copy;
+}
 
 /* helper to run queries on the map */
 int run_queries(char **argv, OSM_Map *mp)
 {
-  printf("\n=== OSM Map Query Results ===\n");
-  printf("Processing file: %s", osm_input_file);
+  char *label = NULL;
+  char **queries = argv;
+  if (num_input_files > 1)
+  {
+    label = input_files_label(argv);
+    queries = first_input_argv(argv);
+  }
+  Output *out = output_open(stdout, output_format);
+  if (!out || (num_input_files > 1 && (!label || !queries)))
+  {
+    free(label);
+    if (queries != argv)
+    {
+      free(queries);
+    }
+    if (out)
+    {
+      output_close(out);
+    }
+    return -1;
+  }
+  print_results_header(out, label ? label : osm_input_file);
+  free(label);
+  int result = run_query_list(queries, mp, out);
+  if (queries != argv)
+  {
+    free(queries);
+  }
+  return output_close(out) == -1 ? -1 : result;
+}
+
+/* a query of an argv list answered while streaming the input */
+typedef struct Stream_Query
+{
+  char **argv; // argv style: a placeholder, the option and its arguments, NULL
+  int64_t id;
+  char **keys; // -w values query when num_keys > 0
+  int num_keys;
+  Query_Batch *batch; // lookups of a -Q file, NULL for the other queries
+  int64_t result_offset; // in the results buffer, -1 until rendered
+  size_t result_size;
+} Stream_Query;
+
+/* what a node or way id of a streamed run answers: a query, or one lookup of its batch */
+typedef struct Stream_Target
+{
+  int query;
+  int64_t batch_query; // -1 for -n and -w
+} Stream_Target;
+
+/* lookups of a streamed run: the index of a node or way id maps to its target */
+typedef struct Stream_Answers
+{
+  Output *out;
+  Output *results; // rendered results not printed yet
+  Stream_Query *queries;
+  int num_queries;
+  int printed; // queries before this one are printed
+  Stream_Target *node_targets;
+  Stream_Target *way_targets;
+  int failed;
+} Stream_Answers;
+
+/* helper to print the results rendered so far that every query before them is ready for, in argv order */
+int print_ready_results(Stream_Answers *answers)
+{
+  int start = answers->printed;
+  while (answers->printed < answers->num_queries && answers->queries[answers->printed].result_offset != -1)
+  {
+    Stream_Query *query = &answers->queries[answers->printed++];
+    output_bytes(answers->out, answers->results->buffer + query->result_offset, query->result_size);
+  }
+  if (answers->printed == start)
+  {
+    return 0;
+  }
+
+  // the buffer is reused once nothing rendered waits behind an unanswered query
+  int waiting = 0;
+  for (int i = answers->printed; i < answers->num_queries && !waiting; i++)
+  {
+    waiting = answers->queries[i].result_offset != -1;
+  }
+  if (!waiting)
+  {
+    answers->results->size = 0;
+  }
+  return output_flush(answers->out) == -1 || fflush(answers->out->sink) != 0 ? -1 : 0;
+}
+
+/* helper to end the result of a query rendered into the results buffer since offset, and print what is ready */
+int finish_streamed_result(Stream_Answers *answers, Stream_Query *query, size_t offset)
+{
+  Output *results = answers->results;
+  if (results->format == OUTPUT_TEXT)
+  {
+    output_char(results, '\n');
+  }
+  query->result_offset = offset;
+  query->result_size = results->size - offset;
+  if (results->failed || print_ready_results(answers) == -1)
+  {
+    answers->failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* helper to render a node lookup as soon as the stream reaches the node */
+int print_streamed_node(uint64_t index, OSM_Node *np, void *arg)
+{
+  Stream_Answers *answers = arg;
+  Stream_Target *target = &answers->node_targets[index];
+  Stream_Query *query = &answers->queries[target->query];
+  if (target->batch_query != -1)
+  {
+    // a batch prints once the stream ends, all its lookups at once
+    render_batch_node_query(query->batch, &query->batch->queries[target->batch_query], np);
+    query->batch->found++;
+    return 0;
+  }
+  size_t offset = answers->results->size;
+  print_node_result(answers->results, query->id, np);
+  return finish_streamed_result(answers, query, offset);
+}
+
+/* helper to render a way lookup as soon as the stream reaches the way */
+int print_streamed_way(uint64_t index, OSM_Map *mp, OSM_Way *wp, void *arg)
+{
+  Stream_Answers *answers = arg;
+  Stream_Target *target = &answers->way_targets[index];
+  Stream_Query *query = &answers->queries[target->query];
+  if (target->batch_query != -1)
+  {
+    if (render_batch_way_query(query->batch, &query->batch->queries[target->batch_query], mp, wp) == -1)
+    {
+      answers->failed = 1;
+      return 1;
+    }
+    query->batch->found++;
+    return 0;
+  }
+  size_t offset = answers->results->size;
+  int result = query->num_keys > 0 ? print_way_values_result(answers->results, mp, query->id, wp, query->keys, query->num_keys)
+                                   : print_way_refs_result(answers->results, mp, query->id, wp);
+  if (result == -1)
+  {
+    answers->failed = 1;
+    return 1;
+  }
+  return finish_streamed_result(answers, query, offset);
+}
+
+/* helper to read every lookup of the -Q file of query, to be answered by one stream */
+int read_streamed_batch(Stream_Query *query)
+{
+  char *path = query->argv[2];
+  FILE *in = fopen(path, "r");
+  query->batch = calloc(1, sizeof(Query_Batch));
+  if (!in || !query->batch)
+  {
+    if (in)
+    {
+      fclose(in);
+    }
+    return -1;
+  }
+  uint64_t line_number = 0;
+  int result = read_batch_queries(in, path, &line_number, query->batch, UINT64_MAX);
+  fclose(in);
+  query->batch->results = output_open(NULL, output_format);
+  return query->batch->results ? result : -1;
+}
+
+/* helper to render the whole -Q output of query once the stream has answered what it could, as one batch */
+int finish_streamed_batch(Stream_Answers *answers, Stream_Query *query, double ms)
+{
+  Query_Batch *batch = query->batch;
+  size_t offset = answers->results->size;
+  print_batch_file_header(answers->results, query->argv[2]);
+  if (batch->count > 0)
+  {
+    print_batch_results(batch, 1, batch->found, ms, answers->results);
+  }
+  return finish_streamed_result(answers, query, offset);
+}
+
+/* helper to answer the -n, -w and -Q queries of argv in one pass over in, printed in argv order as soon as those before are */
+int run_stream_queries(char **argv, FILE *in)
+{
+  int argc = 0;
+  int num_queries = 0;
+  while (argv[argc] != NULL)
+  {
+    num_queries += argc > 0 && is_query_option(argv[argc]);
+    argc++;
+  }
 
-  // internal function to truncate (used for the nanodegrees of Nodes or Ways)
-  double truncate(double value) { return ((int)(value * 100000)) / 100000.0; }
+  Stream_Query *queries = calloc(num_queries + 1, sizeof(Stream_Query));
+  char **query_args = malloc(sizeof(char *) * (argc + 2 * num_queries));
+  int64_t *node_ids = NULL;
+  int64_t *way_ids = NULL;
+  Stream_Target *node_targets = NULL;
+  Stream_Target *way_targets = NULL;
+  Output *out = output_open(stdout, output_format);
+  Output *results = output_open(NULL, output_format);
+  int result = -1;
+  if (!queries || !query_args || !out || !results)
+  {
+    goto done;
+  }
 
-  for (char **p = argv + 1; *p != NULL; p++)
+  // each query: the placeholder argv[0], its option and arguments, NULL (like the tasks of run_query_list)
+  int q = -1;
+  char **next = query_args;
+  for (int i = 1; i < argc; i++)
   {
-    if (strcmp(*p, "-s") == 0)
+    if (is_query_option(argv[i]))
     {
-      printf("=== Map Summary ===\n");
-      int num_nodes = OSM_Map_get_num_nodes(mp);
-      int num_ways = OSM_Map_get_num_ways(mp);
-      printf("Total Nodes: %d\n", num_nodes);
-      printf("Total Ways: %d\n", num_ways);
-    }
-    else if (strcmp(*p, "-b") == 0)
-    {
-      printf("=== Map Bounding Box ===\n");
-      OSM_BBox *bbox = OSM_Map_get_BBox(mp);
-
-      if (bbox)
+      if (q >= 0)
       {
-        double factor = 1000000000;
+        *next++ = NULL;
+      }
+      queries[++q].argv = next;
+      queries[q].result_offset = -1;
+      *next++ = argv[0];
+    }
+    *next++ = argv[i];
+  }
+  *next = NULL;
 
-        double min_lon_value = ((OSM_BBox_get_min_lon(bbox))) / (factor);
-        double max_lon_value = ((OSM_BBox_get_max_lon(bbox))) / (factor);
-        double min_lat_value = ((OSM_BBox_get_min_lat(bbox))) / (factor);
-        double max_lat_value = ((OSM_BBox_get_max_lat(bbox))) / (factor);
+  // a -Q file is read whole, its lookups join those of -n and -w in the same stream
+  uint64_t num_lookups = 0;
+  for (int i = 0; i < num_queries; i++)
+  {
+    if (strcmp(queries[i].argv[1], "-Q") != 0)
+    {
+      num_lookups++;
+    }
+    else if (read_streamed_batch(&queries[i]) == -1)
+    {
+      goto done;
+    }
+    else
+    {
+      num_lookups += queries[i].batch->count;
+    }
+  }
+  node_ids = malloc(sizeof(int64_t) * (num_lookups + 1));
+  way_ids = malloc(sizeof(int64_t) * (num_lookups + 1));
+  node_targets = malloc(sizeof(Stream_Target) * (num_lookups + 1));
+  way_targets = malloc(sizeof(Stream_Target) * (num_lookups + 1));
+  if (!node_ids || !way_ids || !node_targets || !way_targets)
+  {
+    goto done;
+  }
 
-        double rounded_min_lon = truncate(min_lon_value);
-        double rounded_max_lon = truncate(max_lon_value);
-        double rounded_min_lat = truncate(min_lat_value);
-        double rounded_max_lat = truncate(max_lat_value);
+  print_results_header(out, osm_input_file);
 
-        printf("Bounding Box Coordinates:\n");
-        printf("  Minimum Longitude: %.9f\n", rounded_min_lon);
-        printf("  Maximum Longitude: %.9f\n", rounded_max_lon);
-        printf("  Minimum Latitude:  %.9f\n", rounded_min_lat);
-        printf("  Maximum Latitude:  %.9f\n", rounded_max_lat);
+  // register every lookup before reading, the other options (-f, --format) render what they always print
+  Stream_Answers answers = {out, results, queries, num_queries, 0, node_targets, way_targets, 0};
+  uint64_t num_nodes = 0;
+  uint64_t num_ways = 0;
+  for (int i = 0; i < num_queries; i++)
+  {
+    Stream_Query *query = &queries[i];
+    char **args = query->argv;
+    if (strcmp(args[1], "-n") == 0 || strcmp(args[1], "-w") == 0)
+    {
+      char *endptr;
+      query->id = strtol(args[2], &endptr, 10);
+    }
+    if (strcmp(args[1], "-n") == 0)
+    {
+      node_ids[num_nodes] = query->id;
+      node_targets[num_nodes++] = (Stream_Target){i, -1};
+    }
+    else if (strcmp(args[1], "-w") == 0)
+    {
+      // keys follow the id up to the next dash, as in run_queries_in_order
+      query->keys = args + 3;
+      while (query->keys[query->num_keys] != NULL && strchr(query->keys[query->num_keys], '-') == NULL)
+      {
+        query->num_keys++;
       }
+      way_ids[num_ways] = query->id;
+      way_targets[num_ways++] = (Stream_Target){i, -1};
     }
-    else if (strcmp(*p, "-n") == 0)
+    else if (query->batch)
     {
-      p++;
-      char *id = *p;
-
-      char *endptr;
-      int64_t id_as_int = strtol(id, &endptr, 10);
-
-      int num_of_nodes = OSM_Map_get_num_nodes(mp);
-      int found = 0;
-
-      printf("=== Node Information ===\n");
-      printf("Searching for Node ID: %ld\n", id_as_int);
-
-      double factor = 1000000000;
-
-      for (int x = 0; x < num_of_nodes; x++)
+      for (uint64_t j = 0; j < query->batch->count; j++)
       {
-        OSM_Node *curr_node = OSM_Map_get_Node(mp, x);
-        if (OSM_Node_get_id(curr_node) == id_as_int)
+        Batch_Query *lookup = &query->batch->queries[j];
+        if (lookup->is_way)
+        {
+          way_ids[num_ways] = lookup->id;
+          way_targets[num_ways++] = (Stream_Target){i, j};
+        }
+        else
         {
-          found = 1;
-          double lon = ((float)(OSM_Node_get_lon(curr_node))) / factor;
-          double lat = ((float)(OSM_Node_get_lat(curr_node))) / factor;
-          double rounded_lon = truncate(lon);
-          double rounded_lat = truncate(lat);
-          printf("Node Found:\n");
-          printf("  ID: %ld\n", id_as_int);
-          printf("  Latitude:  %.9f\n", rounded_lat);
-          printf("  Longitude: %.9f\n", rounded_lon);
-          break;
+          node_ids[num_nodes] = lookup->id;
+          node_targets[num_nodes++] = (Stream_Target){i, j};
         }
       }
-      if (!found) {
-        printf("Node not found in the map.\n");
+    }
+    else
+    {
+      query->result_offset = results->size;
+      if (run_queries_in_order(args, NULL, results) == -1)
+      {
+        goto done;
       }
+      query->result_size = results->size - query->result_offset;
     }
-    else if (strcmp(*p, "-w") == 0)
+  }
+  if (print_ready_results(&answers) == -1 || output_flush(out) == -1 || fflush(stdout) != 0)
+  {
+    goto done;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (OSM_find_stream(in, node_ids, num_nodes, print_streamed_node, way_ids, num_ways, print_streamed_way, &answers) == -1 ||
+      answers.failed)
+  {
+    goto done;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+  // lookups never found are answered as lookups in no map at all, in their place
+  for (int i = 0; i < num_queries; i++)
+  {
+    if (queries[i].batch)
     {
-      // if the value after -w [arg] is NULL or contains a -, then its just one arg
-      if (*(p + 2) == NULL || strchr(*(p + 2), '-') != NULL)
+      if (finish_streamed_batch(&answers, &queries[i], ms))
       {
-        p++;
+        goto done;
+      }
+    }
+    else if (queries[i].result_offset == -1)
+    {
+      queries[i].result_offset = results->size;
+      if (run_queries_in_order(queries[i].argv, NULL, results) == -1)
+      {
+        goto done;
+      }
+      queries[i].result_size = results->size - queries[i].result_offset;
+    }
+  }
+  result = print_ready_results(&answers);
 
-        char *id = *p;
+done:
+  if (out && output_close(out) == -1)
+  {
+    result = -1;
+  }
+  if (results)
+  {
+    output_close(results);
+  }
+  for (int i = 0; queries && i < num_queries; i++)
+  {
+    if (queries[i].batch)
+    {
+      clear_batch(queries[i].batch);
+      free(queries[i].batch->queries);
+      if (queries[i].batch->results)
+      {
+        output_close(queries[i].batch->results);
+      }
+      free(queries[i].batch);
+    }
+  }
+  free(queries);
+  free(query_args);
+  free(node_ids);
+  free(way_ids);
+  free(node_targets);
+  free(way_targets);
+  return result;
+}
 
-        char *endptr;
-        int64_t id_as_int = strtol(id, &endptr, 10);
+/* helper to check that every query of argv is a lookup answered by its entity alone (-n, or -w and -Q without a geojson line) */
+int can_stream_queries(char **argv)
+{
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (!is_query_option(*p) || strcmp(*p, "-f") == 0 || strcmp(*p, "--format") == 0 || strcmp(*p, "-n") == 0)
+    {
+      continue;
+    }
+    // the line of a way needs its nodes, which a stream has already passed
+    if ((strcmp(*p, "-w") != 0 && strcmp(*p, "-Q") != 0) || output_format == OUTPUT_GEOJSON)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-        int num_of_ways = OSM_Map_get_num_ways(mp);
-        int found = 0;
+/* pick the cheapest plan that answers every query on the command line */
+Query_Plan plan_queries(char **argv)
+{
+  int counts = 0;
+  int lookups = 0;
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (strcmp(*p, "-q") == 0 || strcmp(*p, "-k") == 0 || strcmp(*p, "-r") == 0 || strcmp(*p, "-t") == 0 ||
+        strcmp(*p, "-o") == 0 || strcmp(*p, "--serve") == 0)
+    {
+      return PLAN_FULL;
+    }
+    counts += strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0;
+    lookups += strcmp(*p, "-n") == 0 || strcmp(*p, "-w") == 0 || strcmp(*p, "-Q") == 0;
+  }
 
-        printf("=== Way Node References ===\n");
-        printf("Searching for Way ID: %ld\n", id_as_int);
+  // one pass that decodes everything beats a count pass followed by lookups
+  if (counts && lookups)
+  {
+    return PLAN_FULL;
+  }
+  if (counts)
+  {
+    return PLAN_COUNT;
+  }
+  if (!lookups)
+  {
+    return PLAN_HEADER;
+  }
+  return can_stream_queries(argv) ? PLAN_STREAM : PLAN_LOOKUP;
+}
 
-        for (int x = 0; x < num_of_ways; x++)
-        {
-          OSM_Way *curr_way = OSM_Map_get_Way(mp, x);
-
-          if (OSM_Way_get_id(curr_way) == id_as_int)
-          {
-            found = 1;
-            int ref_count = OSM_Way_get_num_refs(curr_way);
-            printf("Way Found:\n");
-            printf("  ID: %ld\n", id_as_int);
-            printf("  Number of Node References: %d\n", ref_count);
-            printf("  Node Reference Sequence: ");
-            
-            int curr_index = 0;
-            while (curr_index < ref_count - 1)
-            {
-              int64_t id = OSM_Way_get_ref(curr_way, curr_index);
-              printf("%ld ", id);
-              curr_index += 1;
-            }
-            int64_t id = OSM_Way_get_ref(curr_way, ref_count - 1);
-            printf("%ld\n", id);
-            break;
-          }
-        }
-        if (!found) {
-          printf("Way not found in the map.\n");
-        }
-      }
-      else
-      {
-        //-------------Get the Way Object----------------
-        p++;
-        char *id = *p;
+/* read options that carry out a plan read from a stream, NULL for everything */
+const OSM_ReadOptions *plan_read_options(Query_Plan plan, char **argv)
+{
+  static const OSM_ReadOptions header_only = {.entities = 0};
+  static const OSM_ReadOptions count_only = {.entities = OSM_READ_NODES | OSM_READ_WAYS, .count_only = 1};
+  static const OSM_ReadOptions full_summary = {.entities = OSM_READ_NODES | OSM_READ_WAYS, .decode_tags = 1, .summarize = 1};
 
-        char *endptr;
-        int64_t id_as_int = strtol(id, &endptr, 10);
+  if (plan == PLAN_HEADER)
+  {
+    return &header_only;
+  }
+  if (plan == PLAN_COUNT)
+  {
+    return &count_only;
+  }
+  // a snapshot keeps the summary for later -S queries, and so does a server for the -S requests it will get
+  return count_option(argv, "-S") || count_option(argv, "-o") || count_option(argv, "--serve") ? &full_summary : NULL;
+}
 
-        int num_of_ways = OSM_Map_get_num_ways(mp);
+/* read options for each file of several -f: everything, with the versions that pick the newest copy of a shared entity */
+const OSM_ReadOptions *merged_read_options(char **argv)
+{
+  static const OSM_ReadOptions everything = {.entities = OSM_READ_NODES | OSM_READ_WAYS, .decode_tags = 1, .decode_metadata = 1};
+  static const OSM_ReadOptions with_summary = {.entities = OSM_READ_NODES | OSM_READ_WAYS, .decode_tags = 1, .decode_metadata = 1, .summarize = 1};
 
-        OSM_Way *curr_way = NULL;
-        int found = 0;
-        for (int x = 0; x < num_of_ways; x++)
-        {
-          curr_way = OSM_Map_get_Way(mp, x);
-          if (OSM_Way_get_id(curr_way) == id_as_int)
-          {
-            found = 1;
-            break;
-          }
-        }
+  const OSM_ReadOptions *plan = plan_read_options(PLAN_FULL, argv);
+  return plan && plan->summarize ? &with_summary : &everything;
+}
 
-        if (found == 1)
-        {
-          printf("=== Way Key-Value Pairs ===\n");
-          printf("Way ID: %ld\n", id_as_int);
-          printf("Requested Key-Value Pairs:\n");
-          
-          int num_keys = OSM_Way_get_num_keys(curr_way);
-          while (*(p + 1) != NULL && strchr(*(p + 1), '-') == NULL)
-          {
-            p++;
-            char *key = *p;
-
-            int k_index = 0;
-            int actual_key_index = -1;
-
-            while (k_index < num_keys)
-            {
-              // find index of key
-              char *curr_key = OSM_Way_get_key(curr_way, k_index);
-              if (strcmp(curr_key, key) == 0)
-              {
-                actual_key_index = k_index;
-                break;
-              }
-              k_index += 1;
-            }
-
-            if (actual_key_index != -1)
-            {
-              char *value = OSM_Way_get_value(curr_way, actual_key_index);
-              if (value)
-              {
-                printf("  %s: %s\n", key, value);
-              }
-              else
-              {
-                printf("  %s: <no value>\n", key);
-              }
-            }
-            else
-            {
-              printf("  %s: <key not found>\n", key);
-            }
-          }
-        }
-        else
-        {
-          printf("Way ID %ld not found in the map.\n", id_as_int);
-        }
-      }
-    }
-    printf("\n");
+/* helper to parse the i/N of --shard, 0 <= i < N */
+int parse_shard(const char *arg, int *indexp, int *countp)
+{
+  char *slash;
+  char *end;
+  long index = strtol(arg, &slash, 10);
+  if (slash == arg || *slash != '/')
+  {
+    return -1;
+  }
+  long count = strtol(slash + 1, &end, 10);
+  if (end == slash + 1 || *end != '\0' || index < 0 || count < 1 || index >= count || count > INT32_MAX)
+  {
+    return -1;
   }
+  *indexp = index;
+  *countp = count;
   return 0;
 }
 
+/* helper to check the options that go with --shard (a file and the queries whose results merge) or --merge (a format) */
+int check_shard_args(char **argv)
+{
+  int queries = 0;
+  for (char **p = argv + 1; *p != NULL; p++)
+  {
+    if (strcmp(*p, "-f") == 0 || strcmp(*p, "--format") == 0 || strcmp(*p, "-t") == 0 || strcmp(*p, "--shard") == 0)
+    {
+      queries += strcmp(*p, "-t") == 0;
+      p++;
+    }
+    else if (strcmp(*p, "--merge") == 0)
+    {
+      p += num_merge_paths;
+    }
+    else if (strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0 || strcmp(*p, "-b") == 0)
+    {
+      queries++;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+
+  // the format is chosen when merging, the queries when sharding
+  if (shard_count != 0)
+  {
+    return num_input_files == 1 && queries > 0 && !merge_paths && !count_option(argv, "--format") ? 0 : -1;
+  }
+  return !osm_input_file && queries == 0 ? 0 : -1;
+}
+
 /* helper to validate the args */
 int validate_args(int argc, char **argv)
 {
@@ -244,27 +1969,24 @@ int validate_args(int argc, char **argv)
     }
     else if (strcmp(*p, "-f") == 0)
     {
-      // if the input file is set, we've alr seen -f
-      if (osm_input_file != NULL)
+      if (*(p + 1) == NULL)
       {
         return -1;
       }
-      else
-      {
-        if (*(p + 1) == NULL)
-        {
-          return -1;
-        }
 
-        // this triggers on file names with dashes (like the germany file so
-        // skip ig) else if(strchr(*(p+1), '-') != NULL){
-        //     // fprintf(stderr, "the arg after -f contained a -, it
-        //     shouldn't have"); return -1;
-        // }
+      // this triggers on file names with dashes (like the germany file so
+      // skip ig) else if(strchr(*(p+1), '-') != NULL){
+      //     // fprintf(stderr, "the arg after -f contained a -, it
+      //     shouldn't have"); return -1;
+      // }
 
-        p++;
+      // several -f are loaded into one map, the first names the input
+      p++;
+      if (osm_input_file == NULL)
+      {
         osm_input_file = *p;
       }
+      num_input_files++;
     }
     else if (strcmp(*p, "-s") == 0)
     {
@@ -278,6 +2000,18 @@ int validate_args(int argc, char **argv)
         return -1;
       }
     }
+    else if (strcmp(*p, "-S") == 0)
+    {
+      if (*(p + 1) == NULL)
+      {
+        // valid
+      }
+      else if (strchr(*(p + 1), '-') == NULL)
+      {
+        // -S must be followed with nothing OR a dashed arg
+        return -1;
+      }
+    }
     else if (strcmp(*p, "-b") == 0)
     {
       if (*(p + 1) == NULL)
@@ -290,6 +2024,107 @@ int validate_args(int argc, char **argv)
         return -1;
       }
     }
+    else if (strcmp(*p, "-q") == 0)
+    {
+      // exactly four coordinates, which may be negative so cannot be told apart by a dash
+      for (int i = 1; i <= 4; i++)
+      {
+        if (!is_coordinate(*(p + i)))
+        {
+          return -1;
+        }
+      }
+      p += 4;
+    }
+    else if (strcmp(*p, "-r") == 0)
+    {
+      // the path may contain dashes (like -f), but must not be another option
+      if (*(p + 1) == NULL || **(p + 1) == '-')
+      {
+        return -1;
+      }
+      p++;
+
+      // highway values are optional
+      if (*(p + 1) != NULL && strchr(*(p + 1), '-') == NULL)
+      {
+        p++;
+      }
+    }
+    else if (strcmp(*p, "-o") == 0 || strcmp(*p, "-Q") == 0)
+    {
+      // the path may contain dashes (like -f), but must not be another option
+      if (*(p + 1) == NULL || **(p + 1) == '-')
+      {
+        return -1;
+      }
+      p++;
+    }
+    else if (strcmp(*p, "--serve") == 0)
+    {
+      // the path may contain dashes (like -f), but must not be another option
+      if (serve_socket_path != NULL || *(p + 1) == NULL || **(p + 1) == '-')
+      {
+        return -1;
+      }
+      p++;
+      serve_socket_path = *p;
+    }
+    else if (strcmp(*p, "--shard") == 0)
+    {
+      if (shard_count != 0 || *(p + 1) == NULL || parse_shard(*(p + 1), &shard_index, &shard_count) == -1)
+      {
+        return -1;
+      }
+      p++;
+    }
+    else if (strcmp(*p, "--merge") == 0)
+    {
+      // one or more partial result files, up to the next option
+      if (merge_paths != NULL || *(p + 1) == NULL || **(p + 1) == '-')
+      {
+        return -1;
+      }
+      merge_paths = p + 1;
+      while (*(p + 1) != NULL && **(p + 1) != '-')
+      {
+        p++;
+        num_merge_paths++;
+      }
+    }
+    else if (strcmp(*p, "--index") == 0)
+    {
+      if (count_option(argv, "--index") > 1)
+      {
+        return -1;
+      }
+      write_index = 1;
+    }
+    else if (strcmp(*p, "--format") == 0)
+    {
+      if (count_option(argv, "--format") > 1 || *(p + 1) == NULL || output_parse_format(*(p + 1), &output_format) == -1)
+      {
+        return -1;
+      }
+      p++;
+    }
+    else if (strcmp(*p, "-t") == 0)
+    {
+      // values may contain dashes (oneway=-1), but the filter must not be another option
+      if (*(p + 1) == NULL || **(p + 1) == '-')
+      {
+        return -1;
+      }
+      p++;
+    }
+    else if (strcmp(*p, "-k") == 0)
+    {
+      if (!is_coordinate(*(p + 1)) || !is_coordinate(*(p + 2)))
+      {
+        return -1;
+      }
+      p += 2;
+    }
     else if (strcmp(*p, "-n") == 0)
     {
       if (*(p + 1) == NULL)
@@ -353,6 +2188,22 @@ int process_args(int argc, char **argv, OSM_Map *mp)
   else
   {
     int result = validate_args(argc, argv);
+
+    // a server takes its queries from the clients, only -f and --format may go with --serve
+    if (result == 0 && serve_socket_path != NULL &&
+        argc != 3 + 2 * num_input_files + 2 * count_option(argv, "--format") + count_option(argv, "--index"))
+    {
+      return -1;
+    }
+    // the sidecar belongs to one input file
+    if (result == 0 && write_index && num_input_files != 1)
+    {
+      return -1;
+    }
+    if (result == 0 && (shard_count != 0 || merge_paths != NULL) && (serve_socket_path != NULL || check_shard_args(argv) == -1))
+    {
+      return -1;
+    }
     return result;
   }
 }
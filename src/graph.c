@@ -0,0 +1,483 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph.h"
+#include "parallel.h"
+
+#define GRAPH_MAGIC "OSMGRPH"
+#define GRAPH_VERSION 1
+#define EARTH_RADIUS_METERS 6371008.8
+#define NANODEGREES_TO_RADIANS (M_PI / 180.0 / 1000000000)
+#define NO_VERTEX UINT32_MAX
+#define MIN_WAYS_PER_WORKER 1024
+
+/* Directions a selected way can be travelled in */
+#define DIRECTION_NONE 0
+#define DIRECTION_FORWARD 1
+#define DIRECTION_BACKWARD 2
+#define DIRECTION_BOTH 3
+
+typedef struct Graph_FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t num_vertices;
+    uint64_t num_edges;
+} Graph_FileHeader;
+
+/* State shared by the workers of every build pass */
+typedef struct Graph_Build
+{
+    OSM_Map *map;
+    const char **highways;
+    OSM_Geometries *geometries; // coordinates of every ref, slot by slot
+    uint8_t *directions;        // per way
+    int64_t *positions;         // per ref slot: node index, -1 when missing
+    uint32_t *usage;            // per node: 1 per interior use, 2 per end of a piece
+    uint32_t *vertex_of;        // per node: vertex number or NO_VERTEX
+    uint64_t *edge_start;       // per way: first edge, then num_ways + 1 entries
+    uint32_t *edge_sources;
+    uint32_t *edge_targets;
+    float *edge_weights;
+} Graph_Build;
+
+/* Per worker buffers of the length pass */
+typedef struct Graph_Scratch
+{
+    double *lat_rad;
+    double *cos_lat;
+    double *lengths;
+    size_t capacity;
+} Graph_Scratch;
+
+/* Value of a way's tag, NULL when absent */
+static char *way_tag(OSM_Way *wp, const char *key)
+{
+    int num_keys = OSM_Way_get_num_keys(wp);
+    for (int i = 0; i < num_keys; i++)
+    {
+        if (strcmp(OSM_Way_get_key(wp, i), key) == 0)
+        {
+            return OSM_Way_get_value(wp, i);
+        }
+    }
+    return NULL;
+}
+
+static uint8_t way_direction(OSM_Way *wp, const char **highways)
+{
+    char *highway = way_tag(wp, "highway");
+    if (!highway)
+    {
+        return DIRECTION_NONE;
+    }
+    if (highways)
+    {
+        const char **h = highways;
+        while (*h && strcmp(*h, highway) != 0)
+        {
+            h++;
+        }
+        if (!*h)
+        {
+            return DIRECTION_NONE;
+        }
+    }
+
+    char *oneway = way_tag(wp, "oneway");
+    if (oneway && (strcmp(oneway, "yes") == 0 || strcmp(oneway, "true") == 0 || strcmp(oneway, "1") == 0))
+    {
+        return DIRECTION_FORWARD;
+    }
+    if (oneway && (strcmp(oneway, "-1") == 0 || strcmp(oneway, "reverse") == 0))
+    {
+        return DIRECTION_BACKWARD;
+    }
+    if (oneway && strcmp(oneway, "no") == 0)
+    {
+        return DIRECTION_BOTH;
+    }
+
+    // implied oneway
+    char *junction = way_tag(wp, "junction");
+    if ((junction && strcmp(junction, "roundabout") == 0) || strcmp(highway, "motorway") == 0)
+    {
+        return DIRECTION_FORWARD;
+    }
+    return DIRECTION_BOTH;
+}
+
+/*
+ * Great circle lengths of the n - 1 segments of a polyline. Cosines are
+ * computed once per point, and the loops run over plain arrays with no
+ * branches, so the compiler can vectorize them.
+ */
+static void haversine_batch(const OSM_Coord *coords, size_t n, Graph_Scratch *scratch)
+{
+    double *lat_rad = scratch->lat_rad;
+    double *cos_lat = scratch->cos_lat;
+    double *lengths = scratch->lengths;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        lat_rad[i] = coords[i].lat * NANODEGREES_TO_RADIANS;
+        cos_lat[i] = cos(lat_rad[i]);
+    }
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        double half_dlat = (lat_rad[i + 1] - lat_rad[i]) * 0.5;
+        double half_dlon = ((double)coords[i + 1].lon - coords[i].lon) * NANODEGREES_TO_RADIANS * 0.5;
+        double sin_lat = sin(half_dlat);
+        double sin_lon = sin(half_dlon);
+        double a = sin_lat * sin_lat + cos_lat[i] * cos_lat[i + 1] * sin_lon * sin_lon;
+        lengths[i] = 2 * EARTH_RADIUS_METERS * asin(sqrt(a < 1 ? a : 1));
+    }
+}
+
+/* Pass 1: pick the ways, resolve their refs to node indexes and count how nodes are used */
+static int mark_ways(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Graph_Build *build = arg;
+    OSM_Id *refs = NULL;
+    int64_t refs_capacity = 0;
+
+    for (uint64_t w = begin; w < end; w++)
+    {
+        OSM_Way *way = OSM_Map_get_Way(build->map, w);
+        build->directions[w] = way_direction(way, build->highways);
+        if (build->directions[w] == DIRECTION_NONE)
+        {
+            continue;
+        }
+
+        int num_refs = OSM_Way_get_num_refs(way);
+        if (num_refs > refs_capacity)
+        {
+            free(refs);
+            refs_capacity = num_refs * 2;
+            refs = malloc(sizeof(OSM_Id) * refs_capacity);
+            if (!refs)
+            {
+                return -1;
+            }
+        }
+        num_refs = OSM_Way_copy_refs(way, refs, num_refs);
+
+        int64_t *positions = build->positions + build->geometries->offsets[w];
+        for (int r = 0; r < num_refs; r++)
+        {
+            positions[r] = OSM_Map_find_Node_index(build->map, refs[r]);
+        }
+
+        // ends of the way, and nodes next to a ref missing from the map, always become vertices
+        for (int r = 0; r < num_refs; r++)
+        {
+            if (positions[r] == -1)
+            {
+                continue;
+            }
+            int is_end = r == 0 || r == num_refs - 1 || positions[r - 1] == -1 || positions[r + 1] == -1;
+            __atomic_fetch_add(&build->usage[positions[r]], is_end ? 2 : 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(refs);
+    return 0;
+}
+
+/*
+ * Walk the pieces of a selected way: a piece runs between two consecutive
+ * vertex slots with no missing ref in between. With scratch, measures the
+ * pieces and writes their edges from index next; returns the edge count.
+ */
+static uint64_t walk_way(Graph_Build *build, uint64_t w, Graph_Scratch *scratch, uint64_t next)
+{
+    uint8_t direction = build->directions[w];
+    uint64_t first = build->geometries->offsets[w];
+    uint64_t n = build->geometries->offsets[w + 1] - first;
+    int64_t *positions = build->positions + first;
+    uint64_t edges = 0;
+
+    if (scratch)
+    {
+        haversine_batch(build->geometries->coords + first, n, scratch);
+    }
+
+    int64_t start = -1; // slot of the vertex starting the current piece
+    double length = 0;
+    for (uint64_t s = 0; s < n; s++)
+    {
+        if (positions[s] == -1)
+        {
+            start = -1;
+            continue;
+        }
+        if (start != -1 && scratch)
+        {
+            length += scratch->lengths[s - 1];
+        }
+
+        uint32_t vertex = build->vertex_of[positions[s]];
+        if (vertex == NO_VERTEX)
+        {
+            continue;
+        }
+        if (start != -1)
+        {
+            uint32_t from = build->vertex_of[positions[start]];
+            if (from != vertex)
+            {
+                for (int backward = 0; backward < 2; backward++)
+                {
+                    if (!(direction & (backward ? DIRECTION_BACKWARD : DIRECTION_FORWARD)))
+                    {
+                        continue;
+                    }
+                    if (scratch)
+                    {
+                        build->edge_sources[next + edges] = backward ? vertex : from;
+                        build->edge_targets[next + edges] = backward ? from : vertex;
+                        build->edge_weights[next + edges] = length;
+                    }
+                    edges++;
+                }
+            }
+        }
+        start = s;
+        length = 0;
+    }
+    return edges;
+}
+
+/* Pass 2: count the edges of every way */
+static int count_edges(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Graph_Build *build = arg;
+    for (uint64_t w = begin; w < end; w++)
+    {
+        build->edge_start[w] = build->directions[w] == DIRECTION_NONE ? 0 : walk_way(build, w, NULL, 0);
+    }
+    return 0;
+}
+
+/* Pass 3: measure the pieces and write the edges of every way at its offset */
+static int fill_edges(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Graph_Build *build = arg;
+    Graph_Scratch scratch = {NULL, NULL, NULL, 0};
+    int result = 0;
+
+    for (uint64_t w = begin; w < end; w++)
+    {
+        if (build->directions[w] == DIRECTION_NONE)
+        {
+            continue;
+        }
+
+        size_t n = build->geometries->offsets[w + 1] - build->geometries->offsets[w];
+        if (n > scratch.capacity)
+        {
+            free(scratch.lat_rad);
+            free(scratch.cos_lat);
+            free(scratch.lengths);
+            scratch.capacity = n * 2;
+            scratch.lat_rad = malloc(sizeof(double) * scratch.capacity);
+            scratch.cos_lat = malloc(sizeof(double) * scratch.capacity);
+            scratch.lengths = malloc(sizeof(double) * scratch.capacity);
+            if (!scratch.lat_rad || !scratch.cos_lat || !scratch.lengths)
+            {
+                result = -1;
+                break;
+            }
+        }
+        walk_way(build, w, &scratch, build->edge_start[w]);
+    }
+
+    free(scratch.lat_rad);
+    free(scratch.cos_lat);
+    free(scratch.lengths);
+    return result;
+}
+
+/* Number the nodes used as vertices in node order and lay the edges out by source */
+static int assemble_graph(Graph_Build *build, OSM_Graph *graph)
+{
+    uint64_t num_nodes = OSM_Map_get_num_nodes(build->map);
+    for (uint64_t p = 0; p < num_nodes; p++)
+    {
+        if (build->vertex_of[p] != NO_VERTEX)
+        {
+            OSM_Node *node = OSM_Map_get_Node(build->map, p);
+            graph->node_ids[build->vertex_of[p]] = OSM_Node_get_id(node);
+            graph->coords[build->vertex_of[p]].lat = OSM_Node_get_lat(node);
+            graph->coords[build->vertex_of[p]].lon = OSM_Node_get_lon(node);
+        }
+    }
+
+    // counting sort of the edges by source, stable so the layout is deterministic
+    memset(graph->offsets, 0, sizeof(uint64_t) * (graph->num_vertices + 1));
+    for (uint64_t e = 0; e < graph->num_edges; e++)
+    {
+        graph->offsets[build->edge_sources[e] + 1]++;
+    }
+    for (uint64_t v = 0; v < graph->num_vertices; v++)
+    {
+        graph->offsets[v + 1] += graph->offsets[v];
+    }
+
+    uint64_t *cursors = malloc(sizeof(uint64_t) * (graph->num_vertices ? graph->num_vertices : 1));
+    if (!cursors)
+    {
+        return -1;
+    }
+    memcpy(cursors, graph->offsets, sizeof(uint64_t) * graph->num_vertices);
+    for (uint64_t e = 0; e < graph->num_edges; e++)
+    {
+        uint64_t slot = cursors[build->edge_sources[e]]++;
+        graph->targets[slot] = build->edge_targets[e];
+        graph->weights[slot] = build->edge_weights[e];
+    }
+    free(cursors);
+    return 0;
+}
+
+OSM_Graph *OSM_Graph_build(OSM_Map *mp, const char **highways)
+{
+    uint64_t num_nodes = OSM_Map_get_num_nodes(mp);
+    uint64_t num_ways = OSM_Map_get_num_ways(mp);
+
+    Graph_Build build;
+    memset(&build, 0, sizeof(build));
+    build.map = mp;
+    build.highways = highways;
+
+    OSM_Graph *graph = calloc(1, sizeof(OSM_Graph));
+    build.geometries = OSM_Map_resolve_way_geometries(mp);
+    if (!graph || !build.geometries)
+    {
+        goto error;
+    }
+
+    uint64_t num_refs = build.geometries->offsets[num_ways];
+    build.directions = malloc(num_ways ? num_ways : 1);
+    build.positions = malloc(sizeof(int64_t) * (num_refs ? num_refs : 1));
+    build.usage = calloc(num_nodes ? num_nodes : 1, sizeof(uint32_t));
+    build.vertex_of = malloc(sizeof(uint32_t) * (num_nodes ? num_nodes : 1));
+    build.edge_start = malloc(sizeof(uint64_t) * (num_ways + 1));
+    if (!build.directions || !build.positions || !build.usage || !build.vertex_of || !build.edge_start ||
+        parallel_for(num_ways, MIN_WAYS_PER_WORKER, mark_ways, &build) == -1)
+    {
+        goto error;
+    }
+
+    // nodes used twice (an intersection or an end) are the vertices
+    for (uint64_t p = 0; p < num_nodes; p++)
+    {
+        build.vertex_of[p] = build.usage[p] >= 2 ? graph->num_vertices++ : NO_VERTEX;
+        if (graph->num_vertices == NO_VERTEX)
+        {
+            goto error;
+        }
+    }
+
+    if (parallel_for(num_ways, MIN_WAYS_PER_WORKER, count_edges, &build) == -1)
+    {
+        goto error;
+    }
+    uint64_t total = 0;
+    for (uint64_t w = 0; w < num_ways; w++)
+    {
+        uint64_t count = build.edge_start[w];
+        build.edge_start[w] = total;
+        total += count;
+    }
+    build.edge_start[num_ways] = total;
+    graph->num_edges = total;
+
+    build.edge_sources = malloc(sizeof(uint32_t) * (total ? total : 1));
+    build.edge_targets = malloc(sizeof(uint32_t) * (total ? total : 1));
+    build.edge_weights = malloc(sizeof(float) * (total ? total : 1));
+    graph->offsets = malloc(sizeof(uint64_t) * (graph->num_vertices + 1));
+    graph->targets = malloc(sizeof(uint32_t) * (total ? total : 1));
+    graph->weights = malloc(sizeof(float) * (total ? total : 1));
+    graph->node_ids = malloc(sizeof(OSM_Id) * (graph->num_vertices ? graph->num_vertices : 1));
+    graph->coords = malloc(sizeof(OSM_Coord) * (graph->num_vertices ? graph->num_vertices : 1));
+    if (!build.edge_sources || !build.edge_targets || !build.edge_weights || !graph->offsets || !graph->targets ||
+        !graph->weights || !graph->node_ids || !graph->coords ||
+        parallel_for(num_ways, MIN_WAYS_PER_WORKER, fill_edges, &build) == -1 ||
+        assemble_graph(&build, graph) == -1)
+    {
+        goto error;
+    }
+    goto done;
+
+error:
+    OSM_Graph_free(graph);
+    graph = NULL;
+
+done:
+    OSM_Geometries_free(build.geometries);
+    free(build.directions);
+    free(build.positions);
+    free(build.usage);
+    free(build.vertex_of);
+    free(build.edge_start);
+    free(build.edge_sources);
+    free(build.edge_targets);
+    free(build.edge_weights);
+    return graph;
+}
+
+int OSM_Graph_save(const OSM_Graph *graph, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        return -1;
+    }
+
+    Graph_FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC));
+    header.version = GRAPH_VERSION;
+    header.num_vertices = graph->num_vertices;
+    header.num_edges = graph->num_edges;
+
+    uint64_t v = graph->num_vertices;
+    uint64_t e = graph->num_edges;
+    int result = 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(graph->offsets, sizeof(uint64_t), v + 1, f) != v + 1 ||
+        fwrite(graph->targets, sizeof(uint32_t), e, f) != e ||
+        fwrite(graph->weights, sizeof(float), e, f) != e ||
+        fwrite(graph->node_ids, sizeof(OSM_Id), v, f) != v ||
+        fwrite(graph->coords, sizeof(OSM_Coord), v, f) != v)
+    {
+        result = -1;
+    }
+    if (fclose(f) != 0)
+    {
+        result = -1;
+    }
+    if (result == -1)
+    {
+        remove(path);
+    }
+    return result;
+}
+
+void OSM_Graph_free(OSM_Graph *graph)
+{
+    if (!graph)
+    {
+        return;
+    }
+    free(graph->offsets);
+    free(graph->targets);
+    free(graph->weights);
+    free(graph->node_ids);
+    free(graph->coords);
+    free(graph);
+}
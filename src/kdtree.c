@@ -0,0 +1,243 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "kdtree.h"
+#include "parallel.h"
+
+/* Ranges smaller than this are partitioned on the thread that reached them */
+#define MIN_PARALLEL_RANGE 65536
+
+/* A range of the points array still to be partitioned, with the depth of its root */
+typedef struct KD_Range
+{
+    uint64_t lo;
+    uint64_t hi;
+    int depth;
+} KD_Range;
+
+/* Subtrees handed to parallel_for once the top of the tree is built */
+typedef struct KD_Build
+{
+    OSM_KDPoint *points;
+    KD_Range *ranges;
+} KD_Build;
+
+static int64_t axis_key(const OSM_KDPoint *p, int depth)
+{
+    return (depth & 1) ? p->lon : p->lat;
+}
+
+static void swap_points(OSM_KDPoint *a, OSM_KDPoint *b)
+{
+    OSM_KDPoint tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Quickselect: reorder [lo, hi) so that nth holds the element of that rank on the axis of depth */
+static void select_nth(OSM_KDPoint *points, uint64_t lo, uint64_t hi, uint64_t nth, int depth)
+{
+    while (hi - lo > 1)
+    {
+        // median of three pivot moved to hi - 1
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (axis_key(&points[mid], depth) < axis_key(&points[lo], depth))
+        {
+            swap_points(&points[mid], &points[lo]);
+        }
+        if (axis_key(&points[hi - 1], depth) < axis_key(&points[lo], depth))
+        {
+            swap_points(&points[hi - 1], &points[lo]);
+        }
+        if (axis_key(&points[mid], depth) < axis_key(&points[hi - 1], depth))
+        {
+            swap_points(&points[mid], &points[hi - 1]);
+        }
+        int64_t pivot = axis_key(&points[hi - 1], depth);
+
+        // three way partition so runs of equal coordinates cannot degrade it
+        uint64_t less = lo, i = lo, greater = hi - 1;
+        while (i < greater)
+        {
+            int64_t key = axis_key(&points[i], depth);
+            if (key < pivot)
+            {
+                swap_points(&points[i++], &points[less++]);
+            }
+            else if (key > pivot)
+            {
+                swap_points(&points[i], &points[--greater]);
+            }
+            else
+            {
+                i++;
+            }
+        }
+        swap_points(&points[greater], &points[hi - 1]);
+        greater++;
+
+        if (nth < less)
+        {
+            hi = less;
+        }
+        else if (nth >= greater)
+        {
+            lo = greater;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+static void build_range(OSM_KDPoint *points, uint64_t lo, uint64_t hi, int depth)
+{
+    while (hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        select_nth(points, lo, hi, mid, depth);
+        build_range(points, lo, mid, depth + 1);
+        lo = mid + 1;
+        depth++;
+    }
+}
+
+static int build_subtrees(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    KD_Build *build = arg;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        build_range(build->points, build->ranges[i].lo, build->ranges[i].hi, build->ranges[i].depth);
+    }
+    return 0;
+}
+
+OSM_KDTree *kdtree_build(OSM_KDPoint *points, uint64_t count)
+{
+    OSM_KDTree *tree = malloc(sizeof(OSM_KDTree));
+    if (!tree)
+    {
+        return NULL;
+    }
+    tree->points = points;
+    tree->count = count;
+
+    // partition the top levels here until there is a subtree per worker, then build those in parallel
+    int workers = parallel_num_workers();
+    KD_Range ranges[2 * PARALLEL_MAX_WORKERS];
+    int num_ranges = 1;
+    ranges[0] = (KD_Range){0, count, 0};
+
+    while (num_ranges < workers && count / num_ranges >= MIN_PARALLEL_RANGE)
+    {
+        int next = 0;
+        KD_Range split[2 * PARALLEL_MAX_WORKERS];
+        for (int i = 0; i < num_ranges; i++)
+        {
+            KD_Range r = ranges[i];
+            uint64_t mid = r.lo + (r.hi - r.lo) / 2;
+            select_nth(points, r.lo, r.hi, mid, r.depth);
+            split[next++] = (KD_Range){r.lo, mid, r.depth + 1};
+            split[next++] = (KD_Range){mid + 1, r.hi, r.depth + 1};
+        }
+        for (int i = 0; i < next; i++)
+        {
+            ranges[i] = split[i];
+        }
+        num_ranges = next;
+    }
+
+    KD_Build build = {points, ranges};
+    parallel_for(num_ranges, 1, build_subtrees, &build);
+    return tree;
+}
+
+/* Bounded list of the best candidates so far, sorted nearest first */
+typedef struct KD_Search
+{
+    const OSM_KDPoint *points;
+    int64_t lat;
+    int64_t lon;
+    double lon_scale;
+    int k;
+    int found;
+    double *dists;
+    uint64_t *items;
+} KD_Search;
+
+static void offer(KD_Search *s, double dist, uint64_t item)
+{
+    if (s->found == s->k && dist >= s->dists[s->found - 1])
+    {
+        return;
+    }
+
+    int i = s->found < s->k ? s->found++ : s->found - 1;
+    while (i > 0 && s->dists[i - 1] > dist)
+    {
+        s->dists[i] = s->dists[i - 1];
+        s->items[i] = s->items[i - 1];
+        i--;
+    }
+    s->dists[i] = dist;
+    s->items[i] = item;
+}
+
+static void search_range(KD_Search *s, uint64_t lo, uint64_t hi, int depth)
+{
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const OSM_KDPoint *p = &s->points[mid];
+
+        double dlat = (double)(p->lat - s->lat);
+        double dlon = (double)(p->lon - s->lon) * s->lon_scale;
+        offer(s, dlat * dlat + dlon * dlon, p->item);
+
+        // descend on the query's side first, visit the other side only if the plane is closer than the kth best
+        double plane = (depth & 1) ? (double)(s->lon - p->lon) * s->lon_scale : (double)(s->lat - p->lat);
+        uint64_t near_lo = plane < 0 ? lo : mid + 1;
+        uint64_t near_hi = plane < 0 ? mid : hi;
+        uint64_t far_lo = plane < 0 ? mid + 1 : lo;
+        uint64_t far_hi = plane < 0 ? hi : mid;
+
+        search_range(s, near_lo, near_hi, depth + 1);
+        if (s->found == s->k && plane * plane >= s->dists[s->found - 1])
+        {
+            return;
+        }
+        lo = far_lo;
+        hi = far_hi;
+        depth++;
+    }
+}
+
+int kdtree_nearest(const OSM_KDTree *tree, int64_t lat, int64_t lon, int k, uint64_t *items)
+{
+    if (k <= 0)
+    {
+        return 0;
+    }
+
+    double *dists = malloc(sizeof(double) * k);
+    if (!dists)
+    {
+        return -1;
+    }
+
+    KD_Search search = {tree->points, lat, lon, cos(lat * 1e-9 * M_PI / 180.0), k, 0, dists, items};
+    search_range(&search, 0, tree->count, 0);
+    free(dists);
+    return search.found;
+}
+
+void kdtree_free(OSM_KDTree *tree)
+{
+    if (!tree)
+    {
+        return;
+    }
+    free(tree->points);
+    free(tree);
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blob_index.h"
+#include "lazy_map.h"
+
+#define DEFAULT_CACHE_BLOCKS 8
+
+/* A decoded blob held by the cache */
+typedef struct Lazy_CacheSlot
+{
+    int64_t blob;       // index in the blob directory, -1 when empty
+    OSM_Map *map;       // kept across evictions and reset, so its arenas stay warm
+    uint64_t last_used; // LRU clock value
+} Lazy_CacheSlot;
+
+struct OSM_LazySource
+{
+    FILE *in;
+    OSM_BlobIndex *index;
+    Lazy_CacheSlot *slots;
+    int num_slots;
+    uint64_t clock;
+    int64_t last_found[2]; // per OSM_BLOB_* type, blob of the last entity found (-1 if none)
+    int failed;            // the last lookup missed a blob it could not read or decode
+};
+
+OSM_LazySource *lazy_source_open(OSM_Map *mp, const char *path, int cache_blocks)
+{
+    OSM_LazySource *src = calloc(1, sizeof(OSM_LazySource));
+    if (!src)
+    {
+        return NULL;
+    }
+
+    src->num_slots = cache_blocks > 0 ? cache_blocks : DEFAULT_CACHE_BLOCKS;
+    src->slots = calloc(src->num_slots, sizeof(Lazy_CacheSlot));
+    src->index = OSM_BlobIndex_open(path);
+    src->in = fopen(path, "r");
+
+    if (!src->slots || !src->index || !src->in)
+    {
+        lazy_source_free(src);
+        return NULL;
+    }
+    for (int i = 0; i < src->num_slots; i++)
+    {
+        src->slots[i].blob = -1;
+    }
+    src->last_found[OSM_BLOB_NODES] = -1;
+    src->last_found[OSM_BLOB_WAYS] = -1;
+
+    // the header (bbox) is decoded into the lazy map itself
+    for (uint64_t i = 0; i < src->index->count; i++)
+    {
+        if (src->index->blobs[i].type == OSM_BLOB_HEADER)
+        {
+            if (OSM_Map_load_blob(mp, src->in, src->index->blobs[i].offset, NULL) == -1)
+            {
+                lazy_source_free(src);
+                return NULL;
+            }
+            break;
+        }
+    }
+    return src;
+}
+
+/* Decoded map of a blob, from the cache or decoded into the least recently used slot */
+static OSM_Map *cached_blob(OSM_LazySource *src, uint64_t blob)
+{
+    Lazy_CacheSlot *victim = &src->slots[0];
+
+    for (int i = 0; i < src->num_slots; i++)
+    {
+        Lazy_CacheSlot *slot = &src->slots[i];
+        if (slot->blob == (int64_t)blob)
+        {
+            slot->last_used = ++src->clock;
+            return slot->map;
+        }
+        if (slot->blob == -1 || slot->last_used < victim->last_used)
+        {
+            victim = slot;
+        }
+    }
+
+    if (!victim->map)
+    {
+        victim->map = OSM_Map_create();
+        if (!victim->map)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        OSM_Map_reset(victim->map);
+    }
+
+    victim->blob = -1;
+    victim->last_used = 0;
+    if (OSM_Map_load_blob(victim->map, src->in, src->index->blobs[blob].offset, NULL) == -1)
+    {
+        return NULL;
+    }
+    victim->blob = blob;
+    victim->last_used = ++src->clock;
+    return victim->map;
+}
+
+/* Blob to search first for an entity: lookups in id order (batches) mostly hit the blob of the previous one */
+static int64_t first_candidate(OSM_LazySource *src, int entity, OSM_Id id)
+{
+    int64_t last = src->last_found[entity];
+    return last != -1 && OSM_BlobIndex_may_contain(src->index, last, entity, id) ? last : -1;
+}
+
+OSM_Node *lazy_find_Node(OSM_LazySource *src, OSM_Id id)
+{
+    src->failed = 0;
+    int64_t first = first_candidate(src, OSM_BLOB_NODES, id);
+    for (int64_t i = first != -1 ? -1 : 0; i < (int64_t)src->index->count; i++)
+    {
+        uint64_t blob = i == -1 ? (uint64_t)first : (uint64_t)i;
+        if (i == first || !OSM_BlobIndex_may_contain(src->index, blob, OSM_BLOB_NODES, id))
+        {
+            continue;
+        }
+
+        // the id may still be in a later blob, the failure only counts if it is not
+        OSM_Map *block = cached_blob(src, blob);
+        if (!block)
+        {
+            src->failed = 1;
+            continue;
+        }
+        OSM_Node *node = OSM_Map_find_Node(block, id);
+        if (node)
+        {
+            src->last_found[OSM_BLOB_NODES] = blob;
+            return node;
+        }
+    }
+    return NULL;
+}
+
+OSM_Way *lazy_find_Way(OSM_LazySource *src, OSM_Id id)
+{
+    src->failed = 0;
+    int64_t first = first_candidate(src, OSM_BLOB_WAYS, id);
+    for (int64_t i = first != -1 ? -1 : 0; i < (int64_t)src->index->count; i++)
+    {
+        uint64_t blob = i == -1 ? (uint64_t)first : (uint64_t)i;
+        if (i == first || !OSM_BlobIndex_may_contain(src->index, blob, OSM_BLOB_WAYS, id))
+        {
+            continue;
+        }
+
+        // the id may still be in a later blob, the failure only counts if it is not
+        OSM_Map *block = cached_blob(src, blob);
+        if (!block)
+        {
+            src->failed = 1;
+            continue;
+        }
+        OSM_Way *way = OSM_Map_find_Way(block, id);
+        if (way)
+        {
+            src->last_found[OSM_BLOB_WAYS] = blob;
+            return way;
+        }
+    }
+    return NULL;
+}
+
+int lazy_lookup_failed(OSM_LazySource *src)
+{
+    return src->failed;
+}
+
+OSM_BlobIndex *lazy_source_index(OSM_LazySource *src)
+{
+    return src->index;
+}
+
+int lazy_node_extent(OSM_LazySource *src, OSM_Lon *min_lonp, OSM_Lat *min_latp, OSM_Lon *max_lonp, OSM_Lat *max_latp)
+{
+    int found = 0;
+
+    // a decoded blob's bbox is the extent of its nodes, tracked while decoding them
+    for (uint64_t i = 0; i < src->index->count; i++)
+    {
+        OSM_BlobInfo *info = &src->index->blobs[i];
+        if (info->type != OSM_BLOB_DATA || info->min_id[OSM_BLOB_NODES] > info->max_id[OSM_BLOB_NODES])
+        {
+            continue;
+        }
+
+        OSM_Map *block = cached_blob(src, i);
+        if (!block)
+        {
+            return -1;
+        }
+        OSM_BBox *bbox = OSM_Map_get_BBox(block);
+        if (!bbox)
+        {
+            continue;
+        }
+
+        if (!found || OSM_BBox_get_min_lon(bbox) < *min_lonp)
+        {
+            *min_lonp = OSM_BBox_get_min_lon(bbox);
+        }
+        if (!found || OSM_BBox_get_min_lat(bbox) < *min_latp)
+        {
+            *min_latp = OSM_BBox_get_min_lat(bbox);
+        }
+        if (!found || OSM_BBox_get_max_lon(bbox) > *max_lonp)
+        {
+            *max_lonp = OSM_BBox_get_max_lon(bbox);
+        }
+        if (!found || OSM_BBox_get_max_lat(bbox) > *max_latp)
+        {
+            *max_latp = OSM_BBox_get_max_lat(bbox);
+        }
+        found = 1;
+    }
+    return found ? 0 : -1;
+}
+
+void lazy_source_free(OSM_LazySource *src)
+{
+    if (!src)
+    {
+        return;
+    }
+
+    if (src->slots)
+    {
+        for (int i = 0; i < src->num_slots; i++)
+        {
+            OSM_Map_free(src->slots[i].map);
+        }
+        free(src->slots);
+    }
+    OSM_BlobIndex_free(src->index);
+    if (src->in)
+    {
+        fclose(src->in);
+    }
+    free(src);
+}
@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "blob_index.h"
 #include "config.h"
 #include "osm.h"
+#include "server.h"
+#include "shard.h"
 
 int main(int argc, char **argv)
 {
@@ -17,8 +21,66 @@ int main(int argc, char **argv)
         USAGE(*argv, EXIT_SUCCESS);
     }
 
+    // partials written by --shard runs are merged without reading any map
+    if(merge_paths){
+        if(merge_shard_results(merge_paths, num_merge_paths, stdout, output_format) == -1){
+            fprintf(stderr, "Error merging partial results (one per shard of the same file and queries, -t not as geojson).\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    // several input files are read side by side and merged into one map
+    if(num_input_files > 1){
+        FILE **files = calloc(num_input_files, sizeof(FILE *));
+        int opened = 0;
+        for(char **p = argv + 1; files && *p != NULL; p++){
+            if(strcmp(*p, "-f") == 0){
+                p++;
+                files[opened] = fopen(*p, "r");
+                if(!files[opened]){
+                    fprintf(stderr, "Could Not Open File Named: %s", *p);
+                    fflush(stderr);
+                    exit(EXIT_FAILURE);
+                }
+                opened++;
+            }
+        }
+
+        OSM_Map *map = files ? OSM_read_Maps(files, num_input_files, merged_read_options(argv)) : NULL;
+        for(int i = 0; i < opened; i++){
+            fclose(files[i]);
+        }
+        free(files);
+
+        if(!map){
+            fprintf(stderr, "Error Processing File Contents To OSM_Map struc\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+
+        int result = serve_socket_path ? serve_queries(map, serve_socket_path) : process_args(argc, argv, map);
+        OSM_Map_free(map);
+
+        if(result == -1){
+            fprintf(stderr, "Error running queries (path provided via CLI).\n");
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
     // handle case of input file path provided 
-    if(osm_input_file){
+    if(osm_input_file && shard_count){
+        if(run_shard_queries(argv, osm_input_file, shard_index, shard_count, stdout) == -1){
+            fprintf(stderr, "Error writing the partial results of shard %d/%d of %s\n", shard_index, shard_count, osm_input_file);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+    else if(osm_input_file){
         FILE *f = fopen(osm_input_file, "r");
         if(!f){
             fprintf(stderr, "Could Not Open File Named: %s", osm_input_file); 
@@ -26,16 +88,49 @@ int main(int argc, char **argv)
             exit(EXIT_FAILURE);
         }
 
-        OSM_Map *map = OSM_read_Map(f);
-        
+        // a snapshot (see -o) is mapped as is, whatever the queries
+        OSM_Map *map = OSM_Map_open_snapshot(osm_input_file);
+
+        // otherwise decode only what the queries need, point lookups only the blobs holding the requested ids
+        if(!map){
+            Query_Plan plan = plan_queries(argv);
+
+            // lookups are answered while the file streams by, unless its sidecar locates their blobs (or is to be written)
+            if(plan == PLAN_STREAM && (write_index || OSM_BlobIndex_sidecar_is_current(osm_input_file))){
+                plan = PLAN_LOOKUP;
+            }
+            if(plan == PLAN_STREAM){
+                int result = run_stream_queries(argv, f);
+                fclose(f);
+
+                if(result == -1){
+                    fprintf(stderr, "Error running queries (path provided via CLI).\n");
+                    fflush(stderr);
+                    exit(EXIT_FAILURE);
+                }
+                exit(EXIT_SUCCESS);
+            }
+            map = plan == PLAN_LOOKUP ? OSM_open_Map_lazy(osm_input_file, 0) : OSM_read_Map_ex(f, plan_read_options(plan, argv));
+        }
+
         if(!map){
             fprintf(stderr, "Error Processing File Contents To OSM_Map struc\n");
             fflush(stderr);
             exit(EXIT_FAILURE);
         }
 
-        // run query on in memory deserialized protobuf file 
-        int result = process_args(argc, argv, map);
+        // only on request, a query tool writes nothing next to its input
+        int index_result = write_index ? OSM_Map_save_index(map, osm_input_file) : 0;
+        if(index_result == -1){
+            fprintf(stderr, "Error writing the index of %s to %s.idx\n", osm_input_file, osm_input_file);
+            fflush(stderr);
+        }
+
+        // run query on in memory deserialized protobuf file, or keep serving it
+        int result = serve_socket_path ? serve_queries(map, serve_socket_path) : process_args(argc, argv, map);
+
+        OSM_Map_free(map);
+        fclose(f);
 
         if(result == - 1){
             fprintf(stderr, "Error running queries (path provided via CLI).\n");
@@ -43,13 +138,24 @@ int main(int argc, char **argv)
             exit(EXIT_FAILURE);
             
         }
-        exit(EXIT_SUCCESS);
+        exit(index_result == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
     // if no file explicitly passed, read from STDIN
     else{
         FILE *f = stdin;  
-        OSM_Map *map = OSM_read_Map(f);
+
+        // a pipe cannot be opened lazily, lookups are streamed or need the full load
+        Query_Plan plan = plan_queries(argv);
+        if(plan == PLAN_STREAM){
+            if(run_stream_queries(argv, f) == -1){
+                fprintf(stderr, "Error running queries(File originated from stdin)\n");
+                fflush(stderr);
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        OSM_Map *map = OSM_read_Map_ex(f, plan_read_options(plan == PLAN_LOOKUP ? PLAN_FULL : plan, argv));
 
         if(!f){
             fprintf(stderr, "No File Specified in STDIN\n");
@@ -62,7 +168,9 @@ int main(int argc, char **argv)
             fflush(stderr);
             exit(EXIT_FAILURE);
         }
-        int result = process_args(argc, argv, map);
+        int result = serve_socket_path ? serve_queries(map, serve_socket_path) : process_args(argc, argv, map);
+        OSM_Map_free(map);
+
         if (result == -1) {
             fprintf(stderr, "Error running queries(File originated from stdin)\n");
             fflush(stderr);
@@ -0,0 +1,584 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+#define NANO 1000000000
+
+static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                  "8081828384858687888990919293949596979899";
+
+static const uint32_t powers_of_ten[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+static const char *format_names[] = {"text", "json", "csv", "geojson"};
+
+int output_parse_format(const char *name, Output_Format *format)
+{
+    for (int i = 0; i < (int)(sizeof(format_names) / sizeof(format_names[0])); i++)
+    {
+        if (strcmp(name, format_names[i]) == 0)
+        {
+            *format = (Output_Format)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+Output *output_open(FILE *sink, Output_Format format)
+{
+    Output *out = calloc(1, sizeof(Output));
+    size_t capacity = sink ? OUTPUT_BUFFER_SIZE : 4096;
+    char *buffer = out ? malloc(capacity) : NULL;
+    if (!buffer)
+    {
+        free(out);
+        return NULL;
+    }
+    out->format = format;
+    out->sink = sink;
+    out->buffer = buffer;
+    out->capacity = capacity;
+    return out;
+}
+
+int output_flush(Output *out)
+{
+    if (out->sink && out->size > 0)
+    {
+        if (fwrite(out->buffer, 1, out->size, out->sink) != out->size)
+        {
+            out->failed = 1;
+        }
+        out->size = 0;
+    }
+    return out->failed ? -1 : 0;
+}
+
+int output_close(Output *out)
+{
+    if (output_flush(out) == 0 && out->sink && fflush(out->sink) != 0)
+    {
+        out->failed = 1;
+    }
+    int result = out->failed ? -1 : 0;
+    free(out->buffer);
+    free(out);
+    return result;
+}
+
+/* Room for len more bytes at the end of the buffer, flushed or grown to fit. NULL on failure */
+static char *reserve(Output *out, size_t len)
+{
+    if (out->size + len <= out->capacity)
+    {
+        return out->buffer + out->size;
+    }
+    if (out->sink && output_flush(out) == 0 && len <= out->capacity)
+    {
+        return out->buffer;
+    }
+    if (out->failed)
+    {
+        return NULL;
+    }
+
+    size_t capacity = out->capacity * 2;
+    while (capacity < out->size + len)
+    {
+        capacity *= 2;
+    }
+    char *grown = realloc(out->buffer, capacity);
+    if (!grown)
+    {
+        out->failed = 1;
+        return NULL;
+    }
+    out->buffer = grown;
+    out->capacity = capacity;
+    return out->buffer + out->size;
+}
+
+void output_bytes(Output *out, const char *bytes, size_t len)
+{
+    // blocks of a buffer size or more go to the sink without a copy
+    if (out->sink && len >= out->capacity)
+    {
+        if (output_flush(out) == 0 && fwrite(bytes, 1, len, out->sink) != len)
+        {
+            out->failed = 1;
+        }
+        return;
+    }
+
+    char *dst = reserve(out, len);
+    if (dst)
+    {
+        memcpy(dst, bytes, len);
+        out->size += len;
+    }
+}
+
+void output_str(Output *out, const char *str)
+{
+    output_bytes(out, str, strlen(str));
+}
+
+void output_char(Output *out, char c)
+{
+    char *dst = reserve(out, 1);
+    if (dst)
+    {
+        *dst = c;
+        out->size++;
+    }
+}
+
+/* Write the digits of value backwards, two at a time, ending just before end. Returns the first digit */
+static char *format_uint(char *end, uint64_t value)
+{
+    while (value >= 100)
+    {
+        const char *pair = digit_pairs + (value % 100) * 2;
+        value /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (value >= 10)
+    {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    }
+    else
+    {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+void output_uint(Output *out, uint64_t value)
+{
+    char text[20];
+    char *start = format_uint(text + sizeof(text), value);
+    output_bytes(out, start, text + sizeof(text) - start);
+}
+
+void output_int(Output *out, int64_t value)
+{
+    char text[21];
+    char *start = format_uint(text + sizeof(text), value < 0 ? -(uint64_t)value : (uint64_t)value);
+    if (value < 0)
+    {
+        *--start = '-';
+    }
+    output_bytes(out, start, text + sizeof(text) - start);
+}
+
+void output_printf(Output *out, const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0)
+    {
+        out->failed = 1;
+        return;
+    }
+    if ((size_t)len < sizeof(text))
+    {
+        output_bytes(out, text, len);
+        return;
+    }
+
+    char *dst = reserve(out, len + 1);
+    if (dst)
+    {
+        va_start(args, format);
+        vsnprintf(dst, len + 1, format, args);
+        va_end(args);
+        out->size += len;
+    }
+}
+
+void output_degrees(Output *out, int64_t nano, int decimals, int width)
+{
+    uint64_t magnitude = nano < 0 ? -(uint64_t)nano : (uint64_t)nano;
+    uint64_t whole = magnitude / NANO;
+    uint64_t fraction = magnitude % NANO / powers_of_ten[9 - decimals];
+    int negative = nano < 0 && (whole || fraction);
+
+    int digits = decimals;
+    while (digits > width && fraction % 10 == 0)
+    {
+        fraction /= 10;
+        digits--;
+    }
+
+    char text[40];
+    char *start = text + sizeof(text);
+    for (int i = digits; i < width; i++)
+    {
+        *--start = '0';
+    }
+    for (int i = 0; i < digits; i++)
+    {
+        *--start = (char)('0' + fraction % 10);
+        fraction /= 10;
+    }
+    if (digits > 0 || width > 0)
+    {
+        *--start = '.';
+    }
+    start = format_uint(start, whole);
+    if (negative)
+    {
+        *--start = '-';
+    }
+    output_bytes(out, start, text + sizeof(text) - start);
+}
+
+/* Degrees of the structured formats: exact, without trailing zeros */
+static void output_coordinate(Output *out, int64_t nano)
+{
+    output_degrees(out, nano, 9, 1);
+}
+
+static void output_json_string(Output *out, const char *str)
+{
+    output_char(out, '"');
+    const char *run = str;
+    const char *p = str;
+    for (; *p != '\0'; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        output_bytes(out, run, p - run);
+        run = p + 1;
+        if (c == '"' || c == '\\')
+        {
+            output_char(out, '\\');
+            output_char(out, (char)c);
+        }
+        else if (c == '\n')
+        {
+            output_str(out, "\\n");
+        }
+        else if (c == '\t')
+        {
+            output_str(out, "\\t");
+        }
+        else
+        {
+            output_printf(out, "\\u%04x", c);
+        }
+    }
+    output_bytes(out, run, p - run);
+    output_char(out, '"');
+}
+
+static void output_csv_string(Output *out, const char *str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL)
+    {
+        output_str(out, str);
+        return;
+    }
+    output_char(out, '"');
+    for (const char *quote = strchr(str, '"'); quote != NULL; quote = strchr(str, '"'))
+    {
+        output_bytes(out, str, quote - str + 1);
+        output_char(out, '"');
+        str = quote + 1;
+    }
+    output_str(out, str);
+    output_char(out, '"');
+}
+
+void output_header(Output *out)
+{
+    if (out->format == OUTPUT_CSV)
+    {
+        output_str(out, "query,id,lat,lon,key,value\n");
+    }
+}
+
+/* Csv columns of the record up to the key: query,id,lat,lon, */
+static void output_csv_prefix(Output *out)
+{
+    output_str(out, out->query);
+    output_char(out, ',');
+    if (out->has_id)
+    {
+        output_int(out, out->id);
+    }
+    output_char(out, ',');
+    if (out->has_point)
+    {
+        output_coordinate(out, out->point[0]);
+    }
+    output_char(out, ',');
+    if (out->has_point)
+    {
+        output_coordinate(out, out->point[1]);
+    }
+    output_char(out, ',');
+}
+
+/* Start a field: its name, or in csv the row it takes up to the value */
+static void begin_field(Output *out, const char *name)
+{
+    if (out->format == OUTPUT_CSV)
+    {
+        output_csv_prefix(out);
+        output_csv_string(out, name);
+        output_char(out, ',');
+        out->has_rows = 1;
+        return;
+    }
+    if (out->has_fields)
+    {
+        output_char(out, ',');
+    }
+    output_json_string(out, name);
+    output_char(out, ':');
+    out->has_fields = 1;
+}
+
+static void end_field(Output *out)
+{
+    if (out->format == OUTPUT_CSV)
+    {
+        output_char(out, '\n');
+    }
+}
+
+void output_begin_record(Output *out, const char *query)
+{
+    out->query = query;
+    out->has_id = 0;
+    out->has_point = 0;
+    out->has_box = 0;
+    out->has_rows = 0;
+    out->has_geometry = 0;
+    out->has_fields = 1;
+    if (out->format == OUTPUT_JSON)
+    {
+        output_str(out, "{\"query\":");
+        output_json_string(out, query);
+    }
+    else if (out->format == OUTPUT_GEOJSON)
+    {
+        output_str(out, "{\"type\":\"Feature\",\"properties\":{\"query\":");
+        output_json_string(out, query);
+    }
+}
+
+void output_record_id(Output *out, int64_t id)
+{
+    out->id = id;
+    out->has_id = 1;
+    if (out->format != OUTPUT_CSV)
+    {
+        output_field_int(out, "id", id);
+    }
+}
+
+void output_record_point(Output *out, int64_t lat, int64_t lon)
+{
+    out->point[0] = lat;
+    out->point[1] = lon;
+    out->has_point = 1;
+    if (out->format == OUTPUT_JSON)
+    {
+        begin_field(out, "lat");
+        output_coordinate(out, lat);
+        begin_field(out, "lon");
+        output_coordinate(out, lon);
+    }
+}
+
+void output_record_box(Output *out, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat)
+{
+    int64_t box[4] = {min_lon, min_lat, max_lon, max_lat};
+    const char *names[4] = {"min_lon", "min_lat", "max_lon", "max_lat"};
+    memcpy(out->box, box, sizeof(box));
+    out->has_box = 1;
+    for (int i = 0; out->format != OUTPUT_GEOJSON && i < 4; i++)
+    {
+        begin_field(out, names[i]);
+        output_coordinate(out, box[i]);
+        end_field(out);
+    }
+}
+
+void output_field_int(Output *out, const char *name, int64_t value)
+{
+    begin_field(out, name);
+    output_int(out, value);
+    end_field(out);
+}
+
+void output_field_uint(Output *out, const char *name, uint64_t value)
+{
+    begin_field(out, name);
+    output_uint(out, value);
+    end_field(out);
+}
+
+void output_field_double(Output *out, const char *name, double value, int decimals)
+{
+    begin_field(out, name);
+    output_printf(out, "%.*f", decimals, value);
+    end_field(out);
+}
+
+void output_field_bool(Output *out, const char *name, int value)
+{
+    begin_field(out, name);
+    output_str(out, value ? "true" : "false");
+    end_field(out);
+}
+
+void output_field_string(Output *out, const char *name, const char *value)
+{
+    begin_field(out, name);
+    if (out->format == OUTPUT_CSV)
+    {
+        output_csv_string(out, value ? value : "");
+    }
+    else if (value)
+    {
+        output_json_string(out, value);
+    }
+    else
+    {
+        output_str(out, "null");
+    }
+    end_field(out);
+}
+
+void output_field_ids(Output *out, const char *name, const int64_t *ids, int count)
+{
+    if (out->format == OUTPUT_CSV)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            output_field_int(out, name, ids[i]);
+        }
+        return;
+    }
+    begin_field(out, name);
+    output_char(out, '[');
+    for (int i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            output_char(out, ',');
+        }
+        output_int(out, ids[i]);
+    }
+    output_char(out, ']');
+}
+
+void output_begin_object(Output *out, const char *name)
+{
+    if (out->format != OUTPUT_CSV)
+    {
+        begin_field(out, name);
+        output_char(out, '{');
+        out->has_fields = 0;
+    }
+}
+
+void output_end_object(Output *out)
+{
+    if (out->format != OUTPUT_CSV)
+    {
+        output_char(out, '}');
+        out->has_fields = 1;
+    }
+}
+
+static void output_position(Output *out, int64_t lon, int64_t lat)
+{
+    output_char(out, '[');
+    output_coordinate(out, lon);
+    output_char(out, ',');
+    output_coordinate(out, lat);
+    output_char(out, ']');
+}
+
+void output_record_line(Output *out, const int64_t *lats, const int64_t *lons, int count)
+{
+    if (out->format != OUTPUT_GEOJSON)
+    {
+        return;
+    }
+    out->has_geometry = 1;
+    if (count < 2)
+    {
+        output_str(out, "},\"geometry\":null");
+        return;
+    }
+    output_str(out, "},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[");
+    for (int i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            output_char(out, ',');
+        }
+        output_position(out, lons[i], lats[i]);
+    }
+    output_str(out, "]}");
+}
+
+void output_end_record(Output *out)
+{
+    if (out->format == OUTPUT_CSV)
+    {
+        // a record without fields still takes its row
+        if (!out->has_rows)
+        {
+            output_csv_prefix(out);
+            output_str(out, ",\n");
+        }
+        return;
+    }
+    if (out->format == OUTPUT_GEOJSON && !out->has_geometry)
+    {
+        output_str(out, "},\"geometry\":");
+        if (out->has_point)
+        {
+            output_str(out, "{\"type\":\"Point\",\"coordinates\":");
+            output_position(out, out->point[1], out->point[0]);
+            output_char(out, '}');
+        }
+        else if (out->has_box)
+        {
+            // counterclockwise from the south west corner, closed
+            int corners[5][2] = {{0, 1}, {2, 1}, {2, 3}, {0, 3}, {0, 1}};
+            output_str(out, "{\"type\":\"Polygon\",\"coordinates\":[[");
+            for (int i = 0; i < 5; i++)
+            {
+                if (i > 0)
+                {
+                    output_char(out, ',');
+                }
+                output_position(out, out->box[corners[i][0]], out->box[corners[i][1]]);
+            }
+            output_str(out, "]]}");
+        }
+        else
+        {
+            output_str(out, "null");
+        }
+    }
+    output_str(out, "}\n");
+}
@@ -0,0 +1,84 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+/* One range of a parallel loop */
+typedef struct Parallel_Task
+{
+    Parallel_Body body;
+    void *arg;
+    uint64_t begin;
+    uint64_t end;
+    int worker;
+    int result;
+} Parallel_Task;
+
+static void *run_task(void *arg)
+{
+    Parallel_Task *task = arg;
+    task->result = task->body(task->begin, task->end, task->worker, task->arg);
+    return NULL;
+}
+
+int parallel_num_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        return 1;
+    }
+    return cpus > PARALLEL_MAX_WORKERS ? PARALLEL_MAX_WORKERS : (int)cpus;
+}
+
+int parallel_for(uint64_t count, uint64_t min_chunk, Parallel_Body body, void *arg)
+{
+    uint64_t workers = parallel_num_workers();
+    if (min_chunk > 0 && count / min_chunk < workers)
+    {
+        workers = count / min_chunk;
+    }
+    if (workers <= 1)
+    {
+        return body(0, count, 0, arg);
+    }
+
+    Parallel_Task tasks[PARALLEL_MAX_WORKERS];
+    pthread_t threads[PARALLEL_MAX_WORKERS];
+    int started[PARALLEL_MAX_WORKERS];
+
+    for (uint64_t w = 0; w < workers; w++)
+    {
+        tasks[w].body = body;
+        tasks[w].arg = arg;
+        tasks[w].begin = count * w / workers;
+        tasks[w].end = count * (w + 1) / workers;
+        tasks[w].worker = w;
+        tasks[w].result = 0;
+    }
+
+    // a worker that cannot be started runs its range on the calling thread instead
+    for (uint64_t w = 1; w < workers; w++)
+    {
+        started[w] = pthread_create(&threads[w], NULL, run_task, &tasks[w]) == 0;
+    }
+    run_task(&tasks[0]);
+
+    int result = tasks[0].result;
+    for (uint64_t w = 1; w < workers; w++)
+    {
+        if (started[w])
+        {
+            pthread_join(threads[w], NULL);
+        }
+        else
+        {
+            run_task(&tasks[w]);
+        }
+        if (tasks[w].result == -1)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -1,8 +1,27 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "arena.h"
+#include "blob_index.h"
 #include "config.h"
+#include "kdtree.h"
+#include "lazy_map.h"
 #include "osm.h"
+#include "parallel.h"
+#include "rtree.h"
+#include "string_pool.h"
+#include "varint.h"
+
+#define MAP_ARENA_CHUNK (1024 * 1024)
+#define SCRATCH_ARENA_CHUNK (4 * 1024 * 1024)
+#define MIN_WAYS_PER_WORKER 4096
+#define MIN_QUERIES_PER_WORKER 256
+#define MIN_REFS_PER_WORKER 65536
+#define MIN_KEYS_PER_WORKER 256
+#define MIN_NODES_PER_WORKER 65536
 
 /* OSM Data Structures */
 
@@ -11,23 +30,87 @@ struct OSM_Node
     OSM_Id id;
     OSM_Lat lat;
     OSM_Lon lon;
-    struct OSM_Node *next;
-    PB_Message string_table; // pointer for this node's specific string table
 };
 
+/* String table of a PrimitiveBlock, copied out of the block message */
+typedef struct OSM_StringTable
+{
+    uint32_t count;
+    char **strings; // NUL terminated
+} OSM_StringTable;
+
+/* A PrimitiveBlock being decoded and the handler receiving its entities */
+typedef struct OSM_Block
+{
+    Arena *scratch;
+    const OSM_Handler *handler;
+    OSM_StringTable *strings; // NULL unless a callback receives strings
+    int64_t lat_offset;
+    int64_t lon_offset;
+    int32_t granularity;
+} OSM_Block;
+
+/* Map loader state for the strings of the block being decoded */
+typedef struct OSM_BlockStrings
+{
+    char **strings;     // string table the state is for, NULL until the block's first way
+    uint32_t *interned; // per string index: its id in the map's pool, interned once a kept way needs it
+    uint8_t *kept_keys; // per string index: 1 if the tag projection keeps that key (NULL keeps all)
+} OSM_BlockStrings;
+
+/* Shared buffer holding the refs of every way in their packed, delta-varint form */
+typedef struct OSM_RefStore
+{
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+} OSM_RefStore;
+
 struct OSM_Way
 {
     OSM_Id id;
+    OSM_Map *map;         // map whose ref store and string pool hold the refs and tags (a cached blob of a lazy map)
     uint32_t *keys;
-    int64_t keys_count;
     uint32_t *values;
-    int64_t vals_count;
-    int64_t *refs;
-    int64_t refs_count; // number of refs
-    struct OSM_Way *next;
-    PB_Message string_table; // pointer for this ways specific string table
+    int32_t keys_count;
+    int32_t vals_count;
+    uint64_t refs_offset; // offset of this way's packed refs in the map's ref store
+    uint32_t refs_size;   // size of this way's packed refs in bytes
+    int32_t refs_count;   // number of refs
 };
 
+/* Posting list: ascending way positions as zig-zag delta varints (the layout of way refs) */
+typedef struct Tag_Postings
+{
+    uint64_t offset; // in the index buffer
+    uint32_t size;   // bytes
+    uint32_t count;  // positions
+} Tag_Postings;
+
+/* Postings of one (key, value) pair */
+typedef struct Tag_PairPostings
+{
+    uint32_t value; // pool id
+    Tag_Postings postings;
+} Tag_PairPostings;
+
+/* Inverted index from interned keys and (key, value) pairs to the ways carrying them */
+typedef struct OSM_TagIndex
+{
+    uint32_t num_keys;          // pool ids covered
+    Tag_Postings *keys;         // by key id
+    uint64_t *pair_start;       // pairs of key k are pairs[pair_start[k] .. pair_start[k + 1]], by value id
+    Tag_PairPostings *pairs;
+    OSM_RefStore buf;           // every posting list back to back
+} OSM_TagIndex;
+
+/* Entry of the node location store: an id and the node's position in the nodes array */
+typedef struct OSM_NodeLocation
+{
+    OSM_Id id;
+    uint64_t position;
+} OSM_NodeLocation;
+
 struct OSM_BBox
 {
     // storing as nanodegrees that are already zig zag decoded
@@ -37,15 +120,57 @@ struct OSM_BBox
     OSM_Lat max_lat;
 };
 
+/* Extent of no node at all, every min/max comparison replaces it */
+static const OSM_BBox empty_extent = {INT64_MAX, INT64_MIN, INT64_MAX, INT64_MIN};
+
 struct OSM_Map
 {
+    Arena *arena;   // owns the bbox, way keys/values and interned strings
+    Arena *scratch; // protobuf messages of the blob being decoded, reset per blob
     OSM_BBox *BBox;
-    OSM_Node *nodes; // singly linked list
-    OSM_Node *nodes_tail;
-    OSM_Way *ways; // singly linked list
-    OSM_Way *ways_tail;
+    OSM_BBox node_extent; // min/max of the node coordinates decoded so far, merged block by block
+    OSM_Node *nodes; // array, grown geometrically and kept across resets
+    uint64_t nodes_capacity;
+    OSM_Way *ways; // array, grown geometrically and kept across resets
+    uint64_t ways_capacity;
+    OSM_RefStore *ref_store;
+    OSM_StringPool *strings; // tag strings of every way, kept across resets
+    int32_t *node_versions; // parallel to nodes, only when metadata is decoded
+    uint64_t node_versions_capacity;
+    int32_t *way_versions; // parallel to ways, only when metadata is decoded
+    uint64_t way_versions_capacity;
+    const OSM_ReadOptions *options; // options of the load in progress
+    OSM_BlockStrings block;         // string state of the block the load is decoding
+    int entities;                   // OSM_READ_* decoded by the load in progress
+    int counted;                    // OSM_READ_* counted instead of decoded by the last load
+    int summarized;                 // the last load counted every entity and tag into summary
+    OSM_Summary summary;
+    OSM_LazySource *lazy;           // set for maps opened with OSM_open_Map_lazy
+    OSM_BlobIndex *blob_index;      // sidecar recorded during a full load of a seekable stream
+    OSM_RTree *node_tree;           // spatial index over nodes, built by the first bbox query
+    OSM_NodeLocation *node_locations; // nodes sorted by id, only needed when nodes_unsorted
+    OSM_RTreeBox *way_boxes;        // packed bbox of every way, parallel to ways
+    OSM_RTree *way_tree;            // spatial index over way_boxes
+    OSM_KDTree *node_kdtree;        // nearest neighbour index over nodes
+    uint64_t *node_way_offsets;     // CSR reverse index: ways of node position p are
+    uint32_t *node_ways;            // node_ways[node_way_offsets[p] .. node_way_offsets[p + 1]]
+    OSM_TagIndex *tag_index;        // inverted tag index, only when asked for
+    int nodes_unsorted;             // node ids were not appended in ascending order
+    int ways_unsorted;              // way ids were not appended in ascending order
     uint64_t num_nodes;
     uint64_t num_ways;
+    void *mapping;                  // set when entity arrays and indexes point into a mapped snapshot
+    size_t mapping_size;
+};
+
+/* Everything, the behaviour of OSM_read_Map */
+static const OSM_ReadOptions default_options = {
+    .entities = OSM_READ_NODES | OSM_READ_WAYS,
+    .decode_tags = 1,
+    .tag_keys = NULL,
+    .decode_metadata = 0,
+    .way_filter = NULL,
+    .filter_arg = NULL,
 };
 
 /* Helper Functions */
@@ -110,623 +235,4852 @@ PB_Field *PB_get_FIRST__field(PB_Message msg, int fnum, PB_WireType type)
     return NULL;
 }
 
-/* Handlers for the incredibly nested PrimitiveGroup messages in Protobuf format.*/
+/* Append packed refs to the shared ref store, growing it geometrically */
+int ref_store_append(OSM_RefStore *store, const uint8_t *bytes, size_t len)
+{
+    if (store->size + len > store->capacity)
+    {
+        size_t new_capacity = store->capacity ? store->capacity : 4096;
+        while (new_capacity < store->size + len)
+        {
+            new_capacity *= 2;
+        }
+
+        uint8_t *new_buf = realloc(store->buf, new_capacity);
+        if (!new_buf)
+        {
+            return -1;
+        }
+        store->buf = new_buf;
+        store->capacity = new_capacity;
+    }
+
+    memcpy(store->buf + store->size, bytes, len);
+    store->size += len;
+    return 0;
+}
 
-int64_t handle_NODE(OSM_Map *map, PB_Message prim_group, int64_t lat_offset, int64_t lon_offset, int32_t granularity, PB_Message stringtable)
+/* Reserve the next n slots of a growable entity array, returns NULL when out of memory */
+void *push_entities(void **array, uint64_t *capacity, uint64_t count, uint64_t n, size_t size)
 {
-    PB_Field *current = prim_group;
-    current = current->next; // skip Sentinel Node
+    if (count + n > *capacity)
+    {
+        uint64_t new_capacity = *capacity ? *capacity * 2 : 1024;
+        while (new_capacity < count + n)
+        {
+            new_capacity *= 2;
+        }
+        void *new_array = realloc(*array, new_capacity * size);
+        if (!new_array)
+        {
+            return NULL;
+        }
+        *array = new_array;
+        *capacity = new_capacity;
+    }
+    return (char *)*array + count * size;
+}
+
+/* Reserve the next slot of a growable entity array, returns NULL when out of memory */
+void *push_entity(void **array, uint64_t *capacity, uint64_t count, size_t size)
+{
+    return push_entities(array, capacity, count, 1, size);
+}
+
+OSM_Node *push_node(OSM_Map *map)
+{
+    return push_entity((void **)&map->nodes, &map->nodes_capacity, map->num_nodes, sizeof(OSM_Node));
+}
+
+OSM_Way *push_way(OSM_Map *map)
+{
+    return push_entity((void **)&map->ways, &map->ways_capacity, map->num_ways, sizeof(OSM_Way));
+}
 
-    int64_t node_count = 0;
+/* Track whether node ids keep arriving in ascending order (binary searchable) */
+void note_node_order(OSM_Map *map, OSM_Id id)
+{
+    if (map->num_nodes > 0 && map->nodes[map->num_nodes - 1].id > id)
+    {
+        map->nodes_unsorted = 1;
+    }
+}
+
+/* Copy a block's string table message into NUL terminated strings allocated from arena */
+OSM_StringTable *copy_string_table(Arena *arena, PB_Message msg)
+{
+    OSM_StringTable *table = arena_alloc(arena, sizeof(OSM_StringTable));
+    if (!table)
+    {
+        return NULL;
+    }
 
-    if (current->number == 1)
-    { // another check to ensure its NODE
+    table->count = count(msg, 1, LEN_TYPE);
+    table->strings = arena_alloc(arena, sizeof(char *) * (table->count + 1));
+    if (!table->strings)
+    {
+        return NULL;
+    }
 
-        while (current != NULL && current->type != 8)
+    uint32_t index = 0;
+    PB_Field *current = msg->next; // skip sentinel
+    while (current != NULL && current->type != 8 && index < table->count)
+    {
+        if (current->number == 1 && current->type == LEN_TYPE)
         {
-            PB_Message curr_node = NULL;
-            int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
-            if (embedded_read_result == -1)
+            table->strings[index] = arena_strndup(arena, current->value.bytes.buf, current->value.bytes.size);
+            if (!table->strings[index])
             {
-                return -1;
+                return NULL;
             }
+            index++;
+        }
+        current = current->next;
+    }
+    return table;
+}
 
-            // sint64 id
-            PB_Field *id = PB_get_field(curr_node, 1, VARINT_TYPE);
-            if (!id)
-            {
-                return -1;
-            }
+/* Pool id of a block's string, interning it on first use */
+uint32_t intern_block_string(OSM_Map *map, OSM_BlockStrings *strings, uint32_t index)
+{
+    if (strings->interned[index] == STRING_POOL_NONE)
+    {
+        const char *str = strings->strings[index];
+        strings->interned[index] = string_pool_intern(map->strings, map->arena, str, strlen(str));
+    }
+    return strings->interned[index];
+}
 
-            // sint64 lat
-            PB_Field *lat = PB_get_field(curr_node, 8, VARINT_TYPE);
-            if (!lat)
-            {
-                return -1;
-            }
+/* Mark the string indices of a block that match the keys kept by the tag projection */
+uint8_t *build_kept_keys(Arena *arena, char **strings, uint32_t num_strings, const char **tag_keys)
+{
+    uint8_t *kept = arena_alloc(arena, num_strings + 1);
+    if (!kept)
+    {
+        return NULL;
+    }
 
-            // sint64 lon
-            PB_Field *lon = PB_get_field(curr_node, 9, VARINT_TYPE);
-            if (!lon)
+    for (uint32_t i = 0; i < num_strings; i++)
+    {
+        kept[i] = 0;
+        for (const char **key = tag_keys; *key != NULL; key++)
+        {
+            if (strcmp(strings[i], *key) == 0)
             {
-                return 1;
+                kept[i] = 1;
+                break;
             }
+        }
+    }
+    return kept;
+}
+
+/* Read the version out of an Info message (field 1), -1 if absent */
+int32_t read_info_version(PB_Field *info_field)
+{
+    PB_Message info = NULL;
+    if (!info_field || PB_read_embedded_message(info_field->value.bytes.buf, info_field->value.bytes.size, &info) == -1)
+    {
+        return -1;
+    }
+
+    PB_Field *version = PB_get_field(info, 1, VARINT_TYPE);
+    return version ? (int32_t)version->value.i64 : -1;
+}
 
-            // create Node
-            OSM_Node *node = malloc(sizeof(OSM_Node));
-            node->id = id->value.i64; // don't zigzag decode?
-            node->string_table = stringtable;
+/* Store the version of the entity just pushed at index */
+int push_version(int32_t **versions, uint64_t *capacity, uint64_t index, int32_t version)
+{
+    int32_t *slot = push_entity((void **)versions, capacity, index, sizeof(int32_t));
+    if (!slot)
+    {
+        return -1;
+    }
+    *slot = version;
+    return 0;
+}
 
-            // handle latitutde and longitude. the offsets are int64 values
-            // the lat and lon gotten here from Node, are sint64, so decode first
-            // then apply transformation ig.
+/* Handlers for the incredibly nested PrimitiveGroup messages in Protobuf format.*/
 
-            // dont do 0.0000...1 here since ill divide in the process since this is an int!!!!!!!!!
-            int64_t new_lon = (lon_offset + (granularity * zigzag(lon->value.i64)));
-            int64_t new_lat = (lat_offset + (granularity * zigzag(lat->value.i64)));
+/* Grow extent to cover other */
+void merge_extent(OSM_BBox *extent, const OSM_BBox *other)
+{
+    extent->min_lon = other->min_lon < extent->min_lon ? other->min_lon : extent->min_lon;
+    extent->max_lon = other->max_lon > extent->max_lon ? other->max_lon : extent->max_lon;
+    extent->min_lat = other->min_lat < extent->min_lat ? other->min_lat : extent->min_lat;
+    extent->max_lat = other->max_lat > extent->max_lat ? other->max_lat : extent->max_lat;
+}
 
-            node->lat = new_lat;
-            node->lon = new_lon;
+/* Values of the varint field fnum of entity (packed or not) into a scratch array, each below limit. Returns the count, -1 on error */
+int64_t read_indices(Arena *scratch, PB_Message entity, int fnum, uint32_t limit, uint32_t **indicesp)
+{
+    if (PB_expand_packed_fields(entity, fnum, VARINT_TYPE) == -1)
+    {
+        return -1;
+    }
 
-            // linked list of OSM_NODE
-            if (!map->nodes)
-            {
-                map->nodes = node;
-                map->nodes_tail = node;
-            }
-            else
-            {
-                map->nodes_tail->next = node;
-                map->nodes_tail = node;
-            }
+    int32_t index_count = count(entity, fnum, VARINT_TYPE);
+    uint32_t *indices = arena_alloc(scratch, sizeof(uint32_t) * (index_count + 1));
+    if (!indices)
+    {
+        return -1;
+    }
 
-            node_count += 1;
-            current = current->next;
+    int32_t index = 0;
+    PB_Field *current_field = PB_get_FIRST__field(entity, fnum, VARINT_TYPE);
+    while (current_field != NULL && index < index_count)
+    {
+        if (current_field->value.i64 >= limit)
+        {
+            return -1;
         }
-        return node_count;
+        indices[index] = (uint32_t)current_field->value.i64;
+        index += 1;
+        current_field = PB_next_field(current_field, fnum, VARINT_TYPE, FORWARD_DIR);
     }
-    else
+
+    *indicesp = indices;
+    return index_count;
+}
+
+/* Tags (keys field 2, values field 3) of a Node, Way or Relation message, as indices into the block's strings */
+int read_entity_tags(OSM_Block *block, PB_Message entity, int *num_tagsp, uint32_t **keysp, uint32_t **valuesp)
+{
+    int64_t key_count = read_indices(block->scratch, entity, 2, block->strings->count, keysp);
+    int64_t val_count = read_indices(block->scratch, entity, 3, block->strings->count, valuesp);
+    if (key_count == -1 || key_count != val_count)
     {
         return -1;
     }
+    *num_tagsp = key_count;
+    return 0;
 }
 
-int64_t handle_WAY(OSM_Map *map, PB_Message prim_group, PB_Message stringtable)
+int handle_NODE(OSM_Block *block, PB_Message prim_group)
 {
+    const OSM_Handler *handler = block->handler;
+
     PB_Field *current = prim_group;
     current = current->next; // skip Sentinel Node
 
-    int64_t way_count = 0;
+    while (current != NULL && current->type != 8)
+    {
+        PB_Message curr_node = NULL;
+        int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
+        if (embedded_read_result == -1)
+        {
+            return -1;
+        }
 
-    if (current->number == 3)
-    { // another check to ensure its WAY
+        // sint64 id
+        PB_Field *id = PB_get_field(curr_node, 1, VARINT_TYPE);
+        if (!id)
+        {
+            return -1;
+        }
 
-        while (current != NULL && current->type != 8)
+        // sint64 lat
+        PB_Field *lat = PB_get_field(curr_node, 8, VARINT_TYPE);
+        if (!lat)
         {
-            PB_Message curr_node = NULL;
-            int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
-            if (embedded_read_result == -1)
-            {
-                return -1;
-            }
+            return -1;
+        }
 
-            // expand keys and vals
-            int a = PB_expand_packed_fields(curr_node, 2, VARINT_TYPE);
-            if (a == -1)
-            {
-                return -1;
-            }
-            int b = PB_expand_packed_fields(curr_node, 3, VARINT_TYPE);
-            if (b == -1)
-            {
-                return -1;
-            }
+        // sint64 lon
+        PB_Field *lon = PB_get_field(curr_node, 9, VARINT_TYPE);
+        if (!lon)
+        {
+            return -1;
+        }
+
+        OSM_NodeEvent node = {0};
+        node.id = id->value.i64; // don't zigzag decode?
 
-            int32_t key_count = count(curr_node, 2, VARINT_TYPE);
-            int32_t val_count = count(curr_node, 3, VARINT_TYPE);
+        // handle latitutde and longitude. the offsets are int64 values
+        // the lat and lon gotten here from Node, are sint64, so decode first
+        // then apply transformation ig.
 
-            if (key_count != val_count)
+        // dont do 0.0000...1 here since ill divide in the process since this is an int!!!!!!!!!
+        node.lon = (block->lon_offset + (block->granularity * zigzag(lon->value.i64)));
+        node.lat = (block->lat_offset + (block->granularity * zigzag(lat->value.i64)));
+
+        node.version = handler->decode_metadata ? read_info_version(PB_get_field(curr_node, 4, LEN_TYPE)) : -1;
+
+        if (handler->node_tags)
+        {
+            uint32_t *keys = NULL;
+            uint32_t *values = NULL;
+            if (read_entity_tags(block, curr_node, &node.num_tags, &keys, &values) == -1)
             {
                 return -1;
             }
+            node.keys = keys;
+            node.values = values;
+            node.strings = block->strings->strings;
+            node.num_strings = block->strings->count;
+        }
 
-            OSM_Way *way = malloc(sizeof(OSM_Way));
+        int result = handler->on_node(&node, handler->arg);
+        if (result != 0)
+        {
+            return result;
+        }
+        current = current->next;
+    }
+    return 0;
+}
 
-            way->keys = malloc(sizeof(uint32_t) * key_count);
-            way->values = malloc(sizeof(uint32_t) * val_count);
+int handle_WAY(OSM_Block *block, PB_Message prim_group)
+{
+    const OSM_Handler *handler = block->handler;
 
-            way->keys_count = key_count;
-            way->vals_count = val_count;
+    PB_Field *current = prim_group;
+    current = current->next; // skip Sentinel Node
 
-            int key_index = 0;
-            int val_index = 0;
+    while (current != NULL && current->type != 8)
+    {
+        PB_Message curr_node = NULL;
+        int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
+        if (embedded_read_result == -1)
+        {
+            return -1;
+        }
 
-            PB_Field *current_key_field = PB_get_FIRST__field(curr_node, 2, VARINT_TYPE);
-            while (current_key_field != NULL && key_index < key_count)
-            {
-                way->keys[key_index] = (uint32_t)current_key_field->value.i64;
-                key_index += 1;
-                current_key_field = PB_next_field(current_key_field, 2, VARINT_TYPE, FORWARD_DIR);
-                // current_key_field = PB_next_field(current_key_field, 2, VARINT_TYPE, BACKWARD_DIR);
-            }
+        // sint64 id
+        PB_Field *id = PB_get_field(curr_node, 1, VARINT_TYPE);
+        if (!id)
+        {
+            return -1;
+        }
 
-            PB_Field *current_val_field = PB_get_FIRST__field(curr_node, 3, VARINT_TYPE);
-            while (current_val_field != NULL && val_index < val_count)
-            {
-                way->values[val_index] = (uint32_t)current_val_field->value.i64;
-                val_index += 1;
-                current_val_field = PB_next_field(current_val_field, 3, VARINT_TYPE, FORWARD_DIR);
-                // current_val_field = PB_next_field(current_val_field, 3, VARINT_TYPE, BACKWARD_DIR);
-            }
+        OSM_WayEvent way = {0};
+        way.id = (int64_t)id->value.i64;
+        way.strings = block->strings->strings;
+        way.num_strings = block->strings->count;
+
+        uint32_t *keys = NULL;
+        uint32_t *values = NULL;
+        if (read_entity_tags(block, curr_node, &way.num_tags, &keys, &values) == -1)
+        {
+            return -1;
+        }
+        way.keys = keys;
+        way.values = values;
 
-            int c = PB_expand_packed_fields(curr_node, 8, VARINT_TYPE);
-            if (c == -1)
+        // refs stay packed (zig-zag delta varints)
+        PB_Field *packed_refs = PB_get_field(curr_node, 8, LEN_TYPE);
+        if (packed_refs)
+        {
+            way.refs = (const uint8_t *)packed_refs->value.bytes.buf;
+            way.refs_size = packed_refs->value.bytes.size;
+        }
+        else
+        {
+            // refs written unpacked, re-encode them so every way has one layout
+            uint8_t *encoded = arena_alloc(block->scratch, VARINT_MAX_BYTES * (count(curr_node, 8, VARINT_TYPE) + 1));
+            if (!encoded)
             {
                 return -1;
             }
-
-            int32_t ref_count = count(curr_node, 8, VARINT_TYPE);
-            int32_t ref_index = 0;
-            way->refs = malloc(sizeof(int64_t) * ref_count);
-            way->refs_count = ref_count;
-
             PB_Field *current_ref_field = PB_get_FIRST__field(curr_node, 8, VARINT_TYPE);
-            int64_t total = 0;
-            while (current_ref_field != NULL && ref_index < ref_count)
+            while (current_ref_field != NULL)
             {
-                int64_t delta = zigzag(current_ref_field->value.i64);
-                total += delta;
-                way->refs[ref_index] = total;
-                ref_index += 1;
+                way.refs_size += varint_encode(current_ref_field->value.i64, encoded + way.refs_size);
                 current_ref_field = PB_next_field(current_ref_field, 8, VARINT_TYPE, FORWARD_DIR);
-                // current_ref_field = PB_next_field(current_ref_field, 8, VARINT_TYPE, BACKWARD_DIR);
             }
+            way.refs = encoded;
+        }
+        way.num_refs = varint_count(way.refs, way.refs_size);
 
-            // sint64 id
-            PB_Field *id = PB_get_field(curr_node, 1, VARINT_TYPE);
-            if (!id)
-            {
-                return -1;
-            }
+        way.version = handler->decode_metadata ? read_info_version(PB_get_field(curr_node, 4, LEN_TYPE)) : -1;
 
-            way->id = (int64_t)id->value.i64;
-            way->string_table = stringtable;
-            way->next = NULL;
-            way_count += 1;
+        int result = handler->on_way(&way, handler->arg);
+        if (result != 0)
+        {
+            return result;
+        }
+        current = current->next;
+    }
+    return 0;
+}
 
-            if (!map->ways)
-            {
-                map->ways = way;
-                map->ways_tail = way;
-            }
-            else
-            {
-                map->ways_tail->next = way;
-                map->ways_tail = way;
-            }
-            current = current->next;
+/* Running totals of the delta coded varint column fnum of a DenseNodes message into a scratch array. Returns the count, -1 on error */
+int64_t read_dense_column(Arena *scratch, PB_Message dense, int fnum, int64_t **totalsp)
+{
+    PB_Field *packed = NULL;
+    int occurrences = 0;
+    for (PB_Field *field = dense->next; field != NULL && field->type != SENTINEL_TYPE; field = field->next)
+    {
+        if (field->number == fnum)
+        {
+            packed = field->type == LEN_TYPE ? field : packed;
+            occurrences += 1;
         }
-        return way_count;
     }
-    else
+
+    // a column is normally one packed field: decode its bytes in place rather than expanding a field per value
+    if (occurrences == 1 && packed)
+    {
+        const uint8_t *buf = (const uint8_t *)packed->value.bytes.buf;
+        size_t size = packed->value.bytes.size;
+        size_t column_count = varint_count(buf, size);
+        int64_t *totals = arena_alloc(scratch, sizeof(int64_t) * (column_count + 1));
+        if (!totals || (size > 0 && (buf[size - 1] & 0x80)) || varint_decode_deltas(buf, size, totals, column_count) != column_count)
+        {
+            return -1;
+        }
+        *totalsp = totals;
+        return column_count;
+    }
+
+    if (PB_expand_packed_fields(dense, fnum, VARINT_TYPE) == -1)
+    {
+        return -1;
+    }
+    int32_t column_count = count(dense, fnum, VARINT_TYPE);
+    int64_t *totals = arena_alloc(scratch, sizeof(int64_t) * (column_count + 1));
+    if (!totals)
     {
         return -1;
     }
+    int64_t total = 0;
+    int32_t index = 0;
+    for (PB_Field *field = PB_get_FIRST__field(dense, fnum, VARINT_TYPE); field != NULL && index < column_count;
+         field = PB_next_field(field, fnum, VARINT_TYPE, FORWARD_DIR))
+    {
+        total += zigzag(field->value.i64);
+        totals[index++] = total;
+    }
+    *totalsp = totals;
+    return column_count;
 }
 
-int64_t handle_DENSE(OSM_Map *map, PB_Message prim_group, int64_t lat_offset, int64_t lon_offset, int32_t granularity, PB_Message stringtable)
+int handle_DENSE(OSM_Block *block, PB_Message prim_group)
 {
+    const OSM_Handler *handler = block->handler;
+
     PB_Field *current = prim_group;
     current = current->next; // skip Sentinel Node
 
-    int64_t node_count = 0;
-
-    if (current->number == 2)
-    { // another check to ensure its DENSE
+    while (current != NULL && current->type != 8)
+    {
+        PB_Message curr_node = NULL;
+        int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
+        if (embedded_read_result == -1)
+        {
+            return -1;
+        }
 
-        while (current != NULL && current->type != 8)
+        int64_t *ids = NULL;
+        int64_t *lats = NULL;
+        int64_t *lons = NULL;
+        int64_t id_count = read_dense_column(block->scratch, curr_node, 1, &ids);
+        int64_t lat_count = read_dense_column(block->scratch, curr_node, 8, &lats);
+        int64_t lon_count = read_dense_column(block->scratch, curr_node, 9, &lons);
+        if (id_count == -1 || id_count != lat_count || id_count != lon_count)
         {
-            PB_Message curr_node = NULL;
-            int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_node);
-            if (embedded_read_result == -1)
-            {
-                return -1;
-            }
+            return -1;
+        }
 
-            // expand INT IDS
-            int a = PB_expand_packed_fields(curr_node, 1, VARINT_TYPE);
-            if (a == -1)
+        // versions are packed, not delta coded, in DenseInfo (field 5)
+        PB_Field *current_version_field = NULL;
+        if (handler->decode_metadata)
+        {
+            PB_Field *dense_info_field = PB_get_field(curr_node, 5, LEN_TYPE);
+            PB_Message dense_info = NULL;
+            if (dense_info_field &&
+                PB_read_embedded_message(dense_info_field->value.bytes.buf, dense_info_field->value.bytes.size, &dense_info) != -1 &&
+                PB_expand_packed_fields(dense_info, 1, VARINT_TYPE) != -1)
             {
-                return -1;
+                current_version_field = PB_get_FIRST__field(dense_info, 1, VARINT_TYPE);
             }
+        }
 
-            int b = PB_expand_packed_fields(curr_node, 8, VARINT_TYPE);
-            if (b == -1)
-            {
-                return -1;
-            }
-            int c = PB_expand_packed_fields(curr_node, 9, VARINT_TYPE);
-            if (c == -1)
+        // tags of all nodes are in keys_vals (field 10): key, value pairs, each node's ending with a 0
+        PB_Field *current_tag_field = NULL;
+        uint32_t *keys = NULL;
+        uint32_t *values = NULL;
+        if (handler->node_tags)
+        {
+            if (PB_expand_packed_fields(curr_node, 10, VARINT_TYPE) == -1)
             {
                 return -1;
             }
-            int32_t id_count = count(curr_node, 1, VARINT_TYPE);
-            int32_t lat_count = count(curr_node, 8, VARINT_TYPE);
-            int32_t lon_count = count(curr_node, 9, VARINT_TYPE);
-
-            if (id_count != lat_count || id_count != lon_count || lat_count != lon_count)
+            int32_t max_tags = count(curr_node, 10, VARINT_TYPE) / 2 + 1;
+            keys = arena_alloc(block->scratch, sizeof(uint32_t) * max_tags);
+            values = arena_alloc(block->scratch, sizeof(uint32_t) * max_tags);
+            if (!keys || !values)
             {
                 return -1;
             }
+            current_tag_field = PB_get_FIRST__field(curr_node, 10, VARINT_TYPE);
+        }
 
-            int64_t id_total = 0;
-            int64_t lat_total = 0;
-            int64_t lon_total = 0;
-
-            PB_Field *current_id_field = PB_get_FIRST__field(curr_node, 1, VARINT_TYPE);
-
-            PB_Field *current_lon_field = PB_get_FIRST__field(curr_node, 9, VARINT_TYPE);
+        OSM_NodeEvent node = {0};
+        node.version = -1;
+        node.keys = keys;
+        node.values = values;
+        if (block->strings)
+        {
+            node.strings = block->strings->strings;
+            node.num_strings = block->strings->count;
+        }
 
-            PB_Field *current_lat_field = PB_get_FIRST__field(curr_node, 8, VARINT_TYPE);
+        for (int64_t x = 0; x < id_count; x++)
+        {
+            node.id = ids[x];
+            node.lon = (block->lon_offset + (block->granularity * lons[x]));
+            node.lat = (block->lat_offset + (block->granularity * lats[x]));
 
-            for (int64_t x = 0; x < id_count; x++)
+            if (current_version_field)
             {
-                int64_t id_delta = zigzag(current_id_field->value.i64);
-                int64_t lon_delta = zigzag(current_lon_field->value.i64);
-                int64_t lat_delta = zigzag(current_lat_field->value.i64);
-
-                id_total += id_delta;
-                lat_total += lat_delta;
-                lon_total += lon_delta;
-
-                int64_t new_lon = (lon_offset + (granularity * lon_total));
-                int64_t new_lat = (lat_offset + (granularity * lat_total));
-
-                OSM_Node *node = malloc(sizeof(OSM_Node));
-                node->id = id_total;
-                node->lat = new_lat;
-                node->lon = new_lon;
-                node->string_table = stringtable;
+                node.version = (int32_t)current_version_field->value.i64;
+                current_version_field = PB_next_field(current_version_field, 1, VARINT_TYPE, FORWARD_DIR);
+            }
 
-                if (!map->nodes)
-                {
-                    map->nodes = node;
-                    map->nodes_tail = node;
-                }
-                else
+            node.num_tags = 0;
+            while (current_tag_field != NULL && current_tag_field->value.i64 != 0)
+            {
+                PB_Field *value_field = PB_next_field(current_tag_field, 10, VARINT_TYPE, FORWARD_DIR);
+                if (!value_field || current_tag_field->value.i64 >= node.num_strings || value_field->value.i64 >= node.num_strings)
                 {
-                    map->nodes_tail->next = node;
-                    map->nodes_tail = node;
+                    return -1;
                 }
-                node_count += 1;
-
-                current_id_field = PB_next_field(current_id_field, 1, VARINT_TYPE, FORWARD_DIR);
-
-                current_lon_field = PB_next_field(current_lon_field, 9, VARINT_TYPE, FORWARD_DIR);
-
-                current_lat_field = PB_next_field(current_lat_field, 8, VARINT_TYPE, FORWARD_DIR);
+                keys[node.num_tags] = (uint32_t)current_tag_field->value.i64;
+                values[node.num_tags] = (uint32_t)value_field->value.i64;
+                node.num_tags += 1;
+                current_tag_field = PB_next_field(value_field, 10, VARINT_TYPE, FORWARD_DIR);
+            }
+            if (current_tag_field)
+            {
+                current_tag_field = PB_next_field(current_tag_field, 10, VARINT_TYPE, FORWARD_DIR); // the 0 ending this node's tags
             }
 
-            current = current->next;
+            int result = handler->on_node(&node, handler->arg);
+            if (result != 0)
+            {
+                return result;
+            }
         }
-        return node_count;
-    }
-    else
-    {
-        return -1;
+
+        current = current->next;
     }
+    return 0;
 }
 
-/* Parse an entire OSM Map from a file stream */
-OSM_Map *OSM_read_Map(FILE *in)
+int handle_RELATION(OSM_Block *block, PB_Message prim_group)
 {
+    const OSM_Handler *handler = block->handler;
 
-    OSM_Map *map = malloc(sizeof(OSM_Map));
-    int header_done = 0;
-    map->num_nodes = 0;
-    map->num_ways = 0;
+    PB_Field *current = prim_group;
+    current = current->next; // skip Sentinel Node
 
-    while (1)
+    while (current != NULL && current->type != 8)
     {
-        // ------------HEADER---------------------
-        uint32_t header_length = 0;
-        size_t bytes_read = fread(&header_length, 1, sizeof(header_length), in); // network byte order
-        if (bytes_read != sizeof(header_length))
+        PB_Message curr_relation = NULL;
+        int embedded_read_result = PB_read_embedded_message(current->value.bytes.buf, current->value.bytes.size, &curr_relation);
+        if (embedded_read_result == -1)
         {
-            if (feof(in))
-            {
-                return map;
-            }
-            return NULL;
+            return -1;
         }
-        // convert to little endian
-        //  0x12345678 =>
-        int first = header_length & 0x000000FF;
-        int second = (header_length & 0x0000FF00) >> 8;
-        int third = (header_length & 0x00FF0000) >> 16;
-        int forth = (header_length & 0xFF000000) >> 24;
-
-        // concatenate back
-        uint32_t final_length = (first << 24) | (second << 16) | (third << 8) | forth;
-        // ------------HEADER---------------------
 
-        PB_Message blob_header = malloc(sizeof(PB_Message));
+        // int64 id
+        PB_Field *id = PB_get_field(curr_relation, 1, VARINT_TYPE);
+        if (!id)
+        {
+            return -1;
+        }
 
-        int result = PB_read_message(in, final_length, &blob_header); // get the 'BlobHeader'
+        OSM_RelationEvent relation = {0};
+        relation.id = (int64_t)id->value.i64;
+        relation.strings = block->strings->strings;
+        relation.num_strings = block->strings->count;
 
-        if (result == -1 || result == 0)
+        uint32_t *keys = NULL;
+        uint32_t *values = NULL;
+        if (read_entity_tags(block, curr_relation, &relation.num_tags, &keys, &values) == -1)
         {
+            return -1;
+        }
+        relation.keys = keys;
+        relation.values = values;
+
+        // members: roles_sid (field 8), delta coded memids (field 9) and types (field 10), one each per member
+        uint32_t *roles = NULL;
+        uint32_t *types = NULL;
+        int64_t role_count = read_indices(block->scratch, curr_relation, 8, block->strings->count, &roles);
+        int64_t type_count = read_indices(block->scratch, curr_relation, 10, OSM_MEMBER_RELATION + 1, &types);
+        if (role_count == -1 || role_count != type_count || PB_expand_packed_fields(curr_relation, 9, VARINT_TYPE) == -1 ||
+            count(curr_relation, 9, VARINT_TYPE) != role_count)
+        {
+            return -1;
+        }
+
+        OSM_Id *member_ids = arena_alloc(block->scratch, sizeof(OSM_Id) * (role_count + 1));
+        if (!member_ids)
+        {
+            return -1;
+        }
+
+        int64_t member_total = 0;
+        PB_Field *current_member_field = PB_get_FIRST__field(curr_relation, 9, VARINT_TYPE);
+        for (int64_t i = 0; i < role_count; i++)
+        {
+            member_total += zigzag(current_member_field->value.i64);
+            member_ids[i] = member_total;
+            current_member_field = PB_next_field(current_member_field, 9, VARINT_TYPE, FORWARD_DIR);
+        }
+
+        relation.num_members = role_count;
+        relation.member_ids = member_ids;
+        relation.member_types = types;
+        relation.member_roles = roles;
+
+        relation.version = handler->decode_metadata ? read_info_version(PB_get_field(curr_relation, 4, LEN_TYPE)) : -1;
+
+        int result = handler->on_relation(&relation, handler->arg);
+        if (result != 0)
+        {
+            return result;
+        }
+        current = current->next;
+    }
+    return 0;
+}
+
+/* Number of keys of a Node, Way or Relation message: its keys field 2, packed or not */
+uint64_t scan_entity_tags(PB_Field *entity)
+{
+    uint64_t tags = 0;
+    size_t pos = 0;
+    PB_Field field;
+    while (PB_scan_field(entity->value.bytes.buf, entity->value.bytes.size, &pos, &field) == 1)
+    {
+        if (field.number == 2 && field.type == LEN_TYPE)
+        {
+            tags += varint_count((const uint8_t *)field.value.bytes.buf, field.value.bytes.size);
+        }
+        else if (field.number == 2 && field.type == VARINT_TYPE)
+        {
+            tags++;
+        }
+    }
+    return tags;
+}
+
+/* Nodes and tags of a DenseNodes message: a varint per packed id, a key and value per tag in keys_vals */
+void scan_dense_counts(PB_Field *dense, OSM_Summary *summary)
+{
+    size_t pos = 0;
+    PB_Field field;
+    while (PB_scan_field(dense->value.bytes.buf, dense->value.bytes.size, &pos, &field) == 1)
+    {
+        const uint8_t *buf = (const uint8_t *)field.value.bytes.buf;
+        if (field.number == 1 && field.type == LEN_TYPE)
+        {
+            summary->nodes += varint_count(buf, field.value.bytes.size);
+        }
+        else if (field.number == 10 && field.type == LEN_TYPE)
+        {
+            // every node's key/value pairs end with a single 0
+            uint64_t varints = varint_count(buf, field.value.bytes.size);
+            summary->node_tags += (varints - varint_count_zeros(buf, field.value.bytes.size)) / 2;
+        }
+    }
+}
+
+/* Count the entities and tags of a PrimitiveBlock into summary, skipping over everything else */
+int summarize_block(OSM_Summary *summary, PB_Message primitive_block)
+{
+    for (PB_Field *group = PB_get_field(primitive_block, 2, LEN_TYPE); group; group = PB_next_field(group, 2, LEN_TYPE, FORWARD_DIR))
+    {
+        size_t pos = 0;
+        PB_Field entity;
+        int result;
+        while ((result = PB_scan_field(group->value.bytes.buf, group->value.bytes.size, &pos, &entity)) == 1)
+        {
+            if (entity.type != LEN_TYPE)
+            {
+                continue;
+            }
+            if (entity.number == 1)
+            {
+                summary->nodes++;
+                summary->node_tags += scan_entity_tags(&entity);
+            }
+            else if (entity.number == 2)
+            {
+                scan_dense_counts(&entity, summary);
+            }
+            else if (entity.number == 3)
+            {
+                summary->ways++;
+                summary->way_tags += scan_entity_tags(&entity);
+            }
+            else if (entity.number == 4)
+            {
+                summary->relations++;
+                summary->relation_tags += scan_entity_tags(&entity);
+            }
+        }
+        if (result == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Create an empty OSM Map that owns its arenas and entity buffers */
+OSM_Map *OSM_Map_create(void)
+{
+    OSM_Map *map = calloc(1, sizeof(OSM_Map));
+    if (!map)
+    {
+        return NULL;
+    }
+
+    map->arena = arena_create(MAP_ARENA_CHUNK);
+    map->scratch = arena_create(SCRATCH_ARENA_CHUNK);
+    map->ref_store = calloc(1, sizeof(OSM_RefStore));
+    map->strings = string_pool_create();
+    map->node_extent = empty_extent;
+
+    if (!map->arena || !map->scratch || !map->ref_store || !map->strings)
+    {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/* Whether p points into the snapshot mapped by the map (and must not be freed) */
+int is_mapped(OSM_Map *map, const void *p)
+{
+    const char *start = map->mapping;
+    return start && (const char *)p >= start && (const char *)p < start + map->mapping_size;
+}
+
+/* Free a buffer of the map unless it was borrowed from a mapped snapshot */
+void release(OSM_Map *map, void *p)
+{
+    if (!is_mapped(map, p))
+    {
+        free(p);
+    }
+}
+
+void tag_index_free(OSM_Map *map, OSM_TagIndex *index)
+{
+    if (!index)
+    {
+        return;
+    }
+    release(map, index->keys);
+    release(map, index->pair_start);
+    release(map, index->pairs);
+    release(map, index->buf.buf);
+    free(index);
+}
+
+void release_rtree(OSM_Map *map, OSM_RTree *tree)
+{
+    if (tree && (is_mapped(map, tree->items) || is_mapped(map, tree->boxes)))
+    {
+        free(tree);
+        return;
+    }
+    rtree_free(tree);
+}
+
+void release_kdtree(OSM_Map *map, OSM_KDTree *tree)
+{
+    if (tree && is_mapped(map, tree->points))
+    {
+        free(tree);
+        return;
+    }
+    kdtree_free(tree);
+}
+
+/* Release the indexes derived from the entities, they are rebuilt on demand */
+void drop_indexes(OSM_Map *map)
+{
+    release_rtree(map, map->node_tree);
+    map->node_tree = NULL;
+    release(map, map->node_locations);
+    map->node_locations = NULL;
+    release(map, map->way_boxes);
+    map->way_boxes = NULL;
+    release_rtree(map, map->way_tree);
+    map->way_tree = NULL;
+    release_kdtree(map, map->node_kdtree);
+    map->node_kdtree = NULL;
+    release(map, map->node_way_offsets);
+    map->node_way_offsets = NULL;
+    release(map, map->node_ways);
+    map->node_ways = NULL;
+    tag_index_free(map, map->tag_index);
+    map->tag_index = NULL;
+}
+
+/* Forget the entity arrays borrowed from a mapped snapshot and unmap it, after drop_indexes */
+void unmap_snapshot(OSM_Map *map)
+{
+    if (!map->mapping)
+    {
+        return;
+    }
+    if (is_mapped(map, map->nodes))
+    {
+        map->nodes = NULL;
+        map->nodes_capacity = 0;
+    }
+    if (is_mapped(map, map->node_versions))
+    {
+        map->node_versions = NULL;
+        map->node_versions_capacity = 0;
+    }
+    if (is_mapped(map, map->way_versions))
+    {
+        map->way_versions = NULL;
+        map->way_versions_capacity = 0;
+    }
+    if (is_mapped(map, map->ref_store->buf))
+    {
+        map->ref_store->buf = NULL;
+        map->ref_store->capacity = 0;
+    }
+    munmap(map->mapping, map->mapping_size);
+    map->mapping = NULL;
+    map->mapping_size = 0;
+}
+
+/* Drop every entity of the map while keeping its arenas and buffers for the next load */
+void OSM_Map_reset(OSM_Map *mp)
+{
+    if (!mp)
+    {
+        return;
+    }
+
+    arena_reset(mp->arena);
+    arena_reset(mp->scratch);
+    OSM_BlobIndex_free(mp->blob_index);
+    mp->blob_index = NULL;
+    drop_indexes(mp);
+    mp->ref_store->size = 0;
+    string_pool_reset(mp->strings);
+    mp->BBox = NULL;
+    mp->node_extent = empty_extent;
+    mp->num_nodes = 0;
+    mp->num_ways = 0;
+    mp->counted = 0;
+    mp->summarized = 0;
+    memset(&mp->summary, 0, sizeof(OSM_Summary));
+    mp->nodes_unsorted = 0;
+    mp->ways_unsorted = 0;
+    unmap_snapshot(mp);
+}
+
+/* Release the map and everything it owns */
+void OSM_Map_free(OSM_Map *mp)
+{
+    if (!mp)
+    {
+        return;
+    }
+
+    lazy_source_free(mp->lazy);
+    OSM_BlobIndex_free(mp->blob_index);
+    drop_indexes(mp);
+    unmap_snapshot(mp);
+    arena_free(mp->arena);
+    arena_free(mp->scratch);
+    if (mp->ref_store)
+    {
+        free(mp->ref_store->buf);
+        free(mp->ref_store);
+    }
+    string_pool_free(mp->strings);
+    free(mp->nodes);
+    free(mp->ways);
+    free(mp->node_versions);
+    free(mp->way_versions);
+    free(mp);
+}
+
+/* Open a map that only decodes the blobs needed by OSM_Map_find_Node/Way lookups */
+OSM_Map *OSM_open_Map_lazy(const char *path, int cache_blocks)
+{
+    OSM_Map *map = OSM_Map_create();
+    if (!map)
+    {
+        return NULL;
+    }
+
+    map->lazy = lazy_source_open(map, path, cache_blocks);
+    if (!map->lazy)
+    {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+int OSM_Map_is_lazy(OSM_Map *mp)
+{
+    return mp->lazy != NULL;
+}
+
+/* Parse an entire OSM Map from a file stream */
+OSM_Map *OSM_read_Map(FILE *in)
+{
+    return OSM_read_Map_ex(in, NULL);
+}
+
+/* Parse the parts of an OSM Map selected by options from a file stream */
+OSM_Map *OSM_read_Map_ex(FILE *in, const OSM_ReadOptions *options)
+{
+    OSM_Map *map = OSM_Map_create();
+    if (!map)
+    {
+        return NULL;
+    }
+
+    if (OSM_Map_load_ex(map, in, options) == -1)
+    {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ * Read the next BlobHeader and Blob pair of the stream into the scratch arena.
+ * Returns 1 and sets the blob type on success, 0 at the end of the stream, -1 on error.
+ */
+int read_blob(FILE *in, int *is_headerp, PB_Message *blob_properp)
+{
+    // ------------HEADER---------------------
+    uint32_t header_length = 0;
+    size_t bytes_read = fread(&header_length, 1, sizeof(header_length), in); // network byte order
+    if (bytes_read != sizeof(header_length))
+    {
+        if (bytes_read == 0 && feof(in))
+        {
+            return 0;
+        }
+        return -1;
+    }
+    // convert to little endian
+    //  0x12345678 =>
+    int first = header_length & 0x000000FF;
+    int second = (header_length & 0x0000FF00) >> 8;
+    int third = (header_length & 0x00FF0000) >> 16;
+    int forth = (header_length & 0xFF000000) >> 24;
+
+    // concatenate back
+    uint32_t final_length = (first << 24) | (second << 16) | (third << 8) | forth;
+    // ------------HEADER---------------------
+
+    PB_Message blob_header = NULL;
+
+    int result = PB_read_message(in, final_length, &blob_header); // get the 'BlobHeader'
+
+    if (result == -1 || result == 0)
+    {
+        return -1;
+    }
+
+    PB_Field *header_with_datasize = PB_get_field(blob_header, 3, 0); // get datasize field of 'BlobHeader'
+
+    if (!header_with_datasize)
+    {
+        return -1;
+    }
+
+    // type of the blob (field 1), "OSMHeader" or "OSMData"
+    PB_Field *type = PB_get_field(blob_header, 1, LEN_TYPE);
+    *is_headerp = type && type->value.bytes.size == 9 && memcmp(type->value.bytes.buf, "OSMHeader", 9) == 0;
+
+    uint64_t blob_msg_size = header_with_datasize->value.i64; // get value from datasize field
+
+    result = PB_read_message(in, blob_msg_size, blob_properp); // get the 'BlobProper'
+    if (result == -1 || result == 0)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/* Inflate the block held by a blob */
+int inflate_blob(PB_Message blob_proper, PB_Message *blockp)
+{
+    // field #3 of Blob Proper of LEN_TYPE
+    PB_Field *field = PB_get_field(blob_proper, 3, LEN_TYPE); // is field 1 possible(idts but confirm on piazza later)
+    if (!field)
+    {
+        return -1;
+    }
+
+    // raw_size (field 2) sizes the inflated block exactly
+    PB_Field *raw_size = PB_get_field(blob_proper, 2, VARINT_TYPE);
+    int inflated_result = PB_inflate_embedded_message(field->value.bytes.buf, field->value.bytes.size,
+                                                      raw_size && raw_size->value.i64 > 0 ? raw_size->value.i64 : 0, blockp);
+    if (inflated_result == -1 || !*blockp)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether a HeaderBlock feature (required field 4, optional field 5) is set */
+int has_header_feature(PB_Message header_block, const char *feature)
+{
+    size_t len = strlen(feature);
+    for (PB_Field *current = header_block->next; current != NULL && current->type != 8; current = current->next)
+    {
+        if ((current->number == 4 || current->number == 5) && current->type == LEN_TYPE &&
+            current->value.bytes.size == len && memcmp(current->value.bytes.buf, feature, len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read the HeaderBlock held by a blob, its bbox (if any) into bbox */
+int read_header(PB_Message blob_proper, OSM_Header *header, OSM_BBox *bbox)
+{
+    PB_Message header_block = NULL;
+    if (inflate_blob(blob_proper, &header_block) == -1)
+    {
+        return -1;
+    }
+
+    header->bbox = NULL;
+    header->sorted = has_header_feature(header_block, "Sort.Type_then_ID");
+
+    // get the bbox (field 1)
+    PB_Field *bbox_field = PB_get_field(header_block, 1, LEN_TYPE);
+
+    // if not bbox, continue without it?
+    if (!bbox_field)
+    {
+        return 0;
+    }
+
+    PB_Message HeaderBBox = NULL;
+
+    int embedded_read_result = PB_read_embedded_message(bbox_field->value.bytes.buf, bbox_field->value.bytes.size, &HeaderBBox);
+
+    if (!HeaderBBox || embedded_read_result == -1)
+    {
+        return -1;
+    }
+
+    PB_Field *min_lon = PB_get_field(HeaderBBox, 1, VARINT_TYPE);
+    PB_Field *max_lon = PB_get_field(HeaderBBox, 2, VARINT_TYPE);
+    PB_Field *max_lat = PB_get_field(HeaderBBox, 3, VARINT_TYPE);
+    PB_Field *min_lat = PB_get_field(HeaderBBox, 4, VARINT_TYPE);
+
+    if (!min_lon || !max_lon || !min_lat || !max_lat)
+    {
+        return -1;
+    }
+
+    bbox->min_lon = zigzag(min_lon->value.i64);
+    bbox->max_lon = zigzag(max_lon->value.i64);
+    bbox->min_lat = zigzag(min_lat->value.i64);
+    bbox->max_lat = zigzag(max_lat->value.i64);
+    header->bbox = bbox;
+    return 0;
+}
+
+/* Decode the HeaderBlock held by a blob (bbox) */
+int decode_header_blob(OSM_Map *map, PB_Message blob_proper)
+{
+    OSM_Header header;
+    OSM_BBox bbox;
+    if (read_header(blob_proper, &header, &bbox) == -1)
+    {
+        return -1;
+    }
+
+    map->BBox = NULL;
+    if (header.bbox)
+    {
+        map->BBox = arena_alloc(map->arena, sizeof(OSM_BBox));
+        if (!map->BBox)
+        {
+            return -1;
+        }
+        *map->BBox = bbox;
+    }
+    return 0;
+}
+
+/* Decode the entities of a PrimitiveBlock for handler. Returns 0, 1 if a callback stopped the read, -1 on error */
+int decode_block(Arena *scratch, PB_Message primitive_block, const OSM_Handler *handler)
+{
+    OSM_Block block = {scratch, handler, NULL, 0, 0, 100};
+
+    // save the lat/lon offsets and granularity
+    PB_Field *lat_offset = PB_get_field(primitive_block, 19, I64_TYPE);
+    PB_Field *lon_offset = PB_get_field(primitive_block, 20, I32_TYPE);
+    PB_Field *granularity = PB_get_field(primitive_block, 17, I32_TYPE);
+
+    if (lat_offset)
+    {
+        block.lat_offset = (int64_t)lat_offset->value.i64;
+    }
+    if (lon_offset)
+    {
+        block.lon_offset = (int64_t)lon_offset->value.i64;
+    }
+    if (granularity)
+    {
+        block.granularity = (int32_t)granularity->value.i32;
+    }
+
+    // String Table (Field Number 1, Wire Type = LEN_TYPE), only copied for callbacks receiving tags
+    if (handler->on_way || handler->on_relation || (handler->on_node && handler->node_tags))
+    {
+        PB_Field *string_table = PB_get_field(primitive_block, 1, LEN_TYPE);
+        if (!string_table)
+        {
+            return -1;
+        }
+
+        PB_Message string_table_message = NULL;
+        int embedded_read_result = PB_read_embedded_message(string_table->value.bytes.buf, string_table->value.bytes.size, &string_table_message);
+
+        if (embedded_read_result == -1 || !string_table_message)
+        {
+            return -1;
+        }
+
+        block.strings = copy_string_table(scratch, string_table_message);
+        if (!block.strings)
+        {
+            return -1;
+        }
+    }
+
+    // PrimitiveGroup
+
+    // Get The First PrimitiveGroup (Field #2, LEN_TYPE)
+    PB_Field *current_primitive_group_field = PB_get_field(primitive_block, 2, LEN_TYPE);
+
+    while (current_primitive_group_field != NULL)
+    {
+        PB_Message current_prim_group_message = NULL;
+        int embedded_read_result = PB_read_embedded_message(current_primitive_group_field->value.bytes.buf, current_primitive_group_field->value.bytes.size, &current_prim_group_message);
+
+        if (!current_prim_group_message || embedded_read_result == -1)
+        {
+            return -1;
+        }
+
+        // ATP We'd Have A message of a list of MULTIPLE Field 1(Node) or Field 3(Way).
+        // IF this has a Field 2(DenseNodes), then its ONLY 1 FIELD
+
+        // Find What Type is it (NODE, WAY, DENSENODES, RELATION)
+        PB_Field *current = current_prim_group_message;
+        current = current->next; // skip Sentinel Node
+
+        int result = 0;
+        if (current->number == 1)
+        { // NODE
+            result = handler->on_node ? handle_NODE(&block, current_prim_group_message) : 0;
+        }
+        else if (current->number == 2)
+        { // DENSE NODES
+            result = handler->on_node ? handle_DENSE(&block, current_prim_group_message) : 0;
+        }
+        else if (current->number == 3)
+        { // WAYS
+            result = handler->on_way ? handle_WAY(&block, current_prim_group_message) : 0;
+        }
+        else if (current->number == 4)
+        { // RELATION
+            result = handler->on_relation ? handle_RELATION(&block, current_prim_group_message) : 0;
+        }
+        else if (current->number != 5)
+        { // not a ChangeSet either
+            return -1;
+        }
+        if (result != 0)
+        {
+            return result;
+        }
+        current_primitive_group_field = PB_next_field(current_primitive_group_field, 2, LEN_TYPE, FORWARD_DIR);
+    }
+    return handler->on_block_end ? handler->on_block_end(handler->arg) : 0;
+}
+
+/* Decode a stream block by block, handing its entities to handler */
+int OSM_read_stream(FILE *in, const OSM_Handler *handler)
+{
+    Arena *scratch = arena_create(SCRATCH_ARENA_CHUNK);
+    if (!scratch)
+    {
+        return -1;
+    }
+
+    // every message and entity lives in scratch until the next blob
+    PB_set_arena(scratch);
+
+    int result = 0;
+    while (result == 0)
+    {
+        arena_reset(scratch);
+
+        int is_header = 0;
+        PB_Message blob_proper = NULL;
+        int read_result = read_blob(in, &is_header, &blob_proper);
+        if (read_result <= 0)
+        {
+            result = read_result;
+            break;
+        }
+
+        if (is_header)
+        {
+            if (handler->on_header)
+            {
+                OSM_Header header;
+                OSM_BBox bbox;
+                result = read_header(blob_proper, &header, &bbox) == -1 ? -1 : handler->on_header(&header, handler->arg);
+            }
+        }
+        else
+        {
+            PB_Message primitive_block = NULL;
+            result = inflate_blob(blob_proper, &primitive_block) == -1 ? -1 : decode_block(scratch, primitive_block, handler);
+        }
+    }
+
+    PB_set_arena(NULL);
+    arena_free(scratch);
+    return result;
+}
+
+/* The map loader: the handler decode_data_blob decodes a map's blobs with */
+
+/* Set up interning and the tag projection for the strings of a block, once per block */
+int begin_block_strings(OSM_Map *map, char **strings, uint32_t num_strings)
+{
+    OSM_BlockStrings *block = &map->block;
+    if (block->strings == strings)
+    {
+        return 0;
+    }
+
+    block->strings = strings;
+    block->interned = arena_alloc(map->scratch, sizeof(uint32_t) * (num_strings + 1));
+    if (!block->interned)
+    {
+        return -1;
+    }
+    memset(block->interned, 0xFF, sizeof(uint32_t) * num_strings);
+
+    block->kept_keys = NULL;
+    if (map->options->decode_tags && map->options->tag_keys)
+    {
+        block->kept_keys = build_kept_keys(map->scratch, strings, num_strings, map->options->tag_keys);
+        if (!block->kept_keys)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int load_node(const OSM_NodeEvent *event, void *arg)
+{
+    OSM_Map *map = arg;
+
+    OSM_Node *node = push_node(map);
+    if (!node)
+    {
+        return -1;
+    }
+    note_node_order(map, event->id);
+    node->id = event->id;
+    node->lat = event->lat;
+    node->lon = event->lon;
+
+    OSM_BBox *extent = &map->node_extent;
+    extent->min_lon = event->lon < extent->min_lon ? event->lon : extent->min_lon;
+    extent->max_lon = event->lon > extent->max_lon ? event->lon : extent->max_lon;
+    extent->min_lat = event->lat < extent->min_lat ? event->lat : extent->min_lat;
+    extent->max_lat = event->lat > extent->max_lat ? event->lat : extent->max_lat;
+
+    if (map->options->decode_metadata &&
+        push_version(&map->node_versions, &map->node_versions_capacity, map->num_nodes, event->version) == -1)
+    {
+        return -1;
+    }
+
+    map->num_nodes += 1;
+    return 0;
+}
+
+int load_way(const OSM_WayEvent *event, void *arg)
+{
+    OSM_Map *map = arg;
+    const OSM_ReadOptions *options = map->options;
+    int32_t key_count = event->num_tags;
+
+    // let the caller's predicate drop the way before anything is allocated for it
+    if (options->way_filter)
+    {
+        char **key_strings = arena_alloc(map->scratch, sizeof(char *) * (key_count + 1));
+        char **value_strings = arena_alloc(map->scratch, sizeof(char *) * (key_count + 1));
+        if (!key_strings || !value_strings)
+        {
+            return -1;
+        }
+        for (int i = 0; i < key_count; i++)
+        {
+            key_strings[i] = event->strings[event->keys[i]];
+            value_strings[i] = event->strings[event->values[i]];
+        }
+
+        if (!options->way_filter(event->id, key_count, key_strings, value_strings, options->filter_arg))
+        {
+            return 0;
+        }
+    }
+
+    if (begin_block_strings(map, event->strings, event->num_strings) == -1)
+    {
+        return -1;
+    }
+    OSM_BlockStrings *strings = &map->block;
+
+    OSM_Way *way = push_way(map);
+    if (!way)
+    {
+        return -1;
+    }
+
+    // apply the tag projection
+    int32_t kept_count = 0;
+    if (options->decode_tags)
+    {
+        for (int i = 0; i < key_count; i++)
+        {
+            if (!strings->kept_keys || strings->kept_keys[event->keys[i]])
+            {
+                kept_count++;
+            }
+        }
+    }
+
+    way->map = map;
+    way->keys = NULL;
+    way->values = NULL;
+
+    if (kept_count > 0)
+    {
+        way->keys = arena_alloc(map->arena, sizeof(uint32_t) * kept_count);
+        way->values = arena_alloc(map->arena, sizeof(uint32_t) * kept_count);
+        if (!way->keys || !way->values)
+        {
+            return -1;
+        }
+        int32_t kept = 0;
+        for (int i = 0; i < key_count; i++)
+        {
+            if (strings->kept_keys && !strings->kept_keys[event->keys[i]])
+            {
+                continue;
+            }
+            way->keys[kept] = intern_block_string(map, strings, event->keys[i]);
+            way->values[kept] = intern_block_string(map, strings, event->values[i]);
+            if (way->keys[kept] == STRING_POOL_NONE || way->values[kept] == STRING_POOL_NONE)
+            {
+                return -1;
+            }
+            kept++;
+        }
+    }
+
+    way->keys_count = kept_count;
+    way->vals_count = kept_count;
+
+    // keep refs packed (zig-zag delta varints) in the map's shared ref store
+    way->refs_offset = map->ref_store->size;
+    if (ref_store_append(map->ref_store, event->refs, event->refs_size) == -1)
+    {
+        return -1;
+    }
+    way->refs_size = event->refs_size;
+    way->refs_count = event->num_refs;
+
+    if (options->decode_metadata &&
+        push_version(&map->way_versions, &map->way_versions_capacity, map->num_ways, event->version) == -1)
+    {
+        return -1;
+    }
+
+    if (map->num_ways > 0 && map->ways[map->num_ways - 1].id > event->id)
+    {
+        map->ways_unsorted = 1;
+    }
+    way->id = event->id;
+    map->num_ways += 1;
+    return 0;
+}
+
+/* Relations are not kept, only their ids are recorded in the blob index */
+int load_relation(const OSM_RelationEvent *event, void *arg)
+{
+    OSM_Map *map = arg;
+    return OSM_BlobIndex_add_id(map->blob_index, OSM_BLOB_RELATIONS, event->id);
+}
+
+/* The next block comes with its own strings */
+int end_load_block(void *arg)
+{
+    OSM_Map *map = arg;
+    map->block.strings = NULL;
+    return 0;
+}
+
+/* Add the node and way ids a data blob appended to the map to the blob being recorded */
+int record_blob_ids(OSM_Map *map, uint64_t first_node, uint64_t first_way)
+{
+    for (uint64_t i = first_node; i < map->num_nodes; i++)
+    {
+        if (OSM_BlobIndex_add_id(map->blob_index, OSM_BLOB_NODES, map->nodes[i].id) == -1)
+        {
+            return -1;
+        }
+    }
+    for (uint64_t i = first_way; i < map->num_ways; i++)
+    {
+        if (OSM_BlobIndex_add_id(map->blob_index, OSM_BLOB_WAYS, map->ways[i].id) == -1)
+        {
+            return -1;
+        }
+    }
+    return OSM_BlobIndex_finish_blob(map->blob_index);
+}
+
+/* Decode the PrimitiveBlock held by a blob into map */
+int decode_data_blob(OSM_Map *map, PB_Message blob_proper)
+{
+    PB_Message primitive_block = NULL;
+    if (inflate_blob(blob_proper, &primitive_block) == -1)
+    {
+        return -1;
+    }
+
+    if (map->summarized && summarize_block(&map->summary, primitive_block) == -1)
+    {
+        return -1;
+    }
+    if (map->entities == 0)
+    {
+        return 0; // count only
+    }
+
+    OSM_Handler loader = {
+        .on_node = (map->entities & OSM_READ_NODES) ? load_node : NULL,
+        .on_way = (map->entities & OSM_READ_WAYS) ? load_way : NULL,
+        .on_relation = map->blob_index ? load_relation : NULL,
+        .on_block_end = end_load_block,
+        .decode_metadata = map->options->decode_metadata,
+        .arg = map,
+    };
+    return decode_block(map->scratch, primitive_block, &loader);
+}
+
+/* Decode every blob of the stream into map */
+int load_blobs(OSM_Map *map, FILE *in)
+{
+    while (1)
+    {
+        // protobuf messages only live until the next blob
+        arena_reset(map->scratch);
+
+        int is_header = 0;
+        PB_Message blob_proper = NULL;
+        off_t offset = map->blob_index ? ftello(in) : 0;
+
+        int result = read_blob(in, &is_header, &blob_proper);
+        if (result <= 0)
+        {
+            return result;
+        }
+
+        // every entity of a full load passes through here, so the sidecar comes for free
+        uint64_t first_node = map->num_nodes;
+        uint64_t first_way = map->num_ways;
+        if (map->blob_index && !OSM_BlobIndex_append(map->blob_index, offset, ftello(in) - offset, is_header ? OSM_BLOB_HEADER : OSM_BLOB_DATA))
+        {
+            return -1;
+        }
+
+        // handle OSM_HEADER
+        if (is_header)
+        {
+            if (decode_header_blob(map, blob_proper) == -1)
+            {
+                return -1;
+            }
+
+            // a load decoding no entity is after the bbox: without one in the header it comes from the nodes
+            if (!map->BBox && map->entities == 0)
+            {
+                map->entities = OSM_READ_NODES;
+                map->counted &= ~OSM_READ_NODES;
+            }
+
+            // header only load, the rest of the stream is never read
+            if ((map->entities | map->counted) == 0 && !map->summarized)
+            {
+                return 0;
+            }
+        }
+
+        // handle OSM_Data
+        else if (decode_data_blob(map, blob_proper) == -1 ||
+                 (map->blob_index && record_blob_ids(map, first_node, first_way) == -1))
+        {
+            return -1;
+        }
+    }
+}
+
+/* Set the map's bbox to extent, allocating it on first use */
+int set_bbox(OSM_Map *map, const OSM_BBox *extent)
+{
+    if (!map->BBox)
+    {
+        map->BBox = arena_alloc(map->arena, sizeof(OSM_BBox));
+        if (!map->BBox)
+        {
+            return -1;
+        }
+    }
+    *map->BBox = *extent;
+    return 0;
+}
+
+/* Use the extent of the decoded nodes as the bbox, if any node was decoded */
+int adopt_node_extent(OSM_Map *map)
+{
+    if (map->node_extent.min_lon > map->node_extent.max_lon)
+    {
+        return 0;
+    }
+    return set_bbox(map, &map->node_extent);
+}
+
+/* Load the blobs of a stream into an empty (new or reset) map */
+int OSM_Map_load(OSM_Map *mp, FILE *in)
+{
+    return OSM_Map_load_ex(mp, in, NULL);
+}
+
+/* Load the parts of a stream selected by options into an empty (new or reset) map */
+int OSM_Map_load_ex(OSM_Map *mp, FILE *in, const OSM_ReadOptions *options)
+{
+    mp->options = options ? options : &default_options;
+    mp->entities = mp->options->count_only ? 0 : mp->options->entities;
+    mp->counted = mp->options->count_only ? mp->options->entities : 0;
+    mp->summarized = mp->options->count_only || mp->options->summarize;
+    mp->block.strings = NULL;
+
+    // indexes over the previous entities go stale
+    drop_indexes(mp);
+
+    // only a load of everything sees every id; a pipe cannot report blob offsets
+    OSM_BlobIndex_free(mp->blob_index);
+    mp->blob_index = NULL;
+    if (!options && ftello(in) == 0)
+    {
+        mp->blob_index = OSM_BlobIndex_create();
+    }
+
+    // all protobuf allocations of this load come from the scratch arena
+    PB_set_arena(mp->scratch);
+    int result = load_blobs(mp, in);
+    PB_set_arena(NULL);
+    arena_reset(mp->scratch);
+
+    if (result != -1 && !mp->BBox)
+    {
+        // no bbox in the header: use the extent tracked while decoding the nodes
+        result = adopt_node_extent(mp);
+    }
+
+    if (result == -1)
+    {
+        OSM_BlobIndex_free(mp->blob_index);
+        mp->blob_index = NULL;
+    }
+    else if (mp->options->index_tags)
+    {
+        result = OSM_Map_build_tag_index(mp);
+    }
+    mp->options = NULL;
+    return result;
+}
+
+/* Write the sidecar of pbf_path, unless an up to date one exists: the index of the map if it has one, else one built now */
+int OSM_Map_save_index(OSM_Map *mp, const char *pbf_path)
+{
+    if (mp->mapping)
+    {
+        return -1;
+    }
+    if (OSM_BlobIndex_sidecar_is_current(pbf_path))
+    {
+        return 0;
+    }
+
+    // recorded by a full load, or built by a lazy open
+    OSM_BlobIndex *idx = mp->blob_index ? mp->blob_index : mp->lazy ? lazy_source_index(mp->lazy) : NULL;
+    if (idx)
+    {
+        return OSM_BlobIndex_save_sidecar(idx, pbf_path);
+    }
+    idx = OSM_BlobIndex_open(pbf_path);
+    int result = idx ? OSM_BlobIndex_save_sidecar(idx, pbf_path) : -1;
+    OSM_BlobIndex_free(idx);
+    return result;
+}
+
+/* Decode the single blob starting at offset (its header length) of a seekable stream into mp */
+int OSM_Map_load_blob(OSM_Map *mp, FILE *in, uint64_t offset, const OSM_ReadOptions *options)
+{
+    if (fseeko(in, offset, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+
+    mp->options = options ? options : &default_options;
+    mp->entities = mp->options->count_only ? 0 : mp->options->entities;
+    mp->counted = mp->options->count_only ? mp->options->entities : 0;
+    mp->summarized = mp->options->count_only || mp->options->summarize;
+    mp->block.strings = NULL;
+    PB_set_arena(mp->scratch);
+    drop_indexes(mp);
+
+    int is_header = 0;
+    PB_Message blob_proper = NULL;
+
+    int result = read_blob(in, &is_header, &blob_proper);
+    if (result == 1)
+    {
+        result = is_header ? decode_header_blob(mp, blob_proper) : decode_data_blob(mp, blob_proper);
+    }
+    else
+    {
+        result = -1;
+    }
+
+    PB_set_arena(NULL);
+    arena_reset(mp->scratch);
+    mp->options = NULL;
+
+    if (result != -1 && !mp->BBox)
+    {
+        result = adopt_node_extent(mp);
+    }
+    return result;
+}
+
+/* Merging the maps of several files */
+
+/* An input map of a merge, walked in id order */
+typedef struct Merge_Input
+{
+    OSM_Map *map;
+    OSM_NodeLocation *order; // (id, position) of its nodes or ways sorted by id, NULL when appended in order
+    uint64_t count;
+    uint64_t next;           // rank of the next entity to merge
+    uint32_t *string_ids;    // its pool ids translated to the merged pool's
+    int released;            // its merged entities are freed
+} Merge_Input;
+
+typedef struct Map_Merge
+{
+    OSM_Map *merged;
+    OSM_Map **maps;
+    int count;
+    int versions; // some input decoded versions
+    int consume;  // inputs are freed as they are merged, not left untouched
+} Map_Merge;
+
+/* (id, position) pairs of the nodes or ways of a map sorted by id, ties in position order */
+int compare_id_positions(const void *a, const void *b)
+{
+    const OSM_NodeLocation *x = a;
+    const OSM_NodeLocation *y = b;
+    if (x->id != y->id)
+    {
+        return x->id < y->id ? -1 : 1;
+    }
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+
+int begin_merge_input(Merge_Input *input, OSM_Map *map, int ways)
+{
+    input->map = map;
+    input->order = NULL;
+    input->count = ways ? map->num_ways : map->num_nodes;
+    input->next = 0;
+    input->string_ids = NULL;
+    input->released = 0;
+    if (!(ways ? map->ways_unsorted : map->nodes_unsorted))
+    {
+        return 0;
+    }
+
+    input->order = malloc(sizeof(OSM_NodeLocation) * (input->count ? input->count : 1));
+    if (!input->order)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < input->count; i++)
+    {
+        input->order[i].id = ways ? map->ways[i].id : map->nodes[i].id;
+        input->order[i].position = i;
+    }
+    qsort(input->order, input->count, sizeof(OSM_NodeLocation), compare_id_positions);
+    return 0;
+}
+
+/* Position of the next entity of an input */
+uint64_t merge_position(const Merge_Input *input)
+{
+    return input->order ? input->order[input->next].position : input->next;
+}
+
+/*
+ * Pick the input holding the smallest next id (the first input on ties) and
+ * the copy of that id to keep: the highest version, else the first input's.
+ * Every input is moved past the id. Returns the input, -1 once all are done.
+ */
+int merge_next(Merge_Input *inputs, int count, int ways, int versions, uint64_t *positionp)
+{
+    // a handful of inputs: a scan for the smallest head beats maintaining a heap
+    int smallest = -1;
+    OSM_Id id = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (inputs[i].next < inputs[i].count)
+        {
+            uint64_t p = merge_position(&inputs[i]);
+            OSM_Id head = ways ? inputs[i].map->ways[p].id : inputs[i].map->nodes[p].id;
+            if (smallest == -1 || head < id)
+            {
+                smallest = i;
+                id = head;
+            }
+        }
+    }
+    if (smallest == -1)
+    {
+        return -1;
+    }
+
+    int best = -1;
+    int32_t best_version = 0;
+    for (int i = smallest; i < count; i++)
+    {
+        while (inputs[i].next < inputs[i].count)
+        {
+            uint64_t p = merge_position(&inputs[i]);
+            OSM_Map *map = inputs[i].map;
+            if ((ways ? map->ways[p].id : map->nodes[p].id) != id)
+            {
+                break;
+            }
+            int32_t *input_versions = ways ? map->way_versions : map->node_versions;
+            int32_t version = versions && input_versions ? input_versions[p] : -1;
+            if (best == -1 || version > best_version)
+            {
+                best = i;
+                best_version = version;
+                *positionp = p;
+            }
+            inputs[i].next++;
+        }
+    }
+    return best;
+}
+
+/* Free the nodes (or ways, refs and tags) of the inputs a consuming merge has taken all of */
+void release_merged_inputs(Map_Merge *merge, Merge_Input *inputs, int ways)
+{
+    for (int i = 0; i < merge->count && merge->consume; i++)
+    {
+        Merge_Input *input = &inputs[i];
+        OSM_Map *map = input->map;
+        if (input->released || input->next < input->count)
+        {
+            continue;
+        }
+        input->released = 1;
+        free(input->order);
+        input->order = NULL;
+        if (!ways)
+        {
+            free(map->nodes);
+            free(map->node_versions);
+            map->nodes = NULL;
+            map->node_versions = NULL;
+            map->num_nodes = 0;
+            continue;
+        }
+
+        // the tag ids of its ways live in its arena
+        free(map->ways);
+        free(map->way_versions);
+        map->ways = NULL;
+        map->way_versions = NULL;
+        map->num_ways = 0;
+        free(map->ref_store->buf);
+        map->ref_store->buf = NULL;
+        map->ref_store->size = 0;
+        map->ref_store->capacity = 0;
+        arena_free(map->arena);
+        map->arena = NULL;
+    }
+}
+
+/*
+ * Length of the run of nodes at the head of an input kept in place whose ids
+ * are below the heads of all other inputs and appear once, 0 if there is none.
+ * Regional extracts barely overlap, so most nodes are copied by such runs.
+ */
+uint64_t merge_node_run(Merge_Input *inputs, int count, int *inputp)
+{
+    int smallest = -1;
+    OSM_Id id = 0;
+    OSM_Id bound = INT64_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        if (inputs[i].next < inputs[i].count)
+        {
+            OSM_Id head = inputs[i].map->nodes[merge_position(&inputs[i])].id;
+            if (smallest == -1 || head < id)
+            {
+                bound = smallest == -1 ? bound : id;
+                smallest = i;
+                id = head;
+            }
+            else if (head < bound)
+            {
+                bound = head;
+            }
+        }
+    }
+    if (smallest == -1 || inputs[smallest].order)
+    {
+        return 0;
+    }
+
+    const OSM_Node *nodes = inputs[smallest].map->nodes;
+    uint64_t end = inputs[smallest].next;
+    while (end < inputs[smallest].count && nodes[end].id < bound &&
+           (end + 1 == inputs[smallest].count || nodes[end + 1].id != nodes[end].id))
+    {
+        end++;
+    }
+    *inputp = smallest;
+    return end - inputs[smallest].next;
+}
+
+int merge_nodes(Map_Merge *merge, Merge_Input *inputs)
+{
+    OSM_Map *merged = merge->merged;
+    for (;;)
+    {
+        release_merged_inputs(merge, inputs, 0);
+
+        // a run of nodes no other input has, else the one node the inputs next agree on
+        int input;
+        uint64_t begin;
+        uint64_t run = merge_node_run(inputs, merge->count, &input);
+        if (run > 0)
+        {
+            begin = inputs[input].next;
+            inputs[input].next += run;
+        }
+        else if ((input = merge_next(inputs, merge->count, 0, merge->versions, &begin)) != -1)
+        {
+            run = 1;
+        }
+        else
+        {
+            return 0;
+        }
+
+        OSM_Map *map = inputs[input].map;
+        OSM_Node *nodes = push_entities((void **)&merged->nodes, &merged->nodes_capacity, merged->num_nodes, run, sizeof(OSM_Node));
+        if (!nodes)
+        {
+            return -1;
+        }
+        memcpy(nodes, map->nodes + begin, sizeof(OSM_Node) * run);
+        if (merge->versions)
+        {
+            int32_t *versions = push_entities((void **)&merged->node_versions, &merged->node_versions_capacity,
+                                              merged->num_nodes, run, sizeof(int32_t));
+            if (!versions)
+            {
+                return -1;
+            }
+            for (uint64_t i = 0; i < run; i++)
+            {
+                versions[i] = map->node_versions ? map->node_versions[begin + i] : -1;
+            }
+        }
+        merged->num_nodes += run;
+    }
+}
+
+/* Translate the pool ids of every input into ids of the merged pool, interning each string once */
+int merge_strings(Map_Merge *merge, Merge_Input *inputs)
+{
+    OSM_Map *merged = merge->merged;
+    for (int i = 0; i < merge->count; i++)
+    {
+        OSM_StringPool *pool = inputs[i].map->strings;
+        inputs[i].string_ids = malloc(sizeof(uint32_t) * (pool->count ? pool->count : 1));
+        if (!inputs[i].string_ids)
+        {
+            return -1;
+        }
+        for (uint32_t s = 0; s < pool->count; s++)
+        {
+            inputs[i].string_ids[s] = string_pool_intern(merged->strings, merged->arena, pool->strings[s], strlen(pool->strings[s]));
+            if (inputs[i].string_ids[s] == STRING_POOL_NONE)
+            {
+                return -1;
+            }
+        }
+
+        // the strings themselves stay in the input's arena until its ways are merged
+        if (merge->consume)
+        {
+            string_pool_free(pool);
+            inputs[i].map->strings = NULL;
+        }
+    }
+    return 0;
+}
+
+int merge_ways(Map_Merge *merge, Merge_Input *inputs)
+{
+    OSM_Map *merged = merge->merged;
+    if (merge_strings(merge, inputs) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t position;
+    int input;
+    release_merged_inputs(merge, inputs, 1);
+    while ((input = merge_next(inputs, merge->count, 1, merge->versions, &position)) != -1)
+    {
+        OSM_Map *map = inputs[input].map;
+        const OSM_Way *from = &map->ways[position];
+        OSM_Way *way = push_way(merged);
+        if (!way)
+        {
+            return -1;
+        }
+        *way = *from;
+        way->map = merged;
+        way->keys = NULL;
+        way->values = NULL;
+        if (from->keys_count > 0)
+        {
+            way->keys = arena_alloc(merged->arena, sizeof(uint32_t) * from->keys_count);
+            way->values = arena_alloc(merged->arena, sizeof(uint32_t) * from->keys_count);
+            if (!way->keys || !way->values)
+            {
+                return -1;
+            }
+            for (int64_t k = 0; k < from->keys_count; k++)
+            {
+                way->keys[k] = inputs[input].string_ids[from->keys[k]];
+                way->values[k] = inputs[input].string_ids[from->values[k]];
+            }
+        }
+
+        way->refs_offset = merged->ref_store->size;
+        if (ref_store_append(merged->ref_store, map->ref_store->buf + from->refs_offset, from->refs_size) == -1)
+        {
+            return -1;
+        }
+
+        if (merge->versions &&
+            push_version(&merged->way_versions, &merged->way_versions_capacity, merged->num_ways,
+                         map->way_versions ? map->way_versions[position] : -1) == -1)
+        {
+            return -1;
+        }
+        merged->num_ways += 1;
+        release_merged_inputs(merge, inputs, 1);
+    }
+    return 0;
+}
+
+/* Merge the nodes (item 0) and the ways (item 1) side by side: they share nothing in the merged map */
+int merge_entities(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Map_Merge *merge = arg;
+    for (uint64_t ways = begin; ways < end; ways++)
+    {
+        Merge_Input *inputs = calloc(merge->count, sizeof(Merge_Input));
+        int result = inputs ? 0 : -1;
+        for (int i = 0; i < merge->count && result == 0; i++)
+        {
+            result = begin_merge_input(&inputs[i], merge->maps[i], ways);
+        }
+        if (result == 0)
+        {
+            result = ways ? merge_ways(merge, inputs) : merge_nodes(merge, inputs);
+        }
+        for (int i = 0; inputs && i < merge->count; i++)
+        {
+            free(inputs[i].order);
+            free(inputs[i].string_ids);
+        }
+        free(inputs);
+        if (result == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Merge the maps, freeing what each input gives up as the merge goes when consume is set */
+OSM_Map *merge_maps(OSM_Map **maps, int count, int consume)
+{
+    Map_Merge merge = {OSM_Map_create(), maps, count, 0, consume};
+    OSM_Map *merged = merge.merged;
+    if (!merged)
+    {
+        return NULL;
+    }
+
+    // counted entities are gone and lazy or mapped entities are not all at hand
+    int summarized = count > 0;
+    OSM_BBox bbox = empty_extent;
+    for (int i = 0; i < count; i++)
+    {
+        if (maps[i]->lazy || maps[i]->mapping || maps[i]->counted)
+        {
+            OSM_Map_free(merged);
+            return NULL;
+        }
+        merge.versions |= maps[i]->node_versions != NULL || maps[i]->way_versions != NULL;
+        summarized &= maps[i]->summarized;
+        merge_extent(&merged->node_extent, &maps[i]->node_extent);
+        if (maps[i]->BBox)
+        {
+            merge_extent(&bbox, maps[i]->BBox);
+        }
+    }
+
+    if (parallel_for(2, 1, merge_entities, &merge) == -1 ||
+        (bbox.min_lon <= bbox.max_lon && set_bbox(merged, &bbox) == -1))
+    {
+        OSM_Map_free(merged);
+        return NULL;
+    }
+
+    // what the merged map holds is counted in it, node tags and relations are gone and add up per file
+    merged->summarized = summarized;
+    if (summarized)
+    {
+        merged->summary.nodes = merged->num_nodes;
+        merged->summary.ways = merged->num_ways;
+        for (uint64_t i = 0; i < merged->num_ways; i++)
+        {
+            merged->summary.way_tags += merged->ways[i].keys_count;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            merged->summary.node_tags += maps[i]->summary.node_tags;
+            merged->summary.relations += maps[i]->summary.relations;
+            merged->summary.relation_tags += maps[i]->summary.relation_tags;
+        }
+        merged->summary.summed_files = count > 1 ? count : 0;
+    }
+    return merged;
+}
+
+OSM_Map *OSM_Map_merge(OSM_Map **maps, int count)
+{
+    return merge_maps(maps, count, 0);
+}
+
+/* Files of OSM_read_Maps and the maps read from them, one worker per file */
+typedef struct Map_Reads
+{
+    FILE **ins;
+    OSM_Map **maps;
+    const OSM_ReadOptions *options;
+} Map_Reads;
+
+int read_input_maps(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Map_Reads *reads = arg;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        reads->maps[i] = OSM_read_Map_ex(reads->ins[i], reads->options);
+        if (!reads->maps[i])
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+OSM_Map *OSM_read_Maps(FILE **ins, int count, const OSM_ReadOptions *options)
+{
+    Map_Reads reads = {ins, calloc(count > 0 ? count : 1, sizeof(OSM_Map *)), options};
+    if (!reads.maps)
+    {
+        return NULL;
+    }
+
+    // the inputs only live to be merged, each buffer goes as soon as the merge is past it
+    OSM_Map *merged = NULL;
+    if (parallel_for(count, 1, read_input_maps, &reads) == 0)
+    {
+        merged = merge_maps(reads.maps, count, 1);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (reads.maps[i])
+        {
+            OSM_Map_free(reads.maps[i]);
+        }
+    }
+    free(reads.maps);
+    return merged;
+}
+
+/* State of a bbox query: exact bounds and the caller's visitor */
+typedef struct BBox_Query
+{
+    OSM_Map *map;
+    OSM_Lon min_lon, max_lon;
+    OSM_Lat min_lat, max_lat;
+    OSM_NodeVisitor callback;
+    void *arg;
+    int visited;
+} BBox_Query;
+
+/* R-tree boxes are rounded outwards, so candidates are checked against the exact bounds */
+int visit_bbox_candidate(uint32_t item, void *arg)
+{
+    BBox_Query *query = arg;
+    OSM_Node *node = &query->map->nodes[item];
+    if (node->lon < query->min_lon || node->lon > query->max_lon || node->lat < query->min_lat || node->lat > query->max_lat)
+    {
+        return 0;
+    }
+    query->visited++;
+    return query->callback(node, query->arg);
+}
+
+/* Bulk load the R-tree over the nodes of a map */
+OSM_RTree *build_node_tree(OSM_Map *map)
+{
+    if (map->num_nodes > UINT32_MAX)
+    {
+        return NULL;
+    }
+
+    OSM_RTreeBox *boxes = malloc(sizeof(OSM_RTreeBox) * (map->num_nodes ? map->num_nodes : 1));
+    if (!boxes)
+    {
+        return NULL;
+    }
+    for (uint64_t i = 0; i < map->num_nodes; i++)
+    {
+        OSM_Node *node = &map->nodes[i];
+        rtree_box_from_nano(&boxes[i], node->lon, node->lat, node->lon, node->lat);
+    }
+
+    OSM_RTree *tree = rtree_build(boxes, map->num_nodes);
+    free(boxes);
+    return tree;
+}
+
+int OSM_Map_query_bbox(OSM_Map *mp, OSM_Lon min_lon, OSM_Lat min_lat, OSM_Lon max_lon, OSM_Lat max_lat,
+                       OSM_NodeVisitor callback, void *arg)
+{
+    if (mp->lazy)
+    {
+        return -1;
+    }
+    if (!mp->node_tree)
+    {
+        mp->node_tree = build_node_tree(mp);
+        if (!mp->node_tree)
+        {
+            return -1;
+        }
+    }
+
+    BBox_Query query = {mp, min_lon, max_lon, min_lat, max_lat, callback, arg, 0};
+    OSM_RTreeBox box;
+    rtree_box_from_nano(&box, min_lon, min_lat, max_lon, max_lat);
+    rtree_query(mp->node_tree, &box, visit_bbox_candidate, &query);
+    return query.visited;
+}
+
+/* Computed bounding box */
+
+/* Per worker extents of a reduction over the nodes */
+typedef struct Extent_Reduce
+{
+    OSM_Map *map;
+    OSM_BBox partials[PARALLEL_MAX_WORKERS];
+} Extent_Reduce;
+
+int reduce_node_extent(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Extent_Reduce *reduce = arg;
+    const OSM_Node *nodes = reduce->map->nodes;
+
+    // four independent running min/max, compiled to conditional moves
+    OSM_Lon min_lon = INT64_MAX, max_lon = INT64_MIN;
+    OSM_Lat min_lat = INT64_MAX, max_lat = INT64_MIN;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        min_lon = nodes[i].lon < min_lon ? nodes[i].lon : min_lon;
+        max_lon = nodes[i].lon > max_lon ? nodes[i].lon : max_lon;
+        min_lat = nodes[i].lat < min_lat ? nodes[i].lat : min_lat;
+        max_lat = nodes[i].lat > max_lat ? nodes[i].lat : max_lat;
+    }
+    reduce->partials[worker] = (OSM_BBox){min_lon, max_lon, min_lat, max_lat};
+    return 0;
+}
+
+int OSM_Map_compute_BBox(OSM_Map *mp)
+{
+    OSM_BBox extent = empty_extent;
+
+    if (mp->lazy)
+    {
+        if (lazy_node_extent(mp->lazy, &extent.min_lon, &extent.min_lat, &extent.max_lon, &extent.max_lat) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        Extent_Reduce *reduce = malloc(sizeof(Extent_Reduce));
+        if (!reduce)
+        {
+            return -1;
+        }
+        reduce->map = mp;
+        for (int w = 0; w < PARALLEL_MAX_WORKERS; w++)
+        {
+            reduce->partials[w] = empty_extent;
+        }
+        if (parallel_for(mp->num_nodes, MIN_NODES_PER_WORKER, reduce_node_extent, reduce) == -1)
+        {
+            free(reduce);
+            return -1;
+        }
+        for (int w = 0; w < PARALLEL_MAX_WORKERS; w++)
+        {
+            merge_extent(&extent, &reduce->partials[w]);
+        }
+        free(reduce);
+    }
+
+    if (extent.min_lon > extent.max_lon)
+    {
+        return -1; // no nodes
+    }
+    return set_bbox(mp, &extent);
+}
+
+/* Nearest node queries */
+
+/* Build the k-d tree over the nodes of a map unless it exists */
+int build_node_kdtree(OSM_Map *map)
+{
+    if (map->node_kdtree)
+    {
+        return 0;
+    }
+
+    OSM_KDPoint *points = malloc(sizeof(OSM_KDPoint) * (map->num_nodes ? map->num_nodes : 1));
+    if (!points)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < map->num_nodes; i++)
+    {
+        points[i].lat = map->nodes[i].lat;
+        points[i].lon = map->nodes[i].lon;
+        points[i].item = i;
+    }
+
+    map->node_kdtree = kdtree_build(points, map->num_nodes);
+    if (!map->node_kdtree)
+    {
+        free(points);
+        return -1;
+    }
+    return 0;
+}
+
+/* Answer one query with the tree built, positions is scratch space for k entries */
+int nearest_nodes(OSM_Map *map, OSM_Lat lat, OSM_Lon lon, int k, uint64_t *positions, OSM_Node **results)
+{
+    int found = kdtree_nearest(map->node_kdtree, lat, lon, k, positions);
+    for (int i = 0; i < found; i++)
+    {
+        results[i] = &map->nodes[positions[i]];
+    }
+    for (int i = found < 0 ? 0 : found; i < k; i++)
+    {
+        results[i] = NULL;
+    }
+    return found;
+}
+
+int OSM_Map_nearest_node(OSM_Map *mp, OSM_Lat lat, OSM_Lon lon, int k, OSM_Node **results)
+{
+    if (mp->lazy || k < 0 || build_node_kdtree(mp) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t *positions = malloc(sizeof(uint64_t) * (k ? k : 1));
+    if (!positions)
+    {
+        return -1;
+    }
+    int found = nearest_nodes(mp, lat, lon, k, positions, results);
+    free(positions);
+    return found;
+}
+
+/* A batch of nearest node queries shared by the workers */
+typedef struct Nearest_Batch
+{
+    OSM_Map *map;
+    const OSM_Lat *lats;
+    const OSM_Lon *lons;
+    int k;
+    OSM_Node **results;
+} Nearest_Batch;
+
+int run_nearest_batch(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Nearest_Batch *batch = arg;
+    uint64_t *positions = malloc(sizeof(uint64_t) * (batch->k ? batch->k : 1));
+    if (!positions)
+    {
+        return -1;
+    }
+
+    int result = 0;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        if (nearest_nodes(batch->map, batch->lats[i], batch->lons[i], batch->k, positions, batch->results + i * batch->k) == -1)
+        {
+            result = -1;
+        }
+    }
+    free(positions);
+    return result;
+}
+
+int OSM_Map_nearest_nodes(OSM_Map *mp, int count, const OSM_Lat *lats, const OSM_Lon *lons, int k, OSM_Node **results)
+{
+    if (mp->lazy || count < 0 || k < 0 || build_node_kdtree(mp) == -1)
+    {
+        return -1;
+    }
+
+    Nearest_Batch batch = {mp, lats, lons, k, results};
+    return parallel_for(count, MIN_QUERIES_PER_WORKER, run_nearest_batch, &batch);
+}
+
+/* Node location store */
+
+int compare_node_locations(const void *a, const void *b)
+{
+    const OSM_NodeLocation *x = a;
+    const OSM_NodeLocation *y = b;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/* Make node_position usable: sorted maps need nothing, others get an id sorted copy */
+int build_node_locations(OSM_Map *map)
+{
+    if (!map->nodes_unsorted || map->node_locations)
+    {
+        return 0;
+    }
+
+    map->node_locations = malloc(sizeof(OSM_NodeLocation) * (map->num_nodes ? map->num_nodes : 1));
+    if (!map->node_locations)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < map->num_nodes; i++)
+    {
+        map->node_locations[i].id = map->nodes[i].id;
+        map->node_locations[i].position = i;
+    }
+    qsort(map->node_locations, map->num_nodes, sizeof(OSM_NodeLocation), compare_node_locations);
+    return 0;
+}
+
+/* Position of a node in the nodes array or -1, after build_node_locations (safe to call from threads) */
+int64_t node_position(OSM_Map *map, OSM_Id id)
+{
+    uint64_t low = 0;
+    uint64_t high = map->num_nodes;
+    OSM_NodeLocation *locations = map->node_locations;
+
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        OSM_Id mid_id = locations ? locations[mid].id : map->nodes[mid].id;
+        if (mid_id < id)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == map->num_nodes)
+    {
+        return -1;
+    }
+    if (locations)
+    {
+        return locations[low].id == id ? (int64_t)locations[low].position : -1;
+    }
+    return map->nodes[low].id == id ? (int64_t)low : -1;
+}
+
+/* Id of the node at rank i of the location store */
+OSM_Id sorted_node_id(OSM_Map *map, uint64_t i)
+{
+    return map->node_locations ? map->node_locations[i].id : map->nodes[i].id;
+}
+
+/* Position in the nodes array of the node at rank i of the location store */
+uint64_t sorted_node_position(OSM_Map *map, uint64_t i)
+{
+    return map->node_locations ? map->node_locations[i].position : i;
+}
+
+/* Way geometries */
+
+/* A ref to resolve: the id and the slot of the coordinate buffer it fills */
+typedef struct Geometry_Ref
+{
+    OSM_Id id;
+    uint64_t slot;
+} Geometry_Ref;
+
+/* State shared by the workers resolving geometries */
+typedef struct Geometry_Join
+{
+    OSM_Map *map;
+    OSM_Geometries *geometries;
+    OSM_Id *refs;        // every ref, flat, in coordinate buffer order
+    uint64_t missing[PARALLEL_MAX_WORKERS];
+} Geometry_Join;
+
+int compare_geometry_refs(const void *a, const void *b)
+{
+    const Geometry_Ref *x = a;
+    const Geometry_Ref *y = b;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/* Decode the refs of ways [begin, end) into their slots of the flat ref array */
+int decode_geometry_refs(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Geometry_Join *join = arg;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        OSM_Way *way = &join->map->ways[i];
+        uint64_t offset = join->geometries->offsets[i];
+        OSM_Way_copy_refs(way, join->refs + offset, join->geometries->offsets[i + 1] - offset);
+    }
+    return 0;
+}
+
+/* First rank at or after from whose id is >= id: gallop, then binary search the bracket */
+uint64_t gallop_node_rank(OSM_Map *map, uint64_t from, OSM_Id id)
+{
+    uint64_t step = 1;
+    uint64_t low = from;
+    uint64_t high = from;
+    while (high < map->num_nodes && sorted_node_id(map, high) < id)
+    {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > map->num_nodes)
+    {
+        high = map->num_nodes;
+    }
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (sorted_node_id(map, mid) < id)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Sort slots [begin, end) by ref id and merge them with the id sorted nodes */
+int join_geometry_refs(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Geometry_Join *join = arg;
+    OSM_Map *map = join->map;
+    OSM_Coord *coords = join->geometries->coords;
+
+    Geometry_Ref *sorted = malloc(sizeof(Geometry_Ref) * (end > begin ? end - begin : 1));
+    if (!sorted)
+    {
+        return -1;
+    }
+    for (uint64_t slot = begin; slot < end; slot++)
+    {
+        sorted[slot - begin].id = join->refs[slot];
+        sorted[slot - begin].slot = slot;
+    }
+    qsort(sorted, end - begin, sizeof(Geometry_Ref), compare_geometry_refs);
+
+    uint64_t rank = 0;
+    uint64_t missing = 0;
+    for (uint64_t i = 0; i < end - begin; i++)
+    {
+        rank = gallop_node_rank(map, rank, sorted[i].id);
+        if (rank < map->num_nodes && sorted_node_id(map, rank) == sorted[i].id)
+        {
+            OSM_Node *node = &map->nodes[sorted_node_position(map, rank)];
+            coords[sorted[i].slot].lat = node->lat;
+            coords[sorted[i].slot].lon = node->lon;
+        }
+        else
+        {
+            coords[sorted[i].slot].lat = OSM_COORD_MISSING;
+            coords[sorted[i].slot].lon = OSM_COORD_MISSING;
+            missing++;
+        }
+    }
+
+    join->missing[worker] = missing;
+    free(sorted);
+    return 0;
+}
+
+OSM_Geometries *OSM_Map_resolve_way_geometries(OSM_Map *mp)
+{
+    if (mp->lazy || build_node_locations(mp) == -1)
+    {
+        return NULL;
+    }
+
+    OSM_Geometries *geometries = calloc(1, sizeof(OSM_Geometries));
+    if (!geometries)
+    {
+        return NULL;
+    }
+    geometries->num_ways = mp->num_ways;
+    geometries->offsets = malloc(sizeof(uint64_t) * (mp->num_ways + 1));
+    if (!geometries->offsets)
+    {
+        OSM_Geometries_free(geometries);
+        return NULL;
+    }
+
+    geometries->offsets[0] = 0;
+    for (uint64_t i = 0; i < mp->num_ways; i++)
+    {
+        geometries->offsets[i + 1] = geometries->offsets[i] + mp->ways[i].refs_count;
+    }
+    uint64_t num_refs = geometries->offsets[mp->num_ways];
+
+    Geometry_Join join = {mp, geometries, malloc(sizeof(OSM_Id) * (num_refs ? num_refs : 1)), {0}};
+    geometries->coords = malloc(sizeof(OSM_Coord) * (num_refs ? num_refs : 1));
+
+    // decode every ref once, then each worker joins its share of the refs against the sorted ids
+    if (!join.refs || !geometries->coords ||
+        parallel_for(mp->num_ways, MIN_WAYS_PER_WORKER, decode_geometry_refs, &join) == -1 ||
+        parallel_for(num_refs, MIN_REFS_PER_WORKER, join_geometry_refs, &join) == -1)
+    {
+        free(join.refs);
+        OSM_Geometries_free(geometries);
+        return NULL;
+    }
+    free(join.refs);
+
+    for (int w = 0; w < PARALLEL_MAX_WORKERS; w++)
+    {
+        geometries->num_missing += join.missing[w];
+    }
+    return geometries;
+}
+
+void OSM_Geometries_free(OSM_Geometries *gp)
+{
+    if (!gp)
+    {
+        return;
+    }
+    free(gp->offsets);
+    free(gp->coords);
+    free(gp);
+}
+
+/* Reverse node to ways index */
+
+/* State shared by the workers building the reverse index */
+typedef struct NodeWays_Build
+{
+    OSM_Map *map;
+    uint64_t *ref_offsets;  // per way: first slot of its refs in positions
+    uint64_t *positions;    // per way: its distinct node positions, ascending
+    uint32_t *num_distinct; // per way: how many of its slots are used
+    uint32_t *counts[PARALLEL_MAX_WORKERS]; // per worker histogram, then write cursors
+} NodeWays_Build;
+
+int compare_positions(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Pass 1: resolve the refs of ways [begin, end) once and count them in this worker's histogram */
+int count_node_ways(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    NodeWays_Build *build = arg;
+    OSM_Map *map = build->map;
+
+    uint32_t *counts = calloc(map->num_nodes ? map->num_nodes : 1, sizeof(uint32_t));
+    OSM_Id *refs = NULL;
+    int64_t refs_capacity = 0;
+    if (!counts)
+    {
+        return -1;
+    }
+    build->counts[worker] = counts;
+
+    for (uint64_t i = begin; i < end; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        if (way->refs_count > refs_capacity)
+        {
+            free(refs);
+            refs_capacity = way->refs_count * 2;
+            refs = malloc(sizeof(OSM_Id) * refs_capacity);
+            if (!refs)
+            {
+                return -1;
+            }
+        }
+
+        // a way is listed once per node, even when it passes a node twice (closed rings)
+        uint64_t *positions = build->positions + build->ref_offsets[i];
+        int num_refs = OSM_Way_copy_refs(way, refs, way->refs_count);
+        uint32_t resolved = 0;
+        for (int r = 0; r < num_refs; r++)
+        {
+            int64_t position = node_position(map, refs[r]);
+            if (position != -1)
+            {
+                positions[resolved++] = position;
+            }
+        }
+        qsort(positions, resolved, sizeof(uint64_t), compare_positions);
+
+        uint32_t distinct = 0;
+        for (uint32_t r = 0; r < resolved; r++)
+        {
+            if (distinct == 0 || positions[distinct - 1] != positions[r])
+            {
+                positions[distinct++] = positions[r];
+                counts[positions[r]]++;
+            }
+        }
+        build->num_distinct[i] = distinct;
+    }
+    free(refs);
+    return 0;
+}
+
+/* Pass 2: scatter the ways [begin, end) through this worker's cursors, keeping way order */
+int fill_node_ways(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    NodeWays_Build *build = arg;
+    uint32_t *cursors = build->counts[worker];
+
+    for (uint64_t i = begin; i < end; i++)
+    {
+        uint64_t *positions = build->positions + build->ref_offsets[i];
+        for (uint32_t r = 0; r < build->num_distinct[i]; r++)
+        {
+            build->map->node_ways[build->map->node_way_offsets[positions[r]] + cursors[positions[r]]++] = i;
+        }
+    }
+    return 0;
+}
+
+int OSM_Map_build_node_ways(OSM_Map *mp)
+{
+    if (mp->lazy || mp->num_ways > UINT32_MAX)
+    {
+        return -1;
+    }
+    if (mp->node_way_offsets)
+    {
+        return 0;
+    }
+    if (build_node_locations(mp) == -1)
+    {
+        return -1;
+    }
+
+    NodeWays_Build build;
+    memset(&build, 0, sizeof(build));
+    build.map = mp;
+    build.ref_offsets = malloc(sizeof(uint64_t) * (mp->num_ways + 1));
+    build.num_distinct = malloc(sizeof(uint32_t) * (mp->num_ways ? mp->num_ways : 1));
+    mp->node_way_offsets = malloc(sizeof(uint64_t) * (mp->num_nodes + 1));
+
+    int result = -1;
+    if (!build.ref_offsets || !build.num_distinct || !mp->node_way_offsets)
+    {
+        goto done;
+    }
+
+    build.ref_offsets[0] = 0;
+    for (uint64_t i = 0; i < mp->num_ways; i++)
+    {
+        build.ref_offsets[i + 1] = build.ref_offsets[i] + mp->ways[i].refs_count;
+    }
+    build.positions = malloc(sizeof(uint64_t) * (build.ref_offsets[mp->num_ways] ? build.ref_offsets[mp->num_ways] : 1));
+    if (!build.positions || parallel_for(mp->num_ways, MIN_WAYS_PER_WORKER, count_node_ways, &build) == -1)
+    {
+        goto done;
+    }
+
+    // exclusive prefix sum over (node, worker): worker w's ways for node p follow those of workers < w
+    uint64_t total = 0;
+    for (uint64_t p = 0; p < mp->num_nodes; p++)
+    {
+        mp->node_way_offsets[p] = total;
+        for (int w = 0; w < PARALLEL_MAX_WORKERS && build.counts[w]; w++)
+        {
+            uint32_t count = build.counts[w][p];
+            build.counts[w][p] = total - mp->node_way_offsets[p];
+            total += count;
+        }
+    }
+    mp->node_way_offsets[mp->num_nodes] = total;
+
+    mp->node_ways = malloc(sizeof(uint32_t) * (total ? total : 1));
+    if (!mp->node_ways || parallel_for(mp->num_ways, MIN_WAYS_PER_WORKER, fill_node_ways, &build) == -1)
+    {
+        goto done;
+    }
+    result = 0;
+
+done:
+    for (int w = 0; w < PARALLEL_MAX_WORKERS; w++)
+    {
+        free(build.counts[w]);
+    }
+    free(build.ref_offsets);
+    free(build.positions);
+    free(build.num_distinct);
+    if (result == -1)
+    {
+        free(mp->node_way_offsets);
+        mp->node_way_offsets = NULL;
+        free(mp->node_ways);
+        mp->node_ways = NULL;
+    }
+    return result;
+}
+
+int OSM_Map_get_ways_for_node(OSM_Map *mp, OSM_Id node_id, OSM_Way **ways, int max)
+{
+    if (OSM_Map_build_node_ways(mp) == -1)
+    {
+        return -1;
+    }
+
+    int64_t position = node_position(mp, node_id);
+    if (position == -1)
+    {
+        return 0;
+    }
+
+    uint64_t first = mp->node_way_offsets[position];
+    uint64_t count = mp->node_way_offsets[position + 1] - first;
+    for (uint64_t i = 0; i < count && (int64_t)i < max; i++)
+    {
+        ways[i] = &mp->ways[mp->node_ways[first + i]];
+    }
+    return count;
+}
+
+int OSM_Map_find_intersections(OSM_Map *mp, OSM_NodeVisitor callback, void *arg)
+{
+    if (OSM_Map_build_node_ways(mp) == -1)
+    {
+        return -1;
+    }
+
+    // one pass over the offsets: a node is an intersection when more than one way uses it
+    int found = 0;
+    for (uint64_t p = 0; p < mp->num_nodes; p++)
+    {
+        if (mp->node_way_offsets[p + 1] - mp->node_way_offsets[p] > 1)
+        {
+            found++;
+            if (callback(&mp->nodes[p], arg))
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+/* Way bounding boxes */
+
+/* Boxes of the ways [begin, end): one decode of each way's refs, then a location lookup per ref */
+int compute_way_boxes(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    OSM_Map *map = arg;
+    OSM_Id *refs = NULL;
+    int64_t refs_capacity = 0;
+
+    for (uint64_t i = begin; i < end; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        if (way->refs_count > refs_capacity)
+        {
+            free(refs);
+            refs_capacity = way->refs_count * 2;
+            refs = malloc(sizeof(OSM_Id) * refs_capacity);
+            if (!refs)
+            {
+                return -1;
+            }
+        }
+
+        int num_refs = OSM_Way_copy_refs(way, refs, way->refs_count);
+        OSM_Lon min_lon = INT64_MAX, max_lon = INT64_MIN;
+        OSM_Lat min_lat = INT64_MAX, max_lat = INT64_MIN;
+        for (int r = 0; r < num_refs; r++)
+        {
+            int64_t position = node_position(map, refs[r]);
+            if (position == -1)
+            {
+                continue; // refs outside an extract
+            }
+            OSM_Node *node = &map->nodes[position];
+            min_lon = node->lon < min_lon ? node->lon : min_lon;
+            max_lon = node->lon > max_lon ? node->lon : max_lon;
+            min_lat = node->lat < min_lat ? node->lat : min_lat;
+            max_lat = node->lat > max_lat ? node->lat : max_lat;
+        }
+
+        if (min_lon > max_lon)
+        {
+            // no resolvable ref: an empty box that intersects nothing
+            map->way_boxes[i] = (OSM_RTreeBox){INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+        }
+        else
+        {
+            rtree_box_from_nano(&map->way_boxes[i], min_lon, min_lat, max_lon, max_lat);
+        }
+    }
+    free(refs);
+    return 0;
+}
+
+int OSM_Map_compute_Way_bboxes(OSM_Map *mp)
+{
+    if (mp->lazy)
+    {
+        return -1;
+    }
+    if (mp->way_boxes)
+    {
+        return 0;
+    }
+    if (build_node_locations(mp) == -1)
+    {
+        return -1;
+    }
+
+    mp->way_boxes = malloc(sizeof(OSM_RTreeBox) * (mp->num_ways ? mp->num_ways : 1));
+    if (!mp->way_boxes)
+    {
+        return -1;
+    }
+    if (parallel_for(mp->num_ways, MIN_WAYS_PER_WORKER, compute_way_boxes, mp) == -1)
+    {
+        free(mp->way_boxes);
+        mp->way_boxes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int OSM_Map_get_Way_bbox(OSM_Map *mp, int index, OSM_Lon *min_lonp, OSM_Lat *min_latp, OSM_Lon *max_lonp, OSM_Lat *max_latp)
+{
+    if (index < 0 || (uint64_t)index >= mp->num_ways || OSM_Map_compute_Way_bboxes(mp) == -1)
+    {
+        return -1;
+    }
+
+    OSM_RTreeBox *box = &mp->way_boxes[index];
+    if (box->min_lon > box->max_lon)
+    {
+        return -1;
+    }
+    *min_lonp = (OSM_Lon)box->min_lon * 100;
+    *min_latp = (OSM_Lat)box->min_lat * 100;
+    *max_lonp = (OSM_Lon)box->max_lon * 100;
+    *max_latp = (OSM_Lat)box->max_lat * 100;
+    return 0;
+}
+
+/* State of a way bbox query */
+typedef struct Way_Query
+{
+    OSM_Map *map;
+    OSM_WayVisitor callback;
+    void *arg;
+    int visited;
+} Way_Query;
+
+int visit_way_candidate(uint32_t item, void *arg)
+{
+    Way_Query *query = arg;
+    query->visited++;
+    return query->callback(&query->map->ways[item], query->arg);
+}
+
+int OSM_Map_query_ways_bbox(OSM_Map *mp, OSM_Lon min_lon, OSM_Lat min_lat, OSM_Lon max_lon, OSM_Lat max_lat,
+                            OSM_WayVisitor callback, void *arg)
+{
+    if (mp->num_ways > UINT32_MAX || OSM_Map_compute_Way_bboxes(mp) == -1)
+    {
+        return -1;
+    }
+    if (!mp->way_tree)
+    {
+        mp->way_tree = rtree_build(mp->way_boxes, mp->num_ways);
+        if (!mp->way_tree)
+        {
+            return -1;
+        }
+    }
+
+    Way_Query query = {mp, callback, arg, 0};
+    OSM_RTreeBox box;
+    rtree_box_from_nano(&box, min_lon, min_lat, max_lon, max_lat);
+    rtree_query(mp->way_tree, &box, visit_way_candidate, &query);
+    return query.visited;
+}
+
+/* Tag filters */
+
+/* One key (and optional value) of a clause; a way's tag matching it sets the clause's bit */
+typedef struct Tag_Term
+{
+    uint32_t key;   // pool id
+    uint32_t value; // pool id, STRING_POOL_NONE for any value
+    int clause;
+} Tag_Term;
+
+struct OSM_TagFilter
+{
+    Tag_Term *terms;
+    int num_terms;
+    uint64_t required;  // clauses some tag must match
+    uint64_t forbidden; // clauses no tag may match
+};
+
+/* Add a term for key and value (NULL for any), dropping it when a string never occurs in the map */
+int add_tag_term(OSM_Map *map, OSM_TagFilter *filter, const char *key, size_t key_len, const char *value, size_t value_len,
+                 int clause, int *capacity)
+{
+    uint32_t key_id = string_pool_find(map->strings, key, key_len);
+    uint32_t value_id = value ? string_pool_find(map->strings, value, value_len) : STRING_POOL_NONE;
+    if (key_id == STRING_POOL_NONE || (value && value_id == STRING_POOL_NONE))
+    {
+        return 0; // no tag can match it
+    }
+
+    if (filter->num_terms == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        Tag_Term *terms = realloc(filter->terms, sizeof(Tag_Term) * *capacity);
+        if (!terms)
+        {
+            return -1;
+        }
+        filter->terms = terms;
+    }
+    filter->terms[filter->num_terms++] = (Tag_Term){key_id, value_id, clause};
+    return 0;
+}
+
+/* Parse one clause: key, key=*, key=value|value..., key!=value|value... or !key */
+int compile_clause(OSM_Map *map, OSM_TagFilter *filter, const char *clause, size_t len, int number, int *capacity)
+{
+    int negated = 0;
+    const char *key = clause;
+    size_t key_len = len;
+    const char *values = NULL;
+    const char *end = clause + len;
+
+    const char *equals = memchr(clause, '=', len);
+    if (equals)
+    {
+        key_len = equals - clause;
+        values = equals + 1;
+        if (key_len > 0 && clause[key_len - 1] == '!')
+        {
+            negated = 1;
+            key_len--;
+        }
+    }
+    else if (len > 0 && clause[0] == '!')
+    {
+        negated = 1;
+        key++;
+        key_len--;
+    }
+
+    if (key_len == 0 || (values && values == end))
+    {
+        return -1;
+    }
+
+    if (!values || (end - values == 1 && *values == '*'))
+    {
+        if (add_tag_term(map, filter, key, key_len, NULL, 0, number, capacity) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        while (values < end)
+        {
+            const char *bar = memchr(values, '|', end - values);
+            const char *value_end = bar ? bar : end;
+            if (value_end == values || (bar && bar + 1 == end))
+            {
+                return -1;
+            }
+            if (add_tag_term(map, filter, key, key_len, values, value_end - values, number, capacity) == -1)
+            {
+                return -1;
+            }
+            values = value_end + (bar != NULL);
+        }
+    }
+
+    if (negated)
+    {
+        filter->forbidden |= 1ULL << number;
+    }
+    else
+    {
+        filter->required |= 1ULL << number;
+    }
+    return 0;
+}
+
+OSM_TagFilter *OSM_TagFilter_compile(OSM_Map *mp, const char *expr)
+{
+    if (mp->lazy || !expr || *expr == '\0')
+    {
+        return NULL;
+    }
+
+    OSM_TagFilter *filter = calloc(1, sizeof(OSM_TagFilter));
+    if (!filter)
+    {
+        return NULL;
+    }
+
+    int capacity = 0;
+    int number = 0;
+    const char *clause = expr;
+    while (1)
+    {
+        const char *comma = strchr(clause, ',');
+        size_t len = comma ? (size_t)(comma - clause) : strlen(clause);
+        if (number == OSM_TAG_FILTER_MAX_CLAUSES || compile_clause(mp, filter, clause, len, number, &capacity) == -1)
+        {
+            OSM_TagFilter_free(filter);
             return NULL;
         }
+        number++;
+        if (!comma)
+        {
+            break;
+        }
+        clause = comma + 1;
+    }
+    return filter;
+}
+
+void OSM_TagFilter_free(OSM_TagFilter *filter)
+{
+    if (!filter)
+    {
+        return;
+    }
+    free(filter->terms);
+    free(filter);
+}
+
+/* Every term against every tag, accumulating clause bits without branching on the comparisons */
+int way_matches(const OSM_TagFilter *filter, const OSM_Way *way)
+{
+    uint64_t matched = 0;
+    for (int64_t t = 0; t < way->keys_count; t++)
+    {
+        uint32_t key = way->keys[t];
+        uint32_t value = way->values[t];
+        for (int i = 0; i < filter->num_terms; i++)
+        {
+            const Tag_Term *term = &filter->terms[i];
+            uint64_t hit = (key == term->key) & ((term->value == STRING_POOL_NONE) | (value == term->value));
+            matched |= hit << term->clause;
+        }
+    }
+    return (matched & filter->required) == filter->required && (matched & filter->forbidden) == 0;
+}
+
+/* State shared by the workers scanning the ways */
+typedef struct Tag_Scan
+{
+    OSM_Map *map;
+    const OSM_TagFilter *filter;
+    uint8_t *matches; // per way
+} Tag_Scan;
+
+int scan_way_tags(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Tag_Scan *scan = arg;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        scan->matches[i] = way_matches(scan->filter, &scan->map->ways[i]);
+    }
+    return 0;
+}
+
+/* Inverted tag index */
+
+/* A tag bucketed under its key: the value and the way carrying it */
+typedef struct Tag_Entry
+{
+    uint32_t value;
+    uint32_t way;
+} Tag_Entry;
+
+/* State shared by the workers sorting the key buckets */
+typedef struct TagIndex_Build
+{
+    Tag_Entry *entries;
+    uint64_t *key_start; // bucket of key k is entries[key_start[k] .. key_start[k + 1]]
+} TagIndex_Build;
+
+int compare_tag_entries(const void *a, const void *b)
+{
+    const Tag_Entry *x = a;
+    const Tag_Entry *y = b;
+    if (x->value != y->value)
+    {
+        return x->value < y->value ? -1 : 1;
+    }
+    return x->way < y->way ? -1 : x->way > y->way;
+}
+
+int sort_key_buckets(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    TagIndex_Build *build = arg;
+    for (uint64_t k = begin; k < end; k++)
+    {
+        uint64_t first = build->key_start[k];
+        qsort(build->entries + first, build->key_start[k + 1] - first, sizeof(Tag_Entry), compare_tag_entries);
+    }
+    return 0;
+}
+
+/* Append the ways of entries [0, count) (ascending, repeats skipped) as a posting list */
+int append_postings(OSM_RefStore *buf, Tag_Postings *postings, const Tag_Entry *entries, uint64_t count)
+{
+    postings->offset = buf->size;
+    postings->count = 0;
+
+    int64_t previous = -1;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (entries[i].way == previous)
+        {
+            continue;
+        }
+        uint8_t encoded[VARINT_MAX_BYTES];
+        uint64_t delta = entries[i].way - (previous == -1 ? 0 : previous);
+        size_t encoded_size = varint_encode(delta << 1, encoded); // zig-zag of a non negative delta
+        if (ref_store_append(buf, encoded, encoded_size) == -1)
+        {
+            return -1;
+        }
+        previous = entries[i].way;
+        postings->count++;
+    }
+    postings->size = buf->size - postings->offset;
+    return 0;
+}
+
+/* Bucket every tag by key in way order, encode the key postings, then sort each bucket into pair runs */
+int build_tag_index(OSM_Map *map, OSM_TagIndex *index, TagIndex_Build *build)
+{
+    uint32_t num_keys = index->num_keys;
+    build->key_start = calloc((uint64_t)num_keys + 1, sizeof(uint64_t));
+    if (!build->key_start)
+    {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < map->num_ways; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        for (int64_t t = 0; t < way->keys_count; t++)
+        {
+            build->key_start[way->keys[t] + 1]++;
+        }
+    }
+    for (uint32_t k = 0; k < num_keys; k++)
+    {
+        build->key_start[k + 1] += build->key_start[k];
+    }
+
+    uint64_t *fill = malloc(sizeof(uint64_t) * (num_keys ? num_keys : 1));
+    build->entries = malloc(sizeof(Tag_Entry) * (build->key_start[num_keys] ? build->key_start[num_keys] : 1));
+    if (!fill || !build->entries)
+    {
+        free(fill);
+        return -1;
+    }
+    memcpy(fill, build->key_start, sizeof(uint64_t) * num_keys);
+
+    for (uint64_t i = 0; i < map->num_ways; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        for (int64_t t = 0; t < way->keys_count; t++)
+        {
+            build->entries[fill[way->keys[t]]++] = (Tag_Entry){way->values[t], (uint32_t)i};
+        }
+    }
+    free(fill);
+
+    // buckets are in way order now, which is the key postings order
+    index->keys = malloc(sizeof(Tag_Postings) * (num_keys ? num_keys : 1));
+    index->pair_start = malloc(sizeof(uint64_t) * ((uint64_t)num_keys + 1));
+    if (!index->keys || !index->pair_start)
+    {
+        return -1;
+    }
+    for (uint32_t k = 0; k < num_keys; k++)
+    {
+        uint64_t first = build->key_start[k];
+        if (append_postings(&index->buf, &index->keys[k], build->entries + first, build->key_start[k + 1] - first) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (parallel_for(num_keys, MIN_KEYS_PER_WORKER, sort_key_buckets, build) == -1)
+    {
+        return -1;
+    }
+
+    // one pair per run of equal values
+    uint64_t num_pairs = 0;
+    for (uint32_t k = 0; k < num_keys; k++)
+    {
+        for (uint64_t e = build->key_start[k]; e < build->key_start[k + 1]; e++)
+        {
+            num_pairs += e == build->key_start[k] || build->entries[e].value != build->entries[e - 1].value;
+        }
+    }
+    index->pairs = calloc(num_pairs ? num_pairs : 1, sizeof(Tag_PairPostings)); // zeroed, snapshots save the padding too
+    if (!index->pairs)
+    {
+        return -1;
+    }
+
+    uint64_t pair = 0;
+    for (uint32_t k = 0; k < num_keys; k++)
+    {
+        index->pair_start[k] = pair;
+        uint64_t run = build->key_start[k];
+        while (run < build->key_start[k + 1])
+        {
+            uint64_t run_end = run + 1;
+            while (run_end < build->key_start[k + 1] && build->entries[run_end].value == build->entries[run].value)
+            {
+                run_end++;
+            }
+            index->pairs[pair].value = build->entries[run].value;
+            if (append_postings(&index->buf, &index->pairs[pair].postings, build->entries + run, run_end - run) == -1)
+            {
+                return -1;
+            }
+            pair++;
+            run = run_end;
+        }
+    }
+    index->pair_start[num_keys] = pair;
+    return 0;
+}
+
+int OSM_Map_build_tag_index(OSM_Map *mp)
+{
+    if (mp->lazy || mp->num_ways > UINT32_MAX)
+    {
+        return -1;
+    }
+    if (mp->tag_index)
+    {
+        return 0;
+    }
+
+    OSM_TagIndex *index = calloc(1, sizeof(OSM_TagIndex));
+    if (!index)
+    {
+        return -1;
+    }
+    index->num_keys = mp->strings->count;
+
+    TagIndex_Build build = {NULL, NULL};
+    int result = build_tag_index(mp, index, &build);
+    free(build.entries);
+    free(build.key_start);
+    if (result == -1)
+    {
+        tag_index_free(mp, index);
+        return -1;
+    }
+    mp->tag_index = index;
+    return 0;
+}
+
+/* Postings of a term, NULL when no way carries it */
+const Tag_Postings *term_postings(const OSM_TagIndex *index, const Tag_Term *term)
+{
+    if (term->key >= index->num_keys)
+    {
+        return NULL;
+    }
+    if (term->value == STRING_POOL_NONE)
+    {
+        return &index->keys[term->key];
+    }
+
+    uint64_t low = index->pair_start[term->key];
+    uint64_t high = index->pair_start[term->key + 1];
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (index->pairs[mid].value < term->value)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low < index->pair_start[term->key + 1] && index->pairs[low].value == term->value)
+    {
+        return &index->pairs[low].postings;
+    }
+    return NULL;
+}
+
+/* Sorted list of way positions */
+typedef struct Tag_Positions
+{
+    int64_t *positions;
+    uint64_t count;
+} Tag_Positions;
+
+/* Ways matching any term of a clause: the decoded postings, merged when there are several */
+int clause_positions(const OSM_TagIndex *index, const OSM_TagFilter *filter, int clause, Tag_Positions *out)
+{
+    uint64_t total = 0;
+    int num_lists = 0;
+    for (int i = 0; i < filter->num_terms; i++)
+    {
+        const Tag_Postings *postings = filter->terms[i].clause == clause ? term_postings(index, &filter->terms[i]) : NULL;
+        if (postings)
+        {
+            total += postings->count;
+            num_lists++;
+        }
+    }
+
+    out->count = 0;
+    out->positions = malloc(sizeof(int64_t) * (total ? total : 1));
+    if (!out->positions)
+    {
+        return -1;
+    }
+    for (int i = 0; i < filter->num_terms; i++)
+    {
+        const Tag_Postings *postings = filter->terms[i].clause == clause ? term_postings(index, &filter->terms[i]) : NULL;
+        if (postings)
+        {
+            out->count += varint_decode_deltas(index->buf.buf + postings->offset, postings->size,
+                                               out->positions + out->count, postings->count);
+        }
+    }
+
+    if (num_lists > 1)
+    {
+        qsort(out->positions, out->count, sizeof(int64_t), compare_positions); // positions are never negative
+        uint64_t unique = 0;
+        for (uint64_t i = 0; i < out->count; i++)
+        {
+            if (unique == 0 || out->positions[i] != out->positions[unique - 1])
+            {
+                out->positions[unique++] = out->positions[i];
+            }
+        }
+        out->count = unique;
+    }
+    return 0;
+}
+
+/* First index at or after from whose position is >= target: gallop, then binary search the bracket */
+uint64_t gallop_position(const Tag_Positions *list, uint64_t from, int64_t target)
+{
+    uint64_t step = 1;
+    uint64_t low = from;
+    uint64_t high = from;
+    while (high < list->count && list->positions[high] < target)
+    {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > list->count)
+    {
+        high = list->count;
+    }
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (list->positions[mid] < target)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Keep the candidates that are (or, with keep_found 0, are not) in list */
+void intersect_positions(Tag_Positions *candidates, const Tag_Positions *list, int keep_found)
+{
+    uint64_t kept = 0;
+    uint64_t at = 0;
+    for (uint64_t i = 0; i < candidates->count; i++)
+    {
+        at = gallop_position(list, at, candidates->positions[i]);
+        int found = at < list->count && list->positions[at] == candidates->positions[i];
+        if (found == keep_found)
+        {
+            candidates->positions[kept++] = candidates->positions[i];
+        }
+    }
+    candidates->count = kept;
+}
+
+int compare_position_counts(const void *a, const void *b)
+{
+    uint64_t x = ((const Tag_Positions *)a)->count;
+    uint64_t y = ((const Tag_Positions *)b)->count;
+    return x < y ? -1 : x > y;
+}
+
+/* Answer a filter from the postings: intersect the required clauses shortest first, then drop the forbidden ones */
+int filter_indexed_ways(OSM_Map *map, const OSM_TagFilter *filter, OSM_WayVisitor callback, void *arg)
+{
+    Tag_Positions required[OSM_TAG_FILTER_MAX_CLAUSES];
+    Tag_Positions forbidden[OSM_TAG_FILTER_MAX_CLAUSES];
+    int num_required = 0;
+    int num_forbidden = 0;
+    int result = 0;
+
+    for (int clause = 0; clause < OSM_TAG_FILTER_MAX_CLAUSES && result == 0; clause++)
+    {
+        if (filter->required & (1ULL << clause))
+        {
+            result = clause_positions(map->tag_index, filter, clause, &required[num_required++]);
+        }
+        else if (filter->forbidden & (1ULL << clause))
+        {
+            result = clause_positions(map->tag_index, filter, clause, &forbidden[num_forbidden++]);
+        }
+    }
+
+    int visited = 0;
+    if (result == 0)
+    {
+        qsort(required, num_required, sizeof(Tag_Positions), compare_position_counts);
+        Tag_Positions *candidates = &required[0];
+        for (int i = 1; i < num_required && candidates->count > 0; i++)
+        {
+            intersect_positions(candidates, &required[i], 1);
+        }
+        for (int i = 0; i < num_forbidden && candidates->count > 0; i++)
+        {
+            intersect_positions(candidates, &forbidden[i], 0);
+        }
+
+        for (uint64_t i = 0; i < candidates->count; i++)
+        {
+            visited++;
+            if (callback(&map->ways[candidates->positions[i]], arg))
+            {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_required; i++)
+    {
+        free(required[i].positions);
+    }
+    for (int i = 0; i < num_forbidden; i++)
+    {
+        free(forbidden[i].positions);
+    }
+    return result == -1 ? -1 : visited;
+}
+
+/* Answer from the tag index when it is built and some clause is required, else scan every way */
+int OSM_Map_filter_ways(OSM_Map *mp, const OSM_TagFilter *filter, OSM_WayVisitor callback, void *arg)
+{
+    if (mp->lazy)
+    {
+        return -1;
+    }
+    if (mp->tag_index && filter->required)
+    {
+        return filter_indexed_ways(mp, filter, callback, arg);
+    }
+
+    Tag_Scan scan = {mp, filter, malloc(mp->num_ways ? mp->num_ways : 1)};
+    if (!scan.matches)
+    {
+        return -1;
+    }
+    if (parallel_for(mp->num_ways, MIN_WAYS_PER_WORKER, scan_way_tags, &scan) == -1)
+    {
+        free(scan.matches);
+        return -1;
+    }
+
+    int visited = 0;
+    for (uint64_t i = 0; i < mp->num_ways; i++)
+    {
+        if (scan.matches[i])
+        {
+            visited++;
+            if (callback(&mp->ways[i], arg))
+            {
+                break;
+            }
+        }
+    }
+    free(scan.matches);
+    return visited;
+}
+
+/* Build the indexes the queries otherwise build on first use, after which they only read the map */
+int OSM_Map_build_query_indexes(OSM_Map *mp, int indexes)
+{
+    if (mp->lazy)
+    {
+        return -1;
+    }
+    if ((indexes & OSM_INDEX_NODE_TREE) && !mp->node_tree && !(mp->node_tree = build_node_tree(mp)))
+    {
+        return -1;
+    }
+    if ((indexes & OSM_INDEX_NODE_KDTREE) && build_node_kdtree(mp) == -1)
+    {
+        return -1;
+    }
+    if ((indexes & OSM_INDEX_NODE_LOCATIONS) && build_node_locations(mp) == -1)
+    {
+        return -1;
+    }
+    if ((indexes & OSM_INDEX_TAGS) && OSM_Map_build_tag_index(mp) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Snapshots */
+
+#define SNAPSHOT_MAGIC "OSMSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_ALIGN 8
+
+/* Header flags */
+#define SNAPSHOT_BBOX 0x1
+#define SNAPSHOT_NODES_UNSORTED 0x2
+#define SNAPSHOT_WAYS_UNSORTED 0x4
+#define SNAPSHOT_SUMMARIZED 0x8
+
+/* Sections of a snapshot: flat arrays in the layout the map uses in memory */
+enum
+{
+    SNAP_NODES,            // OSM_Node by position
+    SNAP_NODE_VERSIONS,    // int32 by node position
+    SNAP_WAYS,             // Snapshot_Way by position
+    SNAP_WAY_TAGS,         // pool ids, the keys then the values of every way
+    SNAP_WAY_VERSIONS,     // int32 by way position
+    SNAP_REFS,             // the ref store
+    SNAP_STRING_OFFSETS,   // uint64 by pool id, into SNAP_STRING_BYTES
+    SNAP_STRING_BYTES,     // NUL terminated strings back to back
+    SNAP_STRING_HASHES,    // uint64 by pool id
+    SNAP_STRING_SLOTS,     // the pool's open addressing table
+    SNAP_NODE_LOCATIONS,   // the indexes built before saving, each optional
+    SNAP_WAY_BOXES,
+    SNAP_NODE_WAY_OFFSETS,
+    SNAP_NODE_WAYS,
+    SNAP_TAG_KEYS,
+    SNAP_TAG_PAIR_START,
+    SNAP_TAG_PAIRS,
+    SNAP_TAG_POSTINGS,
+    SNAP_NODE_TREE_ITEMS,
+    SNAP_NODE_TREE_BOXES,
+    SNAP_WAY_TREE_ITEMS,
+    SNAP_WAY_TREE_BOXES,
+    SNAP_KDTREE_POINTS,
+    SNAP_SECTIONS
+};
+
+#define SNAPSHOT_REQUIRED ((1u << SNAP_NODES) | (1u << SNAP_WAYS) | (1u << SNAP_WAY_TAGS) | (1u << SNAP_REFS) |      \
+                           (1u << SNAP_STRING_OFFSETS) | (1u << SNAP_STRING_BYTES) | (1u << SNAP_STRING_HASHES) | \
+                           (1u << SNAP_STRING_SLOTS))
+
+typedef struct Snapshot_Section
+{
+    uint64_t offset; // multiple of SNAPSHOT_ALIGN
+    uint64_t size;   // bytes
+} Snapshot_Section;
+
+/* Shape of a saved R-tree, its items and boxes are sections */
+typedef struct Snapshot_Tree
+{
+    uint32_t count;
+    int32_t num_levels;
+    uint64_t level_start[RTREE_MAX_LEVELS];
+    uint64_t level_count[RTREE_MAX_LEVELS];
+} Snapshot_Tree;
+
+/* Way without pointers: its keys are SNAP_WAY_TAGS[tags ..] and its values follow them */
+typedef struct Snapshot_Way
+{
+    OSM_Id id;
+    uint64_t tags;
+    uint64_t refs_offset;
+    uint32_t refs_size;
+    uint32_t num_keys;
+    int64_t refs_count;
+} Snapshot_Way;
+
+/* Layout of a snapshot file: this header, then every present section at its offset */
+typedef struct Snapshot_Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint32_t flags;   // SNAPSHOT_* flags
+    uint32_t present; // bit s is set when section s was saved
+    uint64_t num_nodes;
+    uint64_t num_ways;
+    uint32_t num_strings;
+    uint32_t num_string_slots;
+    uint32_t tag_keys; // pool ids covered by the tag index
+    uint32_t reserved;
+    OSM_BBox bbox;
+    OSM_BBox node_extent;
+    OSM_Summary summary;
+    Snapshot_Tree node_tree;
+    Snapshot_Tree way_tree;
+    Snapshot_Section sections[SNAP_SECTIONS];
+} Snapshot_Header;
+
+/* Pad the file to the next aligned offset and start section s there */
+int begin_section(FILE *out, Snapshot_Header *header, int s)
+{
+    static const char padding[SNAPSHOT_ALIGN];
+    off_t pos = ftello(out);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    size_t pad = (SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    if (fwrite(padding, 1, pad, out) != pad)
+    {
+        return -1;
+    }
+    header->sections[s].offset = pos + pad;
+    header->present |= 1u << s;
+    return 0;
+}
+
+int end_section(FILE *out, Snapshot_Header *header, int s)
+{
+    off_t pos = ftello(out);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    header->sections[s].size = pos - header->sections[s].offset;
+    return 0;
+}
+
+int write_section(FILE *out, Snapshot_Header *header, int s, const void *data, uint64_t size)
+{
+    if (begin_section(out, header, s) == -1 || (size && fwrite(data, 1, size, out) != size))
+    {
+        return -1;
+    }
+    return end_section(out, header, s);
+}
+
+/* Ways as Snapshot_Way records, then their tags */
+int write_ways(FILE *out, Snapshot_Header *header, OSM_Map *map)
+{
+    uint64_t tags = 0;
+    if (begin_section(out, header, SNAP_WAYS) == -1)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < map->num_ways; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        Snapshot_Way record = {way->id, tags, way->refs_offset, way->refs_size, (uint32_t)way->keys_count, way->refs_count};
+        if (fwrite(&record, sizeof(record), 1, out) != 1)
+        {
+            return -1;
+        }
+        tags += 2 * way->keys_count;
+    }
+
+    if (end_section(out, header, SNAP_WAYS) == -1 || begin_section(out, header, SNAP_WAY_TAGS) == -1)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < map->num_ways; i++)
+    {
+        OSM_Way *way = &map->ways[i];
+        if (way->keys_count && (fwrite(way->keys, sizeof(uint32_t), way->keys_count, out) != (size_t)way->keys_count ||
+                                fwrite(way->values, sizeof(uint32_t), way->keys_count, out) != (size_t)way->keys_count))
+        {
+            return -1;
+        }
+    }
+    return end_section(out, header, SNAP_WAY_TAGS);
+}
+
+/* The pool's strings packed back to back with their offsets, then its hash table as is */
+int write_strings(FILE *out, Snapshot_Header *header, OSM_StringPool *pool)
+{
+    uint64_t offset = 0;
+    if (begin_section(out, header, SNAP_STRING_OFFSETS) == -1)
+    {
+        return -1;
+    }
+    for (uint32_t id = 0; id < pool->count; id++)
+    {
+        if (fwrite(&offset, sizeof(offset), 1, out) != 1)
+        {
+            return -1;
+        }
+        offset += strlen(pool->strings[id]) + 1;
+    }
+
+    if (end_section(out, header, SNAP_STRING_OFFSETS) == -1 || begin_section(out, header, SNAP_STRING_BYTES) == -1)
+    {
+        return -1;
+    }
+    for (uint32_t id = 0; id < pool->count; id++)
+    {
+        size_t size = strlen(pool->strings[id]) + 1;
+        if (fwrite(pool->strings[id], 1, size, out) != size)
+        {
+            return -1;
+        }
+    }
+
+    if (end_section(out, header, SNAP_STRING_BYTES) == -1 ||
+        write_section(out, header, SNAP_STRING_HASHES, pool->hashes, sizeof(uint64_t) * pool->count) == -1 ||
+        write_section(out, header, SNAP_STRING_SLOTS, pool->slots, sizeof(uint32_t) * pool->num_slots) == -1)
+    {
+        return -1;
+    }
+    header->num_strings = pool->count;
+    header->num_string_slots = pool->num_slots;
+    return 0;
+}
+
+int write_rtree(FILE *out, Snapshot_Header *header, const OSM_RTree *tree, Snapshot_Tree *shape, int items)
+{
+    int last = tree->num_levels - 1;
+    shape->count = tree->count;
+    shape->num_levels = tree->num_levels;
+    memcpy(shape->level_start, tree->level_start, sizeof(shape->level_start));
+    memcpy(shape->level_count, tree->level_count, sizeof(shape->level_count));
+
+    if (write_section(out, header, items, tree->items, sizeof(uint32_t) * tree->count) == -1)
+    {
+        return -1;
+    }
+    return write_section(out, header, items + 1, tree->boxes,
+                         sizeof(OSM_RTreeBox) * (tree->level_start[last] + tree->level_count[last]));
+}
+
+/* Every section of the map, and of the indexes it has built */
+int write_snapshot_sections(FILE *out, Snapshot_Header *header, OSM_Map *map)
+{
+    if (write_section(out, header, SNAP_NODES, map->nodes, sizeof(OSM_Node) * map->num_nodes) == -1 ||
+        write_ways(out, header, map) == -1 ||
+        write_section(out, header, SNAP_REFS, map->ref_store->buf, map->ref_store->size) == -1 ||
+        write_strings(out, header, map->strings) == -1)
+    {
+        return -1;
+    }
+
+    if (map->node_versions &&
+        write_section(out, header, SNAP_NODE_VERSIONS, map->node_versions, sizeof(int32_t) * map->num_nodes) == -1)
+    {
+        return -1;
+    }
+    if (map->way_versions &&
+        write_section(out, header, SNAP_WAY_VERSIONS, map->way_versions, sizeof(int32_t) * map->num_ways) == -1)
+    {
+        return -1;
+    }
+    if (map->node_locations &&
+        write_section(out, header, SNAP_NODE_LOCATIONS, map->node_locations, sizeof(OSM_NodeLocation) * map->num_nodes) == -1)
+    {
+        return -1;
+    }
+    if (map->way_boxes &&
+        write_section(out, header, SNAP_WAY_BOXES, map->way_boxes, sizeof(OSM_RTreeBox) * map->num_ways) == -1)
+    {
+        return -1;
+    }
+    if (map->node_way_offsets &&
+        (write_section(out, header, SNAP_NODE_WAY_OFFSETS, map->node_way_offsets, sizeof(uint64_t) * (map->num_nodes + 1)) == -1 ||
+         write_section(out, header, SNAP_NODE_WAYS, map->node_ways, sizeof(uint32_t) * map->node_way_offsets[map->num_nodes]) == -1))
+    {
+        return -1;
+    }
+
+    OSM_TagIndex *index = map->tag_index;
+    if (index)
+    {
+        uint64_t num_pairs = index->pair_start[index->num_keys];
+        header->tag_keys = index->num_keys;
+        if (write_section(out, header, SNAP_TAG_KEYS, index->keys, sizeof(Tag_Postings) * index->num_keys) == -1 ||
+            write_section(out, header, SNAP_TAG_PAIR_START, index->pair_start, sizeof(uint64_t) * (index->num_keys + 1)) == -1 ||
+            write_section(out, header, SNAP_TAG_PAIRS, index->pairs, sizeof(Tag_PairPostings) * num_pairs) == -1 ||
+            write_section(out, header, SNAP_TAG_POSTINGS, index->buf.buf, index->buf.size) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (map->node_tree && write_rtree(out, header, map->node_tree, &header->node_tree, SNAP_NODE_TREE_ITEMS) == -1)
+    {
+        return -1;
+    }
+    if (map->way_tree && write_rtree(out, header, map->way_tree, &header->way_tree, SNAP_WAY_TREE_ITEMS) == -1)
+    {
+        return -1;
+    }
+    if (map->node_kdtree &&
+        write_section(out, header, SNAP_KDTREE_POINTS, map->node_kdtree->points, sizeof(OSM_KDPoint) * map->node_kdtree->count) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int OSM_Map_save_snapshot(OSM_Map *mp, const char *path)
+{
+    if (mp->lazy || mp->counted)
+    {
+        return -1;
+    }
+
+    // written aside and renamed, so a snapshot being read (maybe by this map) is never truncated
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".tmp"));
+    if (!tmp_path)
+    {
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out)
+    {
+        free(tmp_path);
+        return -1;
+    }
+
+    Snapshot_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.flags = (mp->BBox ? SNAPSHOT_BBOX : 0) | (mp->nodes_unsorted ? SNAPSHOT_NODES_UNSORTED : 0) |
+                   (mp->ways_unsorted ? SNAPSHOT_WAYS_UNSORTED : 0) | (mp->summarized ? SNAPSHOT_SUMMARIZED : 0);
+    header.num_nodes = mp->num_nodes;
+    header.num_ways = mp->num_ways;
+    header.bbox = mp->BBox ? *mp->BBox : empty_extent;
+    header.node_extent = mp->node_extent;
+    header.summary = mp->summary;
+
+    // the header is rewritten once the sections are in place
+    int result = fwrite(&header, sizeof(header), 1, out) == 1 ? write_snapshot_sections(out, &header, mp) : -1;
+    if (result != -1)
+    {
+        off_t size = ftello(out);
+        header.file_size = size;
+        if (size < 0 || fseeko(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+        {
+            result = -1;
+        }
+    }
+    if (fclose(out) != 0 || (result != -1 && rename(tmp_path, path) != 0))
+    {
+        result = -1;
+    }
+    if (result == -1)
+    {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    return result;
+}
+
+/* Whether a present section holds exactly count elements of size bytes */
+int section_holds(const Snapshot_Header *header, int s, uint64_t size, uint64_t count)
+{
+    return count <= header->sections[s].size / size && header->sections[s].size == count * size;
+}
+
+int has_section(const Snapshot_Header *header, int s)
+{
+    return (header->present >> s) & 1;
+}
+
+/* Check a saved R-tree: built over the num_items items of the map, shaped as rtree_build shapes it and inside its sections */
+int valid_snapshot_tree(const Snapshot_Header *header, const Snapshot_Tree *tree, int items, uint64_t num_items)
+{
+    if (has_section(header, items) != has_section(header, items + 1))
+    {
+        return 0;
+    }
+    if (!has_section(header, items))
+    {
+        return 1;
+    }
+    if (tree->count != num_items || tree->num_levels < 1 || tree->num_levels > RTREE_MAX_LEVELS ||
+        tree->level_start[0] != 0 || tree->level_count[0] != tree->count)
+    {
+        return 0;
+    }
+
+    // the shape rtree_build gives: each level right after the one below, a box per RTREE_FANOUT of it, up to one root
+    for (int l = 1; l < tree->num_levels; l++)
+    {
+        if (tree->level_start[l] != tree->level_start[l - 1] + tree->level_count[l - 1] ||
+            tree->level_count[l] != (tree->level_count[l - 1] + RTREE_FANOUT - 1) / RTREE_FANOUT)
+        {
+            return 0;
+        }
+    }
+    int last = tree->num_levels - 1;
+    return tree->level_count[last] == (tree->count > 0) &&
+           section_holds(header, items, sizeof(uint32_t), tree->count) &&
+           section_holds(header, items + 1, sizeof(OSM_RTreeBox), tree->level_start[last] + tree->level_count[last]);
+}
+
+/* Check the header against the file: every section in bounds, and sized for the counts it claims */
+int valid_snapshot(const Snapshot_Header *header, uint64_t file_size)
+{
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER || header->file_size != file_size ||
+        (header->present & SNAPSHOT_REQUIRED) != SNAPSHOT_REQUIRED || header->present >> SNAP_SECTIONS != 0)
+    {
+        return 0;
+    }
+    for (int s = 0; s < SNAP_SECTIONS; s++)
+    {
+        const Snapshot_Section *section = &header->sections[s];
+        if (has_section(header, s) &&
+            (section->offset % SNAPSHOT_ALIGN != 0 || section->offset < sizeof(Snapshot_Header) ||
+             section->offset > file_size || section->size > file_size - section->offset))
+        {
+            return 0;
+        }
+    }
+
+    uint32_t slots = header->num_string_slots;
+    if ((slots & (slots - 1)) != 0 || (uint64_t)header->num_strings * 2 > slots || header->tag_keys > header->num_strings)
+    {
+        return 0;
+    }
+
+    return section_holds(header, SNAP_NODES, sizeof(OSM_Node), header->num_nodes) &&
+           section_holds(header, SNAP_WAYS, sizeof(Snapshot_Way), header->num_ways) &&
+           header->sections[SNAP_WAY_TAGS].size % sizeof(uint32_t) == 0 &&
+           section_holds(header, SNAP_STRING_OFFSETS, sizeof(uint64_t), header->num_strings) &&
+           section_holds(header, SNAP_STRING_HASHES, sizeof(uint64_t), header->num_strings) &&
+           section_holds(header, SNAP_STRING_SLOTS, sizeof(uint32_t), slots) &&
+           (!has_section(header, SNAP_NODE_VERSIONS) || section_holds(header, SNAP_NODE_VERSIONS, sizeof(int32_t), header->num_nodes)) &&
+           (!has_section(header, SNAP_WAY_VERSIONS) || section_holds(header, SNAP_WAY_VERSIONS, sizeof(int32_t), header->num_ways)) &&
+           (!has_section(header, SNAP_NODE_LOCATIONS) || section_holds(header, SNAP_NODE_LOCATIONS, sizeof(OSM_NodeLocation), header->num_nodes)) &&
+           (!has_section(header, SNAP_WAY_BOXES) || section_holds(header, SNAP_WAY_BOXES, sizeof(OSM_RTreeBox), header->num_ways)) &&
+           has_section(header, SNAP_NODE_WAY_OFFSETS) == has_section(header, SNAP_NODE_WAYS) &&
+           (!has_section(header, SNAP_NODE_WAY_OFFSETS) || (section_holds(header, SNAP_NODE_WAY_OFFSETS, sizeof(uint64_t), header->num_nodes + 1) &&
+                                                            header->sections[SNAP_NODE_WAYS].size % sizeof(uint32_t) == 0)) &&
+           has_section(header, SNAP_TAG_KEYS) == has_section(header, SNAP_TAG_PAIR_START) &&
+           has_section(header, SNAP_TAG_KEYS) == has_section(header, SNAP_TAG_PAIRS) &&
+           has_section(header, SNAP_TAG_KEYS) == has_section(header, SNAP_TAG_POSTINGS) &&
+           (!has_section(header, SNAP_TAG_KEYS) || (section_holds(header, SNAP_TAG_KEYS, sizeof(Tag_Postings), header->tag_keys) &&
+                                                    section_holds(header, SNAP_TAG_PAIR_START, sizeof(uint64_t), (uint64_t)header->tag_keys + 1) &&
+                                                    header->sections[SNAP_TAG_PAIRS].size % sizeof(Tag_PairPostings) == 0)) &&
+           valid_snapshot_tree(header, &header->node_tree, SNAP_NODE_TREE_ITEMS, header->num_nodes) &&
+           valid_snapshot_tree(header, &header->way_tree, SNAP_WAY_TREE_ITEMS, header->num_ways) &&
+           (!has_section(header, SNAP_KDTREE_POINTS) ||
+            header->sections[SNAP_KDTREE_POINTS].size == sizeof(OSM_KDPoint) * header->num_nodes);
+}
+
+/* Start of a section in the mapping, NULL when it is absent or empty */
+void *section_data(OSM_Map *map, const Snapshot_Header *header, int s)
+{
+    if (!has_section(header, s) || header->sections[s].size == 0)
+    {
+        return NULL;
+    }
+    return (char *)map->mapping + header->sections[s].offset;
+}
+
+/* Ways being rebuilt from their records, bounds checked against the tag and ref sections */
+typedef struct Snapshot_Ways
+{
+    OSM_Map *map;
+    const Snapshot_Way *records;
+    uint32_t *tags;
+    uint64_t num_tags;
+} Snapshot_Ways;
+
+int attach_ways(uint64_t begin, uint64_t end, int worker, void *arg)
+{
+    Snapshot_Ways *ways = arg;
+    OSM_Map *map = ways->map;
+
+    for (uint64_t i = begin; i < end; i++)
+    {
+        const Snapshot_Way *record = &ways->records[i];
+        if (record->tags > ways->num_tags || 2 * (uint64_t)record->num_keys > ways->num_tags - record->tags ||
+            record->refs_offset > map->ref_store->size || record->refs_size > map->ref_store->size - record->refs_offset ||
+            record->num_keys > INT32_MAX || record->refs_count < 0 || record->refs_count > INT32_MAX)
+        {
+            return -1;
+        }
+
+        OSM_Way *way = &map->ways[i];
+        way->id = record->id;
+        way->map = map;
+        way->keys = record->num_keys ? ways->tags + record->tags : NULL;
+        way->values = record->num_keys ? way->keys + record->num_keys : NULL;
+        way->keys_count = record->num_keys;
+        way->vals_count = record->num_keys;
+        way->refs_offset = record->refs_offset;
+        way->refs_size = record->refs_size;
+        way->refs_count = record->refs_count;
+    }
+    return 0;
+}
+
+OSM_RTree *attach_rtree(OSM_Map *map, const Snapshot_Header *header, const Snapshot_Tree *shape, int items)
+{
+    OSM_RTree *tree = calloc(1, sizeof(OSM_RTree));
+    if (!tree)
+    {
+        return NULL;
+    }
+    tree->count = shape->count;
+    tree->num_levels = shape->num_levels;
+    memcpy(tree->level_start, shape->level_start, sizeof(tree->level_start));
+    memcpy(tree->level_count, shape->level_count, sizeof(tree->level_count));
+    tree->items = section_data(map, header, items);
+    tree->boxes = section_data(map, header, items + 1);
+    return tree;
+}
+
+/* Point the map at the sections of its mapping, only ways and pool pointers are rebuilt */
+int attach_snapshot(OSM_Map *map, const Snapshot_Header *header)
+{
+    map->num_nodes = header->num_nodes;
+    map->nodes = section_data(map, header, SNAP_NODES);
+    map->node_versions = section_data(map, header, SNAP_NODE_VERSIONS);
+    map->way_versions = section_data(map, header, SNAP_WAY_VERSIONS);
+    map->ref_store->buf = section_data(map, header, SNAP_REFS);
+    map->ref_store->size = header->sections[SNAP_REFS].size;
+    map->nodes_unsorted = (header->flags & SNAPSHOT_NODES_UNSORTED) != 0;
+    map->ways_unsorted = (header->flags & SNAPSHOT_WAYS_UNSORTED) != 0;
+    map->summarized = (header->flags & SNAPSHOT_SUMMARIZED) != 0;
+    map->summary = header->summary;
+    map->node_extent = header->node_extent;
+
+    if (header->flags & SNAPSHOT_BBOX)
+    {
+        map->BBox = arena_alloc(map->arena, sizeof(OSM_BBox));
+        if (!map->BBox)
+        {
+            return -1;
+        }
+        *map->BBox = header->bbox;
+    }
+
+    // every string must end inside the string section
+    const char *bytes = section_data(map, header, SNAP_STRING_BYTES);
+    const uint64_t *offsets = section_data(map, header, SNAP_STRING_OFFSETS);
+    uint64_t bytes_size = header->sections[SNAP_STRING_BYTES].size;
+    if (header->num_strings && bytes[bytes_size - 1] != '\0')
+    {
+        return -1;
+    }
+    for (uint32_t id = 0; id < header->num_strings; id++)
+    {
+        if (offsets[id] >= bytes_size)
+        {
+            return -1;
+        }
+    }
+    if (string_pool_attach(map->strings, header->num_strings, bytes, offsets, section_data(map, header, SNAP_STRING_HASHES),
+                           section_data(map, header, SNAP_STRING_SLOTS), header->num_string_slots) == -1)
+    {
+        return -1;
+    }
+
+    map->ways = malloc(sizeof(OSM_Way) * (header->num_ways ? header->num_ways : 1));
+    if (!map->ways)
+    {
+        return -1;
+    }
+    map->ways_capacity = header->num_ways ? header->num_ways : 1;
+    map->num_ways = header->num_ways;
+    Snapshot_Ways ways = {map, section_data(map, header, SNAP_WAYS), section_data(map, header, SNAP_WAY_TAGS),
+                          header->sections[SNAP_WAY_TAGS].size / sizeof(uint32_t)};
+    if (parallel_for(map->num_ways, MIN_WAYS_PER_WORKER, attach_ways, &ways) == -1)
+    {
+        return -1;
+    }
+
+    map->node_locations = section_data(map, header, SNAP_NODE_LOCATIONS);
+    map->way_boxes = section_data(map, header, SNAP_WAY_BOXES);
+    map->node_way_offsets = section_data(map, header, SNAP_NODE_WAY_OFFSETS);
+    map->node_ways = section_data(map, header, SNAP_NODE_WAYS);
+
+    if (has_section(header, SNAP_TAG_KEYS))
+    {
+        map->tag_index = calloc(1, sizeof(OSM_TagIndex));
+        if (!map->tag_index)
+        {
+            return -1;
+        }
+        map->tag_index->num_keys = header->tag_keys;
+        map->tag_index->keys = section_data(map, header, SNAP_TAG_KEYS);
+        map->tag_index->pair_start = section_data(map, header, SNAP_TAG_PAIR_START);
+        map->tag_index->pairs = section_data(map, header, SNAP_TAG_PAIRS);
+        map->tag_index->buf.buf = section_data(map, header, SNAP_TAG_POSTINGS);
+        map->tag_index->buf.size = header->sections[SNAP_TAG_POSTINGS].size;
+    }
+    if (has_section(header, SNAP_NODE_TREE_ITEMS) &&
+        !(map->node_tree = attach_rtree(map, header, &header->node_tree, SNAP_NODE_TREE_ITEMS)))
+    {
+        return -1;
+    }
+    if (has_section(header, SNAP_WAY_TREE_ITEMS) &&
+        !(map->way_tree = attach_rtree(map, header, &header->way_tree, SNAP_WAY_TREE_ITEMS)))
+    {
+        return -1;
+    }
+    if (has_section(header, SNAP_KDTREE_POINTS))
+    {
+        map->node_kdtree = calloc(1, sizeof(OSM_KDTree));
+        if (!map->node_kdtree)
+        {
+            return -1;
+        }
+        map->node_kdtree->count = header->sections[SNAP_KDTREE_POINTS].size / sizeof(OSM_KDPoint);
+        map->node_kdtree->points = section_data(map, header, SNAP_KDTREE_POINTS);
+    }
+    return 0;
+}
+
+OSM_Map *OSM_Map_open_snapshot(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    Snapshot_Header header;
+    OSM_Map *map = NULL;
+
+    if (fstat(fileno(f), &st) != 0 || fread(&header, sizeof(header), 1, f) != 1 || !valid_snapshot(&header, st.st_size))
+    {
+        goto done;
+    }
+
+    // pages of the sections are faulted in by the queries that touch them
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (mapping == MAP_FAILED)
+    {
+        goto done;
+    }
+
+    map = OSM_Map_create();
+    if (!map)
+    {
+        munmap(mapping, st.st_size);
+        goto done;
+    }
+    map->mapping = mapping;
+    map->mapping_size = st.st_size;
+    if (attach_snapshot(map, &header) == -1)
+    {
+        OSM_Map_free(map);
+        map = NULL;
+    }
+
+done:
+    fclose(f);
+    return map;
+}
+
+/* OSM Map Accessor Functions */
+
+int OSM_Map_get_num_nodes(OSM_Map *mp)
+{
+    return (mp->counted & OSM_READ_NODES) ? mp->summary.nodes : mp->num_nodes;
+}
+
+int OSM_Map_get_num_ways(OSM_Map *mp)
+{
+    return (mp->counted & OSM_READ_WAYS) ? mp->summary.ways : mp->num_ways;
+}
+
+const OSM_Summary *OSM_Map_get_summary(OSM_Map *mp)
+{
+    return mp->summarized ? &mp->summary : NULL;
+}
+
+OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index)
+{
+    if (mp == NULL || mp->nodes == NULL || index < 0 || index >= mp->num_nodes)
+    {
+        return NULL;
+    }
+
+    return &mp->nodes[index];
+}
+
+OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index)
+{
+    if (mp == NULL || mp->ways == NULL || index < 0 || index >= mp->num_ways)
+    {
+
+        return NULL;
+    }
+
+    return &mp->ways[index];
+}
 
-        PB_Field *header_with_datasize = PB_get_field(blob_header, 3, 0); // get datasize field of 'BlobHeader'
+OSM_Node *OSM_Map_find_Node(OSM_Map *mp, OSM_Id id)
+{
+    if (mp == NULL)
+    {
+        return NULL;
+    }
+    if (mp->lazy)
+    {
+        return lazy_find_Node(mp->lazy, id);
+    }
+
+    if (!mp->nodes_unsorted)
+    {
+        uint64_t low = 0;
+        uint64_t high = mp->num_nodes;
+        while (low < high)
+        {
+            uint64_t mid = low + (high - low) / 2;
+            if (mp->nodes[mid].id < id)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return (low < mp->num_nodes && mp->nodes[low].id == id) ? &mp->nodes[low] : NULL;
+    }
 
-        if (!header_with_datasize)
+    for (uint64_t i = 0; i < mp->num_nodes; i++)
+    {
+        if (mp->nodes[i].id == id)
         {
-            return NULL;
+            return &mp->nodes[i];
         }
+    }
+    return NULL;
+}
 
-        uint64_t blob_msg_size = header_with_datasize->value.i64; // get value from datasize field
+int OSM_Map_lookup_failed(OSM_Map *mp)
+{
+    return mp != NULL && mp->lazy && lazy_lookup_failed(mp->lazy);
+}
 
-        PB_Message blob_proper = malloc(sizeof(PB_Message));
+int64_t OSM_Map_find_Node_index(OSM_Map *mp, OSM_Id id)
+{
+    if (mp == NULL || mp->lazy || build_node_locations(mp) == -1)
+    {
+        return -1;
+    }
+    return node_position(mp, id);
+}
 
-        result = PB_read_message(in, blob_msg_size, &blob_proper); // get the 'BlobProper'
-        if (result == -1 || result == 0)
-        {
-            return NULL;
-        }
+OSM_Way *OSM_Map_find_Way(OSM_Map *mp, OSM_Id id)
+{
+    if (mp == NULL)
+    {
+        return NULL;
+    }
+    if (mp->lazy)
+    {
+        return lazy_find_Way(mp->lazy, id);
+    }
 
-        // handle OSM_HEADER
-        if (header_done == 0)
+    if (!mp->ways_unsorted)
+    {
+        uint64_t low = 0;
+        uint64_t high = mp->num_ways;
+        while (low < high)
         {
-            header_done = 1;
-
-            // field #3 of Blob Proper of LEN_TYPE
-            PB_Field *field = PB_get_field(blob_proper, 3, LEN_TYPE); // is field 1 possible(idts but confirm on piazza later)
-            if (!field)
+            uint64_t mid = low + (high - low) / 2;
+            if (mp->ways[mid].id < id)
             {
-                return NULL;
+                low = mid + 1;
             }
-
-            PB_Message header_block = NULL;
-            int inflated_result = PB_inflate_embedded_message(field->value.bytes.buf, field->value.bytes.size, &header_block);
-
-            if (inflated_result == -1 || !header_block)
+            else
             {
-                return NULL;
+                high = mid;
             }
+        }
+        return (low < mp->num_ways && mp->ways[low].id == id) ? &mp->ways[low] : NULL;
+    }
+
+    for (uint64_t i = 0; i < mp->num_ways; i++)
+    {
+        if (mp->ways[i].id == id)
+        {
+            return &mp->ways[i];
+        }
+    }
+    return NULL;
+}
 
-            // get the bbox (field 1)
-            PB_Field *bbox_field = PB_get_field(header_block, 1, LEN_TYPE);
+/* Batch lookups */
 
-            // if not bbox, continue without it?
-            if (!bbox_field)
-            {
-                map->BBox = NULL;
-            }
-            else
-            {
-                PB_Message HeaderBBox = NULL;
+/* An id of a batch and its index in the caller's array (also: a way id and its position) */
+typedef struct Batch_Key
+{
+    OSM_Id id;
+    uint64_t index;
+} Batch_Key;
 
-                int embedded_read_result = PB_read_embedded_message(bbox_field->value.bytes.buf, bbox_field->value.bytes.size, &HeaderBBox);
+int compare_batch_keys(const void *a, const void *b)
+{
+    const Batch_Key *x = a;
+    const Batch_Key *y = b;
+    if (x->id != y->id)
+    {
+        return x->id < y->id ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
 
-                if (!HeaderBBox || embedded_read_result == -1)
-                {
-                    return NULL;
-                }
+/* The ids of a batch in ascending order, duplicates in input order */
+Batch_Key *sort_batch(const OSM_Id *ids, uint64_t count)
+{
+    Batch_Key *keys = malloc(sizeof(Batch_Key) * (count ? count : 1));
+    if (!keys)
+    {
+        return NULL;
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        keys[i].id = ids[i];
+        keys[i].index = i;
+    }
+    qsort(keys, count, sizeof(Batch_Key), compare_batch_keys);
+    return keys;
+}
 
-                PB_Field *min_lon = PB_get_field(HeaderBBox, 1, VARINT_TYPE);
-                PB_Field *max_lon = PB_get_field(HeaderBBox, 2, VARINT_TYPE);
-                PB_Field *max_lat = PB_get_field(HeaderBBox, 3, VARINT_TYPE);
-                PB_Field *min_lat = PB_get_field(HeaderBBox, 4, VARINT_TYPE);
+/* Id of element i of an id sorted array whose elements start with their id */
+OSM_Id id_at(const char *base, size_t stride, uint64_t i)
+{
+    OSM_Id id;
+    memcpy(&id, base + i * stride, sizeof(id));
+    return id;
+}
 
-                if (!min_lon || !max_lon || !min_lat || !max_lat)
-                {
-                    return NULL;
-                }
+/* First element at or after from whose id is not below id: doubling steps, then a binary search of the last step */
+uint64_t gallop_ids(const void *base, size_t stride, uint64_t count, uint64_t from, OSM_Id id)
+{
+    uint64_t low = from;
+    uint64_t high = from;
+    uint64_t step = 1;
+    while (high < count && id_at(base, stride, high) < id)
+    {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > count)
+    {
+        high = count;
+    }
+
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (id_at(base, stride, mid) < id)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
 
-                OSM_BBox *BBox_pointer = malloc(sizeof(OSM_BBox));
+int64_t OSM_Map_find_Nodes(OSM_Map *mp, const OSM_Id *ids, uint64_t count, OSM_NodeBatchVisitor callback, void *arg)
+{
+    if (!mp->lazy && build_node_locations(mp) == -1)
+    {
+        return -1;
+    }
+    Batch_Key *keys = sort_batch(ids, count);
+    if (!keys)
+    {
+        return -1;
+    }
 
-                BBox_pointer->min_lon = zigzag(min_lon->value.i64);
-                BBox_pointer->max_lon = zigzag(max_lon->value.i64);
-                BBox_pointer->min_lat = zigzag(min_lat->value.i64);
-                BBox_pointer->max_lat = zigzag(max_lat->value.i64);
+    // sorted nodes, or the id sorted location store of unsorted ones
+    const void *base = mp->node_locations ? (const void *)mp->node_locations : (const void *)mp->nodes;
+    size_t stride = mp->node_locations ? sizeof(OSM_NodeLocation) : sizeof(OSM_Node);
 
-                map->BBox = BBox_pointer;
+    int64_t found = 0;
+    uint64_t rank = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        OSM_Node *np = NULL;
+        if (mp->lazy)
+        {
+            // ids in ascending order walk the blobs in file order, so each one is decoded once
+            np = OSM_Map_find_Node(mp, keys[i].id);
+            if (!np && OSM_Map_lookup_failed(mp))
+            {
+                found = -1;
+                break;
             }
         }
-
-        // handle OSM_Data
         else
         {
-            // field #3 of Blob Proper of LEN_TYPE
-            PB_Field *field = PB_get_field(blob_proper, 3, LEN_TYPE); // is field 1 possible(idts but confirm on piazza later)
-            if (!field)
+            rank = gallop_ids(base, stride, mp->num_nodes, rank, keys[i].id);
+            if (rank < mp->num_nodes && sorted_node_id(mp, rank) == keys[i].id)
             {
-                return NULL;
+                np = &mp->nodes[sorted_node_position(mp, rank)];
             }
+        }
 
-            PB_Message primitive_block = NULL;
-            int inflated_result = PB_inflate_embedded_message(field->value.bytes.buf, field->value.bytes.size, &primitive_block);
-
-            if (inflated_result == -1 || !primitive_block)
+        if (np)
+        {
+            found++;
+            if (callback(keys[i].index, np, arg))
             {
-                // print error here?
-                return NULL;
+                break;
             }
+        }
+    }
+    free(keys);
+    return found;
+}
 
-            // save the lat/lon offsets and granularity
-            PB_Field *lat_offset = PB_get_field(primitive_block, 19, I64_TYPE);
-            PB_Field *lon_offset = PB_get_field(primitive_block, 20, I32_TYPE);
-            PB_Field *granularity = PB_get_field(primitive_block, 17, I32_TYPE);
+int64_t OSM_Map_find_Ways(OSM_Map *mp, const OSM_Id *ids, uint64_t count, OSM_WayBatchVisitor callback, void *arg)
+{
+    Batch_Key *keys = sort_batch(ids, count);
+    if (!keys)
+    {
+        return -1;
+    }
 
-            int64_t lat_offset_value;
-            int64_t lon_offset_value;
-            int32_t granularity_value;
+    // unsorted ways are sorted by id for the batch (one sort instead of a scan per id)
+    Batch_Key *positions = NULL;
+    if (!mp->lazy && mp->ways_unsorted)
+    {
+        positions = malloc(sizeof(Batch_Key) * (mp->num_ways ? mp->num_ways : 1));
+        if (!positions)
+        {
+            free(keys);
+            return -1;
+        }
+        for (uint64_t i = 0; i < mp->num_ways; i++)
+        {
+            positions[i].id = mp->ways[i].id;
+            positions[i].index = i;
+        }
+        qsort(positions, mp->num_ways, sizeof(Batch_Key), compare_batch_keys);
+    }
+    const void *base = positions ? (const void *)positions : (const void *)mp->ways;
+    size_t stride = positions ? sizeof(Batch_Key) : sizeof(OSM_Way);
 
-            if (!lat_offset)
+    int64_t found = 0;
+    uint64_t rank = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        OSM_Way *wp = NULL;
+        if (mp->lazy)
+        {
+            wp = OSM_Map_find_Way(mp, keys[i].id);
+            if (!wp && OSM_Map_lookup_failed(mp))
             {
-                lat_offset_value = 0;
+                found = -1;
+                break;
             }
-            else
+        }
+        else
+        {
+            rank = gallop_ids(base, stride, mp->num_ways, rank, keys[i].id);
+            if (rank < mp->num_ways && id_at(base, stride, rank) == keys[i].id)
             {
-                lat_offset_value = (int64_t)lat_offset->value.i64;
+                wp = &mp->ways[positions ? positions[rank].index : rank];
             }
+        }
 
-            if (!lon_offset)
-            {
-                lon_offset_value = 0;
-            }
-            else
+        if (wp)
+        {
+            found++;
+            if (callback(keys[i].index, mp, wp, arg))
             {
-                lon_offset_value = (int64_t)lon_offset->value.i64;
+                break;
             }
+        }
+    }
+    free(positions);
+    free(keys);
+    return found;
+}
 
-            if (!granularity)
-            {
-                granularity_value = 100;
-            }
-            else
-            {
-                granularity_value = (int32_t)granularity->value.i32;
-            }
+/* Ids of one entity type a streaming lookup is waiting for */
+typedef struct Stream_Pending
+{
+    Batch_Key *keys; // ascending ids
+    uint64_t count;
+    char *found;     // per key
+    uint64_t missing;
+    int passed;      // a sorted stream went past every id
+} Stream_Pending;
+
+/* A streaming lookup: its own handler, switched off type by type as the ids are settled */
+typedef struct Stream_Lookup
+{
+    OSM_Handler handler;
+    Stream_Pending nodes;
+    Stream_Pending ways;
+    int sorted;
+    OSM_Map *found_ways; // ways found, loaded as map ways for the visitor
+    OSM_NodeBatchVisitor node_callback;
+    OSM_WayBatchVisitor way_callback;
+    void *arg;
+    int64_t visited;
+} Stream_Lookup;
+
+int stream_pending_init(Stream_Pending *pending, const OSM_Id *ids, uint64_t count)
+{
+    pending->count = count;
+    pending->missing = count;
+    pending->passed = count == 0;
+    pending->keys = sort_batch(ids, count);
+    pending->found = calloc(count ? count : 1, 1);
+    return pending->keys && pending->found ? 0 : -1;
+}
 
-            // String Table (Field Number 1, Wire Type = LEN_TYPE)
-            PB_Field *string_table = PB_get_field(primitive_block, 1, LEN_TYPE);
+int stream_settled(const Stream_Pending *pending)
+{
+    return pending->missing == 0 || pending->passed;
+}
 
-            PB_Message string_table_message = NULL;
-            int embedded_read_result = PB_read_embedded_message(string_table->value.bytes.buf, string_table->value.bytes.size, &string_table_message);
+/* 1 once every id is found or passed, stopping the read */
+int stream_lookup_done(const Stream_Lookup *lookup)
+{
+    return stream_settled(&lookup->nodes) && stream_settled(&lookup->ways);
+}
 
-            if (embedded_read_result == -1 || !string_table_message)
-            {
-                return NULL;
-            }
+/* First key of id not found yet, the keys of id are keys[*firstp ..] up to the next id. 0 if there is none */
+int stream_match(Stream_Lookup *lookup, Stream_Pending *pending, OSM_Id id, uint64_t *firstp)
+{
+    if (pending->count == 0 || id < pending->keys[0].id || id > pending->keys[pending->count - 1].id)
+    {
+        // in a sorted stream every later id of this type is larger still
+        pending->passed |= lookup->sorted && pending->count > 0 && id > pending->keys[pending->count - 1].id;
+        return 0;
+    }
 
-            // PrimitiveGroup
+    uint64_t first = gallop_ids(pending->keys, sizeof(Batch_Key), pending->count, 0, id);
+    if (first == pending->count || pending->keys[first].id != id || pending->found[first])
+    {
+        return 0;
+    }
+    *firstp = first;
+    return 1;
+}
 
-            // Get The First PrimitiveGroup (Field #2, LEN_TYPE)
-            PB_Field *current_primitive_group_field = PB_get_field(primitive_block, 2, LEN_TYPE);
+int stream_lookup_node(const OSM_NodeEvent *event, void *arg)
+{
+    Stream_Lookup *lookup = arg;
+    Stream_Pending *pending = &lookup->nodes;
 
-            while (current_primitive_group_field != NULL)
-            {
-                PB_Message current_prim_group_message = NULL;
-                int embedded_read_result = PB_read_embedded_message(current_primitive_group_field->value.bytes.buf, current_primitive_group_field->value.bytes.size, &current_prim_group_message);
+    uint64_t first;
+    if (!stream_match(lookup, pending, event->id, &first))
+    {
+        return stream_lookup_done(lookup);
+    }
 
-                if (!current_prim_group_message || embedded_read_result == -1)
-                {
-                    return NULL;
-                }
-                else
-                {
-                    // ATP We'd Have A message of a list of MULTIPLE Field 1(Node) or Field 3(Way).
-                    // IF this has a Field 2(DenseNodes), then its ONLY 1 FIELD
-
-                    // Find What Type is it (NODE, WAY, DENSENODES)
-                    PB_Field *current = current_prim_group_message;
-                    current = current->next; // skip Sentinel Node
-
-                    if (current->number == 1)
-                    { // NODE
-                        int64_t result = handle_NODE(map, current_prim_group_message, lat_offset_value, lon_offset_value, granularity_value, string_table_message);
-                        if (result == -1)
-                        {
-                            return NULL;
-                        }
-                        map->num_nodes = result + map->num_nodes;
-                    }
-                    else if (current->number == 2)
-                    { // DENSE NODES
-                        int64_t result = handle_DENSE(map, current_prim_group_message, lat_offset_value, lon_offset_value, granularity_value, string_table_message);
-                        if (result == -1)
-                        {
-                            return NULL;
-                        }
-                        map->num_nodes = result + map->num_nodes;
-                    }
-                    else if (current->number == 3)
-                    { // WAYS
-                        int64_t result = handle_WAY(map, current_prim_group_message, string_table_message);
-                        if (result == -1)
-                        {
-                            return NULL;
-                        }
-                        map->num_ways = result + map->num_ways;
-                    }
-                    else if (current->number == 4)
-                    { // RELATION
-                    }
-                    else if (current->number == 5)
-                    { // ChangeSet
-                    }
-                    else
-                    {
-                        return NULL;
-                    }
-                }
-                current_primitive_group_field = PB_next_field(current_primitive_group_field, 2, LEN_TYPE, FORWARD_DIR);
-            }
+    OSM_Node node = {event->id, event->lat, event->lon};
+    for (uint64_t i = first; i < pending->count && pending->keys[i].id == event->id; i++)
+    {
+        pending->found[i] = 1;
+        pending->missing--;
+        lookup->visited++;
+        if (lookup->node_callback(pending->keys[i].index, &node, lookup->arg))
+        {
+            return 1;
         }
     }
-    return NULL;
+    return stream_lookup_done(lookup);
 }
 
-/* OSM Map Accessor Functions */
-
-int OSM_Map_get_num_nodes(OSM_Map *mp)
+int stream_lookup_way(const OSM_WayEvent *event, void *arg)
 {
-    return mp->num_nodes;
-}
+    Stream_Lookup *lookup = arg;
+    Stream_Pending *pending = &lookup->ways;
 
-int OSM_Map_get_num_ways(OSM_Map *mp)
-{
-    return mp->num_ways;
-}
+    // a sorted stream has no node left once ways start
+    lookup->nodes.passed |= lookup->sorted;
 
-OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index)
-{
-    if (mp == NULL || mp->nodes == NULL || index < 0 || index >= mp->num_nodes)
+    uint64_t first;
+    if (!stream_match(lookup, pending, event->id, &first))
     {
-        return NULL;
+        return stream_lookup_done(lookup);
     }
 
-    OSM_Node *current = mp->nodes;
-    int count = 0;
+    OSM_Map *map = lookup->found_ways;
+    if (load_way(event, map) == -1)
+    {
+        return -1;
+    }
+    OSM_Way *way = &map->ways[map->num_ways - 1];
 
-    while (current != NULL)
+    for (uint64_t i = first; i < pending->count && pending->keys[i].id == event->id; i++)
     {
-        if (count == index)
+        pending->found[i] = 1;
+        pending->missing--;
+        lookup->visited++;
+        if (lookup->way_callback(pending->keys[i].index, map, way, lookup->arg))
         {
-            return current;
+            return 1;
         }
-        current = current->next;
-        count++;
     }
+    return stream_lookup_done(lookup);
+}
 
-    return NULL;
+/* Only registered for sorted streams: the first relation comes after every node and way */
+int stream_lookup_relation(const OSM_RelationEvent *event, void *arg)
+{
+    Stream_Lookup *lookup = arg;
+    lookup->nodes.passed = 1;
+    lookup->ways.passed = 1;
+    return 1;
 }
 
-OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index)
+/* Entities of a type whose ids are all settled are no longer decoded */
+int stream_lookup_block_end(void *arg)
 {
-    if (mp == NULL || mp->ways == NULL || index < 0 || index >= mp->num_ways)
+    Stream_Lookup *lookup = arg;
+    if (stream_settled(&lookup->nodes))
+    {
+        lookup->handler.on_node = NULL;
+    }
+    if (stream_settled(&lookup->ways) && !(lookup->sorted && lookup->handler.on_node))
     {
+        lookup->handler.on_way = NULL;
+    }
 
-        return NULL;
+    end_load_block(lookup->found_ways);
+    arena_reset(lookup->found_ways->scratch);
+    return stream_lookup_done(lookup);
+}
+
+int stream_lookup_header(const OSM_Header *header, void *arg)
+{
+    Stream_Lookup *lookup = arg;
+    lookup->sorted = header->sorted;
+
+    // ways and relations of a sorted stream tell when the ids before them are passed
+    if (lookup->sorted)
+    {
+        lookup->handler.on_way = stream_lookup_way;
+        lookup->handler.on_relation = stream_lookup_relation;
     }
+    return 0;
+}
 
-    OSM_Way *current = mp->ways;
-    int count = 0;
+int64_t OSM_find_stream(FILE *in, const OSM_Id *node_ids, uint64_t num_node_ids, OSM_NodeBatchVisitor node_callback,
+                        const OSM_Id *way_ids, uint64_t num_way_ids, OSM_WayBatchVisitor way_callback, void *arg)
+{
+    Stream_Lookup lookup = {
+        .handler = {
+            .on_header = stream_lookup_header,
+            .on_node = num_node_ids ? stream_lookup_node : NULL,
+            .on_way = num_way_ids ? stream_lookup_way : NULL,
+            .on_block_end = stream_lookup_block_end,
+        },
+        .found_ways = OSM_Map_create(),
+        .node_callback = node_callback,
+        .way_callback = way_callback,
+        .arg = arg,
+    };
+    lookup.handler.arg = &lookup;
+
+    int result = -1;
+    if (lookup.found_ways &&
+        stream_pending_init(&lookup.nodes, node_ids, num_node_ids) == 0 &&
+        stream_pending_init(&lookup.ways, way_ids, num_way_ids) == 0)
+    {
+        lookup.found_ways->options = &default_options;
+        result = stream_lookup_done(&lookup) ? 0 : OSM_read_stream(in, &lookup.handler);
+    }
 
-    while (current != NULL)
+    free(lookup.nodes.keys);
+    free(lookup.nodes.found);
+    free(lookup.ways.keys);
+    free(lookup.ways.found);
+    if (lookup.found_ways)
     {
-        if (count == index)
-        {
-            return current;
-        }
-        current = current->next;
-        count++;
+        lookup.found_ways->options = NULL;
+        OSM_Map_free(lookup.found_ways);
+    }
+    return result == -1 ? -1 : lookup.visited;
+}
+
+int32_t OSM_Map_get_Node_version(OSM_Map *mp, int index)
+{
+    if (mp == NULL || mp->node_versions == NULL || index < 0 || index >= mp->num_nodes)
+    {
+        return -1;
     }
+    return mp->node_versions[index];
+}
 
-    return NULL;
+int32_t OSM_Map_get_Way_version(OSM_Map *mp, int index)
+{
+    if (mp == NULL || mp->way_versions == NULL || index < 0 || index >= mp->num_ways)
+    {
+        return -1;
+    }
+    return mp->way_versions[index];
 }
 
 OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp)
@@ -763,95 +5117,84 @@ int OSM_Way_get_num_refs(OSM_Way *wp)
     return wp->refs_count;
 }
 
-OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index)
+/* String of a key or value id of a way, NULL if out of range */
+char *way_string(OSM_Way *wp, uint32_t id)
 {
-    if (wp == NULL || wp->refs == NULL || index < 0 || index >= wp->refs_count)
+    if (id >= wp->map->strings->count)
     {
-        return -1;
+        return NULL;
     }
-
-    return wp->refs[index];
-}
-
-int OSM_Way_get_num_keys(OSM_Way *wp)
-{
-    return wp->keys_count;
+    return wp->map->strings->strings[id]; // owned by the map
 }
 
-char *OSM_Way_get_key(OSM_Way *wp, int index)
+OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index)
 {
-    if (wp == NULL || wp->keys == NULL || index < 0 || index >= wp->keys_count)
-    {
-        return NULL;
-    }
-
-    uint32_t key_index = wp->keys[index]; // index of key in the keys object, use this to query string table
-
-    PB_Field *curr = wp->string_table;
-
-    if (!curr)
+    if (wp == NULL || index < 0 || index >= wp->refs_count)
     {
-        return NULL;
+        return -1;
     }
 
-    curr = curr->next; // skip sentinel node
+    // refs are delta coded, so walk the prefix up to index
+    const uint8_t *buf = wp->map->ref_store->buf + wp->refs_offset;
+    size_t pos = 0;
+    int64_t total = 0;
 
-    for (int i = 0; i < key_index; i++)
+    for (int i = 0; i <= index; i++)
     {
-        if (!curr->next)
+        uint64_t delta;
+        size_t used = varint_decode(buf + pos, wp->refs_size - pos, &delta);
+        if (used == 0)
         {
-            return NULL;
+            return -1;
         }
-        curr = curr->next;
+        total += zigzag(delta);
+        pos += used;
     }
 
-    char *result = malloc(curr->value.bytes.size + 1);
+    return total;
+}
 
-    for (size_t i = 0; i < curr->value.bytes.size; i++)
+int OSM_Way_copy_refs(OSM_Way *wp, OSM_Id *refs, int max)
+{
+    if (wp == NULL || refs == NULL || max < 0)
     {
-        result[i] = curr->value.bytes.buf[i];
+        return -1;
     }
-    result[curr->value.bytes.size] = '\0';
 
-    return result;
+    const uint8_t *buf = wp->map->ref_store->buf + wp->refs_offset;
+    return varint_decode_deltas(buf, wp->refs_size, refs, max);
 }
 
-char *OSM_Way_get_value(OSM_Way *wp, int index)
+int OSM_WayEvent_copy_refs(const OSM_WayEvent *way, OSM_Id *refs, int max)
 {
-    if (wp == NULL || wp->values == NULL || index < 0 || index >= wp->vals_count)
+    if (way == NULL || refs == NULL || max < 0)
     {
-        return NULL;
+        return -1;
     }
+    return varint_decode_deltas(way->refs, way->refs_size, refs, max);
+}
 
-    uint32_t value_index = wp->values[index]; // index of key in the keys object, use this to query string table
-
-    PB_Field *curr = wp->string_table;
+int OSM_Way_get_num_keys(OSM_Way *wp)
+{
+    return wp->keys_count;
+}
 
-    if (!curr)
+char *OSM_Way_get_key(OSM_Way *wp, int index)
+{
+    if (wp == NULL || wp->keys == NULL || index < 0 || index >= wp->keys_count)
     {
         return NULL;
     }
+    return way_string(wp, wp->keys[index]);
+}
 
-    curr = curr->next; // skip sentinel node
-
-    for (int i = 0; i < value_index; i++)
-    {
-        if (!curr->next)
-        {
-            return NULL;
-        }
-        curr = curr->next;
-    }
-
-    char *result = malloc(curr->value.bytes.size + 1);
-
-    for (size_t i = 0; i < curr->value.bytes.size; i++)
+char *OSM_Way_get_value(OSM_Way *wp, int index)
+{
+    if (wp == NULL || wp->values == NULL || index < 0 || index >= wp->vals_count)
     {
-        result[i] = curr->value.bytes.buf[i];
+        return NULL;
     }
-    result[curr->value.bytes.size] = '\0';
-
-    return result;
+    return way_string(wp, wp->values[index]);
 }
 
 int64_t OSM_BBox_get_min_lon(OSM_BBox *bbp)
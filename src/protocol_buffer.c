@@ -1,14 +1,42 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
 
 #include "protocol_buffer.h"
+#include "varint.h"
 #include "zlib_inflate.h"
 
+/* arena that message fields and buffers are allocated from (malloc if NULL) */
+static __thread Arena *pb_arena = NULL;
+
+void PB_set_arena(Arena *arena)
+{
+    pb_arena = arena;
+}
+
+static void *pb_alloc(size_t size)
+{
+    if (pb_arena)
+    {
+        return arena_alloc(pb_arena, size);
+    }
+    return malloc(size);
+}
+
+static void pb_free(void *ptr)
+{
+    if (!pb_arena)
+    {
+        free(ptr);
+    }
+}
+
 
 /* Build a linked list of protobuf messages from a stream of len bytes */
 int PB_read_message(FILE *in, size_t len, PB_Message *msgp){
     
-    PB_Field *head = malloc(sizeof(PB_Field));
+    PB_Field *head = pb_alloc(sizeof(PB_Field));
     head->number = -1;
     head->type = 8;
     head->next = head;
@@ -19,12 +47,12 @@ int PB_read_message(FILE *in, size_t len, PB_Message *msgp){
     size_t total_byte_count = 0;
     
     while (total_byte_count < len) {
-        PB_Field *field = malloc(sizeof(PB_Field));
+        PB_Field *field = pb_alloc(sizeof(PB_Field));
         int result = PB_read_field(in, field);
 
         // handle error in read
         if (result <= 0) {
-            free(field);
+            pb_free(field);
             if (total_byte_count == 0){
                 return 0;
             } 
@@ -61,23 +89,37 @@ int PB_read_embedded_message(char *buf, size_t len, PB_Message *msgp) {
     return 0;
 }
 
-/* Read zlib-compressed data from a memory buffer, inflating it and interpreting it as a protocol buffer message. */
-int PB_inflate_embedded_message(char *buf, size_t len, PB_Message *msgp) {
-    FILE *f = fmemopen(buf, len, "r");
-    char *other_buffer = NULL;
-    size_t decompressed_size = 0;
-
-    FILE *other_stream = open_memstream(&other_buffer, &decompressed_size);
-    int result = zlib_inflate(f, other_stream);    
-    if(result != 0){
+/* Read zlib-compressed data of raw_size bytes once inflated (0 if unknown) from a memory buffer, inflating it and interpreting it as a protocol buffer message. */
+int PB_inflate_embedded_message(char *buf, size_t len, size_t raw_size, PB_Message *msgp) {
+    if (raw_size > PB_MAX_INFLATED_SIZE) {
         return -1;
     }
 
-    fclose(f);
-    fclose(other_stream);
+    // inflate straight into memory: once into a buffer of the declared size, else doubling a guess until the stream fits
+    size_t capacity = raw_size ? raw_size : len * 4 + 1024;
+    char *inflated = NULL;
+    size_t inflated_size = 0;
 
-    
-    int r = PB_read_embedded_message(other_buffer, decompressed_size, msgp);
+    while (1) {
+        inflated = pb_alloc(capacity);
+        if (!inflated) {
+            return -1;
+        }
+
+        int result = zlib_inflate_buffer(buf, len, inflated, capacity, &inflated_size);
+        if (result == Z_OK) {
+            break;
+        }
+
+        pb_free(inflated);
+        if (result != Z_BUF_ERROR || capacity > PB_MAX_INFLATED_SIZE) {
+            return -1;
+        }
+        capacity *= 2;
+    }
+
+    int r = PB_read_embedded_message(inflated, inflated_size, msgp);
+    pb_free(inflated);
     if(r == 0){
         return 0;
     }
@@ -92,8 +134,8 @@ int PB_inflate_embedded_message(char *buf, size_t len, PB_Message *msgp) {
  */
 int PB_read_field(FILE *in, PB_Field *fieldp) {
     int32_t return_fieldp;
-    PB_WireType *typepb = malloc(sizeof(PB_WireType));
-    int bytes_1 = PB_read_tag(in, typepb, &return_fieldp);
+    PB_WireType typepb;
+    int bytes_1 = PB_read_tag(in, &typepb, &return_fieldp);
 
     if(bytes_1 == -1){
         return -1;
@@ -103,12 +145,12 @@ int PB_read_field(FILE *in, PB_Field *fieldp) {
         return 0;
     }
 
-    union value *valuep = malloc(sizeof(union value));
+    union value valuep;
 
-    fieldp->type = *typepb;
+    fieldp->type = typepb;
     fieldp->number = return_fieldp;
     
-    int bytes_2 = PB_read_value(in, *typepb, valuep);
+    int bytes_2 = PB_read_value(in, typepb, &valuep);
 
     if(bytes_2 == -1){
         return -1;
@@ -117,7 +159,7 @@ int PB_read_field(FILE *in, PB_Field *fieldp) {
         return 0;
     }
 
-    fieldp -> value = *valuep;
+    fieldp -> value = valuep;
 
 
     return bytes_1 + bytes_2;
@@ -132,12 +174,11 @@ int PB_read_tag(FILE *in, PB_WireType *typep, int32_t *fieldp) {
     
     uint64_t actual_value = 0; //this should be the actual value it reads, not the byte count
 
-    unsigned char *buffer = malloc(sizeof(char) * 10); // max 10 bytes? idk if its the same here or not...
+    unsigned char buffer[10]; // max 10 bytes? idk if its the same here or not...
     int count = 0; 
 
     while(count < 10){
         if (fread(&buffer[count], 1, 1, in) != 1) { 
-            free(buffer);
             if(count == 0){
                 return 0;
             }
@@ -175,12 +216,11 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep) {
     int64_t _handle_varint(){
         int64_t actual_value = 0; //this should be the actual value it reads, not the byte count
 
-        unsigned char *buffer = malloc(sizeof(char) * 10); // max 10 bytes
+        unsigned char buffer[10]; // max 10 bytes
         int count = 0; 
 
         while(count < 10){
             if (fread(&buffer[count], 1, 1, in) != 1) { 
-                free(buffer);
                 if(count == 0){
                     return 0;
                 }
@@ -210,12 +250,11 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep) {
     int64_t _handle_lentype(){
         int64_t actual_value = 0; //this should be the actual value it reads, not the byte count
 
-        unsigned char *buffer = malloc(sizeof(char) * 10); // max 10 bytes
+        unsigned char buffer[10]; // max 10 bytes
         int count = 0; 
 
         while(count < 10){
             if (fread(&buffer[count], 1, 1, in) != 1) { 
-                free(buffer);               
                 if(count == 0){
                     return 0;
                 }
@@ -239,11 +278,9 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep) {
         }
 
         valuep->bytes.size = actual_value;
-        valuep->bytes.buf = malloc(actual_value * sizeof(char));
-        int b_count = 0;
-        while(b_count < actual_value){
-            fread(&valuep->bytes.buf[b_count], 1, 1, in);
-            b_count++;
+        valuep->bytes.buf = pb_alloc(actual_value * sizeof(char));
+        if(actual_value > 0 && fread(valuep->bytes.buf, 1, actual_value, in) != (size_t)actual_value){
+            return -1;
         }
         
         return count + actual_value; // the number of bytes which represented the length + the number of bytes for the actual content
@@ -306,6 +343,70 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep) {
     }
 }
 
+/**
+ * Decode the field starting at *posp of a message held in memory and advance
+ * *posp past it. Unlike PB_read_field nothing is allocated: LEN values point
+ * into buf. Returns 1 on success, 0 at the end of the buffer and -1 on
+ * malformed input.
+ */
+int PB_scan_field(char *buf, size_t len, size_t *posp, PB_Field *fieldp) {
+    size_t pos = *posp;
+    if (pos >= len) {
+        return 0;
+    }
+
+    uint64_t tag;
+    size_t used = varint_decode((uint8_t *)buf + pos, len - pos, &tag);
+    if (used == 0) {
+        return -1;
+    }
+    pos += used;
+
+    fieldp->number = tag >> 3;
+    fieldp->type = tag & 0x7;
+
+    switch (fieldp->type) {
+        case VARINT_TYPE:
+            used = varint_decode((uint8_t *)buf + pos, len - pos, &fieldp->value.i64);
+            if (used == 0) {
+                return -1;
+            }
+            pos += used;
+            break;
+        case I64_TYPE:
+            if (len - pos < 8) {
+                return -1;
+            }
+            memcpy(&fieldp->value.i64, buf + pos, 8);
+            pos += 8;
+            break;
+        case I32_TYPE:
+            if (len - pos < 4) {
+                return -1;
+            }
+            memcpy(&fieldp->value.i32, buf + pos, 4);
+            pos += 4;
+            break;
+        case LEN_TYPE: {
+            uint64_t size;
+            used = varint_decode((uint8_t *)buf + pos, len - pos, &size);
+            if (used == 0 || size > len - pos - used) {
+                return -1;
+            }
+            pos += used;
+            fieldp->value.bytes.size = size;
+            fieldp->value.bytes.buf = buf + pos;
+            pos += size;
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    *posp = pos;
+    return 1;
+}
+
 /**
  * Get the next field with a specified number from a PB_Message object,
  * scanning the fields in a specified direction starting from a specified previous field.
@@ -407,12 +508,11 @@ int PB_expand_packed_fields(PB_Message msg, int fnum, PB_WireType type) {
             while (bytes_read < size) {
             // -------------------------------HANDLE VARINT--------------------------------
                 int64_t actual_value = 0;  
-                unsigned char *buffer = malloc(sizeof(char) * 10);  
+                unsigned char buffer[10];  
                 int count = 0;
     
                 while (count < 10) {
                     if (fread(&buffer[count], 1, 1, f) != 1) {
-                        free(buffer);
                         fclose(f);
                         return -1;
                     }
@@ -430,7 +530,7 @@ int PB_expand_packed_fields(PB_Message msg, int fnum, PB_WireType type) {
     
                 // -------------------------------HANDLE VARINT--------------------------------
     
-                PB_Field *new_field = malloc(sizeof(PB_Field));
+                PB_Field *new_field = pb_alloc(sizeof(PB_Field));
                 new_field->number = fnum;  
                 new_field->type = type;  
                 new_field->value.i64 = actual_value;  
@@ -469,7 +569,7 @@ int PB_expand_packed_fields(PB_Message msg, int fnum, PB_WireType type) {
             FILE *f = fmemopen(buf, size, "r");
             while(bytes_read < size){
 
-                PB_Field *new_field = malloc(sizeof(PB_Field));
+                PB_Field *new_field = pb_alloc(sizeof(PB_Field));
                 new_field->number = fnum;
                 new_field->type = 5;
 
@@ -510,7 +610,7 @@ int PB_expand_packed_fields(PB_Message msg, int fnum, PB_WireType type) {
             FILE *f = fmemopen(buf, size, "r");
             while(bytes_read < size){
 
-                PB_Field *new_field = malloc(sizeof(PB_Field));
+                PB_Field *new_field = pb_alloc(sizeof(PB_Field));
                 new_field->number = fnum;
                 new_field->type = 1;
 
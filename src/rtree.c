@@ -0,0 +1,217 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "rtree.h"
+
+#define NANO_PER_UNIT 100
+
+/* Sort key of an item: box center on one axis */
+typedef struct RTree_Entry
+{
+    int64_t key;
+    uint32_t item;
+} RTree_Entry;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const RTree_Entry *x = a;
+    const RTree_Entry *y = b;
+    if (x->key != y->key)
+    {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->item < y->item ? -1 : x->item > y->item;
+}
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    int64_t q = a / b;
+    return (a % b != 0 && a < 0) ? q - 1 : q;
+}
+
+static int64_t ceil_div(int64_t a, int64_t b)
+{
+    int64_t q = a / b;
+    return (a % b != 0 && a > 0) ? q + 1 : q;
+}
+
+static int32_t clamp_unit(int64_t v)
+{
+    return v < INT32_MIN ? INT32_MIN : v > INT32_MAX ? INT32_MAX : (int32_t)v;
+}
+
+void rtree_box_from_nano(OSM_RTreeBox *box, int64_t min_lon, int64_t min_lat, int64_t max_lon, int64_t max_lat)
+{
+    box->min_lon = clamp_unit(floor_div(min_lon, NANO_PER_UNIT));
+    box->min_lat = clamp_unit(floor_div(min_lat, NANO_PER_UNIT));
+    box->max_lon = clamp_unit(ceil_div(max_lon, NANO_PER_UNIT));
+    box->max_lat = clamp_unit(ceil_div(max_lat, NANO_PER_UNIT));
+}
+
+static int intersects(const OSM_RTreeBox *a, const OSM_RTreeBox *b)
+{
+    return a->min_lon <= b->max_lon && a->max_lon >= b->min_lon && a->min_lat <= b->max_lat && a->max_lat >= b->min_lat;
+}
+
+static void extend(OSM_RTreeBox *box, const OSM_RTreeBox *other)
+{
+    if (other->min_lon < box->min_lon)
+    {
+        box->min_lon = other->min_lon;
+    }
+    if (other->min_lat < box->min_lat)
+    {
+        box->min_lat = other->min_lat;
+    }
+    if (other->max_lon > box->max_lon)
+    {
+        box->max_lon = other->max_lon;
+    }
+    if (other->max_lat > box->max_lat)
+    {
+        box->max_lat = other->max_lat;
+    }
+}
+
+OSM_RTree *rtree_build(const OSM_RTreeBox *boxes, uint32_t count)
+{
+    OSM_RTree *tree = calloc(1, sizeof(OSM_RTree));
+    RTree_Entry *entries = malloc(sizeof(RTree_Entry) * (count ? count : 1));
+    if (!tree || !entries)
+    {
+        free(entries);
+        free(tree);
+        return NULL;
+    }
+    tree->count = count;
+
+    // size every level up front: count items, then ceil(n / fanout) per level up to one root
+    uint64_t total = 0;
+    uint64_t level_size = count;
+    do
+    {
+        tree->level_start[tree->num_levels] = total;
+        tree->level_count[tree->num_levels] = level_size;
+        tree->num_levels++;
+        total += level_size;
+        level_size = (level_size + RTREE_FANOUT - 1) / RTREE_FANOUT;
+    } while (tree->level_count[tree->num_levels - 1] > 1 && tree->num_levels < RTREE_MAX_LEVELS);
+
+    tree->items = malloc(sizeof(uint32_t) * (count ? count : 1));
+    tree->boxes = malloc(sizeof(OSM_RTreeBox) * (total ? total : 1));
+    if (!tree->items || !tree->boxes)
+    {
+        free(entries);
+        rtree_free(tree);
+        return NULL;
+    }
+
+    // STR: sort by lon into vertical slices of slice_size items, then each slice by lat
+    for (uint32_t i = 0; i < count; i++)
+    {
+        entries[i].key = (int64_t)boxes[i].min_lon + boxes[i].max_lon;
+        entries[i].item = i;
+    }
+    qsort(entries, count, sizeof(RTree_Entry), compare_entries);
+
+    uint64_t num_leaves = (count + RTREE_FANOUT - 1) / RTREE_FANOUT;
+    uint64_t num_slices = (uint64_t)ceil(sqrt((double)num_leaves));
+    uint64_t slice_size = (num_slices ? (num_leaves + num_slices - 1) / num_slices : 0) * RTREE_FANOUT;
+
+    for (uint64_t start = 0; start < count; start += slice_size)
+    {
+        uint64_t end = start + slice_size < count ? start + slice_size : count;
+        for (uint64_t i = start; i < end; i++)
+        {
+            entries[i].key = (int64_t)boxes[entries[i].item].min_lat + boxes[entries[i].item].max_lat;
+        }
+        qsort(entries + start, end - start, sizeof(RTree_Entry), compare_entries);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tree->items[i] = entries[i].item;
+        tree->boxes[i] = boxes[entries[i].item];
+    }
+    free(entries);
+
+    // each parent covers the next RTREE_FANOUT boxes of the level below
+    for (int level = 1; level < tree->num_levels; level++)
+    {
+        OSM_RTreeBox *children = tree->boxes + tree->level_start[level - 1];
+        OSM_RTreeBox *parents = tree->boxes + tree->level_start[level];
+        uint64_t num_children = tree->level_count[level - 1];
+
+        for (uint64_t i = 0; i < tree->level_count[level]; i++)
+        {
+            uint64_t first = i * RTREE_FANOUT;
+            uint64_t last = first + RTREE_FANOUT < num_children ? first + RTREE_FANOUT : num_children;
+            parents[i] = children[first];
+            for (uint64_t c = first + 1; c < last; c++)
+            {
+                extend(&parents[i], &children[c]);
+            }
+        }
+    }
+    return tree;
+}
+
+int rtree_query(const OSM_RTree *tree, const OSM_RTreeBox *query, OSM_RTreeVisitor visit, void *arg)
+{
+    if (tree->count == 0)
+    {
+        return 0;
+    }
+
+    // depth first, at most one pending sibling run per level
+    struct
+    {
+        uint64_t next;
+        uint64_t end;
+    } stack[RTREE_MAX_LEVELS];
+
+    int level = tree->num_levels - 1;
+    stack[level].next = 0;
+    stack[level].end = tree->level_count[level];
+
+    while (level < tree->num_levels)
+    {
+        if (stack[level].next == stack[level].end)
+        {
+            level++;
+            continue;
+        }
+
+        uint64_t i = stack[level].next++;
+        if (!intersects(&tree->boxes[tree->level_start[level] + i], query))
+        {
+            continue;
+        }
+
+        if (level == 0)
+        {
+            if (visit(tree->items[i], arg))
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            level--;
+            stack[level].next = i * RTREE_FANOUT;
+            stack[level].end = stack[level].next + RTREE_FANOUT < tree->level_count[level] ? stack[level].next + RTREE_FANOUT : tree->level_count[level];
+        }
+    }
+    return 0;
+}
+
+void rtree_free(OSM_RTree *tree)
+{
+    if (!tree)
+    {
+        return;
+    }
+    free(tree->items);
+    free(tree->boxes);
+    free(tree);
+}
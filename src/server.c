@@ -0,0 +1,603 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "parallel.h"
+#include "server.h"
+
+#define MAX_REQUEST_LINE 65536
+#define MAX_REQUEST_ARGS 1024
+#define MAX_EVENTS 64
+#define READ_CHUNK 4096
+
+/* Options a request may not use: they configure the process or touch files on the server */
+static const char *refused_options[] = {"-h", "-f", "-o", "-r", "-Q", "--serve", "--format", "--index", "--shard", "--merge", NULL};
+
+/* A connection, owned by the I/O loop except while its request is with the workers */
+typedef struct Server_Client
+{
+    int fd;          // -1 once closed
+    uint32_t events; // epoll interest
+    char *in;        // bytes received and not yet dispatched, requests are its complete lines
+    size_t in_size;
+    size_t in_capacity;
+    char *request; // line being answered by a worker
+    char *out;     // response being written
+    size_t out_size;
+    size_t out_sent;
+    int busy;                       // the request is with the workers
+    int eof;                        // the client shut down its side, answer what it sent then close
+    struct Server_Client *next;     // in the pending or done queue while busy
+    struct Server_Client *prev_all; // every open client, for shutdown
+    struct Server_Client *next_all;
+} Server_Client;
+
+typedef struct Server
+{
+    OSM_Map *map;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;         // workers bump it when they put a client on the done queue
+    pthread_mutex_t lock; // guards the queues and stopping
+    pthread_cond_t ready;
+    Server_Client *pending; // requests waiting for a worker, oldest first
+    Server_Client *pending_tail;
+    Server_Client *done; // answered requests waiting for the I/O loop
+    int stopping;
+    Server_Client *clients;
+} Server;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signum)
+{
+    stop_requested = 1;
+}
+
+static int is_refused(const char *arg)
+{
+    for (const char **option = refused_options; *option != NULL; option++)
+    {
+        if (strcmp(arg, *option) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Set the framed response of a request: its output, or the reason it failed */
+static void set_response(Server_Client *client, int ok, const char *body, size_t body_size)
+{
+    char status[64];
+    int status_size = ok ? snprintf(status, sizeof(status), "OK %zu\n", body_size)
+                         : snprintf(status, sizeof(status), "ERROR %s\n", body);
+    size_t size = status_size + (ok ? body_size : 0);
+
+    client->out = malloc(size);
+    client->out_size = client->out ? size : 0;
+    client->out_sent = 0;
+    if (client->out)
+    {
+        memcpy(client->out, status, status_size);
+        memcpy(client->out + status_size, body, size - status_size);
+    }
+}
+
+/* Run the queries of a request line on the shared map (worker side) */
+static void answer_request(OSM_Map *map, Server_Client *client)
+{
+    char *argv[MAX_REQUEST_ARGS + 2];
+    int argc = 1;
+    argv[0] = "serve";
+
+    char *save = NULL;
+    for (char *arg = strtok_r(client->request, " \t\r", &save); arg != NULL; arg = strtok_r(NULL, " \t\r", &save))
+    {
+        if (argc > MAX_REQUEST_ARGS || is_refused(arg))
+        {
+            set_response(client, 0, "invalid request", 0);
+            return;
+        }
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+
+    if (validate_args(argc, argv) == -1)
+    {
+        set_response(client, 0, "invalid request", 0);
+        return;
+    }
+
+    // every response is a whole document in the format the server was started with
+    Output *out = output_open(NULL, output_format);
+    if (!out)
+    {
+        set_response(client, 0, "out of memory", 0);
+        return;
+    }
+    output_header(out);
+    int result = run_queries_in_order(argv, map, out);
+    if (out->failed || result == -1)
+    {
+        set_response(client, 0, "query failed", 0);
+    }
+    else
+    {
+        set_response(client, 1, out->buffer, out->size);
+    }
+    output_close(out);
+}
+
+static void *run_worker(void *arg)
+{
+    Server *server = arg;
+
+    pthread_mutex_lock(&server->lock);
+    while (!server->stopping)
+    {
+        Server_Client *client = server->pending;
+        if (!client)
+        {
+            pthread_cond_wait(&server->ready, &server->lock);
+            continue;
+        }
+        server->pending = client->next;
+        pthread_mutex_unlock(&server->lock);
+
+        answer_request(server->map, client);
+
+        pthread_mutex_lock(&server->lock);
+        client->next = server->done;
+        server->done = client;
+        uint64_t one = 1;
+        if (write(server->event_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            // the counter is already non zero, the loop will wake up anyway
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+static void set_events(Server *server, Server_Client *client, uint32_t events)
+{
+    if (client->events == events)
+    {
+        return;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = client};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->events = events;
+}
+
+static void close_client(Server *server, Server_Client *client)
+{
+    if (client->fd != -1)
+    {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+static void free_client(Server *server, Server_Client *client)
+{
+    close_client(server, client);
+    if (client->prev_all)
+    {
+        client->prev_all->next_all = client->next_all;
+    }
+    else
+    {
+        server->clients = client->next_all;
+    }
+    if (client->next_all)
+    {
+        client->next_all->prev_all = client->prev_all;
+    }
+    free(client->in);
+    free(client->request);
+    free(client->out);
+    free(client);
+}
+
+/* Read what the client sent, up to one request line worth of bytes. Returns -1 on error */
+static int read_client(Server_Client *client)
+{
+    while (!client->eof && client->in_size < MAX_REQUEST_LINE)
+    {
+        if (client->in_capacity - client->in_size < READ_CHUNK)
+        {
+            size_t capacity = client->in_capacity ? client->in_capacity * 2 : READ_CHUNK;
+            char *grown = realloc(client->in, capacity);
+            if (!grown)
+            {
+                return -1;
+            }
+            client->in = grown;
+            client->in_capacity = capacity;
+        }
+
+        ssize_t received = recv(client->fd, client->in + client->in_size, client->in_capacity - client->in_size, 0);
+        if (received > 0)
+        {
+            client->in_size += received;
+        }
+        else if (received == 0)
+        {
+            client->eof = 1;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write as much of the pending response as the socket takes. Returns -1 on error */
+static int flush_client(Server_Client *client)
+{
+    while (client->out_sent < client->out_size)
+    {
+        ssize_t sent = send(client->fd, client->out + client->out_sent, client->out_size - client->out_sent, MSG_NOSIGNAL);
+        if (sent >= 0)
+        {
+            client->out_sent += sent;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    free(client->out);
+    client->out = NULL;
+    client->out_size = 0;
+    client->out_sent = 0;
+    return 0;
+}
+
+/* Hand the next complete request line to the workers, returns 0 if there is none */
+static int dispatch_request(Server *server, Server_Client *client)
+{
+    char *end;
+    while ((end = memchr(client->in, '\n', client->in_size)) != NULL)
+    {
+        size_t line_size = end - client->in;
+        char *line = malloc(line_size + 1);
+        if (!line)
+        {
+            return -1;
+        }
+        memcpy(line, client->in, line_size);
+        line[line_size] = '\0';
+        client->in_size -= line_size + 1;
+        memmove(client->in, end + 1, client->in_size);
+
+        // blank lines (keep alives) get no response
+        if (strspn(line, " \t\r") == line_size)
+        {
+            free(line);
+            continue;
+        }
+
+        client->request = line;
+        client->busy = 1;
+        client->next = NULL;
+        pthread_mutex_lock(&server->lock);
+        if (server->pending)
+        {
+            server->pending_tail->next = client;
+        }
+        else
+        {
+            server->pending = client;
+        }
+        server->pending_tail = client;
+        pthread_cond_signal(&server->ready);
+        pthread_mutex_unlock(&server->lock);
+        return 1;
+    }
+    return 0;
+}
+
+/* Move a client forward after an event: write its response, dispatch its next request, or close it */
+static void advance_client(Server *server, Server_Client *client)
+{
+    if (client->fd == -1)
+    {
+        if (!client->busy)
+        {
+            free_client(server, client);
+        }
+        return;
+    }
+    if (client->busy)
+    {
+        set_events(server, client, 0);
+        return;
+    }
+
+    if (flush_client(client) == -1)
+    {
+        free_client(server, client);
+        return;
+    }
+    if (client->out)
+    {
+        set_events(server, client, EPOLLOUT);
+        return;
+    }
+
+    int dispatched = dispatch_request(server, client);
+    if (dispatched == -1)
+    {
+        free_client(server, client);
+    }
+    else if (dispatched == 1)
+    {
+        set_events(server, client, 0);
+    }
+    else if (client->eof || client->in_size >= MAX_REQUEST_LINE)
+    {
+        // nothing left to answer, or a line too long to ever complete
+        free_client(server, client);
+    }
+    else
+    {
+        set_events(server, client, EPOLLIN);
+    }
+}
+
+static void accept_clients(Server *server)
+{
+    while (1)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            return;
+        }
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        {
+            close(fd);
+            continue;
+        }
+
+        Server_Client *client = calloc(1, sizeof(Server_Client));
+        struct epoll_event event = {.events = EPOLLIN};
+        event.data.ptr = client;
+        if (!client || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->events = EPOLLIN;
+        client->next_all = server->clients;
+        if (server->clients)
+        {
+            server->clients->prev_all = client;
+        }
+        server->clients = client;
+    }
+}
+
+/* Take back the clients the workers answered */
+static void collect_answers(Server *server)
+{
+    uint64_t count;
+    if (read(server->event_fd, &count, sizeof(count)) != sizeof(count))
+    {
+        // spurious wake up, the done queue is checked anyway
+    }
+
+    pthread_mutex_lock(&server->lock);
+    Server_Client *client = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (client)
+    {
+        Server_Client *next = client->next;
+        free(client->request);
+        client->request = NULL;
+        client->busy = 0;
+        advance_client(server, client);
+        client = next;
+    }
+}
+
+static void client_event(Server *server, Server_Client *client, uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        // nothing can be written back any more
+        close_client(server, client);
+    }
+    else if ((events & EPOLLIN) && read_client(client) == -1)
+    {
+        close_client(server, client);
+    }
+    advance_client(server, client);
+}
+
+/* Listening socket at path, replacing a stale socket left by an earlier server */
+static int listen_at(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_loop(Server *server)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stop_requested)
+    {
+        int count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == &server->listen_fd)
+            {
+                accept_clients(server);
+            }
+            else if (events[i].data.ptr == &server->event_fd)
+            {
+                collect_answers(server);
+            }
+            else
+            {
+                client_event(server, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+    return 0;
+}
+
+int serve_queries(OSM_Map *mp, const char *socket_path)
+{
+    // requests run side by side, so nothing may be built on first use (a missing bbox included)
+    if (OSM_Map_build_query_indexes(mp, OSM_INDEX_ALL) == -1)
+    {
+        return -1;
+    }
+    if (!OSM_Map_get_BBox(mp))
+    {
+        OSM_Map_compute_BBox(mp);
+    }
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.map = mp;
+    server.listen_fd = listen_at(socket_path);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = &server.listen_fd};
+    struct epoll_event answer_event = {.events = EPOLLIN, .data.ptr = &server.event_fd};
+    if (server.listen_fd == -1 || server.epoll_fd == -1 || server.event_fd == -1 ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_event) == -1 ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.event_fd, &answer_event) == -1)
+    {
+        if (server.listen_fd != -1)
+        {
+            close(server.listen_fd);
+            unlink(socket_path);
+        }
+        if (server.epoll_fd != -1)
+        {
+            close(server.epoll_fd);
+        }
+        if (server.event_fd != -1)
+        {
+            close(server.event_fd);
+        }
+        return -1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    // no SA_RESTART, so that epoll_wait returns on the signal
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // the workers inherit a mask without the signals, so they are delivered to the I/O loop
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    int num_workers = parallel_num_workers();
+    pthread_t workers[PARALLEL_MAX_WORKERS];
+    int started = 0;
+    while (started < num_workers && pthread_create(&workers[started], NULL, run_worker, &server) == 0)
+    {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    printf("Serving queries on: %s\n", socket_path);
+    fflush(stdout);
+    int result = started > 0 ? run_loop(&server) : -1;
+
+    // workers finish the request in hand and stop
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int w = 0; w < started; w++)
+    {
+        pthread_join(workers[w], NULL);
+    }
+
+    while (server.clients)
+    {
+        free_client(&server, server.clients);
+    }
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    close(server.event_fd);
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    unlink(socket_path);
+    return result;
+}
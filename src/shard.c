@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "blob_index.h"
+#include "config.h"
+#include "osm.h"
+#include "shard.h"
+#include "varint.h"
+
+#define SHARD_MAGIC "OSMPART"
+#define SHARD_VERSION 2
+
+/* Growable buffer a partial is written into */
+typedef struct Shard_Buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} Shard_Buffer;
+
+static void put_bytes(Shard_Buffer *b, const void *bytes, size_t len)
+{
+    if (b->failed)
+    {
+        return;
+    }
+    if (b->size + len > b->capacity)
+    {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->size + len)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(b->data, capacity);
+        if (!grown)
+        {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, bytes, len);
+    b->size += len;
+}
+
+static void put_uint(Shard_Buffer *b, uint64_t value)
+{
+    uint8_t bytes[VARINT_MAX_BYTES];
+    put_bytes(b, bytes, varint_encode(value, bytes));
+}
+
+static void put_int(Shard_Buffer *b, int64_t value)
+{
+    put_uint(b, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void put_string(Shard_Buffer *b, const char *s)
+{
+    put_uint(b, strlen(s));
+    put_bytes(b, s, strlen(s));
+}
+
+/* Ids of the ways matched by a filter, in the order the filter visits them */
+typedef struct Shard_Matches
+{
+    OSM_Id *ids;
+    uint64_t count;
+    uint64_t capacity;
+} Shard_Matches;
+
+static int collect_match(OSM_Way *wp, void *arg)
+{
+    Shard_Matches *matches = arg;
+    if (matches->count == matches->capacity)
+    {
+        uint64_t capacity = matches->capacity ? matches->capacity * 2 : 1024;
+        OSM_Id *grown = realloc(matches->ids, capacity * sizeof(OSM_Id));
+        if (!grown)
+        {
+            return -1;
+        }
+        matches->ids = grown;
+        matches->capacity = capacity;
+    }
+    matches->ids[matches->count++] = OSM_Way_get_id(wp);
+    return 0;
+}
+
+/* Blobs [*firstp, *endp) of a shard: each blob goes to the shard holding the middle of its bytes among the data bytes */
+static void shard_blob_range(const OSM_BlobIndex *idx, int shard, int num_shards, uint64_t *firstp, uint64_t *endp)
+{
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < idx->count; i++)
+    {
+        total += idx->blobs[i].type == OSM_BLOB_DATA ? idx->blobs[i].size : 0;
+    }
+
+    // owners never decrease along the file, so every range is contiguous
+    uint64_t before = 0;
+    *firstp = idx->count;
+    *endp = idx->count;
+    for (uint64_t i = 0; i < idx->count; i++)
+    {
+        if (idx->blobs[i].type != OSM_BLOB_DATA)
+        {
+            continue;
+        }
+        uint64_t owner = (before + idx->blobs[i].size / 2) * num_shards / total;
+        before += idx->blobs[i].size;
+        if (owner >= (uint64_t)shard && *firstp == idx->count)
+        {
+            *firstp = i;
+        }
+        if (owner > (uint64_t)shard)
+        {
+            *endp = i;
+            break;
+        }
+    }
+}
+
+/* FNV-1a of the offset, size and type of every blob, the same for every copy of the file */
+static uint64_t directory_digest(const OSM_BlobIndex *idx)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t i = 0; i < idx->count; i++)
+    {
+        uint64_t fields[3] = {idx->blobs[i].offset, idx->blobs[i].size, idx->blobs[i].type};
+        for (int f = 0; f < 3; f++)
+        {
+            for (int byte = 0; byte < 8; byte++)
+            {
+                hash ^= (fields[f] >> (8 * byte)) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+/* Write the kind of every record, then one record per query of argv decoded from the shard's map */
+static int write_records(char **argv, OSM_Map *map, Shard_Buffer *b)
+{
+    int num_records = 0;
+    for (char **p = argv + 1; *p != NULL; p++)
+    {
+        num_records += strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0 || strcmp(*p, "-b") == 0 || strcmp(*p, "-t") == 0;
+    }
+    put_uint(b, num_records);
+    for (char **p = argv + 1; *p != NULL; p++)
+    {
+        if (strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0 || strcmp(*p, "-b") == 0 || strcmp(*p, "-t") == 0)
+        {
+            put_bytes(b, *p + 1, 1);
+        }
+    }
+
+    const OSM_Summary *summary = OSM_Map_get_summary(map);
+    for (char **p = argv + 1; *p != NULL; p++)
+    {
+        if (strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0)
+        {
+            if (!summary)
+            {
+                return -1;
+            }
+            put_uint(b, (*p)[1]);
+            put_uint(b, summary->nodes);
+            if ((*p)[1] == 'S')
+            {
+                put_uint(b, summary->node_tags);
+            }
+            put_uint(b, summary->ways);
+            if ((*p)[1] == 'S')
+            {
+                put_uint(b, summary->way_tags);
+                put_uint(b, summary->relations);
+                put_uint(b, summary->relation_tags);
+            }
+        }
+        else if (strcmp(*p, "-b") == 0)
+        {
+            OSM_BBox *bbox = OSM_Map_get_BBox(map);
+            put_uint(b, 'b');
+            put_uint(b, bbox != NULL);
+            if (bbox)
+            {
+                put_int(b, OSM_BBox_get_min_lon(bbox));
+                put_int(b, OSM_BBox_get_min_lat(bbox));
+                put_int(b, OSM_BBox_get_max_lon(bbox));
+                put_int(b, OSM_BBox_get_max_lat(bbox));
+            }
+        }
+        else if (strcmp(*p, "-t") == 0)
+        {
+            p++;
+            OSM_TagFilter *filter = OSM_TagFilter_compile(map, *p);
+            if (!filter)
+            {
+                return -1;
+            }
+            Shard_Matches matches = {NULL, 0, 0};
+            int found = OSM_Map_filter_ways(map, filter, collect_match, &matches);
+            OSM_TagFilter_free(filter);
+            if (found == -1 || (uint64_t)found != matches.count)
+            {
+                free(matches.ids);
+                return -1;
+            }
+
+            put_uint(b, 't');
+            put_string(b, *p);
+            put_uint(b, matches.count);
+            OSM_Id previous = 0;
+            for (uint64_t i = 0; i < matches.count; i++)
+            {
+                put_int(b, matches.ids[i] - previous);
+                previous = matches.ids[i];
+            }
+            free(matches.ids);
+        }
+        else if (strcmp(*p, "-f") == 0 || strcmp(*p, "--shard") == 0)
+        {
+            p++;
+        }
+    }
+    return b->failed ? -1 : 0;
+}
+
+int run_shard_queries(char **argv, const char *path, int shard, int num_shards, FILE *out)
+{
+    FILE *in = fopen(path, "r");
+    struct stat st;
+    if (!in || fstat(fileno(in), &st) != 0)
+    {
+        if (in)
+        {
+            fclose(in);
+        }
+        return -1;
+    }
+
+    // the sidecar when one is current, else only the blob headers are read
+    OSM_BlobIndex *idx = OSM_BlobIndex_sidecar_is_current(path) ? OSM_BlobIndex_open(path) : NULL;
+    if (!idx)
+    {
+        idx = OSM_BlobIndex_build_directory(in);
+    }
+    OSM_Map *map = OSM_Map_create();
+    Shard_Buffer b = {NULL, 0, 0, 0};
+    int result = -1;
+    if (!idx || !map)
+    {
+        goto done;
+    }
+
+    int filters = 0;
+    int counts = 0;
+    int needs_bbox = 0;
+    for (char **p = argv + 1; *p != NULL; p++)
+    {
+        filters += strcmp(*p, "-t") == 0;
+        counts += strcmp(*p, "-s") == 0 || strcmp(*p, "-S") == 0;
+        needs_bbox |= strcmp(*p, "-b") == 0;
+    }
+
+    // every shard reads the header: its bbox, or the extents of the shards' nodes joined when it has none
+    OSM_ReadOptions options = {.entities = 0, .summarize = counts > 0};
+    uint64_t first, end;
+    shard_blob_range(idx, shard, num_shards, &first, &end);
+    for (uint64_t i = 0; i < idx->count; i++)
+    {
+        if (idx->blobs[i].type == OSM_BLOB_HEADER && OSM_Map_load_blob(map, in, idx->blobs[i].offset, &options) == -1)
+        {
+            goto done;
+        }
+    }
+    int needs_extent = needs_bbox && !OSM_Map_get_BBox(map);
+
+    options.entities = (filters ? OSM_READ_WAYS : 0) | (needs_extent ? OSM_READ_NODES : 0);
+    options.decode_tags = filters > 0;
+    if (options.entities || options.summarize)
+    {
+        for (uint64_t i = first; i < end; i++)
+        {
+            if (idx->blobs[i].type == OSM_BLOB_DATA && OSM_Map_load_blob(map, in, idx->blobs[i].offset, &options) == -1)
+            {
+                goto done;
+            }
+        }
+    }
+
+    // several filters pay for the inverted index once, as the same queries on the whole file would
+    if ((needs_extent && OSM_Map_get_num_nodes(map) > 0 && OSM_Map_compute_BBox(map) == -1) ||
+        (filters > 1 && OSM_Map_build_tag_index(map) == -1))
+    {
+        goto done;
+    }
+
+    put_bytes(&b, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    put_uint(&b, SHARD_VERSION);
+    put_uint(&b, shard);
+    put_uint(&b, num_shards);
+    put_uint(&b, st.st_size);
+    put_string(&b, path);
+    put_uint(&b, directory_digest(idx));
+    if (write_records(argv, map, &b) == 0 && fwrite(b.data, 1, b.size, out) == b.size && fflush(out) == 0)
+    {
+        result = 0;
+    }
+
+done:
+    free(b.data);
+    OSM_Map_free(map);
+    OSM_BlobIndex_free(idx);
+    fclose(in);
+    return result;
+}
+
+/* A partial being read, record by record in step with the partials of the other shards */
+typedef struct Shard_Partial
+{
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    int failed; // truncated or malformed
+    uint64_t shard;
+    uint64_t num_shards;
+    uint64_t source_size;
+    char *name; // points into data, not terminated
+    uint64_t name_len;
+    uint64_t directory_digest;
+    uint64_t num_records;
+    char *kinds; // kind of each record, points into data
+} Shard_Partial;
+
+static uint64_t get_uint(Shard_Partial *part)
+{
+    uint64_t value = 0;
+    size_t used = part->failed ? 0 : varint_decode(part->data + part->pos, part->size - part->pos, &value);
+    if (used == 0)
+    {
+        part->failed = 1;
+        return 0;
+    }
+    part->pos += used;
+    return value;
+}
+
+static int64_t get_int(Shard_Partial *part)
+{
+    uint64_t value = get_uint(part);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Length and bytes of a string, *lenp 0 and NULL on error */
+static char *get_string(Shard_Partial *part, uint64_t *lenp)
+{
+    uint64_t len = get_uint(part);
+    if (part->failed || len > part->size - part->pos)
+    {
+        part->failed = 1;
+        *lenp = 0;
+        return NULL;
+    }
+    char *s = (char *)part->data + part->pos;
+    part->pos += len;
+    *lenp = len;
+    return s;
+}
+
+/* Read a partial file and its header */
+static int open_partial(const char *path, Shard_Partial *part)
+{
+    FILE *f = fopen(path, "r");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size < sizeof(SHARD_MAGIC))
+    {
+        if (f)
+        {
+            fclose(f);
+        }
+        return -1;
+    }
+
+    part->size = st.st_size;
+    part->data = malloc(part->size);
+    int read = part->data && fread(part->data, 1, part->size, f) == part->size;
+    fclose(f);
+    if (!read || memcmp(part->data, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0)
+    {
+        return -1;
+    }
+
+    part->pos = sizeof(SHARD_MAGIC);
+    uint64_t version = get_uint(part);
+    part->shard = get_uint(part);
+    part->num_shards = get_uint(part);
+    part->source_size = get_uint(part);
+    part->name = get_string(part, &part->name_len);
+    part->directory_digest = get_uint(part);
+    part->kinds = get_string(part, &part->num_records);
+    return part->failed || version != SHARD_VERSION || part->shard >= part->num_shards ? -1 : 0;
+}
+
+static int compare_partials(const void *a, const void *b)
+{
+    const Shard_Partial *x = a;
+    const Shard_Partial *y = b;
+    return (x->shard > y->shard) - (x->shard < y->shard);
+}
+
+/* Merge record r of every partial (all at the same record) and print its result */
+static int merge_record(Shard_Partial *parts, int num_parts, Output *out)
+{
+    uint64_t kind = get_uint(&parts[0]);
+    for (int i = 1; i < num_parts; i++)
+    {
+        if (get_uint(&parts[i]) != kind)
+        {
+            return -1;
+        }
+    }
+
+    if (kind == 's' || kind == 'S')
+    {
+        OSM_Summary summary = {0};
+        for (int i = 0; i < num_parts; i++)
+        {
+            summary.nodes += get_uint(&parts[i]);
+            summary.node_tags += kind == 'S' ? get_uint(&parts[i]) : 0;
+            summary.ways += get_uint(&parts[i]);
+            if (kind == 'S')
+            {
+                summary.way_tags += get_uint(&parts[i]);
+                summary.relations += get_uint(&parts[i]);
+                summary.relation_tags += get_uint(&parts[i]);
+            }
+        }
+        if (kind == 's')
+        {
+            print_summary_result(out, summary.nodes, summary.ways);
+        }
+        else
+        {
+            print_entity_summary_result(out, &summary);
+        }
+    }
+    else if (kind == 'b')
+    {
+        int found = 0;
+        int64_t min_lon = INT64_MAX, min_lat = INT64_MAX, max_lon = INT64_MIN, max_lat = INT64_MIN;
+        for (int i = 0; i < num_parts; i++)
+        {
+            if (get_uint(&parts[i]))
+            {
+                int64_t box[4];
+                for (int c = 0; c < 4; c++)
+                {
+                    box[c] = get_int(&parts[i]);
+                }
+                min_lon = box[0] < min_lon ? box[0] : min_lon;
+                min_lat = box[1] < min_lat ? box[1] : min_lat;
+                max_lon = box[2] > max_lon ? box[2] : max_lon;
+                max_lat = box[3] > max_lat ? box[3] : max_lat;
+                found = 1;
+            }
+        }
+        print_bbox_result(out, found, min_lon, min_lat, max_lon, max_lat);
+    }
+    else if (kind == 't')
+    {
+        uint64_t filter_len;
+        char *filter_bytes = get_string(&parts[0], &filter_len);
+        char *filter = filter_bytes ? strndup(filter_bytes, filter_len) : NULL;
+        if (!filter)
+        {
+            return -1;
+        }
+
+        print_filter_header(out, filter);
+        int64_t found = 0;
+        for (int i = 0; i < num_parts; i++)
+        {
+            uint64_t len = filter_len;
+            char *other = i == 0 ? filter_bytes : get_string(&parts[i], &len);
+            if (!other || len != filter_len || memcmp(other, filter, len) != 0)
+            {
+                free(filter);
+                return -1;
+            }
+
+            uint64_t count = get_uint(&parts[i]);
+            OSM_Id id = 0;
+            for (uint64_t m = 0; m < count && !parts[i].failed; m++)
+            {
+                id += get_int(&parts[i]);
+                print_filter_match(out, filter, id, NULL, NULL);
+            }
+            found += count;
+        }
+        print_filter_footer(out, found);
+        free(filter);
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (out->format == OUTPUT_TEXT)
+    {
+        output_char(out, '\n');
+    }
+    for (int i = 0; i < num_parts; i++)
+    {
+        if (parts[i].failed)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int merge_shard_results(char **paths, int num_paths, FILE *out, Output_Format format)
+{
+    Shard_Partial *parts = calloc(num_paths, sizeof(Shard_Partial));
+    Output *output = NULL;
+    int result = -1;
+    if (!parts)
+    {
+        return -1;
+    }
+    for (int i = 0; i < num_paths; i++)
+    {
+        if (open_partial(paths[i], &parts[i]) == -1)
+        {
+            goto done;
+        }
+    }
+
+    // exactly one partial per shard, all of the same file (name, size and blob directory) and queries
+    qsort(parts, num_paths, sizeof(Shard_Partial), compare_partials);
+    for (int i = 0; i < num_paths; i++)
+    {
+        if (parts[i].shard != (uint64_t)i || parts[i].num_shards != (uint64_t)num_paths ||
+            parts[i].source_size != parts[0].source_size || parts[i].name_len != parts[0].name_len ||
+            memcmp(parts[i].name, parts[0].name, parts[0].name_len) != 0 ||
+            parts[i].directory_digest != parts[0].directory_digest || parts[i].num_records != parts[0].num_records ||
+            memcmp(parts[i].kinds, parts[0].kinds, parts[0].num_records) != 0)
+        {
+            goto done;
+        }
+    }
+
+    // the line of a geojson filter match needs nodes that other shards decoded
+    if (format == OUTPUT_GEOJSON && memchr(parts[0].kinds, 't', parts[0].num_records))
+    {
+        goto done;
+    }
+
+    // rendered in memory, so a partial that turns out malformed prints nothing
+    char *name = strndup(parts[0].name, parts[0].name_len);
+    output = name ? output_open(NULL, format) : NULL;
+    if (output)
+    {
+        print_results_header(output, name);
+        if (format == OUTPUT_TEXT)
+        {
+            output_str(output, "\n\n"); // as the -f filename of a single run
+        }
+        result = 0;
+        for (uint64_t r = 0; r < parts[0].num_records && result == 0; r++)
+        {
+            result = merge_record(parts, num_paths, output);
+        }
+        if (result == 0 && (output->failed || fwrite(output->buffer, 1, output->size, out) != output->size || fflush(out) != 0))
+        {
+            result = -1;
+        }
+    }
+    free(name);
+
+done:
+    if (output)
+    {
+        output_close(output);
+    }
+    for (int i = 0; i < num_paths; i++)
+    {
+        free(parts[i].data);
+    }
+    free(parts);
+    return result;
+}
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_pool.h"
+
+#define INITIAL_SLOTS 1024
+
+/* FNV-1a */
+static uint64_t hash_string(const char *str, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int equals(const OSM_StringPool *pool, uint32_t id, uint64_t hash, const char *str, size_t len)
+{
+    return pool->hashes[id] == hash && strncmp(pool->strings[id], str, len) == 0 && pool->strings[id][len] == '\0';
+}
+
+OSM_StringPool *string_pool_create(void)
+{
+    OSM_StringPool *pool = calloc(1, sizeof(OSM_StringPool));
+    if (!pool)
+    {
+        return NULL;
+    }
+
+    pool->num_slots = INITIAL_SLOTS;
+    pool->slots = malloc(sizeof(uint32_t) * pool->num_slots);
+    if (!pool->slots)
+    {
+        string_pool_free(pool);
+        return NULL;
+    }
+    memset(pool->slots, 0xFF, sizeof(uint32_t) * pool->num_slots);
+    return pool;
+}
+
+/* Double the slot table and reinsert every id, keeping the load factor at most 1/2 */
+static int grow_slots(OSM_StringPool *pool)
+{
+    uint32_t num_slots = pool->num_slots ? pool->num_slots * 2 : INITIAL_SLOTS;
+    uint32_t *slots = malloc(sizeof(uint32_t) * num_slots);
+    if (!slots)
+    {
+        return -1;
+    }
+    memset(slots, 0xFF, sizeof(uint32_t) * num_slots);
+
+    for (uint32_t id = 0; id < pool->count; id++)
+    {
+        uint32_t slot = pool->hashes[id] & (num_slots - 1);
+        while (slots[slot] != STRING_POOL_NONE)
+        {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        slots[slot] = id;
+    }
+
+    free(pool->slots);
+    pool->slots = slots;
+    pool->num_slots = num_slots;
+    return 0;
+}
+
+uint32_t string_pool_find(const OSM_StringPool *pool, const char *str, size_t len)
+{
+    if (pool->num_slots == 0)
+    {
+        return STRING_POOL_NONE;
+    }
+
+    uint64_t hash = hash_string(str, len);
+    uint32_t slot = hash & (pool->num_slots - 1);
+
+    while (pool->slots[slot] != STRING_POOL_NONE)
+    {
+        if (equals(pool, pool->slots[slot], hash, str, len))
+        {
+            return pool->slots[slot];
+        }
+        slot = (slot + 1) & (pool->num_slots - 1);
+    }
+    return STRING_POOL_NONE;
+}
+
+uint32_t string_pool_intern(OSM_StringPool *pool, Arena *arena, const char *str, size_t len)
+{
+    uint32_t id = string_pool_find(pool, str, len);
+    if (id != STRING_POOL_NONE)
+    {
+        return id;
+    }
+
+    if (pool->count == STRING_POOL_NONE - 1)
+    {
+        return STRING_POOL_NONE;
+    }
+    if ((uint64_t)(pool->count + 1) * 2 > pool->num_slots && grow_slots(pool) == -1)
+    {
+        return STRING_POOL_NONE;
+    }
+
+    if (pool->count == pool->capacity)
+    {
+        uint32_t capacity = pool->capacity ? pool->capacity * 2 : INITIAL_SLOTS / 2;
+        char **strings = realloc(pool->strings, sizeof(char *) * capacity);
+        if (!strings)
+        {
+            return STRING_POOL_NONE;
+        }
+        pool->strings = strings;
+        uint64_t *hashes = realloc(pool->hashes, sizeof(uint64_t) * capacity);
+        if (!hashes)
+        {
+            return STRING_POOL_NONE;
+        }
+        pool->hashes = hashes;
+        pool->capacity = capacity;
+    }
+
+    char *copy = arena_strndup(arena, str, len);
+    if (!copy)
+    {
+        return STRING_POOL_NONE;
+    }
+
+    uint64_t hash = hash_string(str, len);
+    uint32_t slot = hash & (pool->num_slots - 1);
+    while (pool->slots[slot] != STRING_POOL_NONE)
+    {
+        slot = (slot + 1) & (pool->num_slots - 1);
+    }
+
+    id = pool->count++;
+    pool->strings[id] = copy;
+    pool->hashes[id] = hash;
+    pool->slots[slot] = id;
+    return id;
+}
+
+int string_pool_attach(OSM_StringPool *pool, uint32_t count, const char *bytes, const uint64_t *offsets,
+                       const uint64_t *hashes, const uint32_t *slots, uint32_t num_slots)
+{
+    char **strings = malloc(sizeof(char *) * (count ? count : 1));
+    if (!strings)
+    {
+        return -1;
+    }
+    for (uint32_t id = 0; id < count; id++)
+    {
+        strings[id] = (char *)bytes + offsets[id];
+    }
+
+    string_pool_reset(pool);
+    if (!pool->borrowed)
+    {
+        free(pool->hashes);
+        free(pool->slots);
+    }
+    free(pool->strings);
+    pool->strings = strings;
+    pool->hashes = (uint64_t *)hashes;
+    pool->slots = (uint32_t *)slots;
+    pool->num_slots = num_slots;
+    pool->count = count;
+    pool->capacity = count;
+    pool->borrowed = 1;
+    return 0;
+}
+
+void string_pool_reset(OSM_StringPool *pool)
+{
+    pool->count = 0;
+    if (pool->borrowed)
+    {
+        // the next intern allocates tables of its own
+        pool->hashes = NULL;
+        pool->slots = NULL;
+        pool->num_slots = 0;
+        pool->capacity = 0;
+        pool->borrowed = 0;
+        return;
+    }
+    memset(pool->slots, 0xFF, sizeof(uint32_t) * pool->num_slots);
+}
+
+void string_pool_free(OSM_StringPool *pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+    free(pool->strings);
+    if (!pool->borrowed)
+    {
+        free(pool->hashes);
+        free(pool->slots);
+    }
+    free(pool);
+}
@@ -0,0 +1,146 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "varint.h"
+
+#define CONTINUATION_BITS 0x8080808080808080ULL
+
+/* Decode zig-zag encoding without branching */
+static inline int64_t unzigzag(uint64_t val)
+{
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+size_t varint_encode(uint64_t value, uint8_t *out)
+{
+    size_t count = 0;
+    while (value >= 0x80)
+    {
+        out[count++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[count++] = (uint8_t)value;
+    return count;
+}
+
+size_t varint_decode(const uint8_t *buf, size_t len, uint64_t *valuep)
+{
+    uint64_t value = 0;
+    size_t count = 0;
+
+    while (count < len && count < VARINT_MAX_BYTES)
+    {
+        uint8_t byte = buf[count];
+        value |= (uint64_t)(byte & 0x7F) << (7 * count);
+        count++;
+        if ((byte & 0x80) == 0)
+        {
+            *valuep = value;
+            return count;
+        }
+    }
+    return 0;
+}
+
+size_t varint_count(const uint8_t *buf, size_t len)
+{
+    size_t count = 0;
+    size_t pos = 0;
+
+    // every varint ends in exactly one byte without the continuation bit
+#ifdef __SSE2__
+    for (; pos + 16 <= len; pos += 16)
+    {
+        int continuations = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(buf + pos)));
+        count += 16 - __builtin_popcount(continuations);
+    }
+#endif
+    for (; pos + 8 <= len; pos += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + pos, sizeof(word));
+        count += 8 - __builtin_popcountll(word & CONTINUATION_BITS);
+    }
+    for (; pos < len; pos++)
+    {
+        count += (buf[pos] & 0x80) == 0;
+    }
+    return count;
+}
+
+size_t varint_count_zeros(const uint8_t *buf, size_t len)
+{
+    size_t count = 0;
+    size_t pos = 0;
+
+    // a 0x00 byte cannot be part of a longer (canonical) varint: inner bytes have the continuation bit
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; pos + 16 <= len; pos += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(buf + pos));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)));
+    }
+#endif
+    for (; pos < len; pos++)
+    {
+        count += buf[pos] == 0;
+    }
+    return count;
+}
+
+size_t varint_decode_deltas(const uint8_t *buf, size_t len, int64_t *out, size_t max)
+{
+    size_t pos = 0;
+    size_t n = 0;
+    int64_t total = 0;
+
+    while (pos < len && n < max)
+    {
+#ifdef __SSE2__
+        // 16 single byte varints in a row (the common case for sorted refs)
+        if (len - pos >= 16 && max - n >= 16 &&
+            _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(buf + pos))) == 0)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                total += unzigzag(buf[pos + i]);
+                out[n + i] = total;
+            }
+            pos += 16;
+            n += 16;
+            continue;
+        }
+#endif
+        if (len - pos >= 8 && max - n >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, buf + pos, sizeof(word));
+            if ((word & CONTINUATION_BITS) == 0)
+            {
+                for (int i = 0; i < 8; i++)
+                {
+                    total += unzigzag(buf[pos + i]);
+                    out[n + i] = total;
+                }
+                pos += 8;
+                n += 8;
+                continue;
+            }
+        }
+
+        uint64_t value;
+        size_t used = varint_decode(buf + pos, len - pos, &value);
+        if (used == 0)
+        {
+            break;
+        }
+        total += unzigzag(value);
+        out[n++] = total;
+        pos += used;
+    }
+    return n;
+}
@@ -78,3 +78,34 @@ int zlib_inflate(FILE *source, FILE *dest)
     (void)inflateEnd(&strm);
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
+
+
+/* Decompress len bytes of source into the memory buffer dest in one call.
+   Returns Z_OK and sets *sizep on success, Z_BUF_ERROR if dest is too
+   small to hold the whole stream, or Z_DATA_ERROR if the data is invalid. */
+int zlib_inflate_buffer(const char *source, size_t len, char *dest, size_t capacity, size_t *sizep)
+{
+    int ret;
+    z_stream strm;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = len;
+    strm.next_in = (unsigned char *)source;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK)
+        return ret;
+
+    strm.avail_out = capacity;
+    strm.next_out = (unsigned char *)dest;
+    ret = inflate(&strm, Z_FINISH);
+    *sizep = capacity - strm.avail_out;
+    (void)inflateEnd(&strm);
+
+    if (ret == Z_STREAM_END)
+        return Z_OK;
+    if ((ret == Z_BUF_ERROR || ret == Z_OK) && strm.avail_out == 0)
+        return Z_BUF_ERROR;
+    return Z_DATA_ERROR;
+}
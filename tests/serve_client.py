@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+"""Local client for --serve: checks the socket protocol against the command line.
+
+Usage: tests/serve_client.py [bin/osm_parser]
+
+Writes a small synthetic PBF, serves it, and checks that
+  - every response is "OK <length>" and exactly the bytes the same queries print
+    on the command line (after the "Processing file" header in text mode),
+  - requests pipelined by many concurrent clients are answered in order,
+  - a client that half-closes its socket still gets every response, then EOF,
+  - refused and malformed requests get "ERROR <reason>" and the connection stays
+    usable, blank lines get no response and an endless line closes the connection,
+  - SIGTERM stops the server and removes the socket.
+"""
+
+import os
+import random
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+REQUESTS = [
+    "-s",
+    "-b",
+    "-S",
+    "-n 1000",
+    "-n 1061 -n 999999",
+    "-w 10000",
+    "-w 10001 highway name oneway surface",
+    "-w 10005 nokey -n 1500",
+    "-w 1",
+    "-q 1.41 42.42 1.45 42.45",
+    "-k 42.43 1.42",
+    "-t highway=primary",
+    "-t highway=residential|service,!oneway -b -s",
+]
+
+CLIENTS = 8
+ROUNDS = 5
+
+
+# --- a small map: a grid of tagged nodes joined by street and avenue ways ---
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        out.append(b | 0x80 if v else b)
+        if not v:
+            return bytes(out)
+
+
+def zigzag(v):
+    return (v << 1) ^ (v >> 63)
+
+
+def field_varint(number, v):
+    return varint(number << 3) + varint(v)
+
+
+def field_bytes(number, b):
+    return varint(number << 3 | 2) + varint(len(b)) + b
+
+
+def packed(values):
+    return b"".join(varint(v) for v in values)
+
+
+def deltas(values):
+    prev, out = 0, []
+    for v in values:
+        out.append(zigzag(v - prev))
+        prev = v
+    return out
+
+
+def blob(kind, block):
+    data = field_varint(2, len(block)) + field_bytes(3, zlib.compress(block))
+    header = field_bytes(1, kind.encode()) + field_varint(3, len(data))
+    return struct.pack(">I", len(header)) + header + data
+
+
+def block(strings, group):
+    table = b"".join(field_bytes(1, s.encode()) for s in strings)
+    return field_bytes(1, table) + field_bytes(2, group) + field_varint(17, 100)
+
+
+def write_map(path, nx=60, ny=50):
+    lat0, lon0, step = 42_427_600_000, 1_412_360_000, 1_000_000
+    ids = [[1000 + y * nx + x for x in range(nx)] for y in range(ny)]
+    bbox = (field_varint(1, zigzag(lon0)) + field_varint(2, zigzag(lon0 + (nx - 1) * step)) +
+            field_varint(3, zigzag(lat0 + (ny - 1) * step)) + field_varint(4, zigzag(lat0)))
+    data = blob("OSMHeader", field_bytes(1, bbox) + field_bytes(4, b"OsmSchema-V0.6") + field_bytes(4, b"DenseNodes"))
+
+    nodes = [(ids[y][x], lat0 + y * step, lon0 + x * step, (x * 7 + y) % 53 == 0) for y in range(ny) for x in range(nx)]
+    for i in range(0, len(nodes), 1000):
+        chunk = nodes[i:i + 1000]
+        tags = []
+        for node in chunk:
+            tags += [1, 2, 0] if node[3] else [0]
+        dense = (field_bytes(1, packed(deltas([n[0] for n in chunk]))) +
+                 field_bytes(8, packed(deltas([n[1] // 100 for n in chunk]))) +
+                 field_bytes(9, packed(deltas([n[2] // 100 for n in chunk]))) + field_bytes(10, packed(tags)))
+        data += blob("OSMData", block(["", "amenity", "bench"], field_bytes(2, dense)))
+
+    kinds = ["primary", "residential", "service", "footway"]
+    ways = []
+    for y in range(ny):
+        tags = [("highway", kinds[y % 4]), ("name", "Street %d" % y)]
+        tags += [("oneway", "yes")] if y % 3 == 0 else []
+        tags += [("surface", "asphalt")] if y % 2 == 0 else []
+        ways.append((ids[y], tags))
+    for x in range(nx):
+        tags = [("building", "yes")] if x % 5 == 0 else [("highway", kinds[x % 4]), ("name", "Avenue %d" % x)]
+        ways.append(([ids[y][x] for y in range(ny)], tags))
+    for i in range(0, len(ways), 40):
+        strings = [""]
+        group = b""
+        for way_id, (refs, tags) in enumerate(ways[i:i + 40], 10000 + i):
+            for k, v in tags:
+                strings += [s for s in (k, v) if s not in strings]
+            way = (field_varint(1, way_id) + field_bytes(2, packed(strings.index(k) for k, _ in tags)) +
+                   field_bytes(3, packed(strings.index(v) for _, v in tags)) + field_bytes(8, packed(deltas(refs))))
+            group += field_bytes(3, way)
+        data += blob("OSMData", block(strings, group))
+
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+# --- protocol ---
+
+def expected_body(parser, map_path, request, fmt):
+    args = [parser, "-f", map_path] + request.split() + (["--format", fmt] if fmt != "text" else [])
+    out = subprocess.run(args, stdout=subprocess.PIPE, check=True).stdout
+    if fmt == "text":
+        header = b"\n=== OSM Map Query Results ===\nProcessing file: " + map_path.encode() + b"\n\n"
+        assert out.startswith(header), "unexpected command line header for %r" % request
+        out = out[len(header):]
+    return out
+
+
+class Connection:
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(30)
+        self.sock.connect(path)
+        self.buffer = b""
+
+    def send(self, text):
+        self.sock.sendall(text.encode())
+
+    def _fill(self):
+        chunk = self.sock.recv(65536)
+        if not chunk:
+            return False
+        self.buffer += chunk
+        return True
+
+    def response(self):
+        """Next (status, body): ("OK", bytes) or ("ERROR", reason), None at EOF."""
+        while b"\n" not in self.buffer:
+            if not self._fill():
+                assert self.buffer == b"", "truncated status line %r" % self.buffer
+                return None
+        line, self.buffer = self.buffer.split(b"\n", 1)
+        status, _, rest = line.decode().partition(" ")
+        if status == "ERROR":
+            return status, rest
+        assert status == "OK", "bad status line %r" % line
+        size = int(rest)
+        while len(self.buffer) < size:
+            assert self._fill(), "connection closed inside a response"
+        body, self.buffer = self.buffer[:size], self.buffer[size:]
+        return status, body
+
+    def at_eof(self):
+        return self.buffer == b"" and not self._fill()
+
+    def close(self):
+        self.sock.close()
+
+
+def check(condition, message):
+    if not condition:
+        raise AssertionError(message)
+
+
+def check_pipelined(sock_path, expected, seed, failures):
+    try:
+        rng = random.Random(seed)
+        conn = Connection(sock_path)
+        for _ in range(ROUNDS):
+            order = list(expected)
+            rng.shuffle(order)
+            conn.send("".join(request + "\n" for request in order))
+            for request in order:
+                check(conn.response() == ("OK", expected[request]), "client %d: wrong response to %r" % (seed, request))
+        conn.close()
+    except Exception as error:  # reported by the main thread
+        failures.append(error)
+
+
+def check_half_close(sock_path, expected):
+    conn = Connection(sock_path)
+    requests = REQUESTS[:4]
+    conn.send("".join(request + "\n" for request in requests))
+    conn.sock.shutdown(socket.SHUT_WR)
+    for request in requests:
+        check(conn.response() == ("OK", expected[request]), "half close: wrong response to %r" % request)
+    check(conn.at_eof(), "half close: connection not closed after the last response")
+    conn.close()
+
+
+def check_errors(sock_path, expected):
+    conn = Connection(sock_path)
+    for request in ["-f other.pbf", "-o snapshot", "--serve x", "--index -s", "--format json -s",
+                    "-n", "-w", "-q 1 2", "--bogus", "1061"]:
+        conn.send(request + "\n")
+        check(conn.response() == ("ERROR", "invalid request"), "error: %r was not refused" % request)
+
+    # blank lines are keep alives, the next request is answered as usual
+    conn.send("\n \t\n-s\n")
+    check(conn.response() == ("OK", expected["-s"]), "error: connection unusable after errors and blank lines")
+    conn.close()
+
+    # a line that never ends closes the connection without a response
+    conn = Connection(sock_path)
+    try:
+        conn.send("-n " + "1" * (1 << 20))
+        check(conn.response() is None, "error: an endless line got a response")
+    except (BrokenPipeError, ConnectionResetError):
+        pass
+    conn.close()
+
+
+def run_server(parser, map_path, sock_path, fmt):
+    args = [parser, "-f", map_path, "--serve", sock_path] + (["--format", fmt] if fmt != "text" else [])
+    server = subprocess.Popen(args, stdout=subprocess.DEVNULL)
+    deadline = time.time() + 30
+    while not os.path.exists(sock_path):
+        check(server.poll() is None and time.time() < deadline, "server did not start")
+        time.sleep(0.05)
+    return server
+
+
+def check_format(parser, map_path, workdir, fmt):
+    sock_path = os.path.join(workdir, "osm-%s.sock" % fmt)
+    expected = {request: expected_body(parser, map_path, request, fmt) for request in REQUESTS}
+    server = run_server(parser, map_path, sock_path, fmt)
+    try:
+        failures = []
+        clients = [threading.Thread(target=check_pipelined, args=(sock_path, expected, seed, failures))
+                   for seed in range(CLIENTS)]
+        for client in clients:
+            client.start()
+        for client in clients:
+            client.join()
+        if failures:
+            raise failures[0]
+        check_half_close(sock_path, expected)
+        check_errors(sock_path, expected)
+    finally:
+        server.send_signal(signal.SIGTERM)
+        status = server.wait(timeout=30)
+    check(status == 0, "server exited with %d" % status)
+    check(not os.path.exists(sock_path), "socket left behind after SIGTERM")
+    print("serve %s: %d clients x %d pipelined rounds, half close, errors: ok" % (fmt, CLIENTS, ROUNDS))
+
+
+def main():
+    parser = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "bin/osm_parser")
+    with tempfile.TemporaryDirectory() as workdir:
+        map_path = os.path.join(workdir, "grid.osm.pbf")
+        write_map(map_path)
+        for fmt in ("text", "json"):
+            check_format(parser, map_path, workdir, fmt)
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except AssertionError as error:
+        print("FAIL: %s" % error, file=sys.stderr)
+        sys.exit(1)